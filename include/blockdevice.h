@@ -0,0 +1,271 @@
+#ifndef _BLOCKDEVICE_H
+#define _BLOCKDEVICE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "fs.h"
+
+#define BLOCK_DEVICE_BUFFER_ALIGNMENT 4096
+#define BLOCK_DEVICE_ZERO_BUFFER_SIZE (1024 * 1024)
+#define BLOCK_DEVICE_URING_QUEUE_DEPTH 32
+
+typedef enum
+{
+    BLOCK_DEVICE_FILE,   // pread/pwrite with write coalescing
+    BLOCK_DEVICE_MMAP,   // shared mapping of the whole image
+    BLOCK_DEVICE_URING,  // io_uring with registered buffers, pread/pwrite without it
+    BLOCK_DEVICE_DIRECT, // O_DIRECT through aligned bounce buffers, bypasses the page cache
+    BLOCK_DEVICE_MEMORY, // sparse in-memory image, never touches the filesystem
+} BLOCK_DEVICE_TYPE;
+
+typedef enum
+{
+    IMAGE_FORMAT_RAW,   // sectors stored at their own offset
+    IMAGE_FORMAT_QCOW2, // only allocated clusters stored, see Qcow2BlockDevice
+} IMAGE_FORMAT;
+
+struct AlignedBufferDeleter
+{
+    void operator()(uint8_t *buffer) const { free(buffer); }
+};
+
+typedef std::unique_ptr<uint8_t[], AlignedBufferDeleter> AlignedBuffer;
+
+/**
+ * @brief Allocate a zeroed, page-aligned buffer
+ * @param  size: the size of the buffer in bytes
+ * @retval The buffer, or nullptr if out of memory
+ */
+AlignedBuffer allocateAlignedBuffer(size_t size);
+
+/**
+ * Free list of aligned buffers of one size; buffers handed back are reused
+ * by the next request instead of being allocated again
+ */
+class AlignedBufferPool
+{
+public:
+    explicit AlignedBufferPool(size_t size) : bufferSize(size) {}
+
+    // a zeroed buffer when the pool is empty, or nullptr if out of memory
+    AlignedBuffer acquire();
+
+    void release(AlignedBuffer buffer);
+
+private:
+    size_t bufferSize;
+    std::vector<AlignedBuffer> buffers;
+};
+
+/**
+ * @brief Check a logical sector size
+ * @param  size: the sector size in bytes
+ * @retval true for 512 byte and 4Kn sectors, false otherwise
+ */
+bool isSupportedSectorSize(uint32_t size);
+
+/**
+ * Sector-granular access to a disk image
+ */
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() {}
+
+    uint32_t getSectorSize() const { return sectorSize; }
+    uint64_t getSectorCount() const { return sectorCount; }
+
+    /**
+     * @brief Change the logical sector size, keeping the size in bytes
+     * @note Only valid before the first read or write
+     * @param  size: the sector size, 512 or 4096
+     * @retval true if successful, false if the size is not supported or
+     *         does not divide the device
+     */
+    bool setSectorSize(uint32_t size);
+
+    // true if zeroSectors releases storage instead of writing zeros
+    virtual bool isSparse() const { return false; }
+
+    // true if several threads may read and write disjoint sectors at once
+    virtual bool isConcurrent() const { return false; }
+
+    // the sectors in place in memory, or nullptr if the backend can only copy them
+    virtual const uint8_t *getMappedSectors(uint64_t, uint64_t) { return nullptr; }
+
+    /**
+     * @brief Copy part of a host file into consecutive sectors inside the kernel
+     * @note The bytes past the end of the copy in its last sector are left as
+     *       they are. Backends without a file to copy into return false and
+     *       the caller copies through memory instead
+     * @param  fd: the host file
+     * @param  offset: where to start in the host file
+     * @param  logicalBlockAddress: the first sector
+     * @param  length: the number of bytes
+     * @retval true if copied, false otherwise
+     */
+    virtual bool copyFromFile(int, uint64_t, uint64_t, uint64_t) { return false; }
+
+    /**
+     * @brief Leave sectors to be filled from a host file when the image is streamed
+     * @note Only a device planning an image without holding its file data
+     *       takes the reference; the caller then writes nothing there. May
+     *       be called from several threads at once
+     * @param  &path: the host file
+     * @param  offset: where the data starts in the host file
+     * @param  logicalBlockAddress: the first sector
+     * @param  length: the number of bytes, the rest of the last sector reads as zeros
+     * @retval true if the device took the reference, false if the caller writes the data
+     */
+    virtual bool referenceHostFile(const std::string &, uint64_t, uint64_t, uint64_t) { return false; }
+
+    virtual bool readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count) = 0;
+    virtual bool writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count) = 0;
+    virtual bool flush() = 0;
+
+    /**
+     * @brief Write several buffers to consecutive sectors
+     * @note Every buffer length must be a multiple of the sector size; the
+     *       same buffer may appear more than once, e.g. for FAT copies
+     * @param  logicalBlockAddress: the first sector
+     * @param  *vectors: the buffers
+     * @param  vectorCount: the number of buffers
+     * @retval true if successful, false otherwise
+     */
+    virtual bool writeSectorsVectored(uint64_t logicalBlockAddress, const struct iovec *vectors, int vectorCount);
+
+    /**
+     * @brief Make a range of sectors read back as zeros
+     * @note Backends that can drop storage (hole punching, chunk release)
+     *       do so instead of writing zeros
+     * @param  logicalBlockAddress: the first sector
+     * @param  count: the number of sectors
+     * @retval true if successful, false otherwise
+     */
+    virtual bool zeroSectors(uint64_t logicalBlockAddress, uint64_t count);
+
+protected:
+    bool inRange(uint64_t logicalBlockAddress, uint64_t count) const
+    {
+        return logicalBlockAddress <= sectorCount && count <= sectorCount - logicalBlockAddress;
+    }
+
+    uint32_t sectorSize = BLOCK_SIZE;
+    uint64_t sectorCount = 0;
+};
+
+/**
+ * @brief Write a structure to the start of a run of sectors
+ * @note On-disk structures are sized for 512 byte sectors; on larger
+ *       sectors the rest of the last sector is written as zeros
+ * @param  &device: the block device
+ * @param  logicalBlockAddress: the first sector
+ * @param  *buffer: the structure
+ * @param  length: the size of the structure in bytes
+ * @retval true if successful, false otherwise
+ */
+bool writeSectorBytes(BlockDevice &device, uint64_t logicalBlockAddress, const void *buffer, size_t length);
+
+/**
+ * @brief Read a structure from the start of a run of sectors
+ * @param  &device: the block device
+ * @param  logicalBlockAddress: the first sector
+ * @param  *buffer: the structure
+ * @param  length: the size of the structure in bytes
+ * @retval true if successful, false otherwise
+ */
+bool readSectorBytes(BlockDevice &device, uint64_t logicalBlockAddress, void *buffer, size_t length);
+
+/**
+ * @brief Read a whole buffer from a file descriptor at an absolute byte offset
+ * @param  fd: the file descriptor
+ * @param  *buffer: the buffer
+ * @param  length: the number of bytes to read
+ * @param  offset: the byte offset in the file
+ * @retval true if successful, false otherwise
+ */
+bool readFully(int fd, void *buffer, size_t length, uint64_t offset);
+
+/**
+ * @brief Write a whole buffer to a file descriptor at an absolute byte offset
+ * @param  fd: the file descriptor
+ * @param  *buffer: the buffer
+ * @param  length: the number of bytes to write
+ * @param  offset: the byte offset in the file
+ * @retval true if successful, false otherwise
+ */
+bool writeFully(int fd, const void *buffer, size_t length, uint64_t offset);
+
+/**
+ * @brief Write several buffers to the current position of a file, pipe or socket
+ * @note Short writes, which pipes make, continue where they stopped; the
+ *       buffers are consumed
+ * @param  fd: the file descriptor
+ * @param  &vectors: the buffers
+ * @retval true if successful, false otherwise
+ */
+bool writeVectorsFully(int fd, std::vector<struct iovec> &vectors);
+
+/**
+ * @brief Parse a block device backend name
+ * @param  *name: the backend name (i.e. file, mmap, uring, direct)
+ * @param  &type: the backend type
+ * @retval true if the name is a known backend, false otherwise
+ */
+bool parseBlockDeviceType(const char *name, BLOCK_DEVICE_TYPE &type);
+
+/**
+ * @brief Parse an image format name
+ * @param  *name: the format name (i.e. raw, qcow2)
+ * @param  &format: the image format
+ * @retval true if the name is a known format, false otherwise
+ */
+bool parseImageFormat(const char *name, IMAGE_FORMAT &format);
+
+/**
+ * @brief Check whether an image file starts with the qcow2 magic
+ * @param  *path: the image file name
+ * @retval true if the image is a qcow2 image, false otherwise
+ */
+bool isQcow2Image(const char *path);
+
+/**
+ * @brief Get the size of a block device
+ * @param  *path: the device name
+ * @param  &sizeInBytes: the size of the device
+ * @param  &sectorSize: the logical sector size of the device
+ * @retval true if path names a block device, false otherwise
+ */
+bool getBlockDeviceSize(const char *path, uint64_t &sizeInBytes, uint32_t &sectorSize);
+
+/**
+ * @brief Open an existing image file
+ * @note qcow2 images are recognised by their magic and always use the
+ *       qcow2 backend
+ * @param  type: the backend type (file, mmap, uring or direct) for raw images
+ * @param  *path: the image file name
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @retval The block device, or nullptr if the image could not be opened
+ */
+std::unique_ptr<BlockDevice> openBlockDevice(BLOCK_DEVICE_TYPE type, const char *path, uint32_t queueDepth = BLOCK_DEVICE_URING_QUEUE_DEPTH);
+
+/**
+ * @brief Create an image file of a given size
+ * @param  type: the backend type (file, mmap, uring or direct)
+ * @param  *path: the image file name
+ * @param  count: the size of the image in sectors
+ * @param  sparse: true to leave unwritten regions as holes
+ * @param  format: the image format, qcow2 images ignore type and sparse
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @param  sectorSize: the logical sector size, 512 or 4096
+ * @retval The block device, or nullptr if the image could not be created
+ */
+std::unique_ptr<BlockDevice> createBlockDevice(BLOCK_DEVICE_TYPE type, const char *path, uint64_t count, bool sparse, IMAGE_FORMAT format = IMAGE_FORMAT_RAW,
+                                               uint32_t queueDepth = BLOCK_DEVICE_URING_QUEUE_DEPTH, uint32_t sectorSize = BLOCK_SIZE);
+
+#endif // _BLOCKDEVICE_H
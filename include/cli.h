@@ -0,0 +1,36 @@
+#ifndef _CLI_H
+#define _CLI_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/**
+ * @brief Parse a decimal number given on the command line
+ * @param  *text: the text, digits only
+ * @param  minimum: the smallest value allowed
+ * @param  maximum: the largest value allowed
+ * @param  &value: the number
+ * @retval true if the text is a number in range, false otherwise
+ */
+inline bool parseNumber(const char *text, uint32_t minimum, uint32_t maximum, uint32_t &value)
+{
+    // strtoull would skip blanks and wrap a minus sign around
+    if (*text < '0' || *text > '9')
+    {
+        return false;
+    }
+
+    char *end = nullptr;
+    errno = 0;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (*end != '\0' || errno == ERANGE || number < minimum || number > maximum)
+    {
+        return false;
+    }
+
+    value = (uint32_t)number;
+    return true;
+}
+
+#endif // _CLI_H
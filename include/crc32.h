@@ -0,0 +1,571 @@
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_CLMUL 1
+#elif defined(__riscv) && __riscv_xlen == 64 && defined(__linux__) && __has_include(<asm/hwprobe.h>)
+#include <asm/hwprobe.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(RISCV_HWPROBE_EXT_ZBC) && defined(__NR_riscv_hwprobe)
+#define CRC32_HAVE_CLMUL 1
+#endif
+#endif
+
+#define CRC32_POLYNOMIAL 0xEDB88320  // reflected 0x04C11DB7
+#define CRC32C_POLYNOMIAL 0x82F63B78 // reflected 0x1EDC6F41 (Castagnoli)
+#define CRC32_CLMUL_MIN_LENGTH 64
+
+/**
+ * Slicing tables for a reflected CRC32 polynomial; table [0] is the
+ * classic byte-at-a-time table, table [n] advances a byte by n more zero
+ * bytes so that 8 or 16 input bytes can be folded per step
+ */
+struct Crc32Tables
+{
+    uint32_t table[16][256];
+
+    constexpr Crc32Tables(uint32_t polynomial = CRC32_POLYNOMIAL) : table()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ (polynomial & (0 - (crc & 1)));
+            }
+            table[0][i] = crc;
+        }
+
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            for (int slice = 1; slice < 16; slice++)
+            {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+inline constexpr Crc32Tables crc32Tables{};
+inline constexpr Crc32Tables crc32cTables{CRC32C_POLYNOMIAL};
+
+/**
+ * @brief Load a little endian 32-bit word from an unaligned address
+ * @param  *data: the data pointer
+ * @retval The 32-bit word
+ */
+inline uint32_t crc32Load32(const uint8_t *data)
+{
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+/**
+ * @brief Calculate CRC32 checksum one byte at a time
+ * @note Taken from https://create.stephan-brumme.com/crc32/
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  previousCrc32: the previous CRC32 checksum
+ * @retval The CRC32 checksum of the data buffer
+ */
+inline uint32_t crc32Bytewise(const void *data, size_t length, uint32_t previousCrc32 = 0)
+{
+    uint32_t crc = ~previousCrc32;
+    const uint8_t *current = (const uint8_t *)data;
+
+    while (length--)
+    {
+        crc = (crc >> 8) ^ crc32Tables.table[0][(crc & 0xFF) ^ *current++];
+    }
+
+    return ~crc;
+}
+
+/**
+ * @brief Calculate CRC32 checksum eight bytes at a time
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  previousCrc32: the previous CRC32 checksum
+ * @retval The CRC32 checksum of the data buffer
+ */
+inline uint32_t crc32Slicing8(const void *data, size_t length, uint32_t previousCrc32 = 0)
+{
+    const uint32_t (*t)[256] = crc32Tables.table;
+    uint32_t crc = ~previousCrc32;
+    const uint8_t *current = (const uint8_t *)data;
+
+    while (length >= 8)
+    {
+        uint32_t one = crc32Load32(current) ^ crc;
+        uint32_t two = crc32Load32(current + 4);
+        crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+              t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+        current += 8;
+        length -= 8;
+    }
+
+    return crc32Bytewise(current, length, ~crc);
+}
+
+/**
+ * @brief Calculate CRC32 checksum sixteen bytes at a time
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  previousCrc32: the previous CRC32 checksum
+ * @retval The CRC32 checksum of the data buffer
+ */
+inline uint32_t crc32Slicing16(const void *data, size_t length, uint32_t previousCrc32 = 0)
+{
+    const uint32_t (*t)[256] = crc32Tables.table;
+    uint32_t crc = ~previousCrc32;
+    const uint8_t *current = (const uint8_t *)data;
+
+    while (length >= 16)
+    {
+        uint32_t one = crc32Load32(current) ^ crc;
+        uint32_t two = crc32Load32(current + 4);
+        uint32_t three = crc32Load32(current + 8);
+        uint32_t four = crc32Load32(current + 12);
+        crc = t[15][one & 0xFF] ^ t[14][(one >> 8) & 0xFF] ^ t[13][(one >> 16) & 0xFF] ^ t[12][one >> 24] ^
+              t[11][two & 0xFF] ^ t[10][(two >> 8) & 0xFF] ^ t[9][(two >> 16) & 0xFF] ^ t[8][two >> 24] ^
+              t[7][three & 0xFF] ^ t[6][(three >> 8) & 0xFF] ^ t[5][(three >> 16) & 0xFF] ^ t[4][three >> 24] ^
+              t[3][four & 0xFF] ^ t[2][(four >> 8) & 0xFF] ^ t[1][(four >> 16) & 0xFF] ^ t[0][four >> 24];
+        current += 16;
+        length -= 16;
+    }
+
+    return crc32Slicing8(current, length, ~crc);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief Fold 64 byte blocks of the CRC32 state with PCLMULQDQ
+ * @note Folding and Barrett constants from Intel's "Fast CRC Computation for
+ *       Generic Polynomials Using PCLMULQDQ Instruction" for the reflected
+ *       polynomial; length must be at least 64 and a multiple of 16
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  crc: the running (inverted) CRC32 state
+ * @retval The running (inverted) CRC32 state after the data buffer
+ */
+__attribute__((target("pclmul,sse4.1"))) inline uint32_t crc32FoldClmul(const uint8_t *data, size_t length, uint32_t crc)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163CD6124);
+    const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    data += 64;
+    length -= 64;
+
+    // fold four 128-bit lanes in parallel
+    while (length >= 64)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 0x30)));
+        data += 64;
+        length -= 64;
+    }
+
+    // fold the four lanes into one
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+    // fold any remaining 128-bit blocks
+    while (length >= 16)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_loadu_si128((const __m128i *)data)), x5);
+        data += 16;
+        length -= 16;
+    }
+
+    // fold 128 bits down to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5k0, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+/**
+ * @brief Check if the CPU supports the carry-less multiply path
+ * @retval true if PCLMULQDQ and SSE4.1 are available, false otherwise
+ */
+inline bool crc32HasClmul()
+{
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#elif defined(CRC32_HAVE_CLMUL)
+typedef struct _CRC32_U128
+{
+    uint64_t lo;
+    uint64_t hi;
+} CRC32_U128;
+
+/**
+ * @brief Carry-less multiply two 64-bit words with Zbc clmul/clmulh
+ * @note The .option directive lets a build without Zbc carry the instructions;
+ *       they only execute once crc32HasClmul() has confirmed the extension
+ * @param  a: the first operand
+ * @param  b: the second operand
+ * @retval The 128-bit product
+ */
+inline CRC32_U128 crc32Clmul64(uint64_t a, uint64_t b)
+{
+    CRC32_U128 product;
+    __asm__(".option push\n"
+            ".option arch, +zbc\n"
+            "clmul %0, %2, %3\n"
+            "clmulh %1, %2, %3\n"
+            ".option pop\n"
+            : "=&r"(product.lo), "=&r"(product.hi)
+            : "r"(a), "r"(b));
+    return product;
+}
+
+/**
+ * @brief Fold a 128-bit CRC32 state over the next 16 bytes
+ * @param  x: the folded state
+ * @param  k_lo: the constant for the low half
+ * @param  k_hi: the constant for the high half
+ * @param  *data: the next 16 bytes
+ * @retval The new folded state
+ */
+inline CRC32_U128 crc32Fold128(CRC32_U128 x, uint64_t k_lo, uint64_t k_hi, const uint8_t *data)
+{
+    CRC32_U128 lo = crc32Clmul64(x.lo, k_lo);
+    CRC32_U128 hi = crc32Clmul64(x.hi, k_hi);
+    uint64_t next[2];
+    memcpy(next, data, sizeof(next));
+    return {lo.lo ^ hi.lo ^ next[0], lo.hi ^ hi.hi ^ next[1]};
+}
+
+/**
+ * @brief Fold 64 byte blocks of the CRC32 state with Zbc carry-less multiply
+ * @note Same constants and reduction as the PCLMULQDQ path, expressed on
+ *       64-bit scalar halves; length must be at least 64 and a multiple of 16
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  crc: the running (inverted) CRC32 state
+ * @retval The running (inverted) CRC32 state after the data buffer
+ */
+inline uint32_t crc32FoldClmul(const uint8_t *data, size_t length, uint32_t crc)
+{
+    const uint64_t k1 = 0x0154442BD4, k2 = 0x01C6E41596, k3 = 0x01751997D0, k4 = 0x00CCAA009E;
+    const uint64_t k5 = 0x0163CD6124, poly = 0x01DB710641, mu = 0x01F7011641;
+    const uint64_t mask = 0xFFFFFFFF;
+    CRC32_U128 x[4];
+
+    memcpy(x, data, sizeof(x));
+    x[0].lo ^= crc;
+    data += 64;
+    length -= 64;
+
+    // fold four 128-bit lanes in parallel
+    while (length >= 64)
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            x[lane] = crc32Fold128(x[lane], k1, k2, data + lane * 16);
+        }
+        data += 64;
+        length -= 64;
+    }
+
+    // fold the four lanes into one
+    CRC32_U128 x1 = x[0];
+    for (int lane = 1; lane < 4; lane++)
+    {
+        x1 = crc32Fold128(x1, k3, k4, reinterpret_cast<const uint8_t *>(&x[lane]));
+    }
+
+    // fold any remaining 128-bit blocks
+    while (length >= 16)
+    {
+        x1 = crc32Fold128(x1, k3, k4, data);
+        data += 16;
+        length -= 16;
+    }
+
+    // fold 128 bits down to 64 bits
+    CRC32_U128 x2 = crc32Clmul64(x1.lo, k4);
+    x1 = {x1.hi ^ x2.lo, x2.hi};
+    x2 = {(x1.lo >> 32) | (x1.hi << 32), x1.hi >> 32};
+    x1 = crc32Clmul64(x1.lo & mask, k5);
+    x1 = {x1.lo ^ x2.lo, x1.hi ^ x2.hi};
+
+    // Barrett reduction to 32 bits
+    x2 = crc32Clmul64(x1.lo & mask, mu);
+    x2 = crc32Clmul64(x2.lo & mask, poly);
+
+    return (uint32_t)((x1.lo ^ x2.lo) >> 32);
+}
+
+/**
+ * @brief Check if the CPU supports the carry-less multiply path
+ * @retval true if the Zbc extension is available, false otherwise
+ */
+inline bool crc32HasClmul()
+{
+    struct riscv_hwprobe probe = {RISCV_HWPROBE_KEY_IMA_EXT_0, 0};
+    if (syscall(__NR_riscv_hwprobe, &probe, 1, 0, nullptr, 0) != 0)
+    {
+        return false;
+    }
+
+    return (probe.value & RISCV_HWPROBE_EXT_ZBC) != 0;
+}
+#endif
+
+#if defined(CRC32_HAVE_CLMUL)
+/**
+ * @brief Calculate CRC32 checksum with carry-less multiply folding
+ * @note Must only be called when crc32HasClmul() returns true; the head
+ *       and tail that do not fill a 16 byte block go through slicing-by-16
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  previousCrc32: the previous CRC32 checksum
+ * @retval The CRC32 checksum of the data buffer
+ */
+inline uint32_t crc32Clmul(const void *data, size_t length, uint32_t previousCrc32 = 0)
+{
+    if (length < CRC32_CLMUL_MIN_LENGTH)
+    {
+        return crc32Slicing16(data, length, previousCrc32);
+    }
+
+    const uint8_t *current = (const uint8_t *)data;
+    size_t folded = length & ~(size_t)15;
+    uint32_t crc = ~crc32FoldClmul(current, folded, ~previousCrc32);
+
+    return crc32Slicing16(current + folded, length - folded, crc);
+}
+#endif
+
+typedef uint32_t (*Crc32Function)(const void *data, size_t length, uint32_t previousCrc32);
+
+/**
+ * @brief Pick the fastest CRC32 implementation for this CPU
+ * @retval The CRC32 function
+ */
+inline Crc32Function crc32SelectImplementation()
+{
+#if defined(CRC32_HAVE_CLMUL)
+    if (crc32HasClmul())
+    {
+        return crc32Clmul;
+    }
+#endif
+    return crc32Slicing16;
+}
+
+/**
+ * @brief Calculate CRC32 checksum of data buffer
+ * @note Dispatches to the fastest implementation picked at first use
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  previousCrc32: the previous CRC32 checksum
+ * @retval The CRC32 checksum of the data buffer
+ */
+inline uint32_t crc32(const void *data, size_t length, uint32_t previousCrc32 = 0)
+{
+    static const Crc32Function implementation = crc32SelectImplementation();
+    return implementation(data, length, previousCrc32);
+}
+
+/**
+ * @brief Multiply two polynomials modulo the CRC32 polynomial
+ * @param  a: the first polynomial (reflected)
+ * @param  b: the second polynomial (reflected)
+ * @retval a * b mod p(x)
+ */
+constexpr uint32_t crc32MultiplyModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+            {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLYNOMIAL : b >> 1;
+    }
+    return p;
+}
+
+/**
+ * Powers x^(2^n) mod p(x) used to shift a CRC by a number of zero bytes
+ */
+struct Crc32PowerTable
+{
+    uint32_t power[32];
+
+    constexpr Crc32PowerTable() : power()
+    {
+        uint32_t p = (uint32_t)1 << 30; // x^1
+        power[0] = p;
+        for (int n = 1; n < 32; n++)
+        {
+            power[n] = p = crc32MultiplyModP(p, p);
+        }
+    }
+};
+
+inline constexpr Crc32PowerTable crc32PowerTable{};
+
+/**
+ * @brief Combine the CRC32 of two consecutive buffers
+ * @note Equivalent to zlib's crc32_combine; lets buffers be hashed in
+ *       parallel chunks and merged in O(log length)
+ * @param  crc1: the CRC32 checksum of the first buffer
+ * @param  crc2: the CRC32 checksum of the second buffer
+ * @param  length2: the length of the second buffer
+ * @retval The CRC32 checksum of the two buffers concatenated
+ */
+inline uint32_t crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t length2)
+{
+    // x^(8 * length2) mod p(x)
+    uint32_t p = (uint32_t)1 << 31;
+    for (unsigned k = 3; length2; length2 >>= 1, k++)
+    {
+        if (length2 & 1)
+        {
+            p = crc32MultiplyModP(crc32PowerTable.power[k & 31], p);
+        }
+    }
+
+    return crc32MultiplyModP(p, crc1) ^ crc2;
+}
+
+/**
+ * @brief Calculate CRC32C checksum eight bytes at a time
+ * @note Same slicing as crc32Slicing8, over the Castagnoli tables
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  previousCrc32: the previous CRC32C checksum
+ * @retval The CRC32C checksum of the data buffer
+ */
+inline uint32_t crc32cSlicing8(const void *data, size_t length, uint32_t previousCrc32 = 0)
+{
+    const uint32_t (*t)[256] = crc32cTables.table;
+    uint32_t crc = ~previousCrc32;
+    const uint8_t *current = (const uint8_t *)data;
+
+    while (length >= 8)
+    {
+        uint32_t one = crc32Load32(current) ^ crc;
+        uint32_t two = crc32Load32(current + 4);
+        crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+              t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+        current += 8;
+        length -= 8;
+    }
+
+    while (length--)
+    {
+        crc = (crc >> 8) ^ t[0][(crc & 0xFF) ^ *current++];
+    }
+
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief Calculate CRC32C checksum with the SSE4.2 crc32 instruction
+ * @note Must only be called when crc32cHasHardware() returns true
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  previousCrc32: the previous CRC32C checksum
+ * @retval The CRC32C checksum of the data buffer
+ */
+__attribute__((target("sse4.2"))) inline uint32_t crc32cHardware(const void *data, size_t length, uint32_t previousCrc32 = 0)
+{
+    uint64_t crc = ~previousCrc32 & 0xFFFFFFFF;
+    const uint8_t *current = (const uint8_t *)data;
+
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, current, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+        current += 8;
+        length -= 8;
+    }
+
+    while (length--)
+    {
+        crc = _mm_crc32_u8((uint32_t)crc, *current++);
+    }
+
+    return ~(uint32_t)crc;
+}
+
+/**
+ * @brief Check if the CPU has the SSE4.2 crc32 instruction
+ * @retval true if SSE4.2 is available, false otherwise
+ */
+inline bool crc32cHasHardware()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+/**
+ * @brief Calculate CRC32C (Castagnoli) checksum of data buffer
+ * @note Used by ext4 metadata checksums; dispatches to the crc32
+ *       instruction when the CPU has one
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  previousCrc32: the previous CRC32C checksum
+ * @retval The CRC32C checksum of the data buffer
+ */
+inline uint32_t crc32c(const void *data, size_t length, uint32_t previousCrc32 = 0)
+{
+#if defined(__x86_64__)
+    static const Crc32Function implementation = crc32cHasHardware() ? crc32cHardware : crc32cSlicing8;
+#else
+    static const Crc32Function implementation = crc32cSlicing8;
+#endif
+    return implementation(data, length, previousCrc32);
+}
+
+#endif // _CRC32_H
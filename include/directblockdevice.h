@@ -0,0 +1,56 @@
+#ifndef _DIRECTBLOCKDEVICE_H
+#define _DIRECTBLOCKDEVICE_H
+
+#include <fcntl.h>
+#include "fileblockdevice.h"
+
+#define BLOCK_DEVICE_DIRECT_BUFFER_SIZE (1024 * 1024) // bounce buffers of the O_DIRECT backend
+#define BLOCK_DEVICE_DIRECT_ALIGNMENT 4096 // O_DIRECT alignment when the file system does not report one
+
+/**
+ * Image file or block device opened with O_DIRECT, so nothing goes through
+ * the page cache; writes are gathered in an aligned bounce buffer, partial
+ * blocks at its edges are read back first when the device alignment is
+ * larger than a sector, and aligned writes from aligned memory skip the copy
+ */
+class DirectBlockDevice : public FileBlockDevice
+{
+public:
+    DirectBlockDevice() : pool(BLOCK_DEVICE_DIRECT_BUFFER_SIZE) {}
+    ~DirectBlockDevice() override;
+    bool open(const char *path) override;
+    bool create(const char *path, uint64_t count, bool sparse) override;
+
+    // a copy through the page cache would race with the staged writes,
+    // which rewrite whole aligned blocks
+    bool copyFromFile(int, uint64_t, uint64_t, uint64_t) override { return false; }
+
+    bool readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count) override;
+    bool writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count) override;
+    bool writeSectorsVectored(uint64_t logicalBlockAddress, const struct iovec *vectors, int vectorCount) override;
+    bool zeroSectors(uint64_t logicalBlockAddress, uint64_t count) override;
+    bool flush() override;
+
+    // the offset and length granularity of every request
+    uint32_t getAlignment() const { return alignment; }
+
+protected:
+    int getOpenFlags() const override { return O_DIRECT; }
+
+private:
+    bool setup();
+    uint64_t alignUp(uint64_t length) const;
+
+    // read aligned blocks, past the end of an image file reads back as zeros
+    bool readAligned(uint64_t offset, uint8_t *buffer, uint64_t length);
+
+    bool flushStagedWrite();
+
+    AlignedBufferPool pool;
+    AlignedBuffer staged;
+    uint64_t stagedOffset = 0;
+    uint64_t stagedLength = 0;
+    uint32_t alignment = BLOCK_SIZE;
+};
+
+#endif // _DIRECTBLOCKDEVICE_H
@@ -0,0 +1,81 @@
+#ifndef _FILEBLOCKDEVICE_H
+#define _FILEBLOCKDEVICE_H
+
+#include <sys/stat.h>
+#include "blockdevice.h"
+
+#define BLOCK_DEVICE_COALESCE_LIMIT (1024 * 1024)
+
+/**
+ * Image file accessed with pread/pwrite; consecutive writes are gathered
+ * into one buffer and issued as a single pwrite
+ */
+class FileBlockDevice : public BlockDevice
+{
+public:
+    ~FileBlockDevice() override;
+
+    /**
+     * @brief Open an existing image file
+     * @param  *path: the image file name
+     * @retval true if successful, false otherwise
+     */
+    virtual bool open(const char *path);
+
+    /**
+     * @brief Create an image file of a given size without writing its contents
+     * @note A sparse image is only truncated to its final size so that every
+     *       block that is never written stays a hole. Otherwise the blocks are
+     *       reserved with fallocate, which allocates them without writing zeros.
+     *       A block device is discarded instead and always treated as sparse,
+     *       the file systems then zero what must read back as zeros.
+     * @param  *path: the image file or device name
+     * @param  count: the size of the image in sectors
+     * @param  sparse: true to leave unwritten regions as holes
+     * @retval true if successful, false otherwise
+     */
+    virtual bool create(const char *path, uint64_t count, bool sparse);
+
+    bool readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count) override;
+    bool writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count) override;
+    bool writeSectorsVectored(uint64_t logicalBlockAddress, const struct iovec *vectors, int vectorCount) override;
+    bool isSparse() const override { return sparse; }
+    bool zeroSectors(uint64_t logicalBlockAddress, uint64_t count) override;
+    bool copyFromFile(int sourceFd, uint64_t offset, uint64_t logicalBlockAddress, uint64_t length) override;
+    bool flush() override;
+
+    // true if the target is a block device rather than an image file
+    bool isBlockDevice() const { return blockDevice; }
+
+    // the sector sizes the device reports, BLOCK_SIZE for image files
+    uint32_t getLogicalSectorSize() const { return logicalSectorSize; }
+
+    uint32_t getPhysicalSectorSize() const { return physicalSectorSize; }
+
+protected:
+    // extra flags for open(2), e.g. O_DIRECT
+    virtual int getOpenFlags() const { return 0; }
+
+    /**
+     * @brief Get the size of the open file or device
+     * @note For a block device the logical and physical sector sizes are
+     *       read as well
+     * @param  &st: the status of the open file
+     * @param  &sizeInBytes: the size in bytes
+     * @retval true if successful, false otherwise
+     */
+    bool querySize(const struct stat &st, uint64_t &sizeInBytes);
+
+    uint64_t pendingEndLogicalBlockAddress() const;
+    bool flushPendingWrite();
+
+    int fd = -1;
+    bool sparse = false;
+    bool blockDevice = false;
+    uint32_t logicalSectorSize = BLOCK_SIZE;
+    uint32_t physicalSectorSize = BLOCK_SIZE;
+    uint64_t pendingLogicalBlockAddress = 0;
+    std::vector<uint8_t> pendingWrite;
+};
+
+#endif // _FILEBLOCKDEVICE_H
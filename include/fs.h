@@ -11,15 +11,45 @@
 #define GPT_REVISION 0x00010000
 #define OSTYPE_UEFI 0xEF
 #define OSTYPE_PMBR 0xEE
-#define BLOCK_SIZE 512
+#define BLOCK_SIZE 512 // size of the on-disk structures below, and the default logical sector size
+#define MAX_SECTOR_SIZE 4096 // 4Kn drives
 #define GPT_PARTITION_ENTRY_SIZE 128
 #define GPT_PARTITION_TABLE_MIN_SIZE 16384
 #define GPT_PARTITION_ALIGNMENT 1048576
 #define GPT_PARTITION_TABLE_ENTRIES 128
-#define ALIGNMENT_LBA (GPT_PARTITION_ALIGNMENT / BLOCK_SIZE)
+#define ALIGNMENT_LBA(sectorSize) (GPT_PARTITION_ALIGNMENT / (sectorSize))
+
+#define G2FS_SIGNATURE 0x5245505553463247 // "G2FSUPER", little endian
+#define G2FS_GROUP_SIGNATURE 0x5055524753463247 // "G2FSGRUP", little endian
+#define G2FS_NODE_SIGNATURE 0x45444F4E // "NODE", little endian
+#define G2FS_REVISION 0x00010000
+#define G2FS_SUPERBLOCK_SIZE 160
+#define G2FS_BLOCK_SIZE 4096
+#define G2FS_INODE_SIZE 256
+#define G2FS_INODES_PER_BLOCK (G2FS_BLOCK_SIZE / G2FS_INODE_SIZE)
+#define G2FS_BITS_PER_BLOCK (G2FS_BLOCK_SIZE * 8)
+#define G2FS_INLINE_EXTENTS 7
+#define G2FS_MAX_NAME_LENGTH 255
+#define G2FS_ROOT_INODE 1
+#define G2FS_MODE_DIRECTORY 0040000
+#define G2FS_MODE_FILE 0100000
+#define G2FS_INODE_EXTENT_TREE 0x00000001 // extents live in the B+tree at root
+#define G2FS_TYPE_FILE 1
+#define G2FS_TYPE_DIRECTORY 2
+
+#define QCOW2_MAGIC 0x514649FB // "QFI\xfb", big endian
+#define QCOW2_VERSION 3
+#define QCOW2_V2_HEADER_SIZE 72
+#define QCOW2_CLUSTER_BITS 16 // 64 KiB clusters, the qemu default
+#define QCOW2_REFCOUNT_ORDER 4 // 16-bit refcounts
+#define QCOW2_OFFSET_MASK 0x00FFFFFFFFFFFE00ULL // host offset bits of an L1/L2 entry
+#define QCOW2_COPIED (1ULL << 63) // refcount of the cluster is exactly one
+#define QCOW2_COMPRESSED (1ULL << 62)
+#define QCOW2_ZERO 1ULL // L2 entry reads back as zeros
 
 const GUID ESP_GUID = {0xC12A7328, 0xF81F, 0x11D2, 0xBA, 0x4B, {0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B}};
 const GUID FAT32_GUID = {0xEBD0A0A2, 0xB9E5, 0x4433, 0x87, 0xC0, {0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7}};
+const GUID LINUX_FILESYSTEM_GUID = {0x0FC63DAF, 0x8483, 0x4772, 0x8E, 0x79, {0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4}};
 
 // MBR partition entry
 typedef struct _MBR_PARTITION_ENTRY
@@ -71,4 +101,131 @@ typedef struct _GPT_HEADER
     uint8_t reserved2[BLOCK_SIZE - GPT_HEADER_SIZE]; // must be zero
 } __attribute__((packed)) GPT_HEADER;
 
+// g2fs superblock, at byte 0 of block 0 and again in the last block of the volume
+typedef struct _G2FS_SUPERBLOCK
+{
+    uint64_t signature;       // G2FS_SIGNATURE
+    uint32_t revision;        // G2FS_REVISION
+    uint32_t superblockSize;  // size of this superblock (G2FS_SUPERBLOCK_SIZE)
+    uint32_t crc32;           // CRC32 of this superblock (offset +0 up to superblockSize)
+    uint32_t blockSize;       // G2FS_BLOCK_SIZE
+    uint64_t blockCount;      // blocks in the volume, block 0 is the first block of the partition
+    uint64_t freeBlocks;      // sum of the group free block counts
+    uint64_t inodeCount;      // groupCount * inodesPerGroup
+    uint64_t freeInodes;      // sum of the group free inode counts
+    uint32_t groupCount;      // allocation groups, one per CPU
+    uint32_t blocksPerGroup;  // blocks in every group but the last, which takes the remainder
+    uint32_t inodesPerGroup;  // inodes in every group, a multiple of G2FS_INODES_PER_BLOCK
+    uint32_t inodeSize;       // G2FS_INODE_SIZE
+    uint64_t rootInode;       // G2FS_ROOT_INODE
+    uint64_t createTime;      // nanoseconds since the epoch
+    GUID volumeIdentifier;    // volume GUID
+    char volumeLabel[32];     // NUL padded
+    uint8_t reserved[24];     // must be zero
+    uint8_t reserved2[BLOCK_SIZE - G2FS_SUPERBLOCK_SIZE]; // must be zero
+} __attribute__((packed)) G2FS_SUPERBLOCK;
+
+// g2fs allocation group descriptor, in the first block of its group (block 1 for group 0)
+typedef struct _G2FS_GROUP_DESCRIPTOR
+{
+    uint64_t signature;            // G2FS_GROUP_SIGNATURE
+    uint32_t group;                // number of this group
+    uint32_t crc32;                // CRC32 of this descriptor with crc32 zeroed
+    uint64_t firstBlock;           // first block of the group
+    uint64_t blockCount;           // blocks in the group
+    uint64_t freeBlocks;           // free blocks in the group
+    uint64_t freeInodes;           // free inodes in the group
+    uint64_t blockBitmapBlock;     // one bit per block of the group, set when in use
+    uint64_t inodeBitmapBlock;     // one bit per inode of the group, set when in use
+    uint64_t inodeTableBlock;      // inodesPerGroup inodes of G2FS_INODE_SIZE bytes
+    uint64_t firstDataBlock;       // first block after the group metadata
+    uint8_t reserved[BLOCK_SIZE - 80]; // must be zero
+} __attribute__((packed)) G2FS_GROUP_DESCRIPTOR;
+
+// a run of blocks of a file
+typedef struct _G2FS_EXTENT
+{
+    uint64_t logicalBlock;  // first block within the file
+    uint64_t physicalBlock; // first block within the volume
+    uint32_t blockCount;    // length of the run
+    uint32_t flags;         // must be zero
+} __attribute__((packed)) G2FS_EXTENT;
+
+// g2fs inode; inode n is entry (n % inodesPerGroup) of group (n / inodesPerGroup), inode 0 is never used
+typedef struct _G2FS_INODE
+{
+    uint16_t mode;        // G2FS_MODE_* type and permission bits
+    uint16_t linkCount;   // directory entries naming this inode
+    uint32_t flags;       // G2FS_INODE_*
+    uint32_t uid;         // owner
+    uint32_t gid;         // group
+    uint64_t size;        // size in bytes
+    uint64_t blockCount;  // blocks in use, data and B+tree nodes
+    uint64_t accessTime;  // nanoseconds since the epoch
+    uint64_t modifyTime;  // nanoseconds since the epoch
+    uint64_t changeTime;  // nanoseconds since the epoch
+    uint64_t createTime;  // nanoseconds since the epoch
+    uint64_t root;        // B+tree root block: directory entries, or extents with G2FS_INODE_EXTENT_TREE
+    uint64_t parent;      // parent directory inode, for directories
+    uint32_t extentCount; // extents of the file, inline or in the B+tree
+    uint32_t crc32;       // CRC32 of this inode with crc32 zeroed
+    G2FS_EXTENT extents[G2FS_INLINE_EXTENTS]; // the extents, unless G2FS_INODE_EXTENT_TREE
+} __attribute__((packed)) G2FS_INODE;
+
+// header of every B+tree node block; directory trees are keyed by the CRC32 of
+// the name, extent trees by logical block. Lookups descend into the last child
+// whose key is below the one searched for, then follow leaf next links while
+// keys still match, as equal keys may span leaves
+typedef struct _G2FS_NODE_HEADER
+{
+    uint32_t signature; // G2FS_NODE_SIGNATURE
+    uint32_t crc32;     // CRC32 of the whole block with crc32 zeroed
+    uint16_t level;     // 0 for leaves
+    uint16_t count;     // entries in this node
+    uint32_t reserved;  // must be zero
+    uint64_t owner;     // inode the tree belongs to
+    uint64_t next;      // next node on the same level, 0 for the last
+} __attribute__((packed)) G2FS_NODE_HEADER;
+
+// entry of an interior node
+typedef struct _G2FS_NODE_INDEX
+{
+    uint64_t key;   // first key of the child
+    uint64_t block; // child node block
+} __attribute__((packed)) G2FS_NODE_INDEX;
+
+// directory leaf record; a leaf holds count uint16_t offsets after the header,
+// in key order, each locating a record packed from the end of the block
+typedef struct _G2FS_DIRECTORY_ENTRY
+{
+    uint64_t inode;     // inode named by this entry
+    uint32_t hash;      // CRC32 of the name
+    uint8_t type;       // G2FS_TYPE_*
+    uint8_t nameLength; // bytes in name, not NUL terminated
+    char name[];
+} __attribute__((packed)) G2FS_DIRECTORY_ENTRY;
+
+// qcow2 image header, every field is big endian
+typedef struct _QCOW2_HEADER
+{
+    uint32_t magic;                 // QCOW2_MAGIC
+    uint32_t version;               // 2 or 3
+    uint64_t backingFileOffset;     // 0 without a backing file
+    uint32_t backingFileSize;       // length of the backing file name
+    uint32_t clusterBits;           // log2 of the cluster size
+    uint64_t size;                  // virtual disk size in bytes
+    uint32_t cryptMethod;           // 0 for no encryption
+    uint32_t l1Size;                // entries in the L1 table
+    uint64_t l1TableOffset;         // host offset of the L1 table
+    uint64_t refcountTableOffset;   // host offset of the refcount table
+    uint32_t refcountTableClusters; // clusters occupied by the refcount table
+    uint32_t numberOfSnapshots;     // snapshots in the image
+    uint64_t snapshotsOffset;       // host offset of the snapshot table
+    uint64_t incompatibleFeatures;  // version 3 from here on
+    uint64_t compatibleFeatures;
+    uint64_t autoclearFeatures;
+    uint32_t refcountOrder;         // log2 of the refcount width in bits
+    uint32_t headerLength;          // size of this header
+} __attribute__((packed)) QCOW2_HEADER;
+
 #endif // _FS_H
\ No newline at end of file
@@ -0,0 +1,384 @@
+#ifndef _GPT_H
+#define _GPT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+#include "fs.h"
+#include "crc32.h"
+#include "blockdevice.h"
+
+#define GPT_PARTITION_TABLE_SECTORS(sectorSize) (GPT_PARTITION_TABLE_ENTRIES * GPT_PARTITION_ENTRY_SIZE / (sectorSize))
+#define GPT_FIRST_USABLE_LBA(sectorSize) (2 + GPT_PARTITION_TABLE_SECTORS(sectorSize)) // MBR + GPT header + primary partition table
+
+/**
+ * @brief Generate a new GUID
+ * @retval A new GUID
+ */
+inline GUID newGuid()
+{
+    uint8_t randomBytes[16] = { 0 };
+
+    for(uint8_t i = 0; i < sizeof(randomBytes); i++) {
+        randomBytes[i] = rand() % (UINT8_MAX + 1);
+    }
+
+    GUID result = {
+        .timeLow = *(uint32_t *)&randomBytes[0],
+        .timeMid = *(uint16_t *)&randomBytes[4],
+        .timeHiAndVersion = *(uint16_t *)&randomBytes[6],
+        .clockSeqHiAndReserved = *(uint8_t *)&randomBytes[8],
+        .clockSeqLow = *(uint8_t *)&randomBytes[9],
+        .node = {
+            randomBytes[10], randomBytes[11], randomBytes[12],
+            randomBytes[13], randomBytes[14], randomBytes[15]
+        }
+    };
+
+    result.timeHiAndVersion &= ~(1 << 15);
+    result.timeHiAndVersion |= (1 << 14);
+    result.timeHiAndVersion &= ~(1 << 13);
+    result.timeHiAndVersion &= ~(1 << 12);
+
+    result.clockSeqHiAndReserved |= ~(1 << 7);
+    result.clockSeqHiAndReserved |= ~(1 << 6);
+    result.clockSeqHiAndReserved &= ~(1 << 5);
+
+    return result;
+}
+
+/**
+ * @brief Get the next aligned logical block address
+ * @param  logicalBlockAddress: the logical block address
+ * @param  sectorSize: the logical sector size in bytes
+ * @retval The next aligned logical block address
+ */
+inline uint64_t getNextAlignedLBA(const uint64_t logicalBlockAddress, const uint32_t sectorSize) {
+    return logicalBlockAddress - (logicalBlockAddress % ALIGNMENT_LBA(sectorSize)) + ALIGNMENT_LBA(sectorSize);
+}
+
+/**
+ * @brief Convert bytes to a logical block address
+ * @param  bytes: the bytes
+ * @param  sectorSize: the logical sector size in bytes
+ * @retval The logical block address
+ */
+inline uint64_t convertBytesToLogicalBlockAddress(const uint64_t bytes, const uint32_t sectorSize) {
+    return bytes / sectorSize + (bytes % sectorSize ? 1 : 0);
+}
+
+/**
+ * @brief Write the protective master boot record
+ * @param  &device: the block device
+ * @param  sizeInLogicalBlocks: the size of the disk in blocks
+ * @retval true if successful, false otherwise
+ */
+inline bool writeMasterBootRecord(BlockDevice &device, uint64_t sizeInLogicalBlocks)
+{
+    if (sizeInLogicalBlocks > 0xFFFFFFFF) sizeInLogicalBlocks = 0x100000000;
+
+    MBR mbr = {
+        .bootstrap = { 0 },
+        .partitions = {
+            {
+                .status = 0x01,
+                .startingGeometry = {0x00, 0x02, 0x00},
+                .type = OSTYPE_PMBR,
+                .endingGeometry = {0xFF, 0xFF, 0xFF},
+                .firstLogicalBlockAddress = 1,
+                .sizeInLogicalBlocks = (uint32_t)(sizeInLogicalBlocks - 1)
+            }
+        },
+        .signature = MBR_SIGNATURE,
+    };
+
+    return writeSectorBytes(device, 0, &mbr, sizeof(mbr));
+}
+
+/**
+ * @brief Write the primary and secondary GPT headers and partition entry tables
+ * @note Only the headers and tables are written, every other block of the
+ *       disk is left untouched
+ * @param  &device: the block device
+ * @param  sizeInLogicalBlocks: the size of the disk in blocks
+ * @param  &partitions: the partition entries, at most GPT_PARTITION_TABLE_ENTRIES
+ * @retval true if successful, false otherwise
+ */
+inline bool writeGlobalPartitionTableHeaderAndEntries(BlockDevice &device, uint64_t sizeInLogicalBlocks, const std::vector<GPT_PARTITION_ENTRY> &partitions)
+{
+    if (partitions.size() > GPT_PARTITION_TABLE_ENTRIES)
+    {
+        return false;
+    }
+
+    uint32_t sectorSize = device.getSectorSize();
+
+    // fill out primary GPT header
+    GPT_HEADER primaryGPTHeader = {
+        .signature = GPT_SIGNATURE,
+        .revision = GPT_REVISION,
+        .headerSize = GPT_HEADER_SIZE,
+        .crc32 = 0,
+        .reserved = 0,
+        .headerLogicalBlockAddress = 1,
+        .alternateLogicalBlockAddress = sizeInLogicalBlocks - 1,
+        .firstUsableLogicalBlockAddress = GPT_FIRST_USABLE_LBA(sectorSize),
+        .lastUsableLogicalBlockAddress = sizeInLogicalBlocks - 2 - GPT_PARTITION_TABLE_SECTORS(sectorSize), // secondary table + header
+        .diskIdentifier = newGuid(),
+        .partitionTableLogicalBlockAddress = 2,
+        .numberOfPartitionEntries = GPT_PARTITION_TABLE_ENTRIES,
+        .partitionEntrySize = sizeof(GPT_PARTITION_ENTRY),
+        .partitionTableCrc32 = 0,
+        .reserved2 = { 0 }
+    };
+
+    // fill out GPT partition table, unused entries stay zero
+    GPT_PARTITION_ENTRY table[GPT_PARTITION_TABLE_ENTRIES];
+    memset(table, 0, sizeof(table));
+    std::copy(partitions.begin(), partitions.end(), table);
+
+    // fill out primary GPT header partition table CRC32
+    primaryGPTHeader.partitionTableCrc32 = crc32(table, sizeof(table));
+
+    // fill out primary GPT header CRC32
+    primaryGPTHeader.crc32 = crc32(&primaryGPTHeader, primaryGPTHeader.headerSize);
+
+    // write primary GPT header to file
+    if (!writeSectorBytes(device, primaryGPTHeader.headerLogicalBlockAddress, &primaryGPTHeader, sizeof(primaryGPTHeader))) {
+        return false;
+    }
+
+    // write primary GPT partition table to file
+    if (!device.writeSectors(primaryGPTHeader.partitionTableLogicalBlockAddress, table, sizeof(table) / sectorSize)) {
+        return false;
+    }
+
+    // fill out the secondary GPT header
+    GPT_HEADER secondaryGPTHeader = primaryGPTHeader;
+    secondaryGPTHeader.crc32 = 0;
+    secondaryGPTHeader.partitionTableCrc32 = primaryGPTHeader.partitionTableCrc32;
+    secondaryGPTHeader.headerLogicalBlockAddress = primaryGPTHeader.alternateLogicalBlockAddress;
+    secondaryGPTHeader.alternateLogicalBlockAddress = primaryGPTHeader.headerLogicalBlockAddress;
+    secondaryGPTHeader.partitionTableLogicalBlockAddress = sizeInLogicalBlocks - 1 - GPT_PARTITION_TABLE_SECTORS(sectorSize);
+
+    // fill out the secondary GPT header CRC32
+    secondaryGPTHeader.crc32 = crc32(&secondaryGPTHeader, secondaryGPTHeader.headerSize);
+
+    // write secondary GPT partition table to file
+    if (!device.writeSectors(secondaryGPTHeader.partitionTableLogicalBlockAddress, table, sizeof(table) / sectorSize)) {
+        return false;
+    }
+
+    // write secondary GPT header to file
+    return writeSectorBytes(device, secondaryGPTHeader.headerLogicalBlockAddress, &secondaryGPTHeader, sizeof(secondaryGPTHeader));
+}
+
+/**
+ * @brief Read the bounds of a partition from the protective MBR and GPT of a disk
+ * @param  &device: the block device
+ * @param  partitionNumber: the partition number, starting at 1
+ * @param  &partitionStartingLogicalBlockAddress: the first block of the partition
+ * @param  &totalSectors: the size of the partition in blocks
+ * @retval true if successful, false otherwise
+ */
+inline bool readPartition(BlockDevice &device, uint32_t partitionNumber, uint64_t &partitionStartingLogicalBlockAddress, uint64_t &totalSectors)
+{
+    uint64_t diskImageSize = device.getSectorCount();
+    uint32_t sectorSize = device.getSectorSize();
+
+    // read PMBR
+    MBR pmbr;
+    if (!readSectorBytes(device, 0, &pmbr, sizeof(pmbr)))
+    {
+        std::cout << "Error: failed to read PMBR" << std::endl;
+        return false;
+    }
+
+    // make sure signature matches
+    if (pmbr.signature != MBR_SIGNATURE)
+    {
+        std::cout << "Error: invalid PMBR signature" << std::endl;
+        return false;
+    }
+
+    // make sure partition 0 type is OSTYPE_PMBR
+    if (pmbr.partitions[0].type != OSTYPE_PMBR)
+    {
+        std::cout << "Error: invalid partition 0 type" << std::endl;
+        return false;
+    }
+
+    // make sure firstLogicalBlockAddress in partition 0 is 1
+    if (pmbr.partitions[0].firstLogicalBlockAddress != 1)
+    {
+        std::cout << "Error: invalid first logical block address in partition 0 of protected master boot record" << std::endl;
+        return false;
+    }
+
+    // read GPT header
+    GPT_HEADER gpt_header;
+    if (!readSectorBytes(device, 1, &gpt_header, sizeof(gpt_header)))
+    {
+        std::cout << "Error: failed to read GPT header" << std::endl;
+        return false;
+    }
+
+    // make sure GTP header signature is GPT_SIGNATURE
+    if (gpt_header.signature != GPT_SIGNATURE)
+    {
+        std::cout << "Error: invalid GPT header signature" << std::endl;
+        return false;
+    }
+
+    // make sure partitionNumber is >= 0 and <= number of partition entries
+    if (partitionNumber < 1 || partitionNumber > gpt_header.numberOfPartitionEntries)
+    {
+        std::cout << "Error: partition number must be between 1 and " << gpt_header.numberOfPartitionEntries << std::endl;
+        return false;
+    }
+
+    // read the sector holding the partition table entry
+    uint64_t partitionEntryOffset = (partitionNumber - 1) * sizeof(GPT_PARTITION_ENTRY);
+    GPT_PARTITION_ENTRY partitionEntries[MAX_SECTOR_SIZE / sizeof(GPT_PARTITION_ENTRY)];
+    if (!device.readSectors(gpt_header.partitionTableLogicalBlockAddress + partitionEntryOffset / sectorSize, partitionEntries, 1))
+    {
+        std::cout << "Error: failed to read partition table entry" << std::endl;
+        return false;
+    }
+
+    GPT_PARTITION_ENTRY partitionEntry = partitionEntries[(partitionEntryOffset % sectorSize) / sizeof(GPT_PARTITION_ENTRY)];
+
+    partitionStartingLogicalBlockAddress = partitionEntry.firstLogicalBlockAddress;
+    if (partitionStartingLogicalBlockAddress < ALIGNMENT_LBA(sectorSize) || partitionStartingLogicalBlockAddress > diskImageSize)
+    {
+        std::cout << "Error: partition starting block must be between " << ALIGNMENT_LBA(sectorSize) << " and " << diskImageSize << std::endl;
+        return false;
+    }
+
+    uint64_t partitionEndingLogicalBlockAddress = partitionEntry.lastLogicalBlockAddress;
+    // make sure partitionEndingLogicalBlockAddress is > partitionStartingLogicalBlockAddress and <= diskImageSize
+    if (partitionEndingLogicalBlockAddress <= partitionStartingLogicalBlockAddress || partitionEndingLogicalBlockAddress > diskImageSize)
+    {
+        std::cout << "Error: partition ending block must be between " << partitionStartingLogicalBlockAddress << " and " << diskImageSize << std::endl;
+        return false;
+    }
+
+    // the ending block is inclusive
+    totalSectors = partitionEndingLogicalBlockAddress - partitionStartingLogicalBlockAddress + 1;
+    return true;
+}
+
+/**
+ * @brief Give a disk and its partitions new GUIDs, keeping everything else
+ * @note Both headers and partition tables are rewritten with fresh CRC32s;
+ *       a disk cloned from a template becomes distinguishable from it
+ * @param  &device: the block device
+ * @param  &partitions: the partition entries in use, with their new GUIDs
+ * @retval true if successful, false otherwise
+ */
+inline bool reidentifyPartitionTable(BlockDevice &device, std::vector<GPT_PARTITION_ENTRY> &partitions)
+{
+    uint32_t sectorSize = device.getSectorSize();
+
+    GPT_HEADER primaryGPTHeader;
+    if (!readSectorBytes(device, 1, &primaryGPTHeader, sizeof(primaryGPTHeader)))
+    {
+        std::cout << "Error: failed to read GPT header" << std::endl;
+        return false;
+    }
+
+    uint32_t headerCrc32 = primaryGPTHeader.crc32;
+    primaryGPTHeader.crc32 = 0;
+    if (primaryGPTHeader.signature != GPT_SIGNATURE || primaryGPTHeader.headerSize != GPT_HEADER_SIZE ||
+        crc32(&primaryGPTHeader, primaryGPTHeader.headerSize) != headerCrc32 ||
+        primaryGPTHeader.numberOfPartitionEntries != GPT_PARTITION_TABLE_ENTRIES || primaryGPTHeader.partitionEntrySize != sizeof(GPT_PARTITION_ENTRY))
+    {
+        std::cout << "Error: invalid GPT header" << std::endl;
+        return false;
+    }
+
+    GPT_PARTITION_ENTRY table[GPT_PARTITION_TABLE_ENTRIES];
+    if (!device.readSectors(primaryGPTHeader.partitionTableLogicalBlockAddress, table, sizeof(table) / sectorSize) ||
+        crc32(table, sizeof(table)) != primaryGPTHeader.partitionTableCrc32)
+    {
+        std::cout << "Error: invalid GPT partition table" << std::endl;
+        return false;
+    }
+
+    // an entry is in use when it has a partition type
+    static const GUID unused = {};
+    partitions.clear();
+    for (GPT_PARTITION_ENTRY &entry : table)
+    {
+        if (memcmp(&entry.partitionType, &unused, sizeof(unused)) != 0)
+        {
+            entry.uniqueIdentifier = newGuid();
+            partitions.push_back(entry);
+        }
+    }
+
+    primaryGPTHeader.diskIdentifier = newGuid();
+    primaryGPTHeader.partitionTableCrc32 = crc32(table, sizeof(table));
+    primaryGPTHeader.crc32 = crc32(&primaryGPTHeader, primaryGPTHeader.headerSize);
+
+    if (!writeSectorBytes(device, primaryGPTHeader.headerLogicalBlockAddress, &primaryGPTHeader, sizeof(primaryGPTHeader)) ||
+        !device.writeSectors(primaryGPTHeader.partitionTableLogicalBlockAddress, table, sizeof(table) / sectorSize))
+    {
+        return false;
+    }
+
+    // the secondary header mirrors the primary one from the end of the disk
+    GPT_HEADER secondaryGPTHeader = primaryGPTHeader;
+    secondaryGPTHeader.crc32 = 0;
+    secondaryGPTHeader.headerLogicalBlockAddress = primaryGPTHeader.alternateLogicalBlockAddress;
+    secondaryGPTHeader.alternateLogicalBlockAddress = primaryGPTHeader.headerLogicalBlockAddress;
+    secondaryGPTHeader.partitionTableLogicalBlockAddress = primaryGPTHeader.alternateLogicalBlockAddress - GPT_PARTITION_TABLE_SECTORS(sectorSize);
+    secondaryGPTHeader.crc32 = crc32(&secondaryGPTHeader, secondaryGPTHeader.headerSize);
+
+    if (!device.writeSectors(secondaryGPTHeader.partitionTableLogicalBlockAddress, table, sizeof(table) / sectorSize))
+    {
+        return false;
+    }
+
+    return writeSectorBytes(device, secondaryGPTHeader.headerLogicalBlockAddress, &secondaryGPTHeader, sizeof(secondaryGPTHeader));
+}
+
+/**
+ * @brief Switch a device to the logical sector size its GPT was written with
+ * @note The primary GPT header is in the second sector, so its signature is
+ *       looked for at byte 512 and then at byte 4096; a device without
+ *       either keeps its sector size
+ * @param  &device: the block device
+ * @retval true if successful, false otherwise
+ */
+inline bool detectSectorSize(BlockDevice &device)
+{
+    uint8_t sectors[MAX_SECTOR_SIZE * 2];
+    if (device.getSectorCount() * device.getSectorSize() < sizeof(sectors))
+    {
+        return true;
+    }
+
+    if (!device.readSectors(0, sectors, sizeof(sectors) / device.getSectorSize()))
+    {
+        std::cout << "Error: failed to read GPT header" << std::endl;
+        return false;
+    }
+
+    static const uint32_t sectorSizes[] = { BLOCK_SIZE, MAX_SECTOR_SIZE };
+    for (uint32_t sectorSize : sectorSizes)
+    {
+        uint64_t signature;
+        memcpy(&signature, sectors + sectorSize, sizeof(signature));
+        if (signature == GPT_SIGNATURE)
+        {
+            return sectorSize == device.getSectorSize() || device.setSectorSize(sectorSize);
+        }
+    }
+
+    return true;
+}
+
+#endif // _GPT_H
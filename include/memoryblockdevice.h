@@ -0,0 +1,101 @@
+#ifndef _MEMORYBLOCKDEVICE_H
+#define _MEMORYBLOCKDEVICE_H
+
+#include <map>
+#include <mutex>
+#include "blockdevice.h"
+
+#define BLOCK_DEVICE_MEMORY_CHUNK_SIZE (64 * 1024)
+#define BLOCK_DEVICE_STREAM_WINDOW_SIZE (8 * 1024 * 1024) // the buffer an image is streamed through
+
+// sectors left to be filled from a host file when an image is written
+typedef struct _HOST_FILE_EXTENT
+{
+    std::string path;
+    uint64_t offset; // in the host file
+    uint64_t logicalBlockAddress;
+    uint64_t length; // in bytes, the rest of the last sector is zeros
+} HOST_FILE_EXTENT;
+
+/**
+ * Sparse in-memory image; storage is allocated in fixed-size chunks on
+ * first write and unwritten sectors read back as zeros
+ */
+class MemoryBlockDevice : public BlockDevice
+{
+public:
+    MemoryBlockDevice(uint64_t count, uint32_t size = BLOCK_SIZE, bool referencesHostFiles = false);
+    bool readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count) override;
+    bool writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count) override;
+    bool flush() override { return true; }
+    bool isSparse() const override { return true; }
+    bool zeroSectors(uint64_t logicalBlockAddress, uint64_t count) override;
+
+    /**
+     * @brief Get the number of bytes backed by memory
+     * @retval The allocated bytes
+     */
+    uint64_t getAllocatedBytes() const;
+
+    // a device made to reference host files keeps only where their data goes
+    bool referenceHostFile(const std::string &path, uint64_t offset, uint64_t logicalBlockAddress, uint64_t length) override;
+
+    // true if host file data is referenced instead of written
+    bool isReferencingHostFiles() const { return referencesHostFiles; }
+
+    // the bytes left to be read from host files
+    uint64_t getHostFileBytes() const;
+
+    /**
+     * @brief Move the written chunks of another device into this one
+     * @note The devices must not have written the same chunk, e.g. because
+     *       they staged partitions aligned to BLOCK_DEVICE_MEMORY_CHUNK_SIZE
+     * @param  &other: the device to empty, with the same sector size
+     * @retval true if successful, false if a chunk was written by both
+     */
+    bool absorb(MemoryBlockDevice &other);
+
+    /**
+     * @brief Copy every written chunk to another device in one ascending sweep
+     * @note Runs of adjacent chunks are handed over as a single vectored
+     *       write. Chunks that were explicitly zeroed are zeroed on the target
+     *       first, so a device that is not known to read back as zeros (e.g. a
+     *       discarded block device) holds the same image; chunks never
+     *       touched at all are skipped. Referenced host file data goes
+     *       last, in ascending order, copied by the kernel where the target
+     *       supports copyFromFile; the host files must not change between
+     *       staging and writing.
+     * @param  &device: the target device, at least as large as this one
+     * @param  &writes: the number of writes issued
+     * @retval true if successful, false otherwise
+     */
+    bool writeTo(BlockDevice &device, uint64_t &writes) const;
+
+    /**
+     * @brief Write the whole image, zeros included, to a pipe in one forward pass
+     * @note The target never seeks. Sectors in memory, host file data and
+     *       the zeros between them are gathered in ascending order into a
+     *       window of BLOCK_DEVICE_STREAM_WINDOW_SIZE bytes that is written
+     *       whenever it fills up; long zero runs go out straight from a
+     *       shared zero buffer. Host files are read as their sectors come up
+     * @param  fd: the target, e.g. standard output
+     * @param  &writes: the number of writes issued
+     * @retval true if successful, false otherwise
+     */
+    bool streamTo(int fd, uint64_t &writes);
+
+private:
+    // copy the referenced host file data to the target in ascending order
+    bool writeHostFilesTo(BlockDevice &device, uint64_t &writes) const;
+
+    // merge a chunk into the zeroed ranges, joining its neighbours
+    void addZeroedChunk(uint64_t index);
+
+    std::map<uint64_t, std::unique_ptr<uint8_t[]>> chunks;
+    std::map<uint64_t, uint64_t> zeroedChunks; // first chunk -> one past the last
+    bool referencesHostFiles;
+    std::vector<HOST_FILE_EXTENT> hostFileExtents; // in the order they were referenced
+    std::mutex hostFileMutex;
+};
+
+#endif // _MEMORYBLOCKDEVICE_H
@@ -0,0 +1,28 @@
+#ifndef _MMAPBLOCKDEVICE_H
+#define _MMAPBLOCKDEVICE_H
+
+#include "fileblockdevice.h"
+
+/**
+ * Image file mapped into memory; reads and writes are plain copies and the
+ * kernel pages the image in and out
+ */
+class MMapBlockDevice : public FileBlockDevice
+{
+public:
+    ~MMapBlockDevice() override;
+    bool open(const char *path) override;
+    bool create(const char *path, uint64_t count, bool sparse) override;
+    bool readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count) override;
+    bool writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count) override;
+    bool isConcurrent() const override { return true; }
+    const uint8_t *getMappedSectors(uint64_t logicalBlockAddress, uint64_t count) override;
+    bool flush() override;
+
+private:
+    bool map();
+
+    uint8_t *mapping = nullptr;
+};
+
+#endif // _MMAPBLOCKDEVICE_H
@@ -0,0 +1,92 @@
+#ifndef _QCOW2BLOCKDEVICE_H
+#define _QCOW2BLOCKDEVICE_H
+
+#include "blockdevice.h"
+
+/**
+ * qcow2 image; the L1, L2 and refcount tables live in memory and are
+ * written back on flush, guest clusters are only allocated on first write
+ * so an image holds nothing but metadata and the sectors actually written
+ */
+class Qcow2BlockDevice : public BlockDevice
+{
+public:
+    ~Qcow2BlockDevice() override;
+
+    /**
+     * @brief Open an existing qcow2 image
+     * @note Images with a backing file, encryption, snapshots, compressed
+     *       clusters or incompatible features are refused
+     * @param  *path: the image file name
+     * @retval true if successful, false otherwise
+     */
+    bool open(const char *path);
+
+    /**
+     * @brief Create an empty qcow2 image of a given virtual size
+     * @note Only the header, refcount and L1 tables are allocated; the
+     *       refcount table is sized for a fully allocated image up front
+     * @param  *path: the image file name
+     * @param  count: the virtual size of the image in sectors
+     * @retval true if successful, false otherwise
+     */
+    bool create(const char *path, uint64_t count);
+
+    bool readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count) override;
+    bool writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count) override;
+    bool isSparse() const override { return true; }
+    bool zeroSectors(uint64_t logicalBlockAddress, uint64_t count) override;
+    bool flush() override;
+
+private:
+    void setClusterSize(uint32_t clusterBits);
+    void resizeRefcountTable(uint64_t entries);
+    uint16_t getRefcount(uint64_t cluster) const;
+    bool setRefcount(uint64_t cluster, uint16_t refcount);
+
+    /**
+     * @brief Allocate a host cluster, reusing released ones before growing the file
+     * @retval The cluster index, or 0 if the refcount table is full
+     */
+    uint64_t allocateCluster();
+
+    void releaseCluster(uint64_t cluster);
+    uint64_t getHostOffset(uint64_t guestCluster) const;
+
+    /**
+     * @brief Map a guest cluster to a host cluster, allocating both on first use
+     * @param  guestCluster: the guest cluster index
+     * @retval The host byte offset of the cluster, or 0 if the image is full
+     */
+    uint64_t mapCluster(uint64_t guestCluster);
+
+    // reads of clusters past the end of the file would come up short
+    bool extendFile();
+
+    /**
+     * @brief Write the dirty tables and the header back to the image
+     * @retval true if successful, false otherwise
+     */
+    bool writeMetadata();
+
+    int fd = -1;
+    bool dirty = false;
+    uint32_t clusterBits = 0;
+    uint64_t clusterSize = 0;
+    uint64_t l2Entries = 0;
+    uint64_t refcountsPerBlock = 0;
+    uint64_t l1TableOffset = 0;
+    uint64_t refcountTableOffset = 0;
+    uint32_t refcountTableClusters = 0;
+    uint64_t hostClusterCount = 0;
+    uint64_t freeCluster = 0;
+    uint64_t fileSize = 0;
+    std::vector<uint64_t> l1Table; // host offsets of the L2 tables
+    std::vector<std::vector<uint64_t>> l2Tables; // host offsets of the guest clusters, empty until used
+    std::vector<bool> l2Dirty;
+    std::vector<uint64_t> refcountTable; // host offsets of the refcount blocks
+    std::vector<std::vector<uint16_t>> refcountBlocks; // empty until a cluster in range is allocated
+    std::vector<bool> refcountDirty;
+};
+
+#endif // _QCOW2BLOCKDEVICE_H
@@ -0,0 +1,104 @@
+#ifndef _URINGBLOCKDEVICE_H
+#define _URINGBLOCKDEVICE_H
+
+// linux/io_uring.h brings linux/fs.h and its own BLOCK_SIZE, keep the
+// sector size from fs.h
+#pragma push_macro("BLOCK_SIZE")
+#undef BLOCK_SIZE
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE
+#pragma pop_macro("BLOCK_SIZE")
+#include "fileblockdevice.h"
+
+#define BLOCK_DEVICE_URING_BUFFER_SIZE (1024 * 1024) // one registered write buffer per queue slot
+#define BLOCK_DEVICE_URING_WRITE (1ULL << 62) // io_uring user data: request type in the top bits
+#define BLOCK_DEVICE_URING_READ (2ULL << 62)
+#define BLOCK_DEVICE_URING_FSYNC (3ULL << 62)
+#define BLOCK_DEVICE_URING_INDEX_MASK ((1ULL << 62) - 1)
+
+/**
+ * Image file driven through io_uring; writes are copied into registered
+ * buffers and kept in flight up to the queue depth, large reads are split
+ * and issued together, and flush queues an fsync behind every write. Falls
+ * back to pread/pwrite when io_uring is not available.
+ */
+class UringBlockDevice : public FileBlockDevice
+{
+public:
+    explicit UringBlockDevice(uint32_t queueDepth) : queueDepth(std::max(1u, queueDepth)) {}
+    ~UringBlockDevice() override;
+    bool open(const char *path) override;
+    bool create(const char *path, uint64_t count, bool sparse) override;
+    bool readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count) override;
+    bool writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count) override;
+    bool writeSectorsVectored(uint64_t logicalBlockAddress, const struct iovec *vectors, int vectorCount) override;
+    bool zeroSectors(uint64_t logicalBlockAddress, uint64_t count) override;
+    bool copyFromFile(int sourceFd, uint64_t offset, uint64_t logicalBlockAddress, uint64_t length) override;
+    bool flush() override;
+
+private:
+    typedef struct _URING_READ_REQUEST
+    {
+        uint8_t *buffer;
+        uint64_t length;
+        uint64_t offset;
+        int32_t result;
+    } URING_READ_REQUEST;
+
+    /**
+     * @brief Set up the rings and register the write buffers
+     * @note Only fails when memory runs out; without io_uring the device
+     *       keeps using pread/pwrite
+     * @retval true if successful, false otherwise
+     */
+    bool setupRing();
+
+    struct io_uring_sqe *getSubmissionEntry();
+    bool submit(uint32_t count);
+
+    // hand the open write buffer to the kernel
+    bool submitBuffer();
+
+    /**
+     * @brief Consume completions, waiting for at least a given number
+     * @param  minimum: the number of completions to wait for
+     * @retval true if every completed request succeeded, false otherwise
+     */
+    bool reapCompletions(uint32_t minimum);
+
+    // wait until nothing is in flight
+    bool waitForCompletions();
+
+    void completeRequest(const struct io_uring_cqe &completion);
+
+    uint32_t queueDepth;
+    int ringFd = -1;
+    bool registered = false;
+    bool failed = false;
+    uint32_t inFlight = 0;
+    int32_t fsyncResult = 0;
+
+    uint8_t *submissionRing = nullptr;
+    uint8_t *completionRing = nullptr;
+    struct io_uring_sqe *submissionEntries = nullptr;
+    size_t submissionRingSize = 0;
+    size_t completionRingSize = 0;
+    size_t submissionEntriesSize = 0;
+    uint32_t *submissionTail = nullptr;
+    uint32_t submissionMask = 0;
+    uint32_t *submissionArray = nullptr;
+    uint32_t pendingTail = 0;
+    uint32_t *completionHead = nullptr;
+    uint32_t *completionTail = nullptr;
+    uint32_t completionMask = 0;
+    struct io_uring_cqe *completions = nullptr;
+
+    std::vector<AlignedBuffer> buffers;
+    std::vector<uint64_t> bufferOffsets;
+    std::vector<uint64_t> bufferLengths;
+    std::vector<int> freeBuffers;
+    int activeBuffer = -1; // buffer still collecting writes, not yet submitted
+    std::vector<URING_READ_REQUEST> readRequests;
+};
+
+#endif // _URINGBLOCKDEVICE_H
@@ -0,0 +1,369 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+// linux/fs.h brings its own BLOCK_SIZE, keep the sector size from fs.h
+#pragma push_macro("BLOCK_SIZE")
+#undef BLOCK_SIZE
+#include <linux/fs.h>
+#undef BLOCK_SIZE
+#pragma pop_macro("BLOCK_SIZE")
+#include <algorithm>
+#include "blockdevice.h"
+#include "fileblockdevice.h"
+#include "mmapblockdevice.h"
+#include "uringblockdevice.h"
+#include "directblockdevice.h"
+#include "qcow2blockdevice.h"
+
+AlignedBuffer allocateAlignedBuffer(size_t size)
+{
+    size_t alignedSize = (size + BLOCK_DEVICE_BUFFER_ALIGNMENT - 1) & ~(size_t)(BLOCK_DEVICE_BUFFER_ALIGNMENT - 1);
+    uint8_t *buffer = (uint8_t *)aligned_alloc(BLOCK_DEVICE_BUFFER_ALIGNMENT, alignedSize);
+    if (buffer != nullptr)
+    {
+        memset(buffer, 0, alignedSize);
+    }
+
+    return AlignedBuffer(buffer);
+}
+
+AlignedBuffer AlignedBufferPool::acquire()
+{
+    if (buffers.empty())
+    {
+        return allocateAlignedBuffer(bufferSize);
+    }
+
+    AlignedBuffer buffer = std::move(buffers.back());
+    buffers.pop_back();
+    return buffer;
+}
+
+void AlignedBufferPool::release(AlignedBuffer buffer)
+{
+    if (buffer)
+    {
+        buffers.push_back(std::move(buffer));
+    }
+}
+
+bool isSupportedSectorSize(uint32_t size)
+{
+    return size == BLOCK_SIZE || size == MAX_SECTOR_SIZE;
+}
+
+bool BlockDevice::setSectorSize(uint32_t size)
+{
+    if (!isSupportedSectorSize(size) || sectorCount * sectorSize % size != 0)
+    {
+        return false;
+    }
+
+    sectorCount = sectorCount * sectorSize / size;
+    sectorSize = size;
+    return true;
+}
+
+bool BlockDevice::writeSectorsVectored(uint64_t logicalBlockAddress, const struct iovec *vectors, int vectorCount)
+{
+    for (int i = 0; i < vectorCount; i++)
+    {
+        uint64_t count = vectors[i].iov_len / sectorSize;
+        if (!writeSectors(logicalBlockAddress, vectors[i].iov_base, count))
+        {
+            return false;
+        }
+        logicalBlockAddress += count;
+    }
+
+    return true;
+}
+
+bool BlockDevice::zeroSectors(uint64_t logicalBlockAddress, uint64_t count)
+{
+    static const AlignedBuffer zeros = allocateAlignedBuffer(BLOCK_DEVICE_ZERO_BUFFER_SIZE);
+    uint64_t sectorsPerWrite = BLOCK_DEVICE_ZERO_BUFFER_SIZE / sectorSize;
+
+    while (count > 0)
+    {
+        uint64_t sectors = std::min(count, sectorsPerWrite);
+        if (!writeSectors(logicalBlockAddress, zeros.get(), sectors))
+        {
+            return false;
+        }
+        logicalBlockAddress += sectors;
+        count -= sectors;
+    }
+
+    return true;
+}
+
+bool writeSectorBytes(BlockDevice &device, uint64_t logicalBlockAddress, const void *buffer, size_t length)
+{
+    uint32_t sectorSize = device.getSectorSize();
+    if (length % sectorSize == 0)
+    {
+        return device.writeSectors(logicalBlockAddress, buffer, length / sectorSize);
+    }
+
+    uint64_t count = length / sectorSize + 1;
+    AlignedBuffer sectors = allocateAlignedBuffer(count * sectorSize);
+    if (!sectors)
+    {
+        return false;
+    }
+
+    memcpy(sectors.get(), buffer, length);
+    return device.writeSectors(logicalBlockAddress, sectors.get(), count);
+}
+
+bool readSectorBytes(BlockDevice &device, uint64_t logicalBlockAddress, void *buffer, size_t length)
+{
+    uint32_t sectorSize = device.getSectorSize();
+    if (length % sectorSize == 0)
+    {
+        return device.readSectors(logicalBlockAddress, buffer, length / sectorSize);
+    }
+
+    uint64_t count = length / sectorSize + 1;
+    AlignedBuffer sectors = allocateAlignedBuffer(count * sectorSize);
+    if (!sectors || !device.readSectors(logicalBlockAddress, sectors.get(), count))
+    {
+        return false;
+    }
+
+    memcpy(buffer, sectors.get(), length);
+    return true;
+}
+
+bool readFully(int fd, void *buffer, size_t length, uint64_t offset)
+{
+    uint8_t *current = (uint8_t *)buffer;
+
+    while (length > 0)
+    {
+        ssize_t result = pread(fd, current, length, offset);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return false;
+        }
+
+        current += result;
+        offset += result;
+        length -= result;
+    }
+
+    return true;
+}
+
+bool writeFully(int fd, const void *buffer, size_t length, uint64_t offset)
+{
+    const uint8_t *current = (const uint8_t *)buffer;
+
+    while (length > 0)
+    {
+        ssize_t result = pwrite(fd, current, length, offset);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return false;
+        }
+
+        current += result;
+        offset += result;
+        length -= result;
+    }
+
+    return true;
+}
+
+bool writeVectorsFully(int fd, std::vector<struct iovec> &vectors)
+{
+    struct iovec *current = vectors.data();
+    int remaining = (int)vectors.size();
+
+    while (remaining > 0)
+    {
+        ssize_t result = writev(fd, current, remaining);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result < 0)
+        {
+            return false;
+        }
+
+        // skip the buffers written in full, then into the one cut short
+        while (remaining > 0 && (size_t)result >= current->iov_len)
+        {
+            result -= current->iov_len;
+            current++;
+            remaining--;
+        }
+        if (remaining > 0)
+        {
+            current->iov_base = (uint8_t *)current->iov_base + result;
+            current->iov_len -= result;
+        }
+    }
+
+    vectors.clear();
+    return true;
+}
+
+bool parseBlockDeviceType(const char *name, BLOCK_DEVICE_TYPE &type)
+{
+    if (strcmp(name, "file") == 0)
+    {
+        type = BLOCK_DEVICE_FILE;
+    }
+    else if (strcmp(name, "mmap") == 0)
+    {
+        type = BLOCK_DEVICE_MMAP;
+    }
+    else if (strcmp(name, "uring") == 0)
+    {
+        type = BLOCK_DEVICE_URING;
+    }
+    else if (strcmp(name, "direct") == 0)
+    {
+        type = BLOCK_DEVICE_DIRECT;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Construct a file backed block device of the given type
+ * @param  type: the backend type (file, mmap, uring or direct)
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @retval The block device
+ */
+static std::unique_ptr<FileBlockDevice> newFileBlockDevice(BLOCK_DEVICE_TYPE type, uint32_t queueDepth)
+{
+    if (type == BLOCK_DEVICE_MMAP)
+    {
+        return std::unique_ptr<FileBlockDevice>(new MMapBlockDevice());
+    }
+    if (type == BLOCK_DEVICE_URING)
+    {
+        return std::unique_ptr<FileBlockDevice>(new UringBlockDevice(queueDepth));
+    }
+    if (type == BLOCK_DEVICE_DIRECT)
+    {
+        return std::unique_ptr<FileBlockDevice>(new DirectBlockDevice());
+    }
+
+    return std::unique_ptr<FileBlockDevice>(new FileBlockDevice());
+}
+
+bool parseImageFormat(const char *name, IMAGE_FORMAT &format)
+{
+    if (strcmp(name, "raw") == 0)
+    {
+        format = IMAGE_FORMAT_RAW;
+    }
+    else if (strcmp(name, "qcow2") == 0)
+    {
+        format = IMAGE_FORMAT_QCOW2;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool isQcow2Image(const char *path)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    uint32_t magic = 0;
+    bool result = readFully(fd, &magic, sizeof(magic), 0) && be32toh(magic) == QCOW2_MAGIC;
+    close(fd);
+    return result;
+}
+
+bool getBlockDeviceSize(const char *path, uint64_t &sizeInBytes, uint32_t &sectorSize)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISBLK(st.st_mode))
+    {
+        return false;
+    }
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    int logical = 0;
+    bool result = ioctl(fd, BLKGETSIZE64, &sizeInBytes) == 0 && ioctl(fd, BLKSSZGET, &logical) == 0;
+    close(fd);
+    sectorSize = (uint32_t)logical;
+    return result;
+}
+
+std::unique_ptr<BlockDevice> openBlockDevice(BLOCK_DEVICE_TYPE type, const char *path, uint32_t queueDepth)
+{
+    if (isQcow2Image(path))
+    {
+        std::unique_ptr<Qcow2BlockDevice> device(new Qcow2BlockDevice());
+        if (!device->open(path))
+        {
+            return nullptr;
+        }
+
+        return device;
+    }
+
+    std::unique_ptr<FileBlockDevice> device = newFileBlockDevice(type, queueDepth);
+    if (!device->open(path))
+    {
+        return nullptr;
+    }
+
+    return device;
+}
+
+std::unique_ptr<BlockDevice> createBlockDevice(BLOCK_DEVICE_TYPE type, const char *path, uint64_t count, bool sparse, IMAGE_FORMAT format, uint32_t queueDepth, uint32_t sectorSize)
+{
+    if (format == IMAGE_FORMAT_QCOW2)
+    {
+        std::unique_ptr<Qcow2BlockDevice> device(new Qcow2BlockDevice());
+        if (!device->setSectorSize(sectorSize) || !device->create(path, count))
+        {
+            return nullptr;
+        }
+
+        return device;
+    }
+
+    std::unique_ptr<FileBlockDevice> device = newFileBlockDevice(type, queueDepth);
+    if (!device->setSectorSize(sectorSize) || !device->create(path, count, sparse))
+    {
+        return nullptr;
+    }
+
+    return device;
+}
@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include "directblockdevice.h"
+
+DirectBlockDevice::~DirectBlockDevice()
+{
+    flushStagedWrite();
+}
+
+bool DirectBlockDevice::open(const char *path)
+{
+    return FileBlockDevice::open(path) && setup();
+}
+
+bool DirectBlockDevice::create(const char *path, uint64_t count, bool sparse)
+{
+    return FileBlockDevice::create(path, count, sparse) && setup();
+}
+
+bool DirectBlockDevice::readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    uint8_t *current = (uint8_t *)buffer;
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    // make sure the read observes every staged write
+    if (stagedLength > 0 && offset < stagedOffset + stagedLength && offset + length > stagedOffset && !flushStagedWrite())
+    {
+        return false;
+    }
+
+    AlignedBuffer bounce = pool.acquire();
+    bool result = bounce != nullptr;
+    while (result && length > 0)
+    {
+        uint64_t head = offset % alignment;
+        uint64_t size = std::min(length, BLOCK_DEVICE_DIRECT_BUFFER_SIZE - head);
+        result = readAligned(offset - head, bounce.get(), alignUp(head + size));
+        memcpy(current, bounce.get() + head, size);
+
+        current += size;
+        offset += size;
+        length -= size;
+    }
+
+    pool.release(std::move(bounce));
+    return result;
+}
+
+bool DirectBlockDevice::writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    const uint8_t *current = (const uint8_t *)buffer;
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    while (length > 0)
+    {
+        uint64_t room = BLOCK_DEVICE_DIRECT_BUFFER_SIZE - stagedOffset % alignment - stagedLength;
+        if (stagedLength == 0 || offset != stagedOffset + stagedLength || room == 0)
+        {
+            if (!flushStagedWrite())
+            {
+                return false;
+            }
+
+            // whole aligned blocks from aligned memory need no bounce
+            uint64_t size = length - length % alignment;
+            if (offset % alignment == 0 && (uintptr_t)current % BLOCK_DEVICE_BUFFER_ALIGNMENT == 0 && size >= BLOCK_DEVICE_DIRECT_BUFFER_SIZE)
+            {
+                if (!writeFully(fd, current, size, offset))
+                {
+                    return false;
+                }
+
+                current += size;
+                offset += size;
+                length -= size;
+                continue;
+            }
+
+            stagedOffset = offset;
+            room = BLOCK_DEVICE_DIRECT_BUFFER_SIZE - stagedOffset % alignment;
+        }
+
+        uint64_t size = std::min(length, room);
+        memcpy(staged.get() + stagedOffset % alignment + stagedLength, current, size);
+        stagedLength += size;
+
+        current += size;
+        offset += size;
+        length -= size;
+    }
+
+    return true;
+}
+
+bool DirectBlockDevice::writeSectorsVectored(uint64_t logicalBlockAddress, const struct iovec *vectors, int vectorCount)
+{
+    // pwritev on the caller's buffers would ignore the alignment rules
+    return BlockDevice::writeSectorsVectored(logicalBlockAddress, vectors, vectorCount);
+}
+
+bool DirectBlockDevice::zeroSectors(uint64_t logicalBlockAddress, uint64_t count)
+{
+    return flushStagedWrite() && FileBlockDevice::zeroSectors(logicalBlockAddress, count);
+}
+
+bool DirectBlockDevice::flush()
+{
+    return flushStagedWrite() && FileBlockDevice::flush();
+}
+
+bool DirectBlockDevice::setup()
+{
+    // devices take their physical sector size, so writes never make the
+    // device read-modify-write a sector; files what the file system reports
+    alignment = std::max(logicalSectorSize, physicalSectorSize);
+    if (!blockDevice)
+    {
+        struct statx stx;
+        alignment = BLOCK_DEVICE_DIRECT_ALIGNMENT;
+        if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align != 0)
+        {
+            alignment = stx.stx_dio_offset_align;
+        }
+    }
+
+    if ((alignment & (alignment - 1)) != 0 || alignment > BLOCK_DEVICE_DIRECT_BUFFER_SIZE)
+    {
+        std::cerr << "Error: unsupported direct I/O alignment of " << alignment << " bytes" << std::endl;
+        return false;
+    }
+
+    staged = pool.acquire();
+    return staged != nullptr;
+}
+
+uint64_t DirectBlockDevice::alignUp(uint64_t length) const
+{
+    return (length + alignment - 1) & ~(uint64_t)(alignment - 1);
+}
+
+bool DirectBlockDevice::readAligned(uint64_t offset, uint8_t *buffer, uint64_t length)
+{
+    while (length > 0)
+    {
+        ssize_t result = pread(fd, buffer, length, offset);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result < 0)
+        {
+            return false;
+        }
+        if (result == 0)
+        {
+            memset(buffer, 0, length);
+            return true;
+        }
+
+        buffer += result;
+        offset += result;
+        length -= result;
+    }
+
+    return true;
+}
+
+bool DirectBlockDevice::flushStagedWrite()
+{
+    if (stagedLength == 0)
+    {
+        return true;
+    }
+
+    uint64_t head = stagedOffset % alignment;
+    uint64_t end = head + stagedLength;
+    uint64_t alignedEnd = alignUp(end);
+    uint64_t alignedOffset = stagedOffset - head;
+    stagedLength = 0;
+
+    // fill the partial blocks at both edges with what the device holds
+    if (head != 0 || alignedEnd != end)
+    {
+        AlignedBuffer edge = pool.acquire();
+        bool result = edge != nullptr;
+        if (result && head != 0)
+        {
+            result = readAligned(alignedOffset, edge.get(), alignment);
+            memcpy(staged.get(), edge.get(), head);
+        }
+        if (result && alignedEnd != end)
+        {
+            result = readAligned(alignedOffset + alignedEnd - alignment, edge.get(), alignment);
+            memcpy(staged.get() + end, edge.get() + end % alignment, alignedEnd - end);
+        }
+
+        pool.release(std::move(edge));
+        if (!result)
+        {
+            return false;
+        }
+    }
+
+    if (!writeFully(fd, staged.get(), alignedEnd, alignedOffset))
+    {
+        return false;
+    }
+
+    // a block written past the end of an image file grows it, cut it back
+    uint64_t sizeInBytes = sectorCount * sectorSize;
+    return blockDevice || alignedOffset + alignedEnd <= sizeInBytes || ftruncate(fd, sizeInBytes) == 0;
+}
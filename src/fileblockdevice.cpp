@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+// linux/fs.h brings its own BLOCK_SIZE, keep the sector size from fs.h
+#pragma push_macro("BLOCK_SIZE")
+#undef BLOCK_SIZE
+#include <linux/fs.h>
+#undef BLOCK_SIZE
+#pragma pop_macro("BLOCK_SIZE")
+#include <algorithm>
+#include <iostream>
+#include "fileblockdevice.h"
+
+FileBlockDevice::~FileBlockDevice()
+{
+    flushPendingWrite();
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+bool FileBlockDevice::open(const char *path)
+{
+    fd = ::open(path, O_RDWR | getOpenFlags());
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    uint64_t sizeInBytes = 0;
+    if (fstat(fd, &st) != 0 || !querySize(st, sizeInBytes))
+    {
+        return false;
+    }
+
+    // a device is addressed in its own logical sectors
+    if (blockDevice && isSupportedSectorSize(logicalSectorSize))
+    {
+        sectorSize = logicalSectorSize;
+    }
+    sectorCount = sizeInBytes / sectorSize;
+
+    // an image with holes stays sparse when sectors are zeroed, and so
+    // does a device, where zeroing unmaps instead of writing
+    sparse = blockDevice || (uint64_t)st.st_blocks * 512 < (uint64_t)st.st_size;
+    return true;
+}
+
+bool FileBlockDevice::create(const char *path, uint64_t count, bool sparse)
+{
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | getOpenFlags(), 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    uint64_t sizeInBytes = 0;
+    if (fstat(fd, &st) != 0 || !querySize(st, sizeInBytes))
+    {
+        return false;
+    }
+
+    sectorCount = count;
+    this->sparse = sparse;
+    if (blockDevice)
+    {
+        if (sectorSize != logicalSectorSize)
+        {
+            std::cerr << "Error: " << path << " has " << logicalSectorSize << " byte sectors, not " << sectorSize << std::endl;
+            return false;
+        }
+
+        if (count * sectorSize > sizeInBytes)
+        {
+            std::cerr << "Error: " << path << " holds only " << sizeInBytes / sectorSize << " sectors" << std::endl;
+            return false;
+        }
+
+        // file systems rely on a new image reading back as zeros; a device
+        // that cannot discard has its old contents zeroed, which the kernel
+        // does by writing zeros where the device has no command for it
+        this->sparse = true;
+        uint64_t range[2] = { 0, count * sectorSize };
+        if (ioctl(fd, BLKDISCARD, range) != 0 && ioctl(fd, BLKZEROOUT, range) != 0)
+        {
+            std::cerr << "Error: failed to zero " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    sizeInBytes = count * sectorSize;
+    if (ftruncate(fd, sizeInBytes) != 0)
+    {
+        return false;
+    }
+
+    return sparse || posix_fallocate(fd, 0, sizeInBytes) == 0;
+}
+
+bool FileBlockDevice::readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    // make sure the read observes every buffered write
+    if (!pendingWrite.empty() && logicalBlockAddress < pendingEndLogicalBlockAddress() &&
+        logicalBlockAddress + count > pendingLogicalBlockAddress && !flushPendingWrite())
+    {
+        return false;
+    }
+
+    return readFully(fd, buffer, count * sectorSize, logicalBlockAddress * sectorSize);
+}
+
+bool FileBlockDevice::writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    uint64_t length = count * sectorSize;
+
+    // append to the pending write if it continues it and still fits
+    if (!pendingWrite.empty() && logicalBlockAddress == pendingEndLogicalBlockAddress() &&
+        pendingWrite.size() + length <= BLOCK_DEVICE_COALESCE_LIMIT)
+    {
+        pendingWrite.insert(pendingWrite.end(), (const uint8_t *)buffer, (const uint8_t *)buffer + length);
+        return true;
+    }
+
+    if (!flushPendingWrite())
+    {
+        return false;
+    }
+
+    // large writes gain nothing from buffering
+    if (length >= BLOCK_DEVICE_COALESCE_LIMIT)
+    {
+        return writeFully(fd, buffer, length, logicalBlockAddress * sectorSize);
+    }
+
+    pendingLogicalBlockAddress = logicalBlockAddress;
+    pendingWrite.assign((const uint8_t *)buffer, (const uint8_t *)buffer + length);
+    return true;
+}
+
+bool FileBlockDevice::writeSectorsVectored(uint64_t logicalBlockAddress, const struct iovec *vectors, int vectorCount)
+{
+    if (!flushPendingWrite())
+    {
+        return false;
+    }
+
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = 0;
+    for (int i = 0; i < vectorCount; i++)
+    {
+        length += vectors[i].iov_len;
+    }
+
+    if (!inRange(logicalBlockAddress, length / sectorSize))
+    {
+        return false;
+    }
+
+    std::vector<struct iovec> remaining(vectors, vectors + vectorCount);
+    struct iovec *current = remaining.data();
+    int currentCount = vectorCount;
+
+    while (currentCount > 0)
+    {
+        ssize_t result = pwritev(fd, current, std::min(currentCount, IOV_MAX), offset);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return false;
+        }
+
+        // skip what was written, including a partially written buffer
+        offset += result;
+        while (currentCount > 0 && (size_t)result >= current->iov_len)
+        {
+            result -= current->iov_len;
+            current++;
+            currentCount--;
+        }
+        if (currentCount > 0)
+        {
+            current->iov_base = (uint8_t *)current->iov_base + result;
+            current->iov_len -= result;
+        }
+    }
+
+    return true;
+}
+
+bool FileBlockDevice::zeroSectors(uint64_t logicalBlockAddress, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count) || !flushPendingWrite())
+    {
+        return false;
+    }
+
+    // devices zero with write-zeroes or unmap when they support it
+    if (blockDevice)
+    {
+        uint64_t range[2] = { logicalBlockAddress * sectorSize, count * sectorSize };
+        return ioctl(fd, BLKZEROOUT, range) == 0 || BlockDevice::zeroSectors(logicalBlockAddress, count);
+    }
+
+    // punch a hole in sparse images, keep blocks allocated otherwise
+    int mode = sparse ? FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE : FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+    if (fallocate(fd, mode, logicalBlockAddress * sectorSize, count * sectorSize) == 0)
+    {
+        return true;
+    }
+
+    return BlockDevice::zeroSectors(logicalBlockAddress, count);
+}
+
+bool FileBlockDevice::copyFromFile(int sourceFd, uint64_t offset, uint64_t logicalBlockAddress, uint64_t length)
+{
+    if (!inRange(logicalBlockAddress, (length + sectorSize - 1) / sectorSize) || !flushPendingWrite())
+    {
+        return false;
+    }
+
+    // share the host blocks when both sides line up with them, which
+    // the data region of a partition does at its 1 MiB alignment
+    loff_t sourceOffset = offset, targetOffset = logicalBlockAddress * sectorSize;
+    struct stat st;
+    if (!blockDevice && fstat(fd, &st) == 0 && st.st_blksize > 0 && sourceOffset % st.st_blksize == 0 && targetOffset % st.st_blksize == 0)
+    {
+        struct file_clone_range range = {};
+        range.src_fd = sourceFd;
+        range.src_offset = sourceOffset;
+        range.src_length = length - length % st.st_blksize;
+        range.dest_offset = targetOffset;
+        if (range.src_length > 0 && ioctl(fd, FICLONERANGE, &range) == 0)
+        {
+            sourceOffset += range.src_length;
+            targetOffset += range.src_length;
+            length -= range.src_length;
+        }
+    }
+
+    // the rest in-kernel, which falls back to splicing through the page
+    // cache where the file systems cannot do better
+    while (length > 0)
+    {
+        ssize_t copied = copy_file_range(sourceFd, &sourceOffset, fd, &targetOffset, length, 0);
+        if (copied < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (copied <= 0)
+        {
+            return false;
+        }
+        length -= copied;
+    }
+
+    return true;
+}
+
+bool FileBlockDevice::flush()
+{
+    return flushPendingWrite() && fdatasync(fd) == 0;
+}
+
+bool FileBlockDevice::querySize(const struct stat &st, uint64_t &sizeInBytes)
+{
+    blockDevice = S_ISBLK(st.st_mode);
+    if (!blockDevice)
+    {
+        sizeInBytes = st.st_size;
+        return true;
+    }
+
+    int logical = 0;
+    unsigned int physical = 0;
+    if (ioctl(fd, BLKGETSIZE64, &sizeInBytes) != 0 || ioctl(fd, BLKSSZGET, &logical) != 0 || ioctl(fd, BLKPBSZGET, &physical) != 0)
+    {
+        return false;
+    }
+
+    logicalSectorSize = (uint32_t)logical;
+    physicalSectorSize = physical;
+    return true;
+}
+
+uint64_t FileBlockDevice::pendingEndLogicalBlockAddress() const
+{
+    return pendingLogicalBlockAddress + pendingWrite.size() / sectorSize;
+}
+
+bool FileBlockDevice::flushPendingWrite()
+{
+    if (pendingWrite.empty())
+    {
+        return true;
+    }
+
+    bool result = writeFully(fd, pendingWrite.data(), pendingWrite.size(), pendingLogicalBlockAddress * sectorSize);
+    pendingWrite.clear();
+    return result;
+}
@@ -0,0 +1,492 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include "memoryblockdevice.h"
+
+MemoryBlockDevice::MemoryBlockDevice(uint64_t count, uint32_t size, bool referencesHostFiles)
+    : referencesHostFiles(referencesHostFiles)
+{
+    sectorSize = size;
+    sectorCount = count;
+}
+
+bool MemoryBlockDevice::readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    uint8_t *current = (uint8_t *)buffer;
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    while (length > 0)
+    {
+        uint64_t chunkOffset = offset % BLOCK_DEVICE_MEMORY_CHUNK_SIZE;
+        uint64_t size = std::min(length, BLOCK_DEVICE_MEMORY_CHUNK_SIZE - chunkOffset);
+        auto chunk = chunks.find(offset / BLOCK_DEVICE_MEMORY_CHUNK_SIZE);
+        if (chunk == chunks.end())
+        {
+            memset(current, 0, size);
+        }
+        else
+        {
+            memcpy(current, chunk->second.get() + chunkOffset, size);
+        }
+
+        current += size;
+        offset += size;
+        length -= size;
+    }
+
+    return true;
+}
+
+bool MemoryBlockDevice::writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    const uint8_t *current = (const uint8_t *)buffer;
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    while (length > 0)
+    {
+        uint64_t chunkOffset = offset % BLOCK_DEVICE_MEMORY_CHUNK_SIZE;
+        uint64_t size = std::min(length, BLOCK_DEVICE_MEMORY_CHUNK_SIZE - chunkOffset);
+        std::unique_ptr<uint8_t[]> &chunk = chunks[offset / BLOCK_DEVICE_MEMORY_CHUNK_SIZE];
+        if (!chunk)
+        {
+            chunk.reset(new uint8_t[BLOCK_DEVICE_MEMORY_CHUNK_SIZE]());
+        }
+        memcpy(chunk.get() + chunkOffset, current, size);
+
+        current += size;
+        offset += size;
+        length -= size;
+    }
+
+    return true;
+}
+
+bool MemoryBlockDevice::zeroSectors(uint64_t logicalBlockAddress, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    while (length > 0)
+    {
+        uint64_t chunkOffset = offset % BLOCK_DEVICE_MEMORY_CHUNK_SIZE;
+        uint64_t size = std::min(length, BLOCK_DEVICE_MEMORY_CHUNK_SIZE - chunkOffset);
+        uint64_t index = offset / BLOCK_DEVICE_MEMORY_CHUNK_SIZE;
+        auto chunk = chunks.find(index);
+        if (chunk != chunks.end() && size != BLOCK_DEVICE_MEMORY_CHUNK_SIZE)
+        {
+            memset(chunk->second.get() + chunkOffset, 0, size);
+        }
+        else
+        {
+            if (chunk != chunks.end())
+            {
+                chunks.erase(chunk);
+            }
+            addZeroedChunk(index);
+        }
+
+        offset += size;
+        length -= size;
+    }
+
+    return true;
+}
+
+uint64_t MemoryBlockDevice::getAllocatedBytes() const
+{
+    return chunks.size() * BLOCK_DEVICE_MEMORY_CHUNK_SIZE;
+}
+
+bool MemoryBlockDevice::referenceHostFile(const std::string &path, uint64_t offset, uint64_t logicalBlockAddress, uint64_t length)
+{
+    if (!referencesHostFiles || !inRange(logicalBlockAddress, (length + sectorSize - 1) / sectorSize))
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(hostFileMutex);
+    hostFileExtents.push_back({ path, offset, logicalBlockAddress, length });
+    return true;
+}
+
+uint64_t MemoryBlockDevice::getHostFileBytes() const
+{
+    uint64_t bytes = 0;
+    for (const HOST_FILE_EXTENT &extent : hostFileExtents)
+    {
+        bytes += extent.length;
+    }
+    return bytes;
+}
+
+bool MemoryBlockDevice::absorb(MemoryBlockDevice &other)
+{
+    if (other.sectorSize != sectorSize)
+    {
+        return false;
+    }
+
+    for (const auto &range : other.zeroedChunks)
+    {
+        for (uint64_t index = range.first; index < range.second; index++)
+        {
+            addZeroedChunk(index);
+        }
+    }
+    other.zeroedChunks.clear();
+
+    hostFileExtents.insert(hostFileExtents.end(), other.hostFileExtents.begin(), other.hostFileExtents.end());
+    other.hostFileExtents.clear();
+
+    // nodes move between the maps without copying their chunks
+    chunks.merge(other.chunks);
+    return other.chunks.empty();
+}
+
+bool MemoryBlockDevice::writeTo(BlockDevice &device, uint64_t &writes) const
+{
+    uint64_t sectorsPerChunk = BLOCK_DEVICE_MEMORY_CHUNK_SIZE / sectorSize;
+    std::vector<struct iovec> vectors;
+    uint64_t runFirstChunk = 0;
+    writes = 0;
+
+    for (const auto &range : zeroedChunks)
+    {
+        // the last chunk may run past the end of the device
+        uint64_t first = range.first * sectorsPerChunk;
+        uint64_t count = std::min(range.second * sectorsPerChunk, sectorCount) - first;
+        if (!device.zeroSectors(first, count))
+        {
+            return false;
+        }
+    }
+
+    auto writeRun = [&]() {
+        if (vectors.empty())
+        {
+            return true;
+        }
+
+        // the last chunk may run past the end of the device
+        uint64_t count = std::min((uint64_t)vectors.size() * sectorsPerChunk, sectorCount - runFirstChunk * sectorsPerChunk);
+        vectors.back().iov_len -= ((uint64_t)vectors.size() * sectorsPerChunk - count) * sectorSize;
+        writes++;
+        bool result = device.writeSectorsVectored(runFirstChunk * sectorsPerChunk, vectors.data(), (int)vectors.size());
+        vectors.clear();
+        return result;
+    };
+
+    for (const auto &chunk : chunks)
+    {
+        if (!vectors.empty() && (chunk.first != runFirstChunk + vectors.size() || vectors.size() == IOV_MAX))
+        {
+            if (!writeRun())
+            {
+                return false;
+            }
+        }
+        if (vectors.empty())
+        {
+            runFirstChunk = chunk.first;
+        }
+        vectors.push_back({ chunk.second.get(), BLOCK_DEVICE_MEMORY_CHUNK_SIZE });
+    }
+
+    return writeRun() && writeHostFilesTo(device, writes);
+}
+
+bool MemoryBlockDevice::writeHostFilesTo(BlockDevice &device, uint64_t &writes) const
+{
+    if (hostFileExtents.empty())
+    {
+        return true;
+    }
+
+    // the extents are left in place, several writers may share this device
+    std::vector<const HOST_FILE_EXTENT *> extents;
+    for (const HOST_FILE_EXTENT &extent : hostFileExtents)
+    {
+        extents.push_back(&extent);
+    }
+    std::sort(extents.begin(), extents.end(), [](const HOST_FILE_EXTENT *a, const HOST_FILE_EXTENT *b)
+              { return a->logicalBlockAddress < b->logicalBlockAddress; });
+
+    AlignedBuffer buffer = allocateAlignedBuffer(BLOCK_DEVICE_STREAM_WINDOW_SIZE);
+    if (!buffer)
+    {
+        std::cerr << "Error: failed to allocate host file buffer" << std::endl;
+        return false;
+    }
+
+    int hostFd = -1;
+    const std::string *hostPath = nullptr;
+    bool result = true;
+    for (size_t i = 0; result && i < extents.size(); i++)
+    {
+        const HOST_FILE_EXTENT &extent = *extents[i];
+        if (hostPath == nullptr || *hostPath != extent.path)
+        {
+            if (hostFd >= 0)
+            {
+                close(hostFd);
+            }
+            hostPath = &extent.path;
+            hostFd = ::open(extent.path.c_str(), O_RDONLY);
+            if (hostFd < 0)
+            {
+                std::cerr << "Error: failed to open \"" << extent.path << "\"" << std::endl;
+                result = false;
+                break;
+            }
+            posix_fadvise(hostFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        // whole sectors go through the kernel where the target can take
+        // them, a reflink when the host file system shares the blocks
+        uint64_t logicalBlockAddress = extent.logicalBlockAddress;
+        uint64_t done = 0;
+        uint64_t wholeSectors = extent.length - extent.length % sectorSize;
+        if (wholeSectors > 0 && device.copyFromFile(hostFd, extent.offset, logicalBlockAddress, wholeSectors))
+        {
+            writes++;
+            logicalBlockAddress += wholeSectors / sectorSize;
+            done = wholeSectors;
+        }
+
+        // the rest in windows of sectors; the rest of the last sector is zeros
+        while (result && done < extent.length)
+        {
+            uint64_t length = std::min(extent.length - done, (uint64_t)BLOCK_DEVICE_STREAM_WINDOW_SIZE);
+            uint64_t count = (length + sectorSize - 1) / sectorSize;
+            memset(buffer.get() + length, 0, count * sectorSize - length);
+            if (!readFully(hostFd, buffer.get(), length, extent.offset + done))
+            {
+                std::cerr << "Error: failed to read \"" << extent.path << "\", or it shrank while the image was written" << std::endl;
+                result = false;
+                break;
+            }
+
+            writes++;
+            result = device.writeSectors(logicalBlockAddress, buffer.get(), count);
+            logicalBlockAddress += count;
+            done += length;
+        }
+    }
+
+    if (hostFd >= 0)
+    {
+        close(hostFd);
+    }
+    return result;
+}
+
+bool MemoryBlockDevice::streamTo(int fd, uint64_t &writes)
+{
+    static const AlignedBuffer zeros = allocateAlignedBuffer(BLOCK_DEVICE_ZERO_BUFFER_SIZE);
+    AlignedBuffer window = allocateAlignedBuffer(BLOCK_DEVICE_STREAM_WINDOW_SIZE);
+    if (!zeros || !window)
+    {
+        std::cerr << "Error: failed to allocate stream window" << std::endl;
+        return false;
+    }
+
+    std::sort(hostFileExtents.begin(), hostFileExtents.end(), [](const HOST_FILE_EXTENT &a, const HOST_FILE_EXTENT &b)
+              { return a.logicalBlockAddress < b.logicalBlockAddress; });
+
+    uint64_t offset = 0, windowUsed = 0;
+    std::vector<struct iovec> vectors;
+    writes = 0;
+
+    auto flushWindow = [&]() {
+        if (windowUsed == 0)
+        {
+            return true;
+        }
+
+        vectors.push_back({ window.get(), windowUsed });
+        windowUsed = 0;
+        writes++;
+        return writeVectorsFully(fd, vectors);
+    };
+
+    // short runs are gathered, long ones repeat the zero buffer
+    auto emitZeros = [&](uint64_t length) {
+        if (length <= BLOCK_DEVICE_STREAM_WINDOW_SIZE - windowUsed)
+        {
+            memset(window.get() + windowUsed, 0, length);
+            windowUsed += length;
+            return true;
+        }
+
+        if (!flushWindow())
+        {
+            return false;
+        }
+        while (length > 0)
+        {
+            uint64_t size = std::min(length, (uint64_t)BLOCK_DEVICE_ZERO_BUFFER_SIZE);
+            vectors.push_back({ zeros.get(), size });
+            length -= size;
+            if (length == 0 || vectors.size() == BLOCK_DEVICE_STREAM_WINDOW_SIZE / BLOCK_DEVICE_ZERO_BUFFER_SIZE)
+            {
+                writes++;
+                if (!writeVectorsFully(fd, vectors))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    // the sectors in memory, and zeros where there are none, up to an offset
+    auto emitMemory = [&](uint64_t endOffset) {
+        for (auto chunk = chunks.lower_bound(offset / BLOCK_DEVICE_MEMORY_CHUNK_SIZE); offset < endOffset; chunk++)
+        {
+            uint64_t chunkOffset = chunk == chunks.end() ? endOffset : std::min(endOffset, chunk->first * BLOCK_DEVICE_MEMORY_CHUNK_SIZE);
+            if (chunkOffset > offset && !emitZeros(chunkOffset - offset))
+            {
+                return false;
+            }
+            offset = std::max(offset, chunkOffset);
+            if (offset == endOffset)
+            {
+                break;
+            }
+
+            uint64_t size = std::min(endOffset, chunkOffset + BLOCK_DEVICE_MEMORY_CHUNK_SIZE) - offset;
+            const uint8_t *data = chunk->second.get() + offset % BLOCK_DEVICE_MEMORY_CHUNK_SIZE;
+            while (size > 0)
+            {
+                if (windowUsed == BLOCK_DEVICE_STREAM_WINDOW_SIZE && !flushWindow())
+                {
+                    return false;
+                }
+
+                uint64_t length = std::min(size, BLOCK_DEVICE_STREAM_WINDOW_SIZE - windowUsed);
+                memcpy(window.get() + windowUsed, data, length);
+                windowUsed += length;
+                data += length;
+                offset += length;
+                size -= length;
+            }
+        }
+        return true;
+    };
+
+    // a run of host file data, read straight into the window
+    int hostFd = -1;
+    const std::string *hostPath = nullptr;
+    auto emitHostFile = [&](const HOST_FILE_EXTENT &extent) {
+        if (hostPath == nullptr || *hostPath != extent.path)
+        {
+            if (hostFd >= 0)
+            {
+                close(hostFd);
+            }
+            hostPath = &extent.path;
+            hostFd = ::open(extent.path.c_str(), O_RDONLY);
+            if (hostFd < 0)
+            {
+                std::cerr << "Error: failed to open \"" << extent.path << "\"" << std::endl;
+                return false;
+            }
+            posix_fadvise(hostFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        uint64_t position = extent.offset, remaining = extent.length;
+        while (remaining > 0)
+        {
+            if (windowUsed == BLOCK_DEVICE_STREAM_WINDOW_SIZE && !flushWindow())
+            {
+                return false;
+            }
+
+            ssize_t result = pread(hostFd, window.get() + windowUsed, std::min(remaining, BLOCK_DEVICE_STREAM_WINDOW_SIZE - windowUsed), position);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result <= 0)
+            {
+                std::cerr << "Error: failed to read \"" << extent.path << "\", or it shrank while the image was streamed" << std::endl;
+                return false;
+            }
+
+            windowUsed += result;
+            position += result;
+            remaining -= result;
+        }
+
+        uint64_t length = (extent.length + sectorSize - 1) / sectorSize * sectorSize;
+        offset += length;
+        return emitZeros(length - extent.length);
+    };
+
+    bool result = true;
+    for (const HOST_FILE_EXTENT &extent : hostFileExtents)
+    {
+        if (extent.logicalBlockAddress * sectorSize < offset)
+        {
+            std::cerr << "Error: host file data of \"" << extent.path << "\" overlaps other data" << std::endl;
+            result = false;
+            break;
+        }
+
+        result = emitMemory(extent.logicalBlockAddress * sectorSize) && emitHostFile(extent);
+        if (!result)
+        {
+            break;
+        }
+    }
+
+    if (hostFd >= 0)
+    {
+        close(hostFd);
+    }
+    return result && emitMemory(sectorCount * sectorSize) && flushWindow();
+}
+
+void MemoryBlockDevice::addZeroedChunk(uint64_t index)
+{
+    auto next = zeroedChunks.upper_bound(index);
+    if (next != zeroedChunks.begin() && std::prev(next)->second >= index)
+    {
+        auto previous = std::prev(next);
+        previous->second = std::max(previous->second, index + 1);
+        if (next != zeroedChunks.end() && next->first == previous->second)
+        {
+            previous->second = next->second;
+            zeroedChunks.erase(next);
+        }
+        return;
+    }
+
+    uint64_t end = index + 1;
+    if (next != zeroedChunks.end() && next->first == end)
+    {
+        end = next->second;
+        zeroedChunks.erase(next);
+    }
+    zeroedChunks[index] = end;
+}
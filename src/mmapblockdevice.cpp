@@ -0,0 +1,65 @@
+#include <string.h>
+#include <sys/mman.h>
+#include "mmapblockdevice.h"
+
+MMapBlockDevice::~MMapBlockDevice()
+{
+    if (mapping != nullptr)
+    {
+        munmap(mapping, sectorCount * sectorSize);
+    }
+}
+
+bool MMapBlockDevice::open(const char *path)
+{
+    return FileBlockDevice::open(path) && map();
+}
+
+bool MMapBlockDevice::create(const char *path, uint64_t count, bool sparse)
+{
+    return FileBlockDevice::create(path, count, sparse) && map();
+}
+
+bool MMapBlockDevice::readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    memcpy(buffer, mapping + logicalBlockAddress * sectorSize, count * sectorSize);
+    return true;
+}
+
+bool MMapBlockDevice::writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    memcpy(mapping + logicalBlockAddress * sectorSize, buffer, count * sectorSize);
+    return true;
+}
+
+const uint8_t *MMapBlockDevice::getMappedSectors(uint64_t logicalBlockAddress, uint64_t count)
+{
+    return inRange(logicalBlockAddress, count) ? mapping + logicalBlockAddress * sectorSize : nullptr;
+}
+
+bool MMapBlockDevice::flush()
+{
+    return msync(mapping, sectorCount * sectorSize, MS_SYNC) == 0;
+}
+
+bool MMapBlockDevice::map()
+{
+    void *address = mmap(nullptr, sectorCount * sectorSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        return false;
+    }
+
+    mapping = (uint8_t *)address;
+    return true;
+}
@@ -0,0 +1,548 @@
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include "qcow2blockdevice.h"
+
+Qcow2BlockDevice::~Qcow2BlockDevice()
+{
+    if (fd >= 0)
+    {
+        writeMetadata();
+        close(fd);
+    }
+}
+
+bool Qcow2BlockDevice::open(const char *path)
+{
+    fd = ::open(path, O_RDWR);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    QCOW2_HEADER header = {};
+    if (!readFully(fd, &header, QCOW2_V2_HEADER_SIZE, 0) || be32toh(header.magic) != QCOW2_MAGIC)
+    {
+        return false;
+    }
+
+    uint32_t version = be32toh(header.version);
+    if (version == 3 && !readFully(fd, &header, sizeof(header), 0))
+    {
+        return false;
+    }
+
+    if ((version != 2 && version != 3) || header.backingFileOffset != 0 || header.cryptMethod != 0 || header.numberOfSnapshots != 0)
+    {
+        std::cerr << "Error: unsupported qcow2 image (backing file, encryption or snapshots)" << std::endl;
+        return false;
+    }
+
+    if (version == 3 && (header.incompatibleFeatures != 0 || be32toh(header.refcountOrder) != QCOW2_REFCOUNT_ORDER))
+    {
+        std::cerr << "Error: unsupported qcow2 image features, repair it with qemu-img check -r all" << std::endl;
+        return false;
+    }
+
+    uint32_t clusterBits = be32toh(header.clusterBits);
+    if (clusterBits < 9 || clusterBits > 21)
+    {
+        return false;
+    }
+
+    setClusterSize(clusterBits);
+    sectorCount = be64toh(header.size) / sectorSize;
+    l1TableOffset = be64toh(header.l1TableOffset);
+    refcountTableOffset = be64toh(header.refcountTableOffset);
+    refcountTableClusters = be32toh(header.refcountTableClusters);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        return false;
+    }
+
+    fileSize = st.st_size;
+    hostClusterCount = (fileSize + clusterSize - 1) / clusterSize;
+
+    // refcounts first so that zero clusters can be released below
+    std::vector<uint64_t> table(refcountTableClusters * clusterSize / sizeof(uint64_t));
+    if (!readFully(fd, table.data(), table.size() * sizeof(uint64_t), refcountTableOffset))
+    {
+        return false;
+    }
+
+    resizeRefcountTable(table.size());
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        refcountTable[i] = be64toh(table[i]) & QCOW2_OFFSET_MASK;
+        if (refcountTable[i] == 0)
+        {
+            continue;
+        }
+
+        refcountBlocks[i].resize(refcountsPerBlock);
+        if (!readFully(fd, refcountBlocks[i].data(), clusterSize, refcountTable[i]))
+        {
+            return false;
+        }
+        for (uint16_t &refcount : refcountBlocks[i])
+        {
+            refcount = be16toh(refcount);
+        }
+    }
+
+    l1Table.resize(be32toh(header.l1Size));
+    if (!readFully(fd, l1Table.data(), l1Table.size() * sizeof(uint64_t), l1TableOffset))
+    {
+        return false;
+    }
+
+    l2Tables.resize(l1Table.size());
+    l2Dirty.resize(l1Table.size());
+    for (size_t i = 0; i < l1Table.size(); i++)
+    {
+        l1Table[i] = be64toh(l1Table[i]) & QCOW2_OFFSET_MASK;
+        if (l1Table[i] == 0)
+        {
+            continue;
+        }
+
+        std::vector<uint64_t> &l2 = l2Tables[i];
+        l2.resize(l2Entries);
+        if (!readFully(fd, l2.data(), clusterSize, l1Table[i]))
+        {
+            return false;
+        }
+
+        for (uint64_t &entry : l2)
+        {
+            entry = be64toh(entry);
+            if (entry & QCOW2_COMPRESSED)
+            {
+                std::cerr << "Error: compressed qcow2 images are not supported" << std::endl;
+                return false;
+            }
+
+            // a zero cluster reads back as zeros just like an unallocated one
+            if (entry & QCOW2_ZERO)
+            {
+                if ((entry & QCOW2_OFFSET_MASK) != 0)
+                {
+                    releaseCluster((entry & QCOW2_OFFSET_MASK) / clusterSize);
+                }
+                entry = 0;
+                l2Dirty[i] = true;
+            }
+            entry &= QCOW2_OFFSET_MASK;
+        }
+    }
+
+    // the header is rewritten as version 3 on flush
+    dirty = dirty || version != QCOW2_VERSION;
+    return true;
+}
+
+bool Qcow2BlockDevice::create(const char *path, uint64_t count)
+{
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    setClusterSize(QCOW2_CLUSTER_BITS);
+    sectorCount = count;
+
+    uint64_t guestClusters = (count * sectorSize + clusterSize - 1) / clusterSize;
+    uint64_t l1Size = std::max((uint64_t)1, (guestClusters + l2Entries - 1) / l2Entries);
+    uint64_t l1Clusters = (l1Size * sizeof(uint64_t) + clusterSize - 1) / clusterSize;
+    uint64_t maximumClusters = 1 + l1Clusters + l1Size + guestClusters;
+    uint64_t refcountBlockCount = maximumClusters / refcountsPerBlock + 2;
+    refcountTableClusters = (refcountBlockCount * sizeof(uint64_t) + clusterSize - 1) / clusterSize;
+
+    // header, refcount table and L1 table back to back
+    refcountTableOffset = clusterSize;
+    l1TableOffset = (1 + refcountTableClusters) * clusterSize;
+    resizeRefcountTable(refcountTableClusters * clusterSize / sizeof(uint64_t));
+    l1Table.assign(l1Size, 0);
+    l2Tables.resize(l1Size);
+    l2Dirty.assign(l1Size, false);
+
+    hostClusterCount = freeCluster = 1 + refcountTableClusters + l1Clusters;
+    for (uint64_t i = 0; i < hostClusterCount; i++)
+    {
+        if (!setRefcount(i, 1))
+        {
+            return false;
+        }
+    }
+
+    dirty = true;
+    return true;
+}
+
+bool Qcow2BlockDevice::readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count) || !extendFile())
+    {
+        return false;
+    }
+
+    uint8_t *current = (uint8_t *)buffer;
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    while (length > 0)
+    {
+        uint64_t clusterOffset = offset % clusterSize;
+        uint64_t size = std::min(length, clusterSize - clusterOffset);
+        uint64_t hostOffset = getHostOffset(offset / clusterSize);
+        if (hostOffset == 0)
+        {
+            memset(current, 0, size);
+        }
+        else if (!readFully(fd, current, size, hostOffset + clusterOffset))
+        {
+            return false;
+        }
+
+        current += size;
+        offset += size;
+        length -= size;
+    }
+
+    return true;
+}
+
+bool Qcow2BlockDevice::writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count)
+{
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    const uint8_t *current = (const uint8_t *)buffer;
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    // clusters allocated one after another are contiguous in the file,
+    // so a long write goes out as a few large pwrites
+    const uint8_t *run = current;
+    uint64_t runOffset = 0, runLength = 0;
+
+    while (length > 0)
+    {
+        uint64_t clusterOffset = offset % clusterSize;
+        uint64_t size = std::min(length, clusterSize - clusterOffset);
+        uint64_t hostOffset = mapCluster(offset / clusterSize);
+        if (hostOffset == 0)
+        {
+            std::cerr << "Error: qcow2 image is full" << std::endl;
+            return false;
+        }
+
+        hostOffset += clusterOffset;
+        if (runLength > 0 && hostOffset != runOffset + runLength)
+        {
+            if (!writeFully(fd, run, runLength, runOffset))
+            {
+                return false;
+            }
+            runLength = 0;
+        }
+        if (runLength == 0)
+        {
+            run = current;
+            runOffset = hostOffset;
+        }
+        runLength += size;
+
+        current += size;
+        offset += size;
+        length -= size;
+    }
+
+    return runLength == 0 || writeFully(fd, run, runLength, runOffset);
+}
+
+bool Qcow2BlockDevice::zeroSectors(uint64_t logicalBlockAddress, uint64_t count)
+{
+    static const AlignedBuffer zeros = allocateAlignedBuffer(BLOCK_DEVICE_ZERO_BUFFER_SIZE);
+
+    if (!inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    while (length > 0)
+    {
+        uint64_t guestCluster = offset / clusterSize;
+        uint64_t clusterOffset = offset % clusterSize;
+        uint64_t size = std::min(length, clusterSize - clusterOffset);
+        uint64_t hostOffset = getHostOffset(guestCluster);
+        if (hostOffset != 0)
+        {
+            if (size == clusterSize)
+            {
+                // unmap whole clusters and give their space back
+                l2Tables[guestCluster / l2Entries][guestCluster % l2Entries] = 0;
+                l2Dirty[guestCluster / l2Entries] = true;
+                releaseCluster(hostOffset / clusterSize);
+            }
+            else if (!writeFully(fd, zeros.get(), size, hostOffset + clusterOffset))
+            {
+                return false;
+            }
+        }
+
+        offset += size;
+        length -= size;
+    }
+
+    return true;
+}
+
+bool Qcow2BlockDevice::flush()
+{
+    return writeMetadata() && fdatasync(fd) == 0;
+}
+
+void Qcow2BlockDevice::setClusterSize(uint32_t clusterBits)
+{
+    this->clusterBits = clusterBits;
+    clusterSize = 1ULL << clusterBits;
+    l2Entries = clusterSize / sizeof(uint64_t);
+    refcountsPerBlock = clusterSize / sizeof(uint16_t);
+}
+
+void Qcow2BlockDevice::resizeRefcountTable(uint64_t entries)
+{
+    refcountTable.assign(entries, 0);
+    refcountBlocks.resize(entries);
+    refcountDirty.assign(entries, false);
+}
+
+uint16_t Qcow2BlockDevice::getRefcount(uint64_t cluster) const
+{
+    uint64_t block = cluster / refcountsPerBlock;
+    if (block >= refcountBlocks.size() || refcountBlocks[block].empty())
+    {
+        return 0;
+    }
+
+    return refcountBlocks[block][cluster % refcountsPerBlock];
+}
+
+bool Qcow2BlockDevice::setRefcount(uint64_t cluster, uint16_t refcount)
+{
+    uint64_t block = cluster / refcountsPerBlock;
+    if (block >= refcountBlocks.size())
+    {
+        return false;
+    }
+
+    refcountDirty[block] = true;
+    dirty = true;
+    if (!refcountBlocks[block].empty())
+    {
+        refcountBlocks[block][cluster % refcountsPerBlock] = refcount;
+        return true;
+    }
+
+    // claim the cluster before the new refcount block needs one of its own
+    refcountBlocks[block].assign(refcountsPerBlock, 0);
+    refcountBlocks[block][cluster % refcountsPerBlock] = refcount;
+    uint64_t blockCluster = allocateCluster();
+    refcountTable[block] = blockCluster * clusterSize;
+    return blockCluster != 0;
+}
+
+uint64_t Qcow2BlockDevice::allocateCluster()
+{
+    while (getRefcount(freeCluster) != 0)
+    {
+        freeCluster++;
+    }
+
+    uint64_t cluster = freeCluster++;
+    if (!setRefcount(cluster, 1))
+    {
+        return 0;
+    }
+
+    hostClusterCount = std::max(hostClusterCount, cluster + 1);
+    return cluster;
+}
+
+void Qcow2BlockDevice::releaseCluster(uint64_t cluster)
+{
+    setRefcount(cluster, 0);
+    freeCluster = std::min(freeCluster, cluster);
+
+    // a released cluster must read back as zeros when it is reused
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, cluster * clusterSize, clusterSize) != 0)
+    {
+        static const AlignedBuffer zeros = allocateAlignedBuffer(BLOCK_DEVICE_ZERO_BUFFER_SIZE);
+        for (uint64_t offset = 0; offset < clusterSize; offset += BLOCK_DEVICE_ZERO_BUFFER_SIZE)
+        {
+            writeFully(fd, zeros.get(), std::min(clusterSize - offset, (uint64_t)BLOCK_DEVICE_ZERO_BUFFER_SIZE), cluster * clusterSize + offset);
+        }
+    }
+}
+
+uint64_t Qcow2BlockDevice::getHostOffset(uint64_t guestCluster) const
+{
+    const std::vector<uint64_t> &l2 = l2Tables[guestCluster / l2Entries];
+    return l2.empty() ? 0 : l2[guestCluster % l2Entries];
+}
+
+uint64_t Qcow2BlockDevice::mapCluster(uint64_t guestCluster)
+{
+    uint64_t l1Index = guestCluster / l2Entries;
+    std::vector<uint64_t> &l2 = l2Tables[l1Index];
+    if (l2.empty())
+    {
+        uint64_t cluster = allocateCluster();
+        if (cluster == 0)
+        {
+            return 0;
+        }
+
+        l2.assign(l2Entries, 0);
+        l1Table[l1Index] = cluster * clusterSize;
+        l2Dirty[l1Index] = true;
+    }
+
+    uint64_t &entry = l2[guestCluster % l2Entries];
+    if (entry == 0)
+    {
+        uint64_t cluster = allocateCluster();
+        if (cluster == 0)
+        {
+            return 0;
+        }
+
+        entry = cluster * clusterSize;
+        l2Dirty[l1Index] = true;
+    }
+
+    return entry;
+}
+
+bool Qcow2BlockDevice::extendFile()
+{
+    uint64_t size = hostClusterCount * clusterSize;
+    if (size > fileSize)
+    {
+        if (ftruncate(fd, size) != 0)
+        {
+            return false;
+        }
+        fileSize = size;
+    }
+
+    return true;
+}
+
+bool Qcow2BlockDevice::writeMetadata()
+{
+    if (!dirty)
+    {
+        return true;
+    }
+
+    std::vector<uint64_t> buffer(l2Entries);
+    for (size_t i = 0; i < l2Tables.size(); i++)
+    {
+        if (!l2Dirty[i])
+        {
+            continue;
+        }
+
+        for (uint64_t j = 0; j < l2Entries; j++)
+        {
+            buffer[j] = l2Tables[i][j] == 0 ? 0 : htobe64(l2Tables[i][j] | QCOW2_COPIED);
+        }
+        if (!writeFully(fd, buffer.data(), clusterSize, l1Table[i]))
+        {
+            return false;
+        }
+        l2Dirty[i] = false;
+    }
+
+    std::vector<uint16_t> refcounts(refcountsPerBlock);
+    for (size_t i = 0; i < refcountBlocks.size(); i++)
+    {
+        if (!refcountDirty[i])
+        {
+            continue;
+        }
+
+        for (uint64_t j = 0; j < refcountsPerBlock; j++)
+        {
+            refcounts[j] = htobe16(refcountBlocks[i][j]);
+        }
+        if (!writeFully(fd, refcounts.data(), clusterSize, refcountTable[i]))
+        {
+            return false;
+        }
+        refcountDirty[i] = false;
+    }
+
+    std::vector<uint64_t> table(refcountTable.size());
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        table[i] = htobe64(refcountTable[i]);
+    }
+    if (!writeFully(fd, table.data(), table.size() * sizeof(uint64_t), refcountTableOffset))
+    {
+        return false;
+    }
+
+    table.resize(l1Table.size());
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        table[i] = l1Table[i] == 0 ? 0 : htobe64(l1Table[i] | QCOW2_COPIED);
+    }
+    if (!writeFully(fd, table.data(), table.size() * sizeof(uint64_t), l1TableOffset))
+    {
+        return false;
+    }
+
+    // the header is followed by an empty header extension list
+    uint8_t header[sizeof(QCOW2_HEADER) + sizeof(uint64_t)] = { 0 };
+    *(QCOW2_HEADER *)header = {
+        .magic = htobe32(QCOW2_MAGIC),
+        .version = htobe32(QCOW2_VERSION),
+        .backingFileOffset = 0,
+        .backingFileSize = 0,
+        .clusterBits = htobe32(clusterBits),
+        .size = htobe64(sectorCount * sectorSize),
+        .cryptMethod = 0,
+        .l1Size = htobe32((uint32_t)l1Table.size()),
+        .l1TableOffset = htobe64(l1TableOffset),
+        .refcountTableOffset = htobe64(refcountTableOffset),
+        .refcountTableClusters = htobe32(refcountTableClusters),
+        .numberOfSnapshots = 0,
+        .snapshotsOffset = 0,
+        .incompatibleFeatures = 0,
+        .compatibleFeatures = 0,
+        .autoclearFeatures = 0,
+        .refcountOrder = htobe32(QCOW2_REFCOUNT_ORDER),
+        .headerLength = htobe32(sizeof(QCOW2_HEADER)),
+    };
+    if (!extendFile() || !writeFully(fd, header, sizeof(header), 0))
+    {
+        return false;
+    }
+
+    dirty = false;
+    return true;
+}
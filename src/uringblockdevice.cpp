@@ -0,0 +1,411 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <iostream>
+#include "uringblockdevice.h"
+
+UringBlockDevice::~UringBlockDevice()
+{
+    if (ringFd >= 0)
+    {
+        submitBuffer();
+        waitForCompletions();
+        munmap(submissionEntries, submissionEntriesSize);
+        if (completionRing != submissionRing)
+        {
+            munmap(completionRing, completionRingSize);
+        }
+        munmap(submissionRing, submissionRingSize);
+        close(ringFd);
+    }
+}
+
+bool UringBlockDevice::open(const char *path)
+{
+    return FileBlockDevice::open(path) && setupRing();
+}
+
+bool UringBlockDevice::create(const char *path, uint64_t count, bool sparse)
+{
+    return FileBlockDevice::create(path, count, sparse) && setupRing();
+}
+
+bool UringBlockDevice::readSectors(uint64_t logicalBlockAddress, void *buffer, uint64_t count)
+{
+    if (ringFd < 0)
+    {
+        return FileBlockDevice::readSectors(logicalBlockAddress, buffer, count);
+    }
+
+    // reads observe every write issued before them
+    if (!inRange(logicalBlockAddress, count) || !submitBuffer() || !waitForCompletions())
+    {
+        return false;
+    }
+
+    uint8_t *current = (uint8_t *)buffer;
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    while (length > 0)
+    {
+        // up to a queue of reads in flight at once
+        readRequests.clear();
+        while (length > 0 && readRequests.size() < queueDepth)
+        {
+            uint64_t size = std::min(length, (uint64_t)BLOCK_DEVICE_URING_BUFFER_SIZE);
+            readRequests.push_back({ current, size, offset, 0 });
+            struct io_uring_sqe *entry = getSubmissionEntry();
+            if (entry == nullptr)
+            {
+                return false;
+            }
+            entry->opcode = IORING_OP_READ;
+            entry->fd = fd;
+            entry->addr = (uint64_t)current;
+            entry->len = (uint32_t)size;
+            entry->off = offset;
+            entry->user_data = BLOCK_DEVICE_URING_READ | (readRequests.size() - 1);
+            if (!submit(1))
+            {
+                return false;
+            }
+
+            current += size;
+            offset += size;
+            length -= size;
+        }
+
+        if (!waitForCompletions())
+        {
+            return false;
+        }
+
+        // finish short reads synchronously
+        for (const URING_READ_REQUEST &request : readRequests)
+        {
+            if (request.result < 0 ||
+                ((uint64_t)request.result < request.length &&
+                 !readFully(fd, request.buffer + request.result, request.length - request.result, request.offset + request.result)))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool UringBlockDevice::writeSectors(uint64_t logicalBlockAddress, const void *buffer, uint64_t count)
+{
+    if (ringFd < 0)
+    {
+        return FileBlockDevice::writeSectors(logicalBlockAddress, buffer, count);
+    }
+
+    if (failed || !inRange(logicalBlockAddress, count))
+    {
+        return false;
+    }
+
+    const uint8_t *current = (const uint8_t *)buffer;
+    uint64_t offset = logicalBlockAddress * sectorSize;
+    uint64_t length = count * sectorSize;
+
+    while (length > 0)
+    {
+        // start a new buffer unless this write continues the open one
+        if (activeBuffer >= 0 && (offset != bufferOffsets[activeBuffer] + bufferLengths[activeBuffer] || bufferLengths[activeBuffer] == BLOCK_DEVICE_URING_BUFFER_SIZE))
+        {
+            if (!submitBuffer())
+            {
+                return false;
+            }
+        }
+        if (activeBuffer < 0)
+        {
+            while (freeBuffers.empty())
+            {
+                if (!reapCompletions(1))
+                {
+                    return false;
+                }
+            }
+            activeBuffer = freeBuffers.back();
+            freeBuffers.pop_back();
+            bufferOffsets[activeBuffer] = offset;
+            bufferLengths[activeBuffer] = 0;
+        }
+
+        uint64_t size = std::min(length, BLOCK_DEVICE_URING_BUFFER_SIZE - bufferLengths[activeBuffer]);
+        memcpy(buffers[activeBuffer].get() + bufferLengths[activeBuffer], current, size);
+        bufferLengths[activeBuffer] += size;
+
+        current += size;
+        offset += size;
+        length -= size;
+    }
+
+    return true;
+}
+
+bool UringBlockDevice::writeSectorsVectored(uint64_t logicalBlockAddress, const struct iovec *vectors, int vectorCount)
+{
+    if (ringFd < 0)
+    {
+        return FileBlockDevice::writeSectorsVectored(logicalBlockAddress, vectors, vectorCount);
+    }
+
+    // the buffers are copied into the ring one after another
+    return BlockDevice::writeSectorsVectored(logicalBlockAddress, vectors, vectorCount);
+}
+
+bool UringBlockDevice::zeroSectors(uint64_t logicalBlockAddress, uint64_t count)
+{
+    if (ringFd >= 0 && (!submitBuffer() || !waitForCompletions()))
+    {
+        return false;
+    }
+
+    return FileBlockDevice::zeroSectors(logicalBlockAddress, count);
+}
+
+bool UringBlockDevice::copyFromFile(int sourceFd, uint64_t offset, uint64_t logicalBlockAddress, uint64_t length)
+{
+    // the copy goes around the ring, so nothing may still be in flight
+    if (ringFd >= 0 && (!submitBuffer() || !waitForCompletions()))
+    {
+        return false;
+    }
+
+    return FileBlockDevice::copyFromFile(sourceFd, offset, logicalBlockAddress, length);
+}
+
+bool UringBlockDevice::flush()
+{
+    if (ringFd < 0)
+    {
+        return FileBlockDevice::flush();
+    }
+
+    if (!submitBuffer())
+    {
+        return false;
+    }
+
+    // the fsync drains the queue, so it only starts once every write is done
+    struct io_uring_sqe *entry = getSubmissionEntry();
+    if (entry == nullptr)
+    {
+        return false;
+    }
+    entry->opcode = IORING_OP_FSYNC;
+    entry->flags = IOSQE_IO_DRAIN;
+    entry->fd = fd;
+    entry->fsync_flags = IORING_FSYNC_DATASYNC;
+    entry->user_data = BLOCK_DEVICE_URING_FSYNC;
+    fsyncResult = -1;
+
+    return submit(1) && waitForCompletions() && fsyncResult == 0;
+}
+
+bool UringBlockDevice::setupRing()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+
+    ringFd = (int)syscall(__NR_io_uring_setup, queueDepth, &params);
+    if (ringFd < 0)
+    {
+        std::cerr << "io_uring is not available, using pread/pwrite" << std::endl;
+        return true;
+    }
+
+    submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        submissionRingSize = completionRingSize = std::max(submissionRingSize, completionRingSize);
+    }
+
+    submissionRing = (uint8_t *)mmap(nullptr, submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    completionRing = submissionRing;
+    if (submissionRing != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        completionRing = (uint8_t *)mmap(nullptr, completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    }
+    submissionEntriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    submissionEntries = (struct io_uring_sqe *)mmap(nullptr, submissionEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (submissionRing == MAP_FAILED || completionRing == MAP_FAILED || submissionEntries == MAP_FAILED)
+    {
+        return false;
+    }
+
+    submissionTail = (uint32_t *)(submissionRing + params.sq_off.tail);
+    submissionMask = *(uint32_t *)(submissionRing + params.sq_off.ring_mask);
+    submissionArray = (uint32_t *)(submissionRing + params.sq_off.array);
+    completionHead = (uint32_t *)(completionRing + params.cq_off.head);
+    completionTail = (uint32_t *)(completionRing + params.cq_off.tail);
+    completionMask = *(uint32_t *)(completionRing + params.cq_off.ring_mask);
+    completions = (struct io_uring_cqe *)(completionRing + params.cq_off.cqes);
+    queueDepth = std::min(queueDepth, params.sq_entries);
+
+    // one write buffer per queue slot
+    std::vector<struct iovec> vectors(queueDepth);
+    buffers.resize(queueDepth);
+    bufferOffsets.assign(queueDepth, 0);
+    bufferLengths.assign(queueDepth, 0);
+    for (uint32_t i = 0; i < queueDepth; i++)
+    {
+        buffers[i] = allocateAlignedBuffer(BLOCK_DEVICE_URING_BUFFER_SIZE);
+        if (!buffers[i])
+        {
+            return false;
+        }
+        vectors[i] = { buffers[i].get(), BLOCK_DEVICE_URING_BUFFER_SIZE };
+        freeBuffers.push_back(queueDepth - 1 - i);
+    }
+
+    // registered buffers are pinned once instead of on every write; a
+    // low memlock limit leaves them unregistered
+    registered = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, vectors.data(), queueDepth) == 0;
+    return true;
+}
+
+struct io_uring_sqe *UringBlockDevice::getSubmissionEntry()
+{
+    // never have more requests in flight than the rings hold
+    while (inFlight >= queueDepth)
+    {
+        if (!reapCompletions(1))
+        {
+            return nullptr;
+        }
+    }
+
+    uint32_t tail = *submissionTail;
+    uint32_t index = tail & submissionMask;
+    struct io_uring_sqe *entry = &submissionEntries[index];
+    memset(entry, 0, sizeof(*entry));
+    submissionArray[index] = index;
+    pendingTail = tail + 1;
+    return entry;
+}
+
+bool UringBlockDevice::submit(uint32_t count)
+{
+    __atomic_store_n(submissionTail, pendingTail, __ATOMIC_RELEASE);
+    inFlight += count;
+
+    while (count > 0)
+    {
+        int result = (int)syscall(__NR_io_uring_enter, ringFd, count, 0, 0, nullptr, 0);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            failed = true;
+            return false;
+        }
+        count -= result;
+    }
+
+    return true;
+}
+
+bool UringBlockDevice::submitBuffer()
+{
+    if (activeBuffer < 0)
+    {
+        return !failed;
+    }
+
+    int buffer = activeBuffer;
+    activeBuffer = -1;
+    struct io_uring_sqe *entry = getSubmissionEntry();
+    if (entry == nullptr)
+    {
+        return false;
+    }
+    entry->opcode = registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    entry->fd = fd;
+    entry->addr = (uint64_t)buffers[buffer].get();
+    entry->len = (uint32_t)bufferLengths[buffer];
+    entry->off = bufferOffsets[buffer];
+    entry->buf_index = registered ? buffer : 0;
+    entry->user_data = BLOCK_DEVICE_URING_WRITE | buffer;
+    return submit(1);
+}
+
+bool UringBlockDevice::reapCompletions(uint32_t minimum)
+{
+    uint32_t reaped = 0;
+
+    while (reaped < minimum)
+    {
+        uint32_t head = *completionHead;
+        uint32_t tail = __atomic_load_n(completionTail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            int result = (int)syscall(__NR_io_uring_enter, ringFd, 0, minimum - reaped, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (result < 0 && errno != EINTR)
+            {
+                failed = true;
+                return false;
+            }
+            continue;
+        }
+
+        for (; head != tail; head++, reaped++)
+        {
+            completeRequest(completions[head & completionMask]);
+        }
+        __atomic_store_n(completionHead, head, __ATOMIC_RELEASE);
+    }
+
+    return !failed;
+}
+
+bool UringBlockDevice::waitForCompletions()
+{
+    while (inFlight > 0)
+    {
+        if (!reapCompletions(1))
+        {
+            return false;
+        }
+    }
+
+    return !failed;
+}
+
+void UringBlockDevice::completeRequest(const struct io_uring_cqe &completion)
+{
+    uint64_t index = completion.user_data & BLOCK_DEVICE_URING_INDEX_MASK;
+    inFlight--;
+
+    switch (completion.user_data & ~BLOCK_DEVICE_URING_INDEX_MASK)
+    {
+    case BLOCK_DEVICE_URING_WRITE:
+        // finish a short write synchronously before the buffer is reused
+        if (completion.res < 0 ||
+            ((uint64_t)completion.res < bufferLengths[index] &&
+             !writeFully(fd, buffers[index].get() + completion.res, bufferLengths[index] - completion.res, bufferOffsets[index] + completion.res)))
+        {
+            failed = true;
+        }
+        freeBuffers.push_back((int)index);
+        break;
+    case BLOCK_DEVICE_URING_READ:
+        readRequests[index].result = completion.res;
+        break;
+    case BLOCK_DEVICE_URING_FSYNC:
+        fsyncResult = completion.res;
+        break;
+    }
+}
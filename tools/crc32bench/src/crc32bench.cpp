@@ -0,0 +1,157 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "crc32.h"
+#include "cli.h"
+
+#define CRC32BENCH_MAX_SIZE_MIB 65536 // one buffer of this size is allocated up front
+#define CRC32BENCH_MAX_THREADS 1024
+
+void printUsage()
+{
+    std::cout << "Usage: crc32bench [options]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -s\t\t\tBuffer size in MiB, 1 to " << CRC32BENCH_MAX_SIZE_MIB << " (default 64)" << std::endl;
+    std::cout << "  -i\t\t\tIterations per path (default 8)" << std::endl;
+    std::cout << "  -t\t\t\tThreads for the parallel combine path, 1 to " << CRC32BENCH_MAX_THREADS << " (default all cores)" << std::endl;
+}
+
+/**
+ * @brief Hash a buffer in equal chunks on several threads and combine the results
+ * @param  *data: the data buffer
+ * @param  length: the length of the data buffer
+ * @param  previousCrc32: the previous CRC32 checksum
+ * @param  threads: the number of threads
+ * @retval The CRC32 checksum of the data buffer
+ */
+uint32_t crc32Parallel(const uint8_t *data, size_t length, uint32_t previousCrc32, unsigned threads)
+{
+    size_t chunkSize = (length + threads - 1) / threads;
+    std::vector<uint32_t> chunkCrc32(threads, 0);
+    std::vector<std::thread> workers;
+
+    for (unsigned i = 0; i < threads; i++)
+    {
+        size_t offset = std::min(length, i * chunkSize);
+        size_t size = std::min(chunkSize, length - offset);
+        workers.emplace_back([&chunkCrc32, data, offset, size, i]()
+                             { chunkCrc32[i] = crc32(data + offset, size); });
+    }
+
+    uint32_t crc = previousCrc32;
+    for (unsigned i = 0; i < threads; i++)
+    {
+        workers[i].join();
+        size_t offset = std::min(length, i * chunkSize);
+        crc = crc32Combine(crc, chunkCrc32[i], std::min(chunkSize, length - offset));
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Time a CRC32 path over a buffer and print its throughput
+ * @param  *name: the name of the path
+ * @param  function: the path to time
+ * @param  length: the length of the buffer
+ * @param  iterations: the number of passes over the buffer
+ * @param  expected: the checksum every path must produce
+ * @retval true if the path produced the expected checksum, false otherwise
+ */
+template <typename Function>
+bool benchmark(const char *name, Function function, size_t length, unsigned iterations, uint32_t expected)
+{
+    uint32_t crc = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; i++)
+    {
+        crc = function();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double gigabytesPerSecond = (double)length * iterations / elapsed.count() / 1e9;
+    std::cout << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << gigabytesPerSecond << " GB/s  crc32 " << std::hex << std::setw(8)
+              << std::setfill('0') << crc << std::dec << std::setfill(' ')
+              << (crc == expected ? "" : "  MISMATCH") << std::endl;
+
+    return crc == expected;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t sizeInMiB = 64;
+    uint32_t iterations = 8;
+    uint32_t threads = std::min((uint32_t)CRC32BENCH_MAX_THREADS, std::max(1u, std::thread::hardware_concurrency()));
+
+    // a size, count or thread count of zero would measure nothing
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, CRC32BENCH_MAX_SIZE_MIB, sizeInMiB))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, iterations))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, CRC32BENCH_MAX_THREADS, threads))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            printUsage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t length = (size_t)sizeInMiB * 1024 * 1024;
+    std::vector<uint8_t> buffer(length);
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < length; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = seed >> 16;
+    }
+
+    const uint8_t *data = buffer.data();
+    uint32_t expected = crc32Slicing16(data, length);
+    bool ok = true;
+
+    std::cout << "CRC32 over " << sizeInMiB << " MiB x " << iterations << " iterations" << std::endl;
+    ok &= benchmark("bytewise", [&]() { return crc32Bytewise(data, length); }, length, iterations, expected);
+    ok &= benchmark("slicing-by-8", [&]() { return crc32Slicing8(data, length); }, length, iterations, expected);
+    ok &= benchmark("slicing-by-16", [&]() { return crc32Slicing16(data, length); }, length, iterations, expected);
+#if defined(CRC32_HAVE_CLMUL)
+    if (crc32HasClmul())
+    {
+        ok &= benchmark("clmul", [&]() { return crc32Clmul(data, length); }, length, iterations, expected);
+    }
+    else
+    {
+        std::cout << std::left << std::setw(16) << "clmul" << "not supported by this CPU" << std::endl;
+    }
+#endif
+    ok &= benchmark("dispatch", [&]() { return crc32(data, length); }, length, iterations, expected);
+
+    std::string parallel = "combine x" + std::to_string(threads);
+    ok &= benchmark(parallel.c_str(), [&]() { return crc32Parallel(data, length, 0, threads); }, length, iterations, expected);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
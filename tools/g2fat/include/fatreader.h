@@ -0,0 +1,73 @@
+#ifndef __FATREADER_H
+#define __FATREADER_H
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "blockdevice.h"
+#include "fat.h"
+
+#define FAT_READER_MAX_READ_SIZE (8 * 1024 * 1024) // bytes copied from a device that cannot be mapped at a time
+
+// a run of consecutive clusters in a chain
+typedef struct _FAT_EXTENT
+{
+    uint32_t firstCluster;
+    uint32_t clusterCount;
+} FAT_EXTENT;
+
+// a file or directory as its directory entry describes it
+typedef struct _FAT_FILE_INFO
+{
+    std::string name; // the long name if there is one, otherwise NAME.EXT
+    uint32_t firstCluster; // 0 for an empty file and the FAT12/16 root directory
+    uint32_t size;
+    uint8_t attributes;
+    uint16_t writeTime;
+    uint16_t writeDate;
+} FAT_FILE_INFO;
+
+/**
+ * Read-only access to a FAT volume. The FAT is loaded once, and each cluster
+ * chain is turned into extents the first time it is followed and kept, so
+ * file data is read a run of clusters at a time, straight out of the
+ * mapping when the device has one
+ */
+class FATReader
+{
+public:
+    bool open(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress);
+
+    uint8_t getFATType() const { return fatType; }
+    uint64_t getClusterSize() const { return (uint64_t)sectorsPerCluster * bytesPerSector; }
+
+    void getRoot(FAT_FILE_INFO &root) const;
+    bool lookup(const std::string &path, FAT_FILE_INFO &file);
+    bool readDirectory(const FAT_FILE_INFO &directory, std::vector<FAT_FILE_INFO> &entries);
+    bool getExtents(uint32_t firstCluster, const std::vector<FAT_EXTENT> *&extents);
+    bool readFile(const FAT_FILE_INFO &file, const std::function<bool(const uint8_t *, size_t)> &consume);
+
+private:
+    bool readData(uint64_t logicalBlockAddress, uint64_t length, const std::function<bool(const uint8_t *, size_t)> &consume);
+    uint32_t getEntry(uint32_t cluster) const;
+    uint64_t clusterToLogicalBlockAddress(uint32_t cluster) const;
+
+    BlockDevice *device = nullptr;
+    uint64_t partitionStartingLogicalBlockAddress = 0;
+    uint32_t bytesPerSector = 0;
+    uint32_t sectorsPerCluster = 0;
+    uint64_t rootDirectoryLogicalBlockAddress = 0; // FAT12/16 only
+    uint32_t rootDirectorySectors = 0;             // FAT12/16 only
+    uint64_t firstDataSector = 0;                  // relative to the partition
+    uint32_t clusterCount = 0;
+    uint32_t rootCluster = 0; // FAT32 only
+    uint8_t fatType = 0;
+    std::vector<uint8_t> fat;
+    std::unordered_map<uint32_t, std::vector<FAT_EXTENT>> extentCache; // by first cluster
+    AlignedBuffer readBuffer; // only for devices that cannot be mapped
+};
+
+#endif // __FATREADER_H
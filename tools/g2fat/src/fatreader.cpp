@@ -0,0 +1,458 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+#include "fatreader.h"
+
+#define LFN_LAST_ENTRY 0x40
+#define LFN_ORDER_MASK 0x1F
+#define LFN_CHARACTERS_PER_ENTRY 13
+#define LFN_CHECKSUM_OFFSET 13
+
+// where the 13 UCS-2 characters of a long name entry sit in its 32 bytes
+static const uint8_t lfnCharacterOffsets[LFN_CHARACTERS_PER_ENTRY] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+/**
+ * @brief Work out the checksum of a short name that its long name entries carry
+ * @param  *name: the 11 byte short name
+ * @retval The checksum
+ */
+static uint8_t getShortNameChecksum(const uint8_t *name)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+    {
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    }
+
+    return sum;
+}
+
+/**
+ * @brief Format a short name as NAME.EXT
+ * @param  *name: the 11 byte short name
+ * @param  caseFlags: DIR_NTRes, which may ask for a lower case base or extension
+ * @retval The name
+ */
+static std::string formatShortName(const uint8_t *name, uint8_t caseFlags)
+{
+    std::string base(reinterpret_cast<const char *>(name), 8), extension(reinterpret_cast<const char *>(name) + 8, 3);
+    base.erase(base.find_last_not_of(' ') + 1);
+    extension.erase(extension.find_last_not_of(' ') + 1);
+    if (caseFlags & FAT_CASE_LOWER_BASE)
+    {
+        std::transform(base.begin(), base.end(), base.begin(), ::tolower);
+    }
+    if (caseFlags & FAT_CASE_LOWER_EXTENSION)
+    {
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    }
+
+    // 0x05 stands in for a leading 0xE5, which marks deleted entries
+    if (!base.empty() && base[0] == 0x05)
+    {
+        base[0] = (char)0xE5;
+    }
+
+    return extension.empty() ? base : base + "." + extension;
+}
+
+/**
+ * @brief Convert a UTF-16 long name to UTF-8
+ * @param  &longName: the long name
+ * @retval The name
+ */
+static std::string toUTF8(const std::u16string &longName)
+{
+    std::string name;
+    for (size_t i = 0; i < longName.size(); i++)
+    {
+        uint32_t character = longName[i];
+
+        // characters past U+FFFF take a surrogate pair
+        if (character >= 0xD800 && character < 0xDC00 && i + 1 < longName.size() && longName[i + 1] >= 0xDC00 && longName[i + 1] < 0xE000)
+        {
+            character = 0x10000 + ((character - 0xD800) << 10) + (longName[++i] - 0xDC00);
+        }
+
+        if (character < 0x80)
+        {
+            name += (char)character;
+        }
+        else if (character < 0x800)
+        {
+            name += (char)(0xC0 | (character >> 6));
+            name += (char)(0x80 | (character & 0x3F));
+        }
+        else if (character < 0x10000)
+        {
+            name += (char)(0xE0 | (character >> 12));
+            name += (char)(0x80 | ((character >> 6) & 0x3F));
+            name += (char)(0x80 | (character & 0x3F));
+        }
+        else
+        {
+            name += (char)(0xF0 | (character >> 18));
+            name += (char)(0x80 | ((character >> 12) & 0x3F));
+            name += (char)(0x80 | ((character >> 6) & 0x3F));
+            name += (char)(0x80 | (character & 0x3F));
+        }
+    }
+
+    return name;
+}
+
+bool FATReader::open(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress)
+{
+    VOLUME_BOOT_RECORD vbr;
+    if (!readSectorBytes(device, partitionStartingLogicalBlockAddress, &vbr, sizeof(vbr)) || vbr.signature != 0xAA55)
+    {
+        std::cerr << "Error: failed to read volume boot record" << std::endl;
+        return false;
+    }
+
+    uint32_t volumeSectors = vbr.BPB_TotSec16 != 0 ? vbr.BPB_TotSec16 : vbr.BPB_TotSec32;
+    uint32_t fatSize = vbr.BPB_FATSz16 != 0 ? vbr.BPB_FATSz16 : vbr.BPB_FATSz32;
+    uint32_t rootDirectorySectors = (vbr.BPB_RootEntCnt * sizeof(FAT32_DIRECTORY_ENTRY) + vbr.BPB_BytsPerSec - 1) / std::max<uint32_t>(vbr.BPB_BytsPerSec, 1);
+    uint64_t firstDataSector = vbr.BPB_RsvdSecCnt + (uint64_t)vbr.BPB_NumFATs * fatSize + rootDirectorySectors;
+    if (vbr.BPB_BytsPerSec != device.getSectorSize() || vbr.BPB_SecPerClus == 0 || vbr.BPB_NumFATs == 0 || fatSize == 0 || firstDataSector >= volumeSectors)
+    {
+        std::cerr << "Error: partition does not hold a FAT file system in " << device.getSectorSize() << " byte sectors" << std::endl;
+        return false;
+    }
+
+    this->device = &device;
+    this->partitionStartingLogicalBlockAddress = partitionStartingLogicalBlockAddress;
+    this->bytesPerSector = vbr.BPB_BytsPerSec;
+    this->sectorsPerCluster = vbr.BPB_SecPerClus;
+    this->rootDirectoryLogicalBlockAddress = partitionStartingLogicalBlockAddress + vbr.BPB_RsvdSecCnt + (uint64_t)vbr.BPB_NumFATs * fatSize;
+    this->rootDirectorySectors = rootDirectorySectors;
+    this->firstDataSector = firstDataSector;
+    this->clusterCount = (volumeSectors - firstDataSector) / sectorsPerCluster;
+    this->fatType = clusterCount <= FAT12_MAX_CLUSTERS ? 12 : clusterCount <= FAT16_MAX_CLUSTERS ? 16 : 32;
+    this->rootCluster = fatType == 32 ? vbr.BPB_RootClus : 0;
+    extentCache.clear();
+
+    // the whole FAT stays in memory, chains are followed without touching the device
+    fat.resize((uint64_t)fatSize * bytesPerSector);
+    if ((uint64_t)fat.size() * 8 / fatType < (uint64_t)clusterCount + FAT_FIRST_CLUSTER ||
+        !device.readSectors(partitionStartingLogicalBlockAddress + vbr.BPB_RsvdSecCnt, fat.data(), fatSize))
+    {
+        std::cerr << "Error: failed to read the FAT" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void FATReader::getRoot(FAT_FILE_INFO &root) const
+{
+    root.name = "/";
+    root.firstCluster = rootCluster;
+    root.size = 0;
+    root.attributes = ATTR_DIRECTORY;
+    root.writeTime = 0;
+    root.writeDate = 0;
+}
+
+bool FATReader::lookup(const std::string &path, FAT_FILE_INFO &file)
+{
+    getRoot(file);
+
+    // names compare without case, as FAT does
+    size_t start = 0;
+    while (start < path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+        {
+            end = path.size();
+        }
+
+        std::string component = path.substr(start, end - start);
+        start = end + 1;
+        if (component.empty() || component == ".")
+        {
+            continue;
+        }
+
+        std::vector<FAT_FILE_INFO> entries;
+        if (!(file.attributes & ATTR_DIRECTORY) || !readDirectory(file, entries))
+        {
+            std::cerr << "Error: \"" << path << "\" is not a directory" << std::endl;
+            return false;
+        }
+
+        auto entry = std::find_if(entries.begin(), entries.end(), [&](const FAT_FILE_INFO &candidate) {
+            return strcasecmp(candidate.name.c_str(), component.c_str()) == 0;
+        });
+        if (entry == entries.end())
+        {
+            std::cerr << "Error: \"" << path << "\" does not exist" << std::endl;
+            return false;
+        }
+
+        file = *entry;
+    }
+
+    return true;
+}
+
+bool FATReader::readDirectory(const FAT_FILE_INFO &directory, std::vector<FAT_FILE_INFO> &entries)
+{
+    std::vector<uint8_t> data;
+    entries.clear();
+
+    // the FAT12/16 root directory is a fixed region before the clusters
+    if (directory.firstCluster == 0)
+    {
+        data.resize((uint64_t)rootDirectorySectors * bytesPerSector);
+        if (!device->readSectors(rootDirectoryLogicalBlockAddress, data.data(), rootDirectorySectors))
+        {
+            std::cerr << "Error: failed to read the root directory" << std::endl;
+            return false;
+        }
+    }
+    else
+    {
+        const std::vector<FAT_EXTENT> *extents;
+        if (!getExtents(directory.firstCluster, extents))
+        {
+            return false;
+        }
+
+        for (const FAT_EXTENT &extent : *extents)
+        {
+            if (!readData(clusterToLogicalBlockAddress(extent.firstCluster), extent.clusterCount * getClusterSize(), [&](const uint8_t *slice, size_t length) {
+                    data.insert(data.end(), slice, slice + length);
+                    return true;
+                }))
+            {
+                return false;
+            }
+        }
+    }
+
+    // long name entries come last part first, ahead of their short name entry
+    std::u16string longName;
+    uint8_t longNameChecksum = 0, longNameOrder = 0;
+    for (size_t offset = 0; offset + sizeof(FAT32_DIRECTORY_ENTRY) <= data.size(); offset += sizeof(FAT32_DIRECTORY_ENTRY))
+    {
+        const uint8_t *raw = data.data() + offset;
+        FAT32_DIRECTORY_ENTRY entry;
+        memcpy(&entry, raw, sizeof(entry));
+
+        // a zero name ends the directory, 0xE5 is a deleted entry
+        if (entry.DIR_Name[0] == 0x00)
+        {
+            break;
+        }
+        if (entry.DIR_Name[0] == 0xE5)
+        {
+            longNameOrder = 0;
+            continue;
+        }
+
+        if ((entry.DIR_Attr & 0x3F) == ATTR_LONG_NAME)
+        {
+            uint8_t order = entry.DIR_Name[0] & LFN_ORDER_MASK;
+            if (entry.DIR_Name[0] & LFN_LAST_ENTRY)
+            {
+                longName.clear();
+                longNameChecksum = raw[LFN_CHECKSUM_OFFSET];
+            }
+            else if (order + 1 != longNameOrder || raw[LFN_CHECKSUM_OFFSET] != longNameChecksum)
+            {
+                longNameOrder = 0;
+                continue;
+            }
+            longNameOrder = order;
+
+            // each part goes in front of the ones already seen
+            std::u16string part;
+            for (uint8_t characterOffset : lfnCharacterOffsets)
+            {
+                uint16_t character = raw[characterOffset] | (raw[characterOffset + 1] << 8);
+                if (character == 0x0000 || character == 0xFFFF)
+                {
+                    break;
+                }
+                part += (char16_t)character;
+            }
+            longName = part + longName;
+            continue;
+        }
+
+        bool hasLongName = longNameOrder == 1 && getShortNameChecksum(entry.DIR_Name) == longNameChecksum;
+        longNameOrder = 0;
+        if (entry.DIR_Attr & ATTR_VOLUME_ID)
+        {
+            continue;
+        }
+
+        FAT_FILE_INFO file;
+        file.name = hasLongName ? toUTF8(longName) : formatShortName(entry.DIR_Name, entry.DIR_NTRes);
+        if (file.name == "." || file.name == "..")
+        {
+            continue;
+        }
+        file.firstCluster = (fatType == 32 ? (uint32_t)entry.DIR_FstClusHI << 16 : 0) | entry.DIR_FstClusLO;
+        file.size = entry.DIR_FileSize;
+        file.attributes = entry.DIR_Attr;
+        file.writeTime = entry.DIR_WrtTime;
+        file.writeDate = entry.DIR_WrtDate;
+        entries.push_back(file);
+    }
+
+    return true;
+}
+
+bool FATReader::getExtents(uint32_t firstCluster, const std::vector<FAT_EXTENT> *&extents)
+{
+    auto cached = extentCache.find(firstCluster);
+    if (cached != extentCache.end())
+    {
+        extents = &cached->second;
+        return true;
+    }
+
+    // any value from here up ends a chain
+    uint32_t endOfChain = fatType == 12 ? 0x0FF8 : fatType == 16 ? 0xFFF8 : 0x0FFFFFF8;
+    uint32_t lastCluster = clusterCount + FAT_FIRST_CLUSTER - 1;
+    std::vector<FAT_EXTENT> chain;
+
+    // a chain longer than the volume must loop
+    uint32_t cluster = firstCluster;
+    for (uint32_t length = 0; length < clusterCount; length++)
+    {
+        if (cluster < FAT_FIRST_CLUSTER || cluster > lastCluster)
+        {
+            std::cerr << "Error: cluster chain from " << firstCluster << " leaves the volume at " << cluster << std::endl;
+            return false;
+        }
+
+        if (!chain.empty() && chain.back().firstCluster + chain.back().clusterCount == cluster)
+        {
+            chain.back().clusterCount++;
+        }
+        else
+        {
+            chain.push_back({cluster, 1});
+        }
+
+        cluster = getEntry(cluster);
+        if (cluster >= endOfChain)
+        {
+            extents = &(extentCache[firstCluster] = std::move(chain));
+            return true;
+        }
+    }
+
+    std::cerr << "Error: cluster chain from " << firstCluster << " loops" << std::endl;
+    return false;
+}
+
+bool FATReader::readFile(const FAT_FILE_INFO &file, const std::function<bool(const uint8_t *, size_t)> &consume)
+{
+    if (file.size == 0)
+    {
+        return true;
+    }
+
+    const std::vector<FAT_EXTENT> *extents;
+    if (!getExtents(file.firstCluster, extents))
+    {
+        return false;
+    }
+
+    // the last extent is cut short at the end of the file
+    uint64_t remaining = file.size;
+    for (const FAT_EXTENT &extent : *extents)
+    {
+        uint64_t length = std::min(remaining, extent.clusterCount * getClusterSize());
+        if (!readData(clusterToLogicalBlockAddress(extent.firstCluster), length, consume))
+        {
+            return false;
+        }
+
+        remaining -= length;
+        if (remaining == 0)
+        {
+            return true;
+        }
+    }
+
+    std::cerr << "Error: \"" << file.name << "\" is longer than its cluster chain" << std::endl;
+    return false;
+}
+
+bool FATReader::readData(uint64_t logicalBlockAddress, uint64_t length, const std::function<bool(const uint8_t *, size_t)> &consume)
+{
+    uint64_t sectors = (length + bytesPerSector - 1) / bytesPerSector;
+
+    // a mapped device hands out the whole extent without a copy
+    const uint8_t *mapped = device->getMappedSectors(logicalBlockAddress, sectors);
+    if (mapped != nullptr)
+    {
+        return consume(mapped, length);
+    }
+
+    if (!readBuffer)
+    {
+        readBuffer = allocateAlignedBuffer(FAT_READER_MAX_READ_SIZE);
+        if (!readBuffer)
+        {
+            std::cerr << "Error: out of memory" << std::endl;
+            return false;
+        }
+    }
+
+    // otherwise the extent is read in large contiguous pieces
+    uint64_t sectorsPerRead = FAT_READER_MAX_READ_SIZE / bytesPerSector;
+    while (length > 0)
+    {
+        uint64_t count = std::min(sectors, sectorsPerRead);
+        uint64_t bytes = std::min(length, count * bytesPerSector);
+        if (!device->readSectors(logicalBlockAddress, readBuffer.get(), count))
+        {
+            std::cerr << "Error: failed to read sector " << logicalBlockAddress << std::endl;
+            return false;
+        }
+        if (!consume(readBuffer.get(), bytes))
+        {
+            return false;
+        }
+
+        logicalBlockAddress += count;
+        sectors -= count;
+        length -= bytes;
+    }
+
+    return true;
+}
+
+uint32_t FATReader::getEntry(uint32_t cluster) const
+{
+    switch (fatType)
+    {
+    case 12:
+    {
+        uint32_t offset = cluster + cluster / 2;
+        uint32_t value = fat[offset] | (fat[offset + 1] << 8);
+        return cluster & 1 ? value >> 4 : value & 0x0FFF;
+    }
+    case 16:
+        return fat[cluster * 2] | (fat[cluster * 2 + 1] << 8);
+    default:
+    {
+        uint32_t value;
+        memcpy(&value, fat.data() + (uint64_t)cluster * 4, sizeof(value));
+        return value & FAT32_CLUSTER_MASK;
+    }
+    }
+}
+
+uint64_t FATReader::clusterToLogicalBlockAddress(uint32_t cluster) const
+{
+    return partitionStartingLogicalBlockAddress + firstDataSector + (uint64_t)(cluster - FAT_FIRST_CLUSTER) * sectorsPerCluster;
+}
@@ -0,0 +1,299 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fs.h"
+#include "gpt.h"
+#include "blockdevice.h"
+#include "cli.h"
+#include "fatreader.h"
+
+void printUsage()
+{
+    std::cout << "Usage: g2fat [options] <command> target [path] [host directory]" << std::endl;
+    std::cout << "Commands:" << std::endl;
+    std::cout << "  ls\t\t\tList a directory (default /)" << std::endl;
+    std::cout << "  cat\t\t\tWrite a file to standard output" << std::endl;
+    std::cout << "  extract\t\tCopy a file or directory tree (default /) into a host directory" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -p\t\t\tPartition number address (i.e. 1, 2, etc.)" << std::endl;
+    std::cout << "  -b\t\t\tI/O backend (i.e. file, mmap, uring, direct; mmap reads file data without copying it)" << std::endl;
+    std::cout << "  -q\t\t\tRequests in flight with the uring backend (default " << BLOCK_DEVICE_URING_QUEUE_DEPTH << ")" << std::endl;
+    std::cout << "  -R\t\t\tList subdirectories too" << std::endl;
+}
+
+/**
+ * @brief Write a whole buffer to a file, pipe or terminal
+ * @param  fd: the file descriptor
+ * @param  *buffer: the data
+ * @param  length: the size of the data in bytes
+ * @retval true if successful, false otherwise
+ */
+static bool writeAll(int fd, const uint8_t *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+
+        buffer += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Turn the date and time of a directory entry into host time
+ * @param  &file: the file
+ * @retval The time, in the local time zone mkfs stamped it in
+ */
+static time_t getWriteTime(const FAT_FILE_INFO &file)
+{
+    std::tm tm = {};
+    tm.tm_year = (file.writeDate >> 9) + 80;
+    tm.tm_mon = ((file.writeDate >> 5) & 0x0F) - 1;
+    tm.tm_mday = file.writeDate & 0x1F;
+    tm.tm_hour = file.writeTime >> 11;
+    tm.tm_min = (file.writeTime >> 5) & 0x3F;
+    tm.tm_sec = (file.writeTime & 0x1F) * 2;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+/**
+ * @brief Print a file as attributes, size, date and name
+ * @param  &file: the file
+ * @retval None
+ */
+static void printEntry(const FAT_FILE_INFO &file)
+{
+    uint16_t date = file.writeDate, time = file.writeTime;
+    std::cout << (file.attributes & ATTR_DIRECTORY ? 'd' : '-') << (file.attributes & ATTR_READ_ONLY ? 'r' : '-')
+              << (file.attributes & ATTR_HIDDEN ? 'h' : '-') << (file.attributes & ATTR_SYSTEM ? 's' : '-')
+              << (file.attributes & ATTR_ARCHIVE ? 'a' : '-') << std::setfill(' ') << std::setw(11) << file.size << " "
+              << std::setfill('0') << (date >> 9) + 1980 << "-" << std::setw(2) << ((date >> 5) & 0x0F) << "-" << std::setw(2) << (date & 0x1F) << " "
+              << std::setw(2) << (time >> 11) << ":" << std::setw(2) << ((time >> 5) & 0x3F) << " " << file.name
+              << (file.attributes & ATTR_DIRECTORY ? "/" : "") << std::endl;
+}
+
+/**
+ * @brief Print the entries of a directory, one per line
+ * @param  &reader: the volume
+ * @param  &directory: the directory
+ * @param  &path: the path of the directory, for recursive listings
+ * @param  recursive: true to list subdirectories too
+ * @retval true if successful, false otherwise
+ */
+static bool list(FATReader &reader, const FAT_FILE_INFO &directory, const std::string &path, bool recursive)
+{
+    std::vector<FAT_FILE_INFO> entries;
+    if (!reader.readDirectory(directory, entries))
+    {
+        return false;
+    }
+
+    if (recursive)
+    {
+        std::cout << path << ":" << std::endl;
+    }
+
+    for (const FAT_FILE_INFO &entry : entries)
+    {
+        printEntry(entry);
+    }
+
+    if (!recursive)
+    {
+        return true;
+    }
+
+    for (const FAT_FILE_INFO &entry : entries)
+    {
+        if (entry.attributes & ATTR_DIRECTORY)
+        {
+            std::cout << std::endl;
+            if (!list(reader, entry, path == "/" ? "/" + entry.name : path + "/" + entry.name, true))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Copy a file or directory tree out of the volume
+ * @param  &reader: the volume
+ * @param  &file: the file or directory
+ * @param  &hostPath: where to put it
+ * @retval true if successful, false otherwise
+ */
+static bool extract(FATReader &reader, const FAT_FILE_INFO &file, const std::string &hostPath)
+{
+    struct timespec times[2] = {};
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = getWriteTime(file);
+
+    if (file.attributes & ATTR_DIRECTORY)
+    {
+        std::vector<FAT_FILE_INFO> entries;
+        if ((mkdir(hostPath.c_str(), 0755) != 0 && errno != EEXIST) || !reader.readDirectory(file, entries))
+        {
+            std::cerr << "Error: failed to create \"" << hostPath << "\"" << std::endl;
+            return false;
+        }
+
+        for (const FAT_FILE_INFO &entry : entries)
+        {
+            if (!extract(reader, entry, hostPath + "/" + entry.name))
+            {
+                return false;
+            }
+        }
+
+        // the root directory has no date of its own
+        return file.writeDate == 0 || utimensat(AT_FDCWD, hostPath.c_str(), times, 0) == 0;
+    }
+
+    int fd = ::open(hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Error: failed to create \"" << hostPath << "\"" << std::endl;
+        return false;
+    }
+
+    bool copied = reader.readFile(file, [&](const uint8_t *data, size_t length) { return writeAll(fd, data, length); });
+    if (!copied)
+    {
+        std::cerr << "Error: failed to write \"" << hostPath << "\"" << std::endl;
+    }
+
+    futimens(fd, times);
+    return close(fd) == 0 && copied;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    // iterate thru args
+    std::vector<std::string> arguments;
+    uint32_t partitionNumber = 1;
+    BLOCK_DEVICE_TYPE backend = BLOCK_DEVICE_FILE;
+    uint32_t queueDepth = BLOCK_DEVICE_URING_QUEUE_DEPTH;
+    bool recursive = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT16_MAX, partitionNumber))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, queueDepth))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-R") == 0)
+        {
+            recursive = true;
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            if (!parseBlockDeviceType(argv[++i], backend))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            arguments.push_back(argv[i]);
+        }
+    }
+
+    // extract takes the path as optional only when the host directory follows it
+    std::string command = arguments.empty() ? "" : arguments[0];
+    bool isExtract = command == "extract";
+    if ((command != "ls" && command != "cat" && !isExtract) || arguments.size() < (isExtract ? 3u : 2u) || arguments.size() > (isExtract ? 4u : 3u) ||
+        (command == "cat" && arguments.size() != 3))
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+    std::string diskImageName = arguments[1];
+    std::string path = arguments.size() > (isExtract ? 3u : 2u) ? arguments[2] : "/";
+
+    std::unique_ptr<BlockDevice> device = openBlockDevice(backend, diskImageName.c_str(), queueDepth);
+    if (!device)
+    {
+        std::cout << "Error: \"" << diskImageName << "\" does not exist" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // address the image in the sector size it was partitioned with
+    if (!detectSectorSize(*device))
+    {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t partitionStartingLogicalBlockAddress = 0, totalSectors = 0;
+    FATReader reader;
+    FAT_FILE_INFO file;
+    if (!readPartition(*device, partitionNumber, partitionStartingLogicalBlockAddress, totalSectors) ||
+        !reader.open(*device, partitionStartingLogicalBlockAddress) || !reader.lookup(path, file))
+    {
+        return EXIT_FAILURE;
+    }
+
+    bool done;
+    if (command == "ls")
+    {
+        if (!(file.attributes & ATTR_DIRECTORY))
+        {
+            printEntry(file);
+            return EXIT_SUCCESS;
+        }
+        done = list(reader, file, path, recursive);
+    }
+    else if (command == "cat")
+    {
+        if (file.attributes & ATTR_DIRECTORY)
+        {
+            std::cerr << "Error: \"" << path << "\" is a directory" << std::endl;
+            return EXIT_FAILURE;
+        }
+        done = reader.readFile(file, [](const uint8_t *data, size_t length) { return writeAll(STDOUT_FILENO, data, length); });
+    }
+    else
+    {
+        // a file lands in the host directory under its own name, a directory's contents go straight in
+        std::string hostPath = arguments.back();
+        done = extract(reader, file, (file.attributes & ATTR_DIRECTORY) ? hostPath : hostPath + "/" + file.name);
+    }
+
+    return done ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,33 @@
+#ifndef __CHECK_H
+#define __CHECK_H
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <mutex>
+#include <atomic>
+
+#define CHECK_MAX_REPORTED_PROBLEMS 100 // problems printed, the rest are only counted
+
+// the problems found in an image, reported from several threads
+class CheckReport
+{
+public:
+    void problem(const std::string &message)
+    {
+        uint64_t count = ++problems;
+        if (count <= CHECK_MAX_REPORTED_PROBLEMS)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::cout << "Error: " << message << std::endl;
+        }
+    }
+
+    uint64_t getProblemCount() const { return problems; }
+
+private:
+    std::mutex mutex;
+    std::atomic<uint64_t> problems{0};
+};
+
+#endif // __CHECK_H
@@ -0,0 +1,80 @@
+#ifndef __FATCHECK_H
+#define __FATCHECK_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "blockdevice.h"
+#include "fat.h"
+#include "check.h"
+
+#define FAT12_BAD_CLUSTER 0x0FF7
+#define FAT16_BAD_CLUSTER 0xFFF7
+#define FAT32_BAD_CLUSTER 0x0FFFFFF7
+#define FAT_CHECK_LISTED_CLUSTERS 8 // lost clusters named in the report, the rest are only counted
+
+// a FAT volume under check, shared by the checking threads
+typedef struct _FAT_CHECK_VOLUME
+{
+    BlockDevice *device;
+    std::mutex deviceMutex; // the backends are not safe for concurrent reads
+    CheckReport *report;
+    std::string name; // prefixes every problem, e.g. "partition 1"
+    uint64_t partitionStartingLogicalBlockAddress;
+    uint32_t bytesPerSector;
+    uint32_t sectorsPerCluster;
+    uint32_t reservedSectors;
+    uint32_t numberOfFATs;
+    uint32_t fatSize;              // sectors per FAT
+    uint32_t rootEntryCount;       // 0 on FAT32
+    uint32_t rootDirectorySectors; // 0 on FAT32
+    uint32_t firstDataSector;      // relative to the partition
+    uint32_t clusterCount;
+    uint32_t rootCluster;          // 0 on FAT12/16
+    uint8_t fatType;
+    uint8_t media;
+    std::vector<uint8_t> fat; // the first FAT, the others are compared with it
+    std::unique_ptr<std::atomic<uint64_t>[]> visited; // one bit per cluster, set by the first chain to reach it
+    std::atomic<uint64_t> fileCount;
+    std::atomic<uint64_t> directoryCount;
+} FAT_CHECK_VOLUME;
+
+// a file or directory found while walking the tree
+typedef struct _FAT_CHECK_NODE
+{
+    std::string path;
+    uint32_t firstCluster;
+    uint32_t parentCluster; // what '..' must name, 0 for the root
+    uint32_t size;
+    bool isDirectory;
+    bool isRoot;
+} FAT_CHECK_NODE;
+
+class FATCheck
+{
+public:
+    static bool isFileSystem(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress);
+    static void check(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, uint32_t threadCount, const std::string &name, CheckReport &report);
+
+private:
+    static bool readBootSector(FAT_CHECK_VOLUME &volume, uint64_t totalSectors);
+    static bool readFATs(FAT_CHECK_VOLUME &volume);
+    static void checkFSInfo(FAT_CHECK_VOLUME &volume, uint32_t freeCount);
+    static uint32_t getEntry(const FAT_CHECK_VOLUME &volume, uint32_t cluster);
+    static uint32_t getEndOfChain(const FAT_CHECK_VOLUME &volume);
+    static uint32_t getBadCluster(const FAT_CHECK_VOLUME &volume);
+    static bool mark(FAT_CHECK_VOLUME &volume, uint32_t cluster);
+    static bool isMarked(const FAT_CHECK_VOLUME &volume, uint32_t cluster);
+    static void walkChain(FAT_CHECK_VOLUME &volume, const FAT_CHECK_NODE &node, std::vector<uint32_t> &clusters);
+    static bool readDirectory(FAT_CHECK_VOLUME &volume, const FAT_CHECK_NODE &node, const std::vector<uint32_t> &clusters, std::vector<uint8_t> &entries);
+    static void checkDirectory(FAT_CHECK_VOLUME &volume, const FAT_CHECK_NODE &node, const std::vector<uint8_t> &entries, std::vector<FAT_CHECK_NODE> &children);
+    static void checkNode(FAT_CHECK_VOLUME &volume, const FAT_CHECK_NODE &node, std::vector<FAT_CHECK_NODE> &children);
+    static void checkTree(FAT_CHECK_VOLUME &volume, uint32_t threadCount);
+    static uint64_t countLostClusters(FAT_CHECK_VOLUME &volume, uint32_t threadCount, uint32_t &freeCount);
+    static void problem(FAT_CHECK_VOLUME &volume, const std::string &message);
+};
+
+#endif // __FATCHECK_H
@@ -0,0 +1,24 @@
+#ifndef __GPTCHECK_H
+#define __GPTCHECK_H
+
+#include <stdint.h>
+#include <vector>
+#include "fs.h"
+#include "blockdevice.h"
+#include "check.h"
+
+/**
+ * @brief Check the protective MBR and both copies of the GPT
+ * @note Each header is checked on its own (signature, size, CRC32, location,
+ *       usable range and partition table CRC32), then the backup is checked
+ *       against the primary, and the partitions in use against each other
+ * @param  &device: the block device, in the sector size of its GPT
+ * @param  &report: the problems found
+ * @param  &partitions: the partitions in use, from the first valid copy
+ * @param  &partitionNumbers: the number of each partition in use, its
+ *         index in the table plus one
+ * @retval true if at least one copy of the GPT is usable, false otherwise
+ */
+bool checkPartitionTable(BlockDevice &device, CheckReport &report, std::vector<GPT_PARTITION_ENTRY> &partitions, std::vector<uint32_t> &partitionNumbers);
+
+#endif // __GPTCHECK_H
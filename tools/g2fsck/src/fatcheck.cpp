@@ -0,0 +1,675 @@
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <set>
+#include <sstream>
+#include <thread>
+#include "fatcheck.h"
+
+/**
+ * @brief Work out the checksum of a short name that its long name entries carry
+ * @param  *name: the 11 byte short name
+ * @retval The checksum
+ */
+static uint8_t getShortNameChecksum(const uint8_t *name)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+    {
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    }
+
+    return sum;
+}
+
+/**
+ * @brief Format a short name as NAME.EXT
+ * @param  *name: the 11 byte short name
+ * @retval The name
+ */
+static std::string formatShortName(const uint8_t *name)
+{
+    std::string base(reinterpret_cast<const char *>(name), 8), extension(reinterpret_cast<const char *>(name) + 8, 3);
+    base.erase(base.find_last_not_of(' ') + 1);
+    extension.erase(extension.find_last_not_of(' ') + 1);
+
+    // 0x05 stands in for a leading 0xE5, which marks deleted entries
+    if (!base.empty() && base[0] == 0x05)
+    {
+        base[0] = (char)0xE5;
+    }
+
+    return extension.empty() ? base : base + "." + extension;
+}
+
+void FATCheck::problem(FAT_CHECK_VOLUME &volume, const std::string &message)
+{
+    volume.report->problem(volume.name + ": " + message);
+}
+
+bool FATCheck::isFileSystem(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress)
+{
+    VOLUME_BOOT_RECORD vbr;
+    if (!readSectorBytes(device, partitionStartingLogicalBlockAddress, &vbr, sizeof(vbr)))
+    {
+        return false;
+    }
+
+    // a jump, a boot signature and a plausible BPB
+    return (vbr.BS_jmpBoot[0] == 0xEB || vbr.BS_jmpBoot[0] == 0xE9) && vbr.signature == 0xAA55 &&
+           vbr.BPB_BytsPerSec >= BLOCK_SIZE && vbr.BPB_BytsPerSec <= MAX_SECTOR_SIZE && vbr.BPB_SecPerClus != 0 && vbr.BPB_NumFATs != 0;
+}
+
+bool FATCheck::readBootSector(FAT_CHECK_VOLUME &volume, uint64_t totalSectors)
+{
+    BlockDevice &device = *volume.device;
+    VOLUME_BOOT_RECORD vbr;
+    if (!readSectorBytes(device, volume.partitionStartingLogicalBlockAddress, &vbr, sizeof(vbr)))
+    {
+        problem(volume, "boot sector cannot be read");
+        return false;
+    }
+
+    std::ostringstream message;
+    uint32_t volumeSectors = vbr.BPB_TotSec16 != 0 ? vbr.BPB_TotSec16 : vbr.BPB_TotSec32;
+    uint32_t fatSize = vbr.BPB_FATSz16 != 0 ? vbr.BPB_FATSz16 : vbr.BPB_FATSz32;
+    if (vbr.BPB_BytsPerSec != device.getSectorSize())
+    {
+        message << "boot sector has " << vbr.BPB_BytsPerSec << " byte sectors on a disk of " << device.getSectorSize() << " byte sectors";
+    }
+    else if (vbr.BPB_SecPerClus == 0 || (vbr.BPB_SecPerClus & (vbr.BPB_SecPerClus - 1)) != 0)
+    {
+        message << "boot sector has " << (uint32_t)vbr.BPB_SecPerClus << " sectors per cluster";
+    }
+    else if (vbr.BPB_RsvdSecCnt == 0 || vbr.BPB_NumFATs == 0 || fatSize == 0)
+    {
+        message << "boot sector has no reserved sectors, FATs or FAT sectors";
+    }
+    else if (volumeSectors == 0 || volumeSectors > totalSectors)
+    {
+        message << "boot sector has " << volumeSectors << " sectors in a partition of " << totalSectors;
+    }
+    if (!message.str().empty())
+    {
+        problem(volume, message.str());
+        return false;
+    }
+
+    volume.bytesPerSector = vbr.BPB_BytsPerSec;
+    volume.sectorsPerCluster = vbr.BPB_SecPerClus;
+    volume.reservedSectors = vbr.BPB_RsvdSecCnt;
+    volume.numberOfFATs = vbr.BPB_NumFATs;
+    volume.fatSize = fatSize;
+    volume.rootEntryCount = vbr.BPB_RootEntCnt;
+    volume.rootDirectorySectors = (vbr.BPB_RootEntCnt * sizeof(FAT32_DIRECTORY_ENTRY) + vbr.BPB_BytsPerSec - 1) / vbr.BPB_BytsPerSec;
+    volume.media = vbr.BPB_Media;
+
+    uint64_t firstDataSector = (uint64_t)volume.reservedSectors + (uint64_t)volume.numberOfFATs * volume.fatSize + volume.rootDirectorySectors;
+    if (firstDataSector >= volumeSectors)
+    {
+        problem(volume, "FATs and root directory fill the whole volume");
+        return false;
+    }
+    volume.firstDataSector = (uint32_t)firstDataSector;
+    volume.clusterCount = (volumeSectors - volume.firstDataSector) / volume.sectorsPerCluster;
+
+    // the cluster count alone decides the FAT type
+    volume.fatType = volume.clusterCount <= FAT12_MAX_CLUSTERS ? 12 : volume.clusterCount <= FAT16_MAX_CLUSTERS ? 16 : 32;
+    if ((volume.fatType == 32) != (vbr.BPB_FATSz16 == 0))
+    {
+        message << volume.clusterCount << " clusters make FAT" << (uint32_t)volume.fatType << ", but the boot sector has the other BPB layout";
+        problem(volume, message.str());
+        return false;
+    }
+
+    uint64_t fatBytes = (uint64_t)volume.fatSize * volume.bytesPerSector;
+    if (fatBytes * 8 / volume.fatType < (uint64_t)volume.clusterCount + FAT_FIRST_CLUSTER)
+    {
+        message << "FAT of " << volume.fatSize << " sectors cannot map " << volume.clusterCount << " clusters";
+        problem(volume, message.str());
+        return false;
+    }
+
+    if (volume.fatType != 32)
+    {
+        volume.rootCluster = 0;
+        return true;
+    }
+
+    volume.rootCluster = vbr.BPB_RootClus;
+    if (volume.rootCluster < FAT_FIRST_CLUSTER || volume.rootCluster >= volume.clusterCount + FAT_FIRST_CLUSTER)
+    {
+        message << "root directory cluster " << volume.rootCluster << " is outside the volume";
+        problem(volume, message.str());
+        return false;
+    }
+
+    // FAT32 keeps a backup boot sector that must match the primary one
+    std::vector<uint8_t> primary(volume.bytesPerSector), backup(volume.bytesPerSector);
+    if (vbr.BPB_BkBootSec != 0 &&
+        (!device.readSectors(volume.partitionStartingLogicalBlockAddress, primary.data(), 1) ||
+         !device.readSectors(volume.partitionStartingLogicalBlockAddress + vbr.BPB_BkBootSec, backup.data(), 1) || primary != backup))
+    {
+        problem(volume, "backup boot sector differs from the boot sector");
+    }
+
+    return true;
+}
+
+bool FATCheck::readFATs(FAT_CHECK_VOLUME &volume)
+{
+    BlockDevice &device = *volume.device;
+    uint64_t fatBytes = (uint64_t)volume.fatSize * volume.bytesPerSector;
+    uint64_t firstFAT = volume.partitionStartingLogicalBlockAddress + volume.reservedSectors;
+
+    volume.fat.resize(fatBytes);
+    if (!device.readSectors(firstFAT, volume.fat.data(), volume.fatSize))
+    {
+        problem(volume, "FAT 1 cannot be read");
+        return false;
+    }
+
+    // memcmp compares a vector at a time, finding the first difference is only
+    // needed once the copies are known to differ
+    std::vector<uint8_t> copy(fatBytes);
+    for (uint32_t i = 1; i < volume.numberOfFATs; i++)
+    {
+        std::ostringstream message;
+        if (!device.readSectors(firstFAT + (uint64_t)i * volume.fatSize, copy.data(), volume.fatSize))
+        {
+            message << "FAT " << i + 1 << " cannot be read";
+            problem(volume, message.str());
+        }
+        else if (memcmp(copy.data(), volume.fat.data(), fatBytes) != 0)
+        {
+            uint64_t offset = std::mismatch(copy.begin(), copy.end(), volume.fat.begin()).first - copy.begin();
+            message << "FAT " << i + 1 << " differs from FAT 1, first in sector " << offset / volume.bytesPerSector;
+            problem(volume, message.str());
+        }
+    }
+
+    if ((getEntry(volume, 0) & 0xFF) != volume.media)
+    {
+        problem(volume, "FAT entry 0 does not carry the media byte");
+    }
+
+    return true;
+}
+
+void FATCheck::checkFSInfo(FAT_CHECK_VOLUME &volume, uint32_t freeCount)
+{
+    FS_INFO fsInfo;
+    if (!readSectorBytes(*volume.device, volume.partitionStartingLogicalBlockAddress + FAT32_FSINFO_SECTOR, &fsInfo, sizeof(fsInfo)) ||
+        fsInfo.FSI_LeadSig != 0x41615252 || fsInfo.FSI_StrucSig != 0x61417272 || fsInfo.FSI_TrailSig != 0xAA550000)
+    {
+        problem(volume, "FSInfo sector has no signatures");
+        return;
+    }
+
+    std::ostringstream message;
+    if (fsInfo.FSI_FreeCount != FAT_FSINFO_UNKNOWN && fsInfo.FSI_FreeCount != freeCount)
+    {
+        message << "FSInfo counts " << fsInfo.FSI_FreeCount << " free clusters, the FAT has " << freeCount;
+        problem(volume, message.str());
+    }
+    else if (fsInfo.FSI_NxtFree != FAT_FSINFO_UNKNOWN && fsInfo.FSI_NxtFree >= volume.clusterCount + FAT_FIRST_CLUSTER)
+    {
+        message << "FSInfo next free cluster " << fsInfo.FSI_NxtFree << " is outside the volume";
+        problem(volume, message.str());
+    }
+}
+
+uint32_t FATCheck::getEntry(const FAT_CHECK_VOLUME &volume, uint32_t cluster)
+{
+    const uint8_t *fat = volume.fat.data();
+    switch (volume.fatType)
+    {
+    case 12:
+    {
+        uint32_t offset = cluster + cluster / 2;
+        uint32_t value = fat[offset] | (fat[offset + 1] << 8);
+        return cluster & 1 ? value >> 4 : value & 0x0FFF;
+    }
+    case 16:
+        return fat[cluster * 2] | (fat[cluster * 2 + 1] << 8);
+    default:
+    {
+        uint32_t value;
+        memcpy(&value, fat + (uint64_t)cluster * 4, sizeof(value));
+        return value & FAT32_CLUSTER_MASK;
+    }
+    }
+}
+
+uint32_t FATCheck::getEndOfChain(const FAT_CHECK_VOLUME &volume)
+{
+    // any value from here up ends a chain
+    return volume.fatType == 12 ? 0x0FF8 : volume.fatType == 16 ? 0xFFF8 : 0x0FFFFFF8;
+}
+
+uint32_t FATCheck::getBadCluster(const FAT_CHECK_VOLUME &volume)
+{
+    return volume.fatType == 12 ? FAT12_BAD_CLUSTER : volume.fatType == 16 ? FAT16_BAD_CLUSTER : FAT32_BAD_CLUSTER;
+}
+
+bool FATCheck::mark(FAT_CHECK_VOLUME &volume, uint32_t cluster)
+{
+    // true if this call set the bit, so exactly one chain claims a cluster
+    uint64_t bit = 1ULL << (cluster % 64);
+    return (volume.visited[cluster / 64].fetch_or(bit, std::memory_order_relaxed) & bit) == 0;
+}
+
+bool FATCheck::isMarked(const FAT_CHECK_VOLUME &volume, uint32_t cluster)
+{
+    return (volume.visited[cluster / 64].load(std::memory_order_relaxed) >> (cluster % 64)) & 1;
+}
+
+void FATCheck::walkChain(FAT_CHECK_VOLUME &volume, const FAT_CHECK_NODE &node, std::vector<uint32_t> &clusters)
+{
+    uint32_t endOfChain = getEndOfChain(volume), badCluster = getBadCluster(volume);
+    uint32_t lastCluster = volume.clusterCount + FAT_FIRST_CLUSTER - 1;
+
+    for (uint32_t cluster = node.firstCluster;;)
+    {
+        std::ostringstream message;
+        if (cluster < FAT_FIRST_CLUSTER || cluster > lastCluster)
+        {
+            message << node.path << ": chain points at cluster " << cluster << ", outside the volume";
+            problem(volume, message.str());
+            return;
+        }
+
+        // a cluster claimed before is either earlier in this chain or owned by another file
+        if (!mark(volume, cluster))
+        {
+            bool loop = std::find(clusters.begin(), clusters.end(), cluster) != clusters.end();
+            message << node.path << ": " << (loop ? "chain loops back to cluster " : "chain is cross-linked at cluster ") << cluster;
+            problem(volume, message.str());
+            return;
+        }
+        clusters.push_back(cluster);
+
+        uint32_t next = getEntry(volume, cluster);
+        if (next >= endOfChain)
+        {
+            return;
+        }
+        if (next == 0 || next == badCluster)
+        {
+            message << node.path << ": chain reaches cluster " << cluster << ", which the FAT marks " << (next == 0 ? "free" : "bad");
+            problem(volume, message.str());
+            return;
+        }
+
+        cluster = next;
+    }
+}
+
+bool FATCheck::readDirectory(FAT_CHECK_VOLUME &volume, const FAT_CHECK_NODE &node, const std::vector<uint32_t> &clusters, std::vector<uint8_t> &entries)
+{
+    std::lock_guard<std::mutex> lock(volume.deviceMutex);
+    BlockDevice &device = *volume.device;
+
+    // the FAT12/16 root directory is a fixed region before the clusters
+    if (node.isRoot && volume.fatType != 32)
+    {
+        entries.resize((uint64_t)volume.rootDirectorySectors * volume.bytesPerSector);
+        uint64_t root = volume.partitionStartingLogicalBlockAddress + volume.reservedSectors + (uint64_t)volume.numberOfFATs * volume.fatSize;
+        return device.readSectors(root, entries.data(), volume.rootDirectorySectors);
+    }
+
+    uint64_t clusterSize = (uint64_t)volume.sectorsPerCluster * volume.bytesPerSector;
+    entries.resize(clusters.size() * clusterSize);
+    for (size_t i = 0; i < clusters.size();)
+    {
+        // read runs of consecutive clusters at once
+        size_t run = 1;
+        while (i + run < clusters.size() && clusters[i + run] == clusters[i] + run)
+        {
+            run++;
+        }
+
+        uint64_t sector = volume.partitionStartingLogicalBlockAddress + volume.firstDataSector + (uint64_t)(clusters[i] - FAT_FIRST_CLUSTER) * volume.sectorsPerCluster;
+        if (!device.readSectors(sector, entries.data() + i * clusterSize, run * volume.sectorsPerCluster))
+        {
+            return false;
+        }
+
+        i += run;
+    }
+
+    return true;
+}
+
+void FATCheck::checkDirectory(FAT_CHECK_VOLUME &volume, const FAT_CHECK_NODE &node, const std::vector<uint8_t> &entries, std::vector<FAT_CHECK_NODE> &children)
+{
+    std::set<std::string> names;
+    uint32_t longNameRemaining = 0;
+    uint8_t longNameChecksum = 0;
+    bool inLongName = false;
+    size_t index = 0;
+
+    for (; index < entries.size() / sizeof(FAT32_DIRECTORY_ENTRY); index++)
+    {
+        FAT32_DIRECTORY_ENTRY entry;
+        memcpy(&entry, entries.data() + index * sizeof(entry), sizeof(entry));
+        std::ostringstream message;
+
+        // a zero name ends the directory, 0xE5 is a deleted entry
+        if (entry.DIR_Name[0] == 0x00)
+        {
+            break;
+        }
+        if (entry.DIR_Name[0] == 0xE5)
+        {
+            inLongName = false;
+            continue;
+        }
+
+        // long name entries come last part first and carry the checksum of their short name
+        if ((entry.DIR_Attr & 0x3F) == ATTR_LONG_NAME)
+        {
+            uint8_t order = entry.DIR_Name[0], checksum = entries[index * sizeof(entry) + 13];
+            if (order & 0x40)
+            {
+                if (inLongName)
+                {
+                    message << node.path << ": long name entry " << index << " interrupts another long name";
+                    problem(volume, message.str());
+                }
+                inLongName = true;
+                longNameRemaining = order & 0x1F;
+                longNameChecksum = checksum;
+            }
+            else if (!inLongName || order != longNameRemaining || checksum != longNameChecksum)
+            {
+                message << node.path << ": long name entry " << index << " is out of sequence";
+                problem(volume, message.str());
+                inLongName = false;
+                continue;
+            }
+
+            longNameRemaining--;
+            continue;
+        }
+
+        std::string name = formatShortName(entry.DIR_Name);
+        if (inLongName && (longNameRemaining != 0 || getShortNameChecksum(entry.DIR_Name) != longNameChecksum))
+        {
+            message << node.path << ": long name of " << name << " does not belong to it";
+            problem(volume, message.str());
+            message.str("");
+        }
+        inLongName = false;
+
+        if (entry.DIR_Attr & ATTR_VOLUME_ID)
+        {
+            if (!node.isRoot)
+            {
+                message << node.path << ": volume label outside the root directory";
+                problem(volume, message.str());
+            }
+            continue;
+        }
+
+        uint32_t firstCluster = (volume.fatType == 32 ? (uint32_t)entry.DIR_FstClusHI << 16 : 0) | entry.DIR_FstClusLO;
+
+        // '.' and '..' open every directory but the root
+        if (name == "." || name == "..")
+        {
+            uint32_t expected = name == "." ? node.firstCluster : node.parentCluster;
+            bool rootParent = name == ".." && node.parentCluster == 0 && firstCluster == volume.rootCluster;
+            if (node.isRoot || index != (name == "." ? 0u : 1u) || !(entry.DIR_Attr & ATTR_DIRECTORY) || (firstCluster != expected && !rootParent))
+            {
+                message << node.path << ": misplaced or wrong '" << name << "' entry";
+                problem(volume, message.str());
+            }
+            continue;
+        }
+
+        if (!names.insert(name).second)
+        {
+            message << node.path << ": " << name << " appears twice";
+            problem(volume, message.str());
+            continue;
+        }
+
+        FAT_CHECK_NODE child;
+        child.path = node.isRoot ? "/" + name : node.path + "/" + name;
+        child.firstCluster = firstCluster;
+        child.parentCluster = node.isRoot ? 0 : node.firstCluster;
+        child.size = entry.DIR_FileSize;
+        child.isDirectory = (entry.DIR_Attr & ATTR_DIRECTORY) != 0;
+        child.isRoot = false;
+        children.push_back(child);
+    }
+
+    if (inLongName)
+    {
+        problem(volume, node.path + ": long name without its short name entry");
+    }
+
+    // '.' and '..' are the first two entries of a subdirectory
+    if (!node.isRoot)
+    {
+        FAT32_DIRECTORY_ENTRY dot[2] = {};
+        memcpy(dot, entries.data(), std::min(entries.size(), sizeof(dot)));
+        if (formatShortName(dot[0].DIR_Name) != "." || formatShortName(dot[1].DIR_Name) != "..")
+        {
+            problem(volume, node.path + ": directory does not start with '.' and '..'");
+        }
+    }
+}
+
+void FATCheck::checkNode(FAT_CHECK_VOLUME &volume, const FAT_CHECK_NODE &node, std::vector<FAT_CHECK_NODE> &children)
+{
+    uint64_t clusterSize = (uint64_t)volume.sectorsPerCluster * volume.bytesPerSector;
+    std::vector<uint32_t> clusters;
+    std::ostringstream message;
+
+    if (!node.isDirectory)
+    {
+        volume.fileCount++;
+
+        // an empty file has no clusters, any other has exactly enough for its size
+        if (node.firstCluster == 0)
+        {
+            if (node.size != 0)
+            {
+                message << node.path << ": " << node.size << " bytes but no clusters";
+                problem(volume, message.str());
+            }
+            return;
+        }
+
+        walkChain(volume, node, clusters);
+        uint64_t expected = (node.size + clusterSize - 1) / clusterSize;
+        if (clusters.size() != expected)
+        {
+            message << node.path << ": " << node.size << " bytes need " << expected << " clusters, the chain has " << clusters.size();
+            problem(volume, message.str());
+        }
+        return;
+    }
+
+    volume.directoryCount++;
+    if (!(node.isRoot && volume.fatType != 32))
+    {
+        if (node.firstCluster == 0)
+        {
+            problem(volume, node.path + ": directory has no clusters");
+            return;
+        }
+
+        walkChain(volume, node, clusters);
+        if (clusters.empty())
+        {
+            return;
+        }
+    }
+
+    std::vector<uint8_t> entries;
+    if (!readDirectory(volume, node, clusters, entries))
+    {
+        problem(volume, node.path + ": directory cannot be read");
+        return;
+    }
+
+    checkDirectory(volume, node, entries, children);
+}
+
+void FATCheck::checkTree(FAT_CHECK_VOLUME &volume, uint32_t threadCount)
+{
+    // directories hand their children to whichever thread is free
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<FAT_CHECK_NODE> queue;
+    uint32_t busy = 0;
+
+    FAT_CHECK_NODE root;
+    root.path = "/";
+    root.firstCluster = volume.rootCluster;
+    root.parentCluster = 0;
+    root.size = 0;
+    root.isDirectory = true;
+    root.isRoot = true;
+    queue.push_back(root);
+
+    auto checkNodes = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            ready.wait(lock, [&]() { return !queue.empty() || busy == 0; });
+            if (queue.empty())
+            {
+                return;
+            }
+
+            FAT_CHECK_NODE node = std::move(queue.back());
+            queue.pop_back();
+            busy++;
+            lock.unlock();
+
+            std::vector<FAT_CHECK_NODE> children;
+            checkNode(volume, node, children);
+
+            lock.lock();
+            queue.insert(queue.end(), std::make_move_iterator(children.begin()), std::make_move_iterator(children.end()));
+            busy--;
+            ready.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < threadCount; i++)
+    {
+        workers.emplace_back(checkNodes);
+    }
+    checkNodes();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+uint64_t FATCheck::countLostClusters(FAT_CHECK_VOLUME &volume, uint32_t threadCount, uint32_t &freeCount)
+{
+    // each thread scans a shard of the FAT
+    uint32_t firstCluster = FAT_FIRST_CLUSTER, endCluster = volume.clusterCount + FAT_FIRST_CLUSTER;
+    uint32_t shardSize = (volume.clusterCount + threadCount - 1) / threadCount;
+    uint32_t badCluster = getBadCluster(volume);
+    std::vector<uint64_t> lostCounts(threadCount, 0);
+    std::vector<uint32_t> freeCounts(threadCount, 0);
+    std::vector<std::vector<uint32_t>> lostClusters(threadCount);
+
+    auto scanShard = [&](uint32_t shard) {
+        uint32_t first = firstCluster + shard * shardSize;
+        uint32_t end = std::min(endCluster, first + shardSize);
+        for (uint32_t cluster = first; cluster < end && cluster >= first; cluster++)
+        {
+            uint32_t entry = getEntry(volume, cluster);
+            if (entry == 0)
+            {
+                freeCounts[shard]++;
+            }
+            else if (entry != badCluster && !isMarked(volume, cluster))
+            {
+                if (lostClusters[shard].size() < FAT_CHECK_LISTED_CLUSTERS)
+                {
+                    lostClusters[shard].push_back(cluster);
+                }
+                lostCounts[shard]++;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < threadCount; i++)
+    {
+        workers.emplace_back(scanShard, i);
+    }
+    scanShard(0);
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    uint64_t lostCount = 0;
+    std::ostringstream listed;
+    freeCount = 0;
+    for (uint32_t i = 0; i < threadCount; i++)
+    {
+        lostCount += lostCounts[i];
+        freeCount += freeCounts[i];
+        for (uint32_t cluster : lostClusters[i])
+        {
+            listed << " " << cluster;
+        }
+    }
+
+    if (lostCount != 0)
+    {
+        std::ostringstream message;
+        message << lostCount << " lost clusters, in use but in no chain:" << listed.str() << (lostCount > FAT_CHECK_LISTED_CLUSTERS ? " ..." : "");
+        problem(volume, message.str());
+    }
+
+    return lostCount;
+}
+
+void FATCheck::check(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, uint32_t threadCount, const std::string &name, CheckReport &report)
+{
+    FAT_CHECK_VOLUME volume;
+    volume.device = &device;
+    volume.report = &report;
+    volume.name = name;
+    volume.partitionStartingLogicalBlockAddress = partitionStartingLogicalBlockAddress;
+    volume.fileCount = 0;
+    volume.directoryCount = 0;
+
+    if (!readBootSector(volume, totalSectors) || !readFATs(volume))
+    {
+        return;
+    }
+
+    uint64_t visitedWords = ((uint64_t)volume.clusterCount + FAT_FIRST_CLUSTER + 63) / 64;
+    volume.visited.reset(new std::atomic<uint64_t>[visitedWords]);
+    for (uint64_t i = 0; i < visitedWords; i++)
+    {
+        volume.visited[i].store(0, std::memory_order_relaxed);
+    }
+
+    threadCount = std::max(1u, std::min(threadCount, volume.clusterCount));
+    checkTree(volume, threadCount);
+
+    uint32_t freeCount = 0;
+    uint64_t lostCount = countLostClusters(volume, threadCount, freeCount);
+    if (volume.fatType == 32)
+    {
+        checkFSInfo(volume, freeCount);
+    }
+
+    std::cout << name << ": FAT" << (uint32_t)volume.fatType << ", " << volume.clusterCount << " clusters, " << freeCount << " free, "
+              << volume.fileCount << " files, " << volume.directoryCount << " directories, " << lostCount << " lost clusters" << std::endl;
+}
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <cstring>
+#include <thread>
+#include "fs.h"
+#include "gpt.h"
+#include "blockdevice.h"
+#include "cli.h"
+#include "check.h"
+#include "gptcheck.h"
+#include "fatcheck.h"
+
+void printUsage()
+{
+    std::cout << "Usage: g2fsck [options] target" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -p\t\t\tCheck only this partition number (i.e. 1, 2, etc.)" << std::endl;
+    std::cout << "  -b\t\t\tI/O backend (i.e. file, mmap, uring, direct)" << std::endl;
+    std::cout << "  -q\t\t\tRequests in flight with the uring backend (default " << BLOCK_DEVICE_URING_QUEUE_DEPTH << ")" << std::endl;
+    std::cout << "  -j\t\t\tThreads walking the cluster chains of a vfat partition (default: one per CPU)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    // iterate thru args
+    std::string diskImageName;
+    uint32_t partitionNumber = 0;
+    BLOCK_DEVICE_TYPE backend = BLOCK_DEVICE_FILE;
+    uint32_t queueDepth = BLOCK_DEVICE_URING_QUEUE_DEPTH;
+    uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, partitionNumber))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, threadCount))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, queueDepth))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            if (!parseBlockDeviceType(argv[++i], backend))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            diskImageName = argv[i];
+        }
+    }
+
+    std::unique_ptr<BlockDevice> device = openBlockDevice(backend, diskImageName.c_str(), queueDepth);
+    if (!device)
+    {
+        std::cout << "Error: \"" << diskImageName << "\" does not exist" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // address the image in the sector size it was partitioned with
+    if (!detectSectorSize(*device))
+    {
+        return EXIT_FAILURE;
+    }
+
+    CheckReport report;
+    std::vector<GPT_PARTITION_ENTRY> partitions;
+    std::vector<uint32_t> partitionNumbers;
+    if (!checkPartitionTable(*device, report, partitions, partitionNumbers))
+    {
+        std::cout << diskImageName << ": no usable GPT" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    bool found = partitionNumber == 0;
+    for (size_t i = 0; i < partitions.size(); i++)
+    {
+        if (partitionNumber != 0 && partitionNumbers[i] != partitionNumber)
+        {
+            continue;
+        }
+        found = true;
+
+        // only FAT volumes are checked past the partition table
+        std::string name = "partition " + std::to_string(partitionNumbers[i]);
+        uint64_t totalSectors = partitions[i].lastLogicalBlockAddress - partitions[i].firstLogicalBlockAddress + 1;
+        if (!FATCheck::isFileSystem(*device, partitions[i].firstLogicalBlockAddress))
+        {
+            std::cout << name << ": not vfat, skipped" << std::endl;
+            continue;
+        }
+
+        FATCheck::check(*device, partitions[i].firstLogicalBlockAddress, totalSectors, threadCount, name, report);
+    }
+
+    if (!found)
+    {
+        std::cout << "Error: partition " << partitionNumber << " is not in use" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << diskImageName << ": " << report.getProblemCount() << " problems" << std::endl;
+    return report.getProblemCount() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
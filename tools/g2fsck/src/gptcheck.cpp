@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include "crc32.h"
+#include "gpt.h"
+#include "gptcheck.h"
+
+// a GPT header with the partition table it points to
+typedef struct _GPT_COPY
+{
+    GPT_HEADER header;
+    std::vector<uint8_t> table;
+    bool valid;
+} GPT_COPY;
+
+/**
+ * @brief Read and check one copy of the GPT on its own
+ * @param  &device: the block device
+ * @param  logicalBlockAddress: where the header should be
+ * @param  *name: "primary" or "backup", for the report
+ * @param  &report: the problems found
+ * @param  &copy: the header and its partition table
+ * @retval None
+ */
+static void readCopy(BlockDevice &device, uint64_t logicalBlockAddress, const char *name, CheckReport &report, GPT_COPY &copy)
+{
+    uint32_t sectorSize = device.getSectorSize();
+    uint64_t sectorCount = device.getSectorCount();
+    std::ostringstream message;
+    copy.valid = false;
+
+    // the CRC32 may cover more than the structure on large sectors
+    std::vector<uint8_t> sector(sectorSize);
+    if (logicalBlockAddress >= sectorCount || !device.readSectors(logicalBlockAddress, sector.data(), 1))
+    {
+        message << name << " GPT header at block " << logicalBlockAddress << " cannot be read";
+        report.problem(message.str());
+        return;
+    }
+    memcpy(&copy.header, sector.data(), sizeof(copy.header));
+    memset(sector.data() + offsetof(GPT_HEADER, crc32), 0, sizeof(copy.header.crc32));
+
+    const GPT_HEADER &header = copy.header;
+    if (header.signature != GPT_SIGNATURE)
+    {
+        message << name << " GPT header at block " << logicalBlockAddress << " has no signature";
+    }
+    else if (header.headerSize < GPT_HEADER_SIZE || header.headerSize > sectorSize)
+    {
+        message << name << " GPT header size " << header.headerSize << " is invalid";
+    }
+    else if (crc32(sector.data(), header.headerSize) != header.crc32)
+    {
+        message << name << " GPT header CRC32 does not match";
+    }
+    else if (header.headerLogicalBlockAddress != logicalBlockAddress)
+    {
+        message << name << " GPT header at block " << logicalBlockAddress << " claims block " << header.headerLogicalBlockAddress;
+    }
+    else if (header.partitionEntrySize < sizeof(GPT_PARTITION_ENTRY) || header.partitionEntrySize % sizeof(GPT_PARTITION_ENTRY) != 0 ||
+             header.numberOfPartitionEntries == 0 || (uint64_t)header.numberOfPartitionEntries * header.partitionEntrySize > 1024 * 1024)
+    {
+        message << name << " GPT has " << header.numberOfPartitionEntries << " entries of " << header.partitionEntrySize << " bytes";
+    }
+    else if (header.firstUsableLogicalBlockAddress > header.lastUsableLogicalBlockAddress || header.lastUsableLogicalBlockAddress >= sectorCount)
+    {
+        message << name << " GPT usable blocks " << header.firstUsableLogicalBlockAddress << "-" << header.lastUsableLogicalBlockAddress
+                << " do not fit a disk of " << sectorCount << " blocks";
+    }
+    if (!message.str().empty())
+    {
+        report.problem(message.str());
+        return;
+    }
+
+    // the table must sit outside the usable blocks and inside the disk
+    uint64_t tableBytes = (uint64_t)header.numberOfPartitionEntries * header.partitionEntrySize;
+    uint64_t tableSectors = (tableBytes + sectorSize - 1) / sectorSize;
+    uint64_t tableEnd = header.partitionTableLogicalBlockAddress + tableSectors;
+    if (header.partitionTableLogicalBlockAddress < 2 || tableEnd > sectorCount ||
+        (header.partitionTableLogicalBlockAddress <= header.lastUsableLogicalBlockAddress && tableEnd > header.firstUsableLogicalBlockAddress))
+    {
+        message << name << " GPT partition table at block " << header.partitionTableLogicalBlockAddress << " overlaps the usable blocks or the end of the disk";
+        report.problem(message.str());
+        return;
+    }
+
+    copy.table.resize(tableSectors * sectorSize);
+    if (!device.readSectors(header.partitionTableLogicalBlockAddress, copy.table.data(), tableSectors))
+    {
+        message << name << " GPT partition table cannot be read";
+        report.problem(message.str());
+        return;
+    }
+    copy.table.resize(tableBytes);
+
+    if (crc32(copy.table.data(), copy.table.size()) != header.partitionTableCrc32)
+    {
+        message << name << " GPT partition table CRC32 does not match";
+        report.problem(message.str());
+        return;
+    }
+
+    copy.valid = true;
+}
+
+/**
+ * @brief Check the backup GPT against the primary one
+ * @param  &primary: the primary copy
+ * @param  &backup: the backup copy
+ * @param  &report: the problems found
+ * @retval None
+ */
+static void compareCopies(const GPT_COPY &primary, const GPT_COPY &backup, CheckReport &report)
+{
+    const GPT_HEADER &first = primary.header, &second = backup.header;
+    if (second.alternateLogicalBlockAddress != first.headerLogicalBlockAddress)
+    {
+        report.problem("backup GPT header does not point back at the primary one");
+    }
+    if (memcmp(&first.diskIdentifier, &second.diskIdentifier, sizeof(GUID)) != 0)
+    {
+        report.problem("GPT copies have different disk GUIDs");
+    }
+    if (first.firstUsableLogicalBlockAddress != second.firstUsableLogicalBlockAddress || first.lastUsableLogicalBlockAddress != second.lastUsableLogicalBlockAddress)
+    {
+        report.problem("GPT copies have different usable blocks");
+    }
+    if (primary.table != backup.table)
+    {
+        report.problem("GPT copies have different partition tables");
+    }
+}
+
+/**
+ * @brief Check the partitions in use against the usable blocks and each other
+ * @param  &copy: the GPT copy
+ * @param  &report: the problems found
+ * @param  &partitions: the partitions in use
+ * @param  &partitionNumbers: the number of each partition in use
+ * @retval None
+ */
+static void checkEntries(const GPT_COPY &copy, CheckReport &report, std::vector<GPT_PARTITION_ENTRY> &partitions, std::vector<uint32_t> &partitionNumbers)
+{
+    static const GUID unused = {};
+    for (uint32_t i = 0; i < copy.header.numberOfPartitionEntries; i++)
+    {
+        GPT_PARTITION_ENTRY entry;
+        memcpy(&entry, copy.table.data() + (uint64_t)i * copy.header.partitionEntrySize, sizeof(entry));
+        if (memcmp(&entry.partitionType, &unused, sizeof(unused)) == 0)
+        {
+            continue;
+        }
+
+        std::ostringstream message;
+        if (entry.firstLogicalBlockAddress > entry.lastLogicalBlockAddress ||
+            entry.firstLogicalBlockAddress < copy.header.firstUsableLogicalBlockAddress || entry.lastLogicalBlockAddress > copy.header.lastUsableLogicalBlockAddress)
+        {
+            message << "partition " << i + 1 << " blocks " << entry.firstLogicalBlockAddress << "-" << entry.lastLogicalBlockAddress << " are outside the usable blocks";
+            report.problem(message.str());
+            continue;
+        }
+
+        partitions.push_back(entry);
+        partitionNumbers.push_back(i + 1);
+    }
+
+    // sorted by first block, any overlap shows up between neighbours
+    std::vector<size_t> order(partitions.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return partitions[a].firstLogicalBlockAddress < partitions[b].firstLogicalBlockAddress;
+    });
+
+    for (size_t i = 1; i < order.size(); i++)
+    {
+        const GPT_PARTITION_ENTRY &previous = partitions[order[i - 1]], &current = partitions[order[i]];
+        if (current.firstLogicalBlockAddress <= previous.lastLogicalBlockAddress)
+        {
+            std::ostringstream message;
+            message << "partitions " << partitionNumbers[order[i - 1]] << " and " << partitionNumbers[order[i]] << " overlap";
+            report.problem(message.str());
+        }
+
+        for (size_t j = 0; j < i; j++)
+        {
+            if (memcmp(&partitions[order[j]].uniqueIdentifier, &current.uniqueIdentifier, sizeof(GUID)) == 0)
+            {
+                std::ostringstream message;
+                message << "partitions " << partitionNumbers[order[j]] << " and " << partitionNumbers[order[i]] << " share a GUID";
+                report.problem(message.str());
+            }
+        }
+    }
+}
+
+bool checkPartitionTable(BlockDevice &device, CheckReport &report, std::vector<GPT_PARTITION_ENTRY> &partitions, std::vector<uint32_t> &partitionNumbers)
+{
+    partitions.clear();
+    partitionNumbers.clear();
+
+    MBR pmbr;
+    if (!readSectorBytes(device, 0, &pmbr, sizeof(pmbr)) || pmbr.signature != MBR_SIGNATURE)
+    {
+        report.problem("protective MBR has no signature");
+    }
+    else if (pmbr.partitions[0].type != OSTYPE_PMBR || pmbr.partitions[0].firstLogicalBlockAddress != 1)
+    {
+        report.problem("protective MBR does not cover the disk from block 1");
+    }
+
+    GPT_COPY primary, backup;
+    readCopy(device, 1, "primary", report, primary);
+
+    // the backup closes the disk; trust the primary header for where that is
+    uint64_t lastLogicalBlockAddress = device.getSectorCount() - 1;
+    if (primary.valid && primary.header.alternateLogicalBlockAddress != lastLogicalBlockAddress)
+    {
+        std::ostringstream message;
+        message << "primary GPT header puts the backup at block " << primary.header.alternateLogicalBlockAddress << ", not at the last block " << lastLogicalBlockAddress;
+        report.problem(message.str());
+        lastLogicalBlockAddress = primary.header.alternateLogicalBlockAddress;
+    }
+    readCopy(device, lastLogicalBlockAddress, "backup", report, backup);
+
+    if (primary.valid && backup.valid)
+    {
+        compareCopies(primary, backup, report);
+    }
+
+    if (!primary.valid && !backup.valid)
+    {
+        return false;
+    }
+
+    checkEntries(primary.valid ? primary : backup, report, partitions, partitionNumbers);
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#define BATCH_MAX_OUTSTANDING_BYTES (1024ULL * 1024 * 1024) // image bytes written but not yet flushed
+
+// an image of a batch manifest
+typedef struct _BATCH_IMAGE
+{
+    std::string imageFileName;
+    std::string layoutFileName;
+} BATCH_IMAGE;
+
+/**
+ * @brief Read a batch manifest
+ * @note One image per line, the image file name followed by its layout
+ *       file name, separated by blanks; blank lines and lines starting
+ *       with '#' are skipped. Relative names are relative to the manifest
+ * @param  *path: the manifest file name
+ * @param  &images: the images, in manifest order
+ * @retval true if successful, false otherwise
+ */
+bool readBatch(const char *path, std::vector<BATCH_IMAGE> &images);
+
+// a limit on the bytes in flight across threads; a request larger than the
+// whole limit is let through once nothing else is outstanding
+class ByteBudget
+{
+public:
+    explicit ByteBudget(uint64_t limit) : limit(limit) {}
+
+    void acquire(uint64_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [&]() { return outstanding == 0 || outstanding + bytes <= limit; });
+        outstanding += bytes;
+    }
+
+    void release(uint64_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        outstanding -= bytes;
+        available.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable available;
+    uint64_t limit;
+    uint64_t outstanding = 0;
+};
+
+#endif // __BATCH_H
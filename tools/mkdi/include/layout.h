@@ -0,0 +1,69 @@
+#ifndef __LAYOUT_H
+#define __LAYOUT_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "fs.h"
+
+#define LAYOUT_MAX_NAME_LENGTH 35 // GPT names are 36 UTF-16 code units with a terminator
+
+// a partition of the disk layout, in the order it appears on disk
+typedef struct _LAYOUT_PARTITION
+{
+    std::string name;
+    GUID type;
+    uint64_t sizeInBytes; // 0 fills the rest of the disk
+    std::string fileSystem; // vfat, ext4, g2fs, or empty to leave it unformatted
+    uint8_t fatSize; // 0 picks it from the partition size
+    uint32_t groupCount;
+    std::string sourceDirectory; // empty for an empty file system
+    uint64_t firstLogicalBlockAddress;
+    uint64_t lastLogicalBlockAddress; // inclusive
+} LAYOUT_PARTITION;
+
+// a whole disk image described by a layout file
+typedef struct _LAYOUT
+{
+    uint64_t imageSizeInBytes; // 0 fits the image to its partitions
+    std::vector<LAYOUT_PARTITION> partitions;
+} LAYOUT;
+
+/**
+ * @brief Parse a size, either a number of bytes or a string with a K, M, G or T suffix
+ * @param  &value: the value as written in the layout file, quotes removed
+ * @param  &bytes: the size in bytes
+ * @retval true if successful, false otherwise
+ */
+bool parseSize(const std::string &value, uint64_t &bytes);
+
+/**
+ * @brief Read a layout file
+ * @note The file is a TOML subset: an optional [image] table with a size
+ *       and one [[partition]] table per partition with name, type (esp,
+ *       data, linux), size, filesystem (vfat, ext4, g2fs, none), fat
+ *       (12, 16, 32), groups (1 or more) and source. Sizes are bytes or strings with a K, M, G or T
+ *       suffix, sources are relative to the layout file.
+ * @param  *path: the layout file name
+ * @param  &layout: the layout
+ * @retval true if successful, false otherwise
+ */
+bool readLayout(const char *path, LAYOUT &layout);
+
+/**
+ * @brief Place the partitions of a layout on 1 MiB boundaries
+ * @param  &layout: the layout, partition bounds are filled in
+ * @param  sectorSize: the logical sector size of the image
+ * @param  &sizeInLogicalBlocks: the size of the image in blocks
+ * @retval true if the partitions fit the image, false otherwise
+ */
+bool placePartitions(LAYOUT &layout, uint32_t sectorSize, uint64_t &sizeInLogicalBlocks);
+
+/**
+ * @brief Build the GPT partition entries of a placed layout
+ * @param  &layout: the layout
+ * @retval The partition entries
+ */
+std::vector<GPT_PARTITION_ENTRY> getPartitionEntries(const LAYOUT &layout);
+
+#endif // __LAYOUT_H
@@ -0,0 +1,38 @@
+#ifndef __TEMPLATE_H
+#define __TEMPLATE_H
+
+#include <stdint.h>
+#include <string>
+#include "layout.h"
+
+#define TEMPLATE_FORMAT_VERSION 1 // bump whenever the same layout and sources would make a different image
+#define TEMPLATE_COPY_BUFFER_SIZE (8 * 1024 * 1024)
+
+/**
+ * @brief Work out the cache key of the image a layout builds
+ * @note The key covers the template format version, the layout file, the image
+ *       options, and the names, sizes and modification times of everything
+ *       in the source directories, so a changed input never hits a stale
+ *       template
+ * @param  *layoutFileName: the layout file name
+ * @param  &layout: the layout read from it
+ * @param  sectorSize: the logical sector size of the image
+ * @param  sparse: true if unwritten regions are left as holes
+ * @param  &key: the key, 16 hexadecimal digits
+ * @retval true if successful, false otherwise
+ */
+bool getTemplateKey(const char *layoutFileName, const LAYOUT &layout, uint32_t sectorSize, bool sparse, std::string &key);
+
+/**
+ * @brief Clone an image file
+ * @note The clone shares the extents of the source through FICLONE where the
+ *       file system supports reflinks. Otherwise only the data extents are
+ *       copied, with copy_file_range and then read/write, and holes are kept
+ * @param  *sourceFileName: the image to clone
+ * @param  *destinationFileName: the new image, replaced if it exists
+ * @param  &reflinked: true if the clone shares the extents of the source
+ * @retval true if successful, false otherwise
+ */
+bool cloneImage(const char *sourceFileName, const char *destinationFileName, bool &reflinked);
+
+#endif // __TEMPLATE_H
@@ -0,0 +1,57 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "batch.h"
+
+bool readBatch(const char *path, std::vector<BATCH_IMAGE> &images)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Error: could not open batch manifest " << path << std::endl;
+        return false;
+    }
+
+    // names are relative to the directory holding the manifest
+    std::string batchDirectory = path;
+    size_t slash = batchDirectory.rfind('/');
+    batchDirectory = slash == std::string::npos ? "" : batchDirectory.substr(0, slash + 1);
+
+    images.clear();
+
+    std::string line;
+    for (uint32_t lineNumber = 1; std::getline(file, line); lineNumber++)
+    {
+        std::istringstream fields(line);
+        BATCH_IMAGE image;
+        std::string extra;
+        if (!(fields >> image.imageFileName) || image.imageFileName[0] == '#')
+        {
+            continue;
+        }
+
+        if (!(fields >> image.layoutFileName) || (fields >> extra))
+        {
+            std::cerr << "Error: " << path << ":" << lineNumber << ": expected an image and a layout, got \"" << line << "\"" << std::endl;
+            return false;
+        }
+
+        for (std::string *name : { &image.imageFileName, &image.layoutFileName })
+        {
+            if ((*name)[0] != '/')
+            {
+                *name = batchDirectory + *name;
+            }
+        }
+
+        images.push_back(image);
+    }
+
+    if (images.empty())
+    {
+        std::cerr << "Error: " << path << " lists no images" << std::endl;
+        return false;
+    }
+
+    return true;
+}
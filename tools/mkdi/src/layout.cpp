@@ -0,0 +1,344 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include "gpt.h"
+#include "cli.h"
+#include "g2fs.h"
+#include "layout.h"
+
+bool parseSize(const std::string &value, uint64_t &bytes)
+{
+    char *end = nullptr;
+    bytes = strtoull(value.c_str(), &end, 10);
+    if (end == value.c_str())
+    {
+        return false;
+    }
+
+    uint32_t shift = 0;
+    switch (*end)
+    {
+    case '\0':
+        return true;
+    case 'K':
+        shift = 10;
+        break;
+    case 'M':
+        shift = 20;
+        break;
+    case 'G':
+        shift = 30;
+        break;
+    case 'T':
+        shift = 40;
+        break;
+    default:
+        return false;
+    }
+
+    if (end[1] != '\0' && strcmp(end + 1, "iB") != 0)
+    {
+        return false;
+    }
+
+    if (bytes > (UINT64_MAX >> shift))
+    {
+        return false;
+    }
+
+    bytes <<= shift;
+    return true;
+}
+
+/**
+ * @brief Parse a TOML value, a basic string or a bare integer
+ * @param  &text: the text after the equals sign
+ * @param  &value: the value, quotes and escapes removed
+ * @retval true if successful, false otherwise
+ */
+static bool parseValue(const std::string &text, std::string &value)
+{
+    value.clear();
+    if (text.empty())
+    {
+        return false;
+    }
+
+    if (text[0] != '"')
+    {
+        // bare values end at whitespace or a comment
+        value = text.substr(0, text.find_first_of(" \t#"));
+        size_t rest = text.find_first_not_of(" \t", value.size());
+        return !value.empty() && (rest == std::string::npos || text[rest] == '#');
+    }
+
+    for (size_t i = 1; i < text.size(); i++)
+    {
+        if (text[i] == '"')
+        {
+            size_t rest = text.find_first_not_of(" \t", i + 1);
+            return rest == std::string::npos || text[rest] == '#';
+        }
+
+        if (text[i] == '\\' && i + 1 < text.size())
+        {
+            i++;
+        }
+        value += text[i];
+    }
+
+    return false;
+}
+
+/**
+ * @brief Set a key of a partition table
+ * @param  &partition: the partition
+ * @param  &key: the key
+ * @param  &value: the value
+ * @retval true if the key and value are valid, false otherwise
+ */
+static bool setPartitionKey(LAYOUT_PARTITION &partition, const std::string &key, const std::string &value)
+{
+    if (key == "name")
+    {
+        partition.name = value;
+        return value.size() <= LAYOUT_MAX_NAME_LENGTH;
+    }
+    else if (key == "type")
+    {
+        if (value == "esp")
+        {
+            partition.type = ESP_GUID;
+        }
+        else if (value == "data")
+        {
+            partition.type = FAT32_GUID;
+        }
+        else if (value == "linux")
+        {
+            partition.type = LINUX_FILESYSTEM_GUID;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else if (key == "size")
+    {
+        return parseSize(value, partition.sizeInBytes);
+    }
+    else if (key == "filesystem")
+    {
+        if (value != "vfat" && value != "ext4" && value != "g2fs" && value != "none")
+        {
+            return false;
+        }
+        partition.fileSystem = value == "none" ? "" : value;
+    }
+    else if (key == "fat")
+    {
+        uint32_t fatSize = 0;
+        if (!parseNumber(value.c_str(), 12, 32, fatSize) || (fatSize != 12 && fatSize != 16 && fatSize != 32))
+        {
+            return false;
+        }
+        partition.fatSize = (uint8_t)fatSize;
+    }
+    else if (key == "groups")
+    {
+        return parseNumber(value.c_str(), 1, G2FS_MAX_GROUP_COUNT, partition.groupCount);
+    }
+    else if (key == "source")
+    {
+        partition.sourceDirectory = value;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool readLayout(const char *path, LAYOUT &layout)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Error: could not open layout " << path << std::endl;
+        return false;
+    }
+
+    // sources are relative to the directory holding the layout file
+    std::string layoutDirectory = path;
+    size_t slash = layoutDirectory.rfind('/');
+    layoutDirectory = slash == std::string::npos ? "" : layoutDirectory.substr(0, slash + 1);
+
+    layout.imageSizeInBytes = 0;
+    layout.partitions.clear();
+
+    std::string line, table;
+    for (uint32_t lineNumber = 1; std::getline(file, line); lineNumber++)
+    {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+        {
+            continue;
+        }
+        line = line.substr(first, line.find_last_not_of(" \t\r") + 1 - first);
+
+        if (line == "[image]")
+        {
+            table = "image";
+            continue;
+        }
+        if (line == "[[partition]]")
+        {
+            table = "partition";
+            layout.partitions.push_back({
+                .name = "",
+                .type = FAT32_GUID,
+                .sizeInBytes = 0,
+                .fileSystem = "",
+                .fatSize = 0,
+                .groupCount = G2FS_DEFAULT_GROUP_COUNT,
+                .sourceDirectory = "",
+                .firstLogicalBlockAddress = 0,
+                .lastLogicalBlockAddress = 0,
+            });
+            continue;
+        }
+
+        size_t equals = line.find('=');
+        std::string key = line.substr(0, equals);
+        key = key.substr(0, key.find_last_not_of(" \t") + 1);
+        std::string text = equals == std::string::npos ? "" : line.substr(equals + 1);
+        text.erase(0, text.find_first_not_of(" \t"));
+        std::string value;
+        bool valid = !key.empty() && parseValue(text, value);
+
+        if (valid && table == "image")
+        {
+            valid = key == "size" && parseSize(value, layout.imageSizeInBytes);
+        }
+        else if (valid && table == "partition")
+        {
+            valid = setPartitionKey(layout.partitions.back(), key, value);
+        }
+        else
+        {
+            valid = false;
+        }
+
+        if (!valid)
+        {
+            std::cerr << "Error: " << path << ":" << lineNumber << ": invalid line \"" << line << "\"" << std::endl;
+            return false;
+        }
+    }
+
+    if (layout.partitions.empty())
+    {
+        std::cerr << "Error: " << path << " has no [[partition]]" << std::endl;
+        return false;
+    }
+
+    for (LAYOUT_PARTITION &partition : layout.partitions)
+    {
+        if (!partition.sourceDirectory.empty() && partition.sourceDirectory[0] != '/')
+        {
+            partition.sourceDirectory = layoutDirectory + partition.sourceDirectory;
+        }
+
+        if (!partition.sourceDirectory.empty() && partition.fileSystem.empty())
+        {
+            std::cerr << "Error: partition \"" << partition.name << "\" has a source but no file system" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool placePartitions(LAYOUT &layout, uint32_t sectorSize, uint64_t &sizeInLogicalBlocks)
+{
+    // the secondary partition table and header close the disk
+    uint64_t trailingSectors = 1 + GPT_PARTITION_TABLE_SECTORS(sectorSize);
+    uint64_t alignment = ALIGNMENT_LBA(sectorSize);
+    sizeInLogicalBlocks = convertBytesToLogicalBlockAddress(layout.imageSizeInBytes, sectorSize);
+    if (sizeInLogicalBlocks != 0 && sizeInLogicalBlocks <= alignment + trailingSectors)
+    {
+        std::cerr << "Error: an image of " << layout.imageSizeInBytes << " bytes has no room for partitions" << std::endl;
+        return false;
+    }
+
+    uint64_t lastUsableLogicalBlockAddress = sizeInLogicalBlocks - trailingSectors - 1;
+    uint64_t next = alignment;
+
+    for (size_t i = 0; i < layout.partitions.size(); i++)
+    {
+        LAYOUT_PARTITION &partition = layout.partitions[i];
+        partition.firstLogicalBlockAddress = next;
+
+        if (partition.sizeInBytes == 0)
+        {
+            // only the last partition of a sized image can fill the rest
+            if (i + 1 != layout.partitions.size() || sizeInLogicalBlocks == 0)
+            {
+                std::cerr << "Error: partition \"" << partition.name << "\" needs a size" << std::endl;
+                return false;
+            }
+
+            partition.lastLogicalBlockAddress = lastUsableLogicalBlockAddress;
+        }
+        else
+        {
+            partition.lastLogicalBlockAddress = next + convertBytesToLogicalBlockAddress(partition.sizeInBytes, sectorSize) - 1;
+        }
+
+        next = (partition.lastLogicalBlockAddress + alignment) / alignment * alignment;
+    }
+
+    // fit the image to its partitions, keeping the end of the disk aligned
+    if (sizeInLogicalBlocks == 0)
+    {
+        sizeInLogicalBlocks = (layout.partitions.back().lastLogicalBlockAddress + trailingSectors + alignment) / alignment * alignment;
+        return true;
+    }
+
+    if (layout.partitions.back().lastLogicalBlockAddress > lastUsableLogicalBlockAddress ||
+        layout.partitions.back().lastLogicalBlockAddress < layout.partitions.back().firstLogicalBlockAddress)
+    {
+        std::cerr << "Error: the partitions do not fit in " << layout.imageSizeInBytes << " bytes" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+std::vector<GPT_PARTITION_ENTRY> getPartitionEntries(const LAYOUT &layout)
+{
+    std::vector<GPT_PARTITION_ENTRY> entries;
+
+    for (const LAYOUT_PARTITION &partition : layout.partitions)
+    {
+        GPT_PARTITION_ENTRY entry = {
+            .partitionType = partition.type,
+            .uniqueIdentifier = newGuid(),
+            .firstLogicalBlockAddress = partition.firstLogicalBlockAddress,
+            .lastLogicalBlockAddress = partition.lastLogicalBlockAddress,
+            .flags = 0,
+            .name = { 0 }
+        };
+
+        // names are plain ASCII
+        for (size_t i = 0; i < partition.name.size(); i++)
+        {
+            entry.name[i] = (char16_t)(uint8_t)partition.name[i];
+        }
+
+        entries.push_back(entry);
+    }
+
+    return entries;
+}
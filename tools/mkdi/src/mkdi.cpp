@@ -1,286 +1,614 @@
 #include <iostream>
-#include <fstream> 
+#include <cstring>
 #include <cuchar>
+#include <atomic>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <random>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "fs.h"
-#include "guid.h"
+#include "gpt.h"
+#include "blockdevice.h"
+#include "memoryblockdevice.h"
+#include "cli.h"
+#include "filesystem.h"
+#include "layout.h"
+#include "template.h"
+#include "batch.h"
 
 uint64_t imageSizeInBytes = 0, espSizeInBytes = 0, espSizeInLogicalBlocks = 0, espStartingLogicalBlockAddress = 0, espEndingLBA = 0;
 uint64_t dataSizeInBytes = 0, dataSizeInLogicalBlocks = 0, dataStartingLogicalBlockAddress = 0, dataEndingLBA = 0;
 
 /**
- * CRC32 lookup table
+ * @brief Convert a logical block address to cylinder, head, and sector geometry
+ * @note Taken from https://wiki.osdev.org/ATA_PIO_Mode#LBA_to_CHS_conversion
+ * @param  logicalBlockAddress: the logical block address
+ * @param  geometry[3]: the cylinder, head, and sector geometry 
+ * @retval None
  */
-static uint32_t crc32LookupTable[256] = {
-    0x00000000,0x77073096,0xEE0E612C,0x990951BA,0x076DC419,0x706AF48F,0xE963A535,0x9E6495A3,
-    0x0EDB8832,0x79DCB8A4,0xE0D5E91E,0x97D2D988,0x09B64C2B,0x7EB17CBD,0xE7B82D07,0x90BF1D91,
-    0x1DB71064,0x6AB020F2,0xF3B97148,0x84BE41DE,0x1ADAD47D,0x6DDDE4EB,0xF4D4B551,0x83D385C7,
-    0x136C9856,0x646BA8C0,0xFD62F97A,0x8A65C9EC,0x14015C4F,0x63066CD9,0xFA0F3D63,0x8D080DF5,
-    0x3B6E20C8,0x4C69105E,0xD56041E4,0xA2677172,0x3C03E4D1,0x4B04D447,0xD20D85FD,0xA50AB56B,
-    0x35B5A8FA,0x42B2986C,0xDBBBC9D6,0xACBCF940,0x32D86CE3,0x45DF5C75,0xDCD60DCF,0xABD13D59,
-    0x26D930AC,0x51DE003A,0xC8D75180,0xBFD06116,0x21B4F4B5,0x56B3C423,0xCFBA9599,0xB8BDA50F,
-    0x2802B89E,0x5F058808,0xC60CD9B2,0xB10BE924,0x2F6F7C87,0x58684C11,0xC1611DAB,0xB6662D3D,
-    0x76DC4190,0x01DB7106,0x98D220BC,0xEFD5102A,0x71B18589,0x06B6B51F,0x9FBFE4A5,0xE8B8D433,
-    0x7807C9A2,0x0F00F934,0x9609A88E,0xE10E9818,0x7F6A0DBB,0x086D3D2D,0x91646C97,0xE6635C01,
-    0x6B6B51F4,0x1C6C6162,0x856530D8,0xF262004E,0x6C0695ED,0x1B01A57B,0x8208F4C1,0xF50FC457,
-    0x65B0D9C6,0x12B7E950,0x8BBEB8EA,0xFCB9887C,0x62DD1DDF,0x15DA2D49,0x8CD37CF3,0xFBD44C65,
-    0x4DB26158,0x3AB551CE,0xA3BC0074,0xD4BB30E2,0x4ADFA541,0x3DD895D7,0xA4D1C46D,0xD3D6F4FB,
-    0x4369E96A,0x346ED9FC,0xAD678846,0xDA60B8D0,0x44042D73,0x33031DE5,0xAA0A4C5F,0xDD0D7CC9,
-    0x5005713C,0x270241AA,0xBE0B1010,0xC90C2086,0x5768B525,0x206F85B3,0xB966D409,0xCE61E49F,
-    0x5EDEF90E,0x29D9C998,0xB0D09822,0xC7D7A8B4,0x59B33D17,0x2EB40D81,0xB7BD5C3B,0xC0BA6CAD,
-    0xEDB88320,0x9ABFB3B6,0x03B6E20C,0x74B1D29A,0xEAD54739,0x9DD277AF,0x04DB2615,0x73DC1683,
-    0xE3630B12,0x94643B84,0x0D6D6A3E,0x7A6A5AA8,0xE40ECF0B,0x9309FF9D,0x0A00AE27,0x7D079EB1,
-    0xF00F9344,0x8708A3D2,0x1E01F268,0x6906C2FE,0xF762575D,0x806567CB,0x196C3671,0x6E6B06E7,
-    0xFED41B76,0x89D32BE0,0x10DA7A5A,0x67DD4ACC,0xF9B9DF6F,0x8EBEEFF9,0x17B7BE43,0x60B08ED5,
-    0xD6D6A3E8,0xA1D1937E,0x38D8C2C4,0x4FDFF252,0xD1BB67F1,0xA6BC5767,0x3FB506DD,0x48B2364B,
-    0xD80D2BDA,0xAF0A1B4C,0x36034AF6,0x41047A60,0xDF60EFC3,0xA867DF55,0x316E8EEF,0x4669BE79,
-    0xCB61B38C,0xBC66831A,0x256FD2A0,0x5268E236,0xCC0C7795,0xBB0B4703,0x220216B9,0x5505262F,
-    0xC5BA3BBE,0xB2BD0B28,0x2BB45A92,0x5CB36A04,0xC2D7FFA7,0xB5D0CF31,0x2CD99E8B,0x5BDEAE1D,
-    0x9B64C2B0,0xEC63F226,0x756AA39C,0x026D930A,0x9C0906A9,0xEB0E363F,0x72076785,0x05005713,
-    0x95BF4A82,0xE2B87A14,0x7BB12BAE,0x0CB61B38,0x92D28E9B,0xE5D5BE0D,0x7CDCEFB7,0x0BDBDF21,
-    0x86D3D2D4,0xF1D4E242,0x68DDB3F8,0x1FDA836E,0x81BE16CD,0xF6B9265B,0x6FB077E1,0x18B74777,
-    0x88085AE6,0xFF0F6A70,0x66063BCA,0x11010B5C,0x8F659EFF,0xF862AE69,0x616BFFD3,0x166CCF45,
-    0xA00AE278,0xD70DD2EE,0x4E048354,0x3903B3C2,0xA7672661,0xD06016F7,0x4969474D,0x3E6E77DB,
-    0xAED16A4A,0xD9D65ADC,0x40DF0B66,0x37D83BF0,0xA9BCAE53,0xDEBB9EC5,0x47B2CF7F,0x30B5FFE9,
-    0xBDBDF21C,0xCABAC28A,0x53B39330,0x24B4A3A6,0xBAD03605,0xCDD70693,0x54DE5729,0x23D967BF,
-    0xB3667A2E,0xC4614AB8,0x5D681B02,0x2A6F2B94,0xB40BBE37,0xC30C8EA1,0x5A05DF1B,0x2D02EF8D,
-};
+void convertLBAtoCHS(const uint32_t logicalBlockAddress, uint8_t (&geometry)[3])
+{
+    uint32_t cylinder = logicalBlockAddress / (2 * 18);
+    uint32_t head = (logicalBlockAddress / 18) % 2;
+    uint32_t sector = (logicalBlockAddress % 18) + 1;
+
+    geometry[0] = cylinder & 0xff;
+    geometry[1] = head & 0xff;
+    geometry[2] = sector & 0xff;
+}
 
 /**
- * @brief Calcuate CRC32 checksum of data buffer
- * @note Taken from https://create.stephan-brumme.com/crc32/
- * @param  *data: the data buffer
- * @param  length: the length of the data buffer
- * @param  previousCrc32: the previous CRC32 checksum
- * @retval The CRC32 checksum of the data buffer
-*/
-uint32_t crc32(const void* data, size_t length, uint32_t previousCrc32 = 0)
+ * @brief Print the allocated bytes of an image against its logical size
+ * @note The logical size of a qcow2 image is its virtual disk size, not
+ *       the size of the container file
+ * @param  *fileName: the image file name
+ * @retval true if successful, false otherwise
+ */
+bool reportImageAllocation(const char* fileName)
 {
-  uint32_t crc = ~previousCrc32;
-  uint8_t* current = (uint8_t*) data;
-  
-  while (length--)
-    crc = (crc >> 8) ^ crc32LookupTable[(crc & 0xFF) ^ *current++];
-  
-  return ~crc;
+    struct stat st;
+    if (stat(fileName, &st) != 0) {
+        return false;
+    }
+
+    uint64_t logicalBytes = st.st_size;
+    if (isQcow2Image(fileName))
+    {
+        std::unique_ptr<BlockDevice> device = openBlockDevice(BLOCK_DEVICE_FILE, fileName);
+        if (!device)
+        {
+            return false;
+        }
+        logicalBytes = device->getSectorCount() * device->getSectorSize();
+    }
+
+    uint64_t allocatedBytes = (uint64_t)st.st_blocks * 512;
+    std::cout << fileName << ": " << logicalBytes << " bytes logical, "
+              << allocatedBytes << " bytes allocated" << std::endl;
+
+    return true;
 }
 
 /**
- * @brief Generate a new GUID
- * @retval A new GUID
+ * @brief Format the partitions of a placed layout and partition the disk, in memory
+ * @note Partitions are formatted in parallel, each in a device of its own;
+ *       a staging device referencing host files keeps their data out of memory
+ * @param  &layout: the layout, with its partitions placed
+ * @param  threadCount: the threads formatting partitions, split between partitions and their file copies
+ * @param  &staging: the staged image, of the placed size
+ * @retval true if successful, false otherwise
  */
-GUID newGuid()
+bool stageLayoutImage(const LAYOUT &layout, uint32_t threadCount, MemoryBlockDevice &staging)
 {
-    uint8_t randomBytes[16] = { 0 };
+    uint64_t sizeInLogicalBlocks = staging.getSectorCount();
+    uint32_t sectorSize = staging.getSectorSize();
 
-    for(uint8_t i = 0; i < sizeof(randomBytes); i++) {
-        randomBytes[i] = rand() % (UINT8_MAX + 1);
+    for (const LAYOUT_PARTITION &partition : layout.partitions)
+    {
+        if (!partition.fileSystem.empty() && !checkFileSystemOptions(partition.fileSystem, partition.fatSize, partition.groupCount))
+        {
+            return false;
+        }
     }
 
-    GUID result = {
-        .timeLow = *(uint32_t *)&randomBytes[0],
-        .timeMid = *(uint16_t *)&randomBytes[4],
-        .timeHiAndVersion = *(uint16_t *)&randomBytes[6],
-        .clockSeqHiAndReserved = *(uint8_t *)&randomBytes[8],
-        .clockSeqLow = *(uint8_t *)&randomBytes[9],
-        .node = {
-            randomBytes[10], randomBytes[11], randomBytes[12],
-            randomBytes[13], randomBytes[14], randomBytes[15]
+    // each partition is staged in a device of its own on a worker thread;
+    // partitions start on 1 MiB boundaries, so their chunks never overlap.
+    // The threads are shared out so workers and their copy threads together
+    // stay within threadCount
+    size_t partitionCount = layout.partitions.size();
+    uint32_t partitionWorkers = std::max<uint32_t>(1, std::min<size_t>(threadCount, partitionCount));
+    uint32_t fileSystemThreads = std::max(1u, threadCount / partitionWorkers);
+    std::vector<std::unique_ptr<MemoryBlockDevice>> stagedPartitions(partitionCount);
+    std::vector<uint8_t> formatted(partitionCount, true);
+    std::atomic<size_t> nextPartition(0);
+
+    auto formatPartitions = [&]() {
+        for (size_t i = nextPartition++; i < partitionCount; i = nextPartition++)
+        {
+            const LAYOUT_PARTITION &partition = layout.partitions[i];
+            if (partition.fileSystem.empty())
+            {
+                continue;
+            }
+
+            uint64_t totalSectors = partition.lastLogicalBlockAddress - partition.firstLogicalBlockAddress + 1;
+            stagedPartitions[i].reset(new MemoryBlockDevice(sizeInLogicalBlocks, sectorSize, staging.isReferencingHostFiles()));
+            formatted[i] = makeFileSystem(*stagedPartitions[i], partition.firstLogicalBlockAddress, partition.fileSystem, partition.fatSize, partition.groupCount, totalSectors,
+                                          partition.sourceDirectory.empty() ? nullptr : partition.sourceDirectory.c_str(), nullptr, fileSystemThreads);
         }
     };
 
-    result.timeHiAndVersion &= ~(1 << 15);
-    result.timeHiAndVersion |= (1 << 14);
-    result.timeHiAndVersion &= ~(1 << 13);
-    result.timeHiAndVersion &= ~(1 << 12);
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < partitionWorkers; i++)
+    {
+        workers.emplace_back(formatPartitions);
+    }
+    formatPartitions();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    for (size_t i = 0; i < partitionCount; i++)
+    {
+        if (!formatted[i])
+        {
+            std::cerr << "Error: failed to make file system on partition " << i + 1 << std::endl;
+            return false;
+        }
 
-    result.clockSeqHiAndReserved |= ~(1 << 7);
-    result.clockSeqHiAndReserved |= ~(1 << 6);
-    result.clockSeqHiAndReserved &= ~(1 << 5);
+        if (stagedPartitions[i] && !staging.absorb(*stagedPartitions[i]))
+        {
+            std::cerr << "Error: partition " << i + 1 << " overlaps another partition" << std::endl;
+            return false;
+        }
+    }
 
-    return result;
+    // the partition tables go in last, the secondary one may share a chunk
+    // with the end of the last partition
+    if (!writeMasterBootRecord(staging, sizeInLogicalBlocks) ||
+        !writeGlobalPartitionTableHeaderAndEntries(staging, sizeInLogicalBlocks, getPartitionEntries(layout)))
+    {
+        std::cerr << "Error: could not write GPT header/tables" << std::endl;
+        return false;
+    }
+
+    return true;
 }
 
 /**
- * @brief Convert a logical block address to cylinder, head, and sector geometry
- * @note Taken from https://wiki.osdev.org/ATA_PIO_Mode#LBA_to_CHS_conversion
- * @param  logicalBlockAddress: the logical block address
- * @param  geometry[3]: the cylinder, head, and sector geometry 
- * @retval None
+ * @brief Give an image built from a layout new disk, partition and volume identifiers
+ * @param  &device: the image
+ * @param  &layout: the layout the image was built from
+ * @retval true if successful, false otherwise
  */
-void convertLBAtoCHS(const uint32_t logicalBlockAddress, uint8_t (&geometry)[3])
+bool reidentifyLayoutImage(BlockDevice &device, const LAYOUT &layout)
 {
-    uint32_t cylinder = logicalBlockAddress / (2 * 18);
-    uint32_t head = (logicalBlockAddress / 18) % 2;
-    uint32_t sector = (logicalBlockAddress % 18) + 1;
+    std::vector<GPT_PARTITION_ENTRY> partitions;
+    if (!detectSectorSize(device) || !reidentifyPartitionTable(device, partitions) || partitions.size() != layout.partitions.size())
+    {
+        std::cerr << "Error: could not write GPT header/tables" << std::endl;
+        return false;
+    }
 
-    geometry[0] = cylinder & 0xff;
-    geometry[1] = head & 0xff;
-    geometry[2] = sector & 0xff;
-}
+    for (size_t i = 0; i < partitions.size(); i++)
+    {
+        if (!layout.partitions[i].fileSystem.empty() &&
+            !renewVolumeIdentifier(device, partitions[i].firstLogicalBlockAddress, layout.partitions[i].fileSystem))
+        {
+            std::cerr << "Error: could not write volume identifier of partition " << i + 1 << std::endl;
+            return false;
+        }
+    }
 
-/**
- * @brief Get the next aligned logical block address
- * @param  logicalBlockAddress: the logical block address
- * @retval The next aligned logical block address
- */
-uint64_t getNextAlignedLBA(const uint64_t logicalBlockAddress) {
-    return logicalBlockAddress - (logicalBlockAddress % ALIGNMENT_LBA) + ALIGNMENT_LBA;
+    return true;
 }
 
 /**
- * @brief Convert bytes to a logical block address
- * @param  bytes: the bytes
- * @retval The logical block address
+ * @brief Write a staged image front to back
+ * @param  &staging: the staged image
+ * @param  &layout: the layout the image was staged from
+ * @param  *imageFileName: the image file name
+ * @param  backend: the I/O backend of the image
+ * @param  sparse: true to leave unwritten regions as holes
+ * @param  format: the image format
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @param  reidentify: true to give the image identifiers of its own, when
+ *         the same staged image is written more than once
+ * @retval true if successful, false otherwise
  */
-uint64_t convertBytesToLogicalBlockAddress(const uint64_t bytes) {
-    return bytes / BLOCK_SIZE + (bytes % BLOCK_SIZE ? 1 : 0);
+bool writeStagedImage(const MemoryBlockDevice &staging, const LAYOUT &layout, const char* imageFileName, BLOCK_DEVICE_TYPE backend, bool sparse, IMAGE_FORMAT format, uint32_t queueDepth, bool reidentify)
+{
+    std::unique_ptr<BlockDevice> device = createBlockDevice(backend, imageFileName, staging.getSectorCount(), sparse, format, queueDepth, staging.getSectorSize());
+    if (!device)
+    {
+        std::cerr << "Error: could not create file " << imageFileName << std::endl;
+        return false;
+    }
+
+    uint64_t writes = 0;
+    if (!staging.writeTo(*device, writes) || (reidentify && !reidentifyLayoutImage(*device, layout)) || !device->flush())
+    {
+        std::cerr << "Error: could not write file " << imageFileName << std::endl;
+        return false;
+    }
+
+    // one insertion, so lines from concurrent writers do not interleave
+    std::ostringstream report;
+    report << imageFileName << ": " << layout.partitions.size() << " partitions, " << staging.getAllocatedBytes()
+           << " bytes written from memory and " << staging.getHostFileBytes() << " from host files, in " << writes << " writes" << std::endl;
+    std::cout << report.str() << std::flush;
+    return true;
 }
 
 /**
- * @brief Pad to a full logical block size with zeros
- * @param  *fp: the file pointer
+ * @brief Write a planned image to a pipe front to back, zeros included
+ * @param  &staging: the planned image, file data referenced from the host
+ * @param  fd: the pipe, or any other file descriptor that need not seek
  * @retval true if successful, false otherwise
  */
-bool fillToALogicalBlockSizeWithZeros(std::ofstream& outfile)
+bool streamStagedImage(MemoryBlockDevice &staging, int fd)
 {
-    uint8_t zero[512];
-    for (int i = 0; i < (BLOCK_SIZE - sizeof(zero)) / sizeof(zero); i++)
+    uint64_t writes = 0;
+    if (!staging.streamTo(fd, writes) || (fsync(fd) != 0 && errno != EINVAL && errno != EROFS))
     {
-        if (!outfile.write(reinterpret_cast<const char*>(&zero), sizeof(zero)))
-        {
-            return false;
-        }
+        std::cerr << "Error: could not write the image to standard output" << std::endl;
+        return false;
     }
 
+    std::cout << "-: " << staging.getSectorCount() * staging.getSectorSize() << " bytes streamed, " << staging.getAllocatedBytes()
+              << " of them from memory and " << staging.getHostFileBytes() << " from host files, in " << writes << " writes" << std::endl;
     return true;
 }
 
 /**
- * @brief Write the master boot record to file
- * @param  *fp: the file pointer
+ * @brief Read a layout file and place its partitions
+ * @param  *layoutFileName: the layout file name
+ * @param  *imageFileName: the image file name, a block device fills a layout without an image size
+ * @param  sectorSize: the logical sector size of the image
+ * @param  &layout: the placed layout
+ * @param  &sizeInLogicalBlocks: the size of the image in blocks
  * @retval true if successful, false otherwise
  */
-bool writeMasterBootRecord(std::ofstream& outfile) 
+bool loadLayout(const char* layoutFileName, const char* imageFileName, uint32_t sectorSize, LAYOUT &layout, uint64_t &sizeInLogicalBlocks)
 {
-    uint64_t sizeInLogicalBlocks = convertBytesToLogicalBlockAddress(imageSizeInBytes);
-    if (sizeInLogicalBlocks > 0xFFFFFFFF) sizeInLogicalBlocks = 0x100000000;
+    if (!readLayout(layoutFileName, layout))
+    {
+        return false;
+    }
 
-    MBR mbr = {
-        .bootstrap = { 0 },
-        .partitions = {
-            {
-                .status = 0x01,
-                .startingGeometry = {0x00, 0x02, 0x00},
-                .type = OSTYPE_PMBR,
-                .endingGeometry = {0xFF, 0xFF, 0xFF},
-                .firstLogicalBlockAddress = 1,
-                .sizeInLogicalBlocks = (uint32_t)sizeInLogicalBlocks - 1
-            }
-        },
-        .signature = MBR_SIGNATURE,
-    };
+    // a layout without an image size fills a target block device
+    uint64_t deviceSizeInBytes = 0;
+    uint32_t deviceSectorSize = 0;
+    if (layout.imageSizeInBytes == 0 && getBlockDeviceSize(imageFileName, deviceSizeInBytes, deviceSectorSize))
+    {
+        layout.imageSizeInBytes = deviceSizeInBytes;
+    }
 
-    if (!outfile.write(reinterpret_cast<const char*>(&mbr), sizeof(mbr))) {
+    return placePartitions(layout, sectorSize, sizeInLogicalBlocks);
+}
+
+/**
+ * @brief Build a whole image from a layout file
+ * @note Partitions are formatted in memory in parallel and the image is
+ *       then written in a single ascending sweep; file data is only
+ *       referenced while staging and copied from the host files after the
+ *       metadata, so memory holds metadata only
+ * @param  *layoutFileName: the layout file name
+ * @param  *imageFileName: the image file name
+ * @param  backend: the I/O backend of the image
+ * @param  sparse: true to leave unwritten regions as holes
+ * @param  format: the image format
+ * @param  threadCount: the threads formatting partitions, split between partitions and their file copies
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @param  sectorSize: the logical sector size of the image
+ * @retval true if successful, false otherwise
+ */
+bool buildLayoutImage(const char* layoutFileName, const char* imageFileName, BLOCK_DEVICE_TYPE backend, bool sparse, IMAGE_FORMAT format, uint32_t threadCount, uint32_t queueDepth, uint32_t sectorSize)
+{
+    LAYOUT layout;
+    uint64_t sizeInLogicalBlocks = 0;
+    if (!loadLayout(layoutFileName, imageFileName, sectorSize, layout, sizeInLogicalBlocks))
+    {
         return false;
     }
 
-    return fillToALogicalBlockSizeWithZeros(outfile);
+    MemoryBlockDevice staging(sizeInLogicalBlocks, sectorSize, true);
+    return stageLayoutImage(layout, threadCount, staging) &&
+           writeStagedImage(staging, layout, imageFileName, backend, sparse, format, queueDepth, false);
 }
 
 /**
- * @brief Write a global partition table header and partition entry table to file
- * @param  *fp: the file pointer
+ * @brief Build a whole image from a layout file and stream it to a pipe
+ * @note The image is planned in memory as with buildLayoutImage, except
+ *       that the host file data is read in between the metadata, in
+ *       strictly ascending order, so the target never seeks
+ * @param  *layoutFileName: the layout file name
+ * @param  fd: the pipe
+ * @param  threadCount: the threads formatting partitions, split between partitions and their file copies
+ * @param  sectorSize: the logical sector size of the image
  * @retval true if successful, false otherwise
  */
-bool writeGlobalPartitionTableHeaderAndEntries(std::ofstream& outfile) {
-    // fill out primary GPT header
-    GPT_HEADER primaryGPTHeader = {
-        .signature = GPT_SIGNATURE,
-        .revision = GPT_REVISION,
-        .headerSize = GPT_HEADER_SIZE,
-        .crc32 = 0,
-        .reserved = 0,
-        .headerLogicalBlockAddress = 1,
-        .alternateLogicalBlockAddress = convertBytesToLogicalBlockAddress(imageSizeInBytes) - 1,
-        .firstUsableLogicalBlockAddress = 34, // MBR + GPT + Primary GPT table
-        .lastUsableLogicalBlockAddress = convertBytesToLogicalBlockAddress(imageSizeInBytes) - 34, 
-        .diskIdentifier = newGuid(),
-        .partitionTableLogicalBlockAddress = 2,
-        .numberOfPartitionEntries = GPT_PARTITION_TABLE_ENTRIES,
-        .partitionEntrySize = sizeof(GPT_PARTITION_ENTRY),
-        .partitionTableCrc32 = 0,
-        .reserved2 = { 0 }
-    };
+bool streamLayoutImage(const char* layoutFileName, int fd, uint32_t threadCount, uint32_t sectorSize)
+{
+    LAYOUT layout;
+    uint64_t sizeInLogicalBlocks = 0;
+    if (!loadLayout(layoutFileName, "-", sectorSize, layout, sizeInLogicalBlocks))
+    {
+        return false;
+    }
 
-    // fill out GPT partition table
-    GPT_PARTITION_ENTRY partitions[GPT_PARTITION_TABLE_ENTRIES] = {
-        {
-            .partitionType = ESP_GUID,
-            .uniqueIdentifier = newGuid(),
-            .firstLogicalBlockAddress = espStartingLogicalBlockAddress,
-            .lastLogicalBlockAddress = espStartingLogicalBlockAddress + espSizeInLogicalBlocks,
-            .flags = 0,
-            .name = u"EFI System Partition"
-        },
+    // layout partitions are formatted without a manifest
+    for (size_t i = 0; i < layout.partitions.size(); i++)
+    {
+        const LAYOUT_PARTITION &partition = layout.partitions[i];
+        if (!partition.fileSystem.empty() && !partition.sourceDirectory.empty() && !canReferenceHostFiles(partition.fileSystem, nullptr))
         {
-            .partitionType = FAT32_GUID,
-            .uniqueIdentifier = newGuid(),
-            .firstLogicalBlockAddress = dataStartingLogicalBlockAddress,
-            .lastLogicalBlockAddress = dataStartingLogicalBlockAddress + dataSizeInLogicalBlocks,
-            .flags = 0,
-            .name = u"Root Partition"
+            std::cerr << "Error: partition " << i + 1 << " cannot be streamed, " << partition.fileSystem << " would keep its file data in memory" << std::endl;
+            return false;
         }
-     };
+    }
 
-    // fill out primary GPT header partition table CRC32
-    primaryGPTHeader.partitionTableCrc32 = crc32(partitions, sizeof(partitions));
+    MemoryBlockDevice staging(sizeInLogicalBlocks, sectorSize, true);
+    return stageLayoutImage(layout, threadCount, staging) && streamStagedImage(staging, fd);
+}
 
-    // fill out primary GPT header CRC32
-    primaryGPTHeader.crc32 = crc32(&primaryGPTHeader, primaryGPTHeader.headerSize);
+/**
+ * @brief Make sure the cache holds the formatted template of a layout
+ * @note The template is built under a private name and renamed into place,
+ *       so a concurrent mkdi never clones a template still being written
+ * @param  *layoutFileName: the layout file name
+ * @param  &layout: the layout read from it
+ * @param  *cacheDirectory: the directory holding the templates
+ * @param  backend: the I/O backend of the template
+ * @param  sparse: true to leave unwritten regions as holes
+ * @param  threadCount: the threads formatting partitions, split between partitions and their file copies
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @param  sectorSize: the logical sector size of the image
+ * @param  &templateFileName: the template file name
+ * @retval true if successful, false otherwise
+ */
+bool prepareTemplate(const char* layoutFileName, const LAYOUT &layout, const char* cacheDirectory, BLOCK_DEVICE_TYPE backend, bool sparse, uint32_t threadCount, uint32_t queueDepth, uint32_t sectorSize, std::string &templateFileName)
+{
+    std::string key;
+    if (!getTemplateKey(layoutFileName, layout, sectorSize, sparse, key))
+    {
+        return false;
+    }
+
+    templateFileName = std::string(cacheDirectory) + "/" + key + ".img";
+    struct stat st;
+    if (stat(templateFileName.c_str(), &st) == 0)
+    {
+        return true;
+    }
 
-    // write primary GPT header to file
-    if (!outfile.write(reinterpret_cast<const char*>(&primaryGPTHeader), sizeof(primaryGPTHeader))) {
+    std::string temporaryFileName = templateFileName + "." + std::to_string(getpid()) + ".tmp";
+    if (!buildLayoutImage(layoutFileName, temporaryFileName.c_str(), backend, sparse, IMAGE_FORMAT_RAW, threadCount, queueDepth, sectorSize) ||
+        rename(temporaryFileName.c_str(), templateFileName.c_str()) != 0)
+    {
+        unlink(temporaryFileName.c_str());
+        std::cerr << "Error: could not build template " << templateFileName << std::endl;
         return false;
     }
 
-    // pad to a full logical block size
-    if (!fillToALogicalBlockSizeWithZeros(outfile)) {
+    return true;
+}
+
+/**
+ * @brief Clone an image from a template and give it identifiers of its own
+ * @param  &templateFileName: the template file name
+ * @param  &layout: the layout the template was built from
+ * @param  *imageFileName: the image file name
+ * @param  backend: the I/O backend the identifiers are written with
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @retval true if successful, false otherwise
+ */
+bool cloneTemplate(const std::string &templateFileName, const LAYOUT &layout, const char* imageFileName, BLOCK_DEVICE_TYPE backend, uint32_t queueDepth)
+{
+    bool reflinked = false;
+    if (!cloneImage(templateFileName.c_str(), imageFileName, reflinked))
+    {
         return false;
     }
 
-    // write primary GPT partition table to file
-    if (!outfile.write(reinterpret_cast<const char*>(partitions), sizeof(partitions))) {
+    // only the identifiers and the checksums covering them differ between clones
+    std::unique_ptr<BlockDevice> device = openBlockDevice(backend, imageFileName, queueDepth);
+    if (!device || !reidentifyLayoutImage(*device, layout) || !device->flush())
+    {
+        std::cerr << "Error: could not write file " << imageFileName << std::endl;
         return false;
     }
 
-    // fill out the secondary GPT header
-    GPT_HEADER secondaryGPTHeader = primaryGPTHeader;
-    secondaryGPTHeader.crc32 = 0;
-    secondaryGPTHeader.partitionTableCrc32 = primaryGPTHeader.partitionTableCrc32;
-    secondaryGPTHeader.headerLogicalBlockAddress = primaryGPTHeader.alternateLogicalBlockAddress;
-    secondaryGPTHeader.alternateLogicalBlockAddress = primaryGPTHeader.headerLogicalBlockAddress;
-    secondaryGPTHeader.partitionTableLogicalBlockAddress = convertBytesToLogicalBlockAddress(imageSizeInBytes) - 33;
+    std::ostringstream report;
+    report << imageFileName << ": " << (reflinked ? "reflinked" : "copied") << " from " << templateFileName << std::endl;
+    std::cout << report.str() << std::flush;
+    return true;
+}
+
+/**
+ * @brief Build an image from a layout through a cache of formatted templates
+ * @note The first image of a layout is built into the cache directory and
+ *       every image is cloned from it, with new disk, partition and volume
+ *       identifiers; on file systems with reflinks a clone costs metadata
+ *       only, whatever the size of the image
+ * @param  *layoutFileName: the layout file name
+ * @param  *cacheDirectory: the directory holding the templates
+ * @param  *imageFileName: the image file name
+ * @param  backend: the I/O backend of the template and the image
+ * @param  sparse: true to leave unwritten regions as holes
+ * @param  threadCount: the threads formatting partitions, split between partitions and their file copies
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @param  sectorSize: the logical sector size of the image
+ * @retval true if successful, false otherwise
+ */
+bool buildCachedLayoutImage(const char* layoutFileName, const char* cacheDirectory, const char* imageFileName, BLOCK_DEVICE_TYPE backend, bool sparse, uint32_t threadCount, uint32_t queueDepth, uint32_t sectorSize)
+{
+    LAYOUT layout;
+    std::string templateFileName;
+    return readLayout(layoutFileName, layout) &&
+           prepareTemplate(layoutFileName, layout, cacheDirectory, backend, sparse, threadCount, queueDepth, sectorSize, templateFileName) &&
+           cloneTemplate(templateFileName, layout, imageFileName, backend, queueDepth);
+}
+
+// a layout shared by the images of a batch, read, placed and formatted once
+typedef struct _BATCH_LAYOUT
+{
+    LAYOUT layout;
+    std::unique_ptr<MemoryBlockDevice> staging; // without a cache
+    std::string templateFileName;               // with a cache
+    uint64_t sizeInBytes;                       // bytes per image counted against the budget
+} BATCH_LAYOUT;
+
+/**
+ * @brief Read, place and format a layout of a batch, or look it up in the cache
+ * @param  *layoutFileName: the layout file name
+ * @param  *imageFileName: the first image built from it
+ * @param  *cacheDirectory: the directory holding the templates, or nullptr
+ * @param  backend: the I/O backend of the template
+ * @param  sparse: true to leave unwritten regions as holes
+ * @param  threadCount: the threads formatting partitions, split between partitions and their file copies
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @param  sectorSize: the logical sector size of the images
+ * @param  &shared: the prepared layout
+ * @retval true if successful, false otherwise
+ */
+bool prepareBatchLayout(const char* layoutFileName, const char* imageFileName, const char* cacheDirectory, BLOCK_DEVICE_TYPE backend, bool sparse, uint32_t threadCount, uint32_t queueDepth, uint32_t sectorSize, BATCH_LAYOUT &shared)
+{
+    if (cacheDirectory != nullptr)
+    {
+        struct stat st;
+        if (!readLayout(layoutFileName, shared.layout) ||
+            !prepareTemplate(layoutFileName, shared.layout, cacheDirectory, backend, sparse, threadCount, queueDepth, sectorSize, shared.templateFileName) ||
+            stat(shared.templateFileName.c_str(), &st) != 0)
+        {
+            return false;
+        }
 
-    // fill out the secondary GPT header CRC32
-    secondaryGPTHeader.crc32 = crc32(&secondaryGPTHeader, secondaryGPTHeader.headerSize);
+        shared.sizeInBytes = (uint64_t)st.st_blocks * 512;
+        return true;
+    }
 
-    // seek to position of secondary GPT partition table
-    if (!outfile.seekp(secondaryGPTHeader.partitionTableLogicalBlockAddress * BLOCK_SIZE)) {
+    uint64_t sizeInLogicalBlocks = 0;
+    if (!loadLayout(layoutFileName, imageFileName, sectorSize, shared.layout, sizeInLogicalBlocks))
+    {
         return false;
     }
 
-    // write secondary GPT partition table to file
-    if (!outfile.write(reinterpret_cast<const char*>(partitions), sizeof(partitions))) {
+    // file data stays in the host files until each image is written
+    shared.staging.reset(new MemoryBlockDevice(sizeInLogicalBlocks, sectorSize, true));
+    if (!stageLayoutImage(shared.layout, threadCount, *shared.staging))
+    {
+        std::cerr << "Error: could not build layout " << layoutFileName << std::endl;
         return false;
     }
-    
-    // write secondary GPT header to file
-    if (!outfile.write(reinterpret_cast<const char*>(&secondaryGPTHeader), sizeof(secondaryGPTHeader))) {
+
+    // only what the staged image holds in memory; host file data is read
+    // through one window per writer
+    shared.sizeInBytes = shared.staging->getAllocatedBytes();
+    return true;
+}
+
+/**
+ * @brief Build every image of a batch manifest in one process
+ * @note The images are grouped by layout, in the order the layouts first
+ *       appear. Each layout is read, placed and formatted, or looked up in
+ *       the cache, once, and its images are then written by a pool of
+ *       threadCount threads before the next layout is staged, so at most one
+ *       staged layout, its metadata only, is held in memory. The staged
+ *       bytes of the images being written, or the template bytes being
+ *       cloned, are capped across the pool, so a large batch does not thrash
+ *       the page cache
+ * @param  *batchFileName: the batch manifest file name
+ * @param  *cacheDirectory: the directory holding the templates, or nullptr
+ * @param  backend: the I/O backend of the images
+ * @param  sparse: true to leave unwritten regions as holes
+ * @param  format: the image format
+ * @param  threadCount: the number of threads formatting partitions and writing images
+ * @param  queueDepth: the requests kept in flight by the uring backend
+ * @param  sectorSize: the logical sector size of the images
+ * @param  maxOutstandingBytes: the limit on bytes written but not yet flushed
+ * @retval true if every image was built, false otherwise
+ */
+bool buildBatch(const char* batchFileName, const char* cacheDirectory, BLOCK_DEVICE_TYPE backend, bool sparse, IMAGE_FORMAT format, uint32_t threadCount, uint32_t queueDepth, uint32_t sectorSize, uint64_t maxOutstandingBytes)
+{
+    std::vector<BATCH_IMAGE> images;
+    if (!readBatch(batchFileName, images))
+    {
         return false;
     }
 
-     // pad to a full logical block size
-    return fillToALogicalBlockSizeWithZeros(outfile);
+    // the images of each layout, layouts in order of first appearance
+    std::vector<std::string> layoutFileNames;
+    std::map<std::string, std::vector<size_t>> imagesByLayout;
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        uint64_t deviceSizeInBytes = 0;
+        uint32_t deviceSectorSize = 0;
+        if (getBlockDeviceSize(images[i].imageFileName.c_str(), deviceSizeInBytes, deviceSectorSize))
+        {
+            std::cerr << "Error: " << images[i].imageFileName << " is a block device, batches only build image files" << std::endl;
+            return false;
+        }
+
+        std::vector<size_t> &layoutImages = imagesByLayout[images[i].layoutFileName];
+        if (layoutImages.empty())
+        {
+            layoutFileNames.push_back(images[i].layoutFileName);
+        }
+        layoutImages.push_back(i);
+    }
+
+    ByteBudget budget(maxOutstandingBytes);
+    size_t failures = 0;
+
+    for (const std::string &layoutFileName : layoutFileNames)
+    {
+        const std::vector<size_t> &layoutImages = imagesByLayout.at(layoutFileName);
+        BATCH_LAYOUT shared;
+        if (!prepareBatchLayout(layoutFileName.c_str(), images[layoutImages[0]].imageFileName.c_str(), cacheDirectory, backend, sparse,
+                                threadCount, queueDepth, sectorSize, shared))
+        {
+            return false;
+        }
+
+        std::atomic<size_t> nextImage(0);
+        std::atomic<size_t> layoutFailures(0);
+        auto writeImages = [&]() {
+            for (size_t i = nextImage++; i < layoutImages.size(); i = nextImage++)
+            {
+                const char *imageFileName = images[layoutImages[i]].imageFileName.c_str();
+
+                // the bytes count against the budget until the image is flushed
+                budget.acquire(shared.sizeInBytes);
+                bool built = shared.staging ? writeStagedImage(*shared.staging, shared.layout, imageFileName, backend, sparse, format, queueDepth, true)
+                                            : cloneTemplate(shared.templateFileName, shared.layout, imageFileName, backend, queueDepth);
+                budget.release(shared.sizeInBytes);
+
+                if (!built)
+                {
+                    layoutFailures++;
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (uint32_t i = 1; i < std::min((size_t)threadCount, layoutImages.size()); i++)
+        {
+            workers.emplace_back(writeImages);
+        }
+        writeImages();
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+
+        // the staged image is released before the next layout is staged
+        failures += layoutFailures;
+    }
+
+    std::cout << batchFileName << ": " << images.size() - failures << " of " << images.size() << " images built from "
+              << layoutFileNames.size() << " layouts" << std::endl;
+    return failures == 0;
+}
+
+void printUsage()
+{
+    std::cout << "Usage: mkdi [options] <image file, block device or - for standard output>" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -s\t\t\tSparse image, leave unwritten regions as holes (default)" << std::endl;
+    std::cout << "  -P\t\t\tPreallocate the whole image with fallocate instead of leaving holes" << std::endl;
+    std::cout << "  -b\t\t\tI/O backend (i.e. file, mmap, uring, direct)" << std::endl;
+    std::cout << "  -q\t\t\tRequests in flight with the uring backend (default " << BLOCK_DEVICE_URING_QUEUE_DEPTH << ")" << std::endl;
+    std::cout << "  -f\t\t\tImage format (i.e. raw, qcow2)" << std::endl;
+    std::cout << "  -S\t\t\tLogical sector size (i.e. 512, 4096; a block device uses its own)" << std::endl;
+    std::cout << "  --layout\t\tPartition, format and populate the image from a layout file in one pass" << std::endl;
+    std::cout << "  -j\t\t\tThreads building --layout partitions, split between partitions (default: one per CPU)" << std::endl;
+    std::cout << "  --cache\t\tClone --layout images from formatted templates kept in this directory" << std::endl;
+    std::cout << "  --batch\t\tBuild every \"<image> <layout>\" line of a manifest in one process, instead of a single image" << std::endl;
+    std::cout << "  --max-outstanding\tBytes written but not yet flushed across a --batch (default 1G)" << std::endl;
 }
 
 /**
@@ -291,60 +619,306 @@ bool writeGlobalPartitionTableHeaderAndEntries(std::ofstream& outfile) {
  */
 int main(int argc, char **argv)
 {
-    if (argc < 2)
+    // iterate thru args; images are sparse unless preallocation is asked for
+    const char* imageFileName = nullptr;
+    const char* layoutFileName = nullptr;
+    const char* cacheDirectory = nullptr;
+    const char* batchFileName = nullptr;
+    uint64_t maxOutstandingBytes = BATCH_MAX_OUTSTANDING_BYTES;
+    uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+    bool sparse = true;
+    BLOCK_DEVICE_TYPE backend = BLOCK_DEVICE_FILE;
+    uint32_t queueDepth = BLOCK_DEVICE_URING_QUEUE_DEPTH;
+    IMAGE_FORMAT format = IMAGE_FORMAT_RAW;
+    uint32_t sectorSize = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0)
+        {
+            sparse = true;
+        }
+        else if (strcmp(argv[i], "-P") == 0)
+        {
+            sparse = false;
+        }
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, queueDepth))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            if (!parseBlockDeviceType(argv[++i], backend))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+        {
+            layoutFileName = argv[++i];
+        }
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, sectorSize) || !isSupportedSectorSize(sectorSize))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+        {
+            batchFileName = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-outstanding") == 0 && i + 1 < argc)
+        {
+            if (!parseSize(argv[++i], maxOutstandingBytes))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+        {
+            cacheDirectory = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, threadCount))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            if (!parseImageFormat(argv[++i], format))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            imageFileName = argv[i];
+        }
+    }
+
+    // images made within the same second must still get distinct GUIDs
+    srand(std::random_device()());
+
+    if (batchFileName != nullptr)
+    {
+        if (imageFileName != nullptr || layoutFileName != nullptr)
+        {
+            printUsage();
+            return EXIT_FAILURE;
+        }
+
+        if (cacheDirectory != nullptr && format != IMAGE_FORMAT_RAW)
+        {
+            std::cerr << "Error: --cache needs raw image files" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        return buildBatch(batchFileName, cacheDirectory, backend, sparse, format, threadCount, queueDepth, sectorSize == 0 ? BLOCK_SIZE : sectorSize, maxOutstandingBytes)
+                   ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (imageFileName == nullptr)
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    // "-" streams a raw image to standard output, which then only carries
+    // the image; everything else printed goes to standard error
+    int streamFd = -1;
+    if (strcmp(imageFileName, "-") == 0)
+    {
+        if (format != IMAGE_FORMAT_RAW || cacheDirectory != nullptr)
+        {
+            std::cerr << "Error: only raw images without --cache can be written to standard output" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        if (isatty(STDOUT_FILENO))
+        {
+            std::cerr << "Error: standard output is a terminal" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        streamFd = dup(STDOUT_FILENO);
+        if (streamFd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        {
+            std::cerr << "Error: could not write the image to standard output" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t deviceSizeInBytes = 0;
+    uint32_t deviceSectorSize = 0;
+    bool blockDevice = getBlockDeviceSize(imageFileName, deviceSizeInBytes, deviceSectorSize);
+    if (blockDevice && format != IMAGE_FORMAT_RAW)
     {
-        std::cout << "Usage: mkfs <image file name>" << std::endl;
+        std::cerr << "Error: " << imageFileName << " is a block device, only raw images can be written to it" << std::endl;
         return EXIT_FAILURE;
     }
 
+    // a block device dictates its logical sector size
+    if (blockDevice)
+    {
+        if (sectorSize != 0 && sectorSize != deviceSectorSize)
+        {
+            std::cerr << "Error: " << imageFileName << " has " << deviceSectorSize << " byte sectors" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        sectorSize = deviceSectorSize;
+    }
+    else if (sectorSize == 0)
+    {
+        sectorSize = BLOCK_SIZE;
+    }
+
+    if (cacheDirectory != nullptr && (layoutFileName == nullptr || blockDevice || format != IMAGE_FORMAT_RAW))
+    {
+        std::cerr << "Error: --cache needs --layout and a raw image file" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (cacheDirectory != nullptr)
+    {
+        bool built = buildCachedLayoutImage(layoutFileName, cacheDirectory, imageFileName, backend, sparse, threadCount, queueDepth, sectorSize);
+        if (built && sparse && !reportImageAllocation(imageFileName))
+        {
+            std::cerr << "Error: could not stat file " << imageFileName << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        return built ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (layoutFileName != nullptr && streamFd >= 0)
+    {
+        return streamLayoutImage(layoutFileName, streamFd, threadCount, sectorSize) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (layoutFileName != nullptr)
+    {
+        bool built = buildLayoutImage(layoutFileName, imageFileName, backend, sparse, format, threadCount, queueDepth, sectorSize);
+        if (built && !blockDevice && (sparse || format == IMAGE_FORMAT_QCOW2) && !reportImageAllocation(imageFileName))
+        {
+            std::cerr << "Error: could not stat file " << imageFileName << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        return built ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     espSizeInBytes = (1024 * 1024 * 100);
-    espSizeInLogicalBlocks = convertBytesToLogicalBlockAddress(espSizeInBytes) - 1;
-    espStartingLogicalBlockAddress = ALIGNMENT_LBA;
+    espSizeInLogicalBlocks = convertBytesToLogicalBlockAddress(espSizeInBytes, sectorSize) - 1;
+    espStartingLogicalBlockAddress = ALIGNMENT_LBA(sectorSize);
     
     dataSizeInBytes = (1024 * 1024 * 360),
-    dataStartingLogicalBlockAddress = getNextAlignedLBA(espStartingLogicalBlockAddress + espSizeInLogicalBlocks);
-    dataSizeInLogicalBlocks = getNextAlignedLBA(convertBytesToLogicalBlockAddress(dataSizeInBytes)) - 1;
+    dataStartingLogicalBlockAddress = getNextAlignedLBA(espStartingLogicalBlockAddress + espSizeInLogicalBlocks, sectorSize);
+    dataSizeInLogicalBlocks = getNextAlignedLBA(convertBytesToLogicalBlockAddress(dataSizeInBytes, sectorSize), sectorSize) - 1;
 
     imageSizeInBytes = (
-        (BLOCK_SIZE * 1) +                       // Protected Master Boot Record
-        (BLOCK_SIZE * 1) +                       // Primary GPT Header
-        (BLOCK_SIZE * 32) +                      // Primary GPT Partition Table
-        (espSizeInLogicalBlocks * BLOCK_SIZE) +  // ESP partition
-        (dataSizeInLogicalBlocks * BLOCK_SIZE) + // Data partition
-        (GPT_PARTITION_ALIGNMENT * 2) +          // Padding
-        (BLOCK_SIZE * 32) +                      // Secondary GPT Partition Table
-        (BLOCK_SIZE * 1)                         // Secondary GPT Header
+        (sectorSize * 1) +                                           // Protected Master Boot Record
+        (sectorSize * 1) +                                           // Primary GPT Header
+        (sectorSize * GPT_PARTITION_TABLE_SECTORS(sectorSize)) +     // Primary GPT Partition Table
+        (espSizeInLogicalBlocks * sectorSize) +                      // ESP partition
+        (dataSizeInLogicalBlocks * sectorSize) +                     // Data partition
+        (GPT_PARTITION_ALIGNMENT * 2) +                              // Padding
+        (sectorSize * GPT_PARTITION_TABLE_SECTORS(sectorSize)) +     // Secondary GPT Partition Table
+        (sectorSize * 1)                                             // Secondary GPT Header
     );
 
-    srand(time(NULL));
+    // the secondary GPT closes the whole device
+    if (blockDevice)
+    {
+        if (deviceSizeInBytes < imageSizeInBytes)
+        {
+            std::cerr << "Error: " << imageFileName << " is smaller than " << imageSizeInBytes << " bytes" << std::endl;
+            return EXIT_FAILURE;
+        }
 
-    // open file for writing
-    std::ofstream outfile(argv[1], std::ios::binary);
-    if (!outfile)
+        imageSizeInBytes = deviceSizeInBytes;
+    }
+
+    // create the image without writing its contents, a streamed one is
+    // staged in memory and written out at the end
+    std::unique_ptr<BlockDevice> device;
+    MemoryBlockDevice *staging = nullptr;
+    if (streamFd >= 0)
+    {
+        staging = new MemoryBlockDevice(convertBytesToLogicalBlockAddress(imageSizeInBytes, sectorSize), sectorSize);
+        device.reset(staging);
+    }
+    else
+    {
+        device = createBlockDevice(backend, imageFileName, convertBytesToLogicalBlockAddress(imageSizeInBytes, sectorSize), sparse, format, queueDepth, sectorSize);
+    }
+    if (!device)
     {
-        std::cerr << "Error: could not open file " << argv[1] << std::endl;
+        std::cerr << "Error: could not create file " << imageFileName << std::endl;
         return EXIT_FAILURE;
     }
 
     // write master boot record to file
-    if (!writeMasterBootRecord(outfile)) {
-        outfile.close();
-        std::cerr << "Error: could not write MBR to file " << argv[1] << std::endl;
+    uint64_t sizeInLogicalBlocks = convertBytesToLogicalBlockAddress(imageSizeInBytes, sectorSize);
+    if (!writeMasterBootRecord(*device, sizeInLogicalBlocks)) {
+        std::cerr << "Error: could not write MBR to file " << imageFileName << std::endl;
         return EXIT_FAILURE;
     }
 
     // write global partition table header and entries to file
-    if (!writeGlobalPartitionTableHeaderAndEntries(outfile)) {
-        outfile.close();
-        std::cerr << "Error: could not write GTP header/tables" << argv[1] << std::endl;
+    std::vector<GPT_PARTITION_ENTRY> partitions = {
+        {
+            .partitionType = ESP_GUID,
+            .uniqueIdentifier = newGuid(),
+            .firstLogicalBlockAddress = espStartingLogicalBlockAddress,
+            .lastLogicalBlockAddress = espStartingLogicalBlockAddress + espSizeInLogicalBlocks,
+            .flags = 0,
+            .name = u"EFI System Partition"
+        },
+        {
+            .partitionType = LINUX_FILESYSTEM_GUID,
+            .uniqueIdentifier = newGuid(),
+            .firstLogicalBlockAddress = dataStartingLogicalBlockAddress,
+            .lastLogicalBlockAddress = dataStartingLogicalBlockAddress + dataSizeInLogicalBlocks,
+            .flags = 0,
+            .name = u"Root Partition"
+        }
+    };
+    if (!writeGlobalPartitionTableHeaderAndEntries(*device, sizeInLogicalBlocks, partitions)) {
+        std::cerr << "Error: could not write GTP header/tables" << imageFileName << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (staging != nullptr)
+    {
+        return streamStagedImage(*staging, streamFd) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // flush and close file
+    bool flushed = device->flush();
+    device.reset();
+    if (!flushed)
+    {
+        std::cerr << "Error: could not close file " << imageFileName << std::endl;
         return EXIT_FAILURE;
     }
 
-    // close file
-    outfile.close();
-    if (!outfile.good())
+    // report allocated bytes against logical bytes
+    if (!blockDevice && (sparse || format == IMAGE_FORMAT_QCOW2) && !reportImageAllocation(imageFileName))
     {
-        std::cerr << "Error: could not close file " << argv[1] << std::endl;
+        std::cerr << "Error: could not stat file " << imageFileName << std::endl;
         return EXIT_FAILURE;
     }
 
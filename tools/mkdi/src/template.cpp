@@ -0,0 +1,210 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+// linux/fs.h brings its own BLOCK_SIZE, keep the sector size from fs.h
+#pragma push_macro("BLOCK_SIZE")
+#undef BLOCK_SIZE
+#include <linux/fs.h>
+#undef BLOCK_SIZE
+#pragma pop_macro("BLOCK_SIZE")
+#include "crc32.h"
+#include "blockdevice.h"
+#include "template.h"
+
+/**
+ * @brief Append the names, types, sizes and modification times of a host tree
+ * @param  &path: the host directory
+ * @param  &relativePath: the directory relative to the source directory
+ * @param  &fingerprint: the fingerprint, appended to
+ * @retval true if successful, false otherwise
+ */
+static bool fingerprintDirectory(const std::string &path, const std::string &relativePath, std::string &fingerprint)
+{
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr)
+    {
+        std::cerr << "Error: failed to open directory \"" << path << "\"" << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> names;
+    for (struct dirent *entry = readdir(dir); entry != nullptr; entry = readdir(dir))
+    {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+        {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    // sort so that the key does not depend on host directory order
+    std::sort(names.begin(), names.end());
+
+    for (const std::string &name : names)
+    {
+        std::string hostPath = path + "/" + name;
+        struct stat st;
+        if (stat(hostPath.c_str(), &st) != 0)
+        {
+            std::cerr << "Error: failed to stat \"" << hostPath << "\"" << std::endl;
+            return false;
+        }
+
+        std::ostringstream entry;
+        entry << relativePath << "/" << name << '\0' << st.st_mode << ' ' << st.st_size << ' '
+              << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec << '\n';
+        fingerprint += entry.str();
+
+        if (S_ISDIR(st.st_mode) && !fingerprintDirectory(hostPath, relativePath + "/" + name, fingerprint))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool getTemplateKey(const char *layoutFileName, const LAYOUT &layout, uint32_t sectorSize, bool sparse, std::string &key)
+{
+    std::ifstream file(layoutFileName, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Error: failed to open layout file \"" << layoutFileName << "\"" << std::endl;
+        return false;
+    }
+
+    std::ostringstream fingerprint;
+    fingerprint << "mkdi template " << TEMPLATE_FORMAT_VERSION << '\n' << sectorSize << ' ' << sparse << '\n' << file.rdbuf() << '\n';
+
+    std::string sources = fingerprint.str();
+    for (const LAYOUT_PARTITION &partition : layout.partitions)
+    {
+        sources += partition.sourceDirectory + '\n';
+        if (!partition.sourceDirectory.empty() && !fingerprintDirectory(partition.sourceDirectory, "", sources))
+        {
+            return false;
+        }
+    }
+
+    // two independent 32-bit checksums make a 64-bit key
+    std::ostringstream hex;
+    hex << std::hex << std::setfill('0') << std::setw(8) << crc32(sources.data(), sources.size())
+        << std::setw(8) << crc32c(sources.data(), sources.size());
+    key = hex.str();
+    return true;
+}
+
+/**
+ * @brief Copy a byte range between two files
+ * @note copy_file_range shares extents on file systems with reflinks and
+ *       stays in the kernel elsewhere; read/write is the last resort
+ * @param  source: the source file descriptor
+ * @param  destination: the destination file descriptor
+ * @param  offset: the first byte, the same in both files
+ * @param  length: the bytes to copy
+ * @param  &copyFileRange: cleared once copy_file_range turns out unsupported
+ * @param  &buffer: the read/write buffer, allocated on first use
+ * @retval true if successful, false otherwise
+ */
+static bool copyRange(int source, int destination, uint64_t offset, uint64_t length, bool &copyFileRange, std::vector<uint8_t> &buffer)
+{
+    while (length > 0 && copyFileRange)
+    {
+        loff_t sourceOffset = offset, destinationOffset = offset;
+        ssize_t copied = copy_file_range(source, &sourceOffset, destination, &destinationOffset, length, 0);
+        if (copied > 0)
+        {
+            offset += copied;
+            length -= copied;
+        }
+        else if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            copyFileRange = false;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    buffer.resize(TEMPLATE_COPY_BUFFER_SIZE);
+    while (length > 0)
+    {
+        ssize_t bytesRead = pread(source, buffer.data(), std::min<uint64_t>(length, buffer.size()), offset);
+        if (bytesRead <= 0 || pwrite(destination, buffer.data(), bytesRead, offset) != bytesRead)
+        {
+            return false;
+        }
+
+        offset += bytesRead;
+        length -= bytesRead;
+    }
+
+    return true;
+}
+
+bool cloneImage(const char *sourceFileName, const char *destinationFileName, bool &reflinked)
+{
+    int source = open(sourceFileName, O_RDONLY);
+    if (source < 0)
+    {
+        std::cerr << "Error: could not open file " << sourceFileName << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    int destination = fstat(source, &st) == 0 ? open(destinationFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (destination < 0)
+    {
+        std::cerr << "Error: could not create file " << destinationFileName << std::endl;
+        close(source);
+        return false;
+    }
+
+    // a reflink shares every extent and costs only metadata
+    reflinked = ioctl(destination, FICLONE, source) == 0;
+
+    bool cloned = reflinked || ftruncate(destination, st.st_size) == 0;
+    bool copyFileRange = true;
+    std::vector<uint8_t> buffer;
+    for (uint64_t offset = 0; cloned && !reflinked && offset < (uint64_t)st.st_size;)
+    {
+        // copy the data extents only, the holes are already there
+        off_t data = lseek(source, offset, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+        {
+            break;
+        }
+
+        off_t hole = data < 0 ? st.st_size : lseek(source, data, SEEK_HOLE);
+        if (data < 0)
+        {
+            data = offset;
+        }
+        if (hole < 0)
+        {
+            hole = st.st_size;
+        }
+
+        cloned = copyRange(source, destination, data, hole - data, copyFileRange, buffer);
+        offset = hole;
+    }
+
+    cloned = close(destination) == 0 && cloned;
+    close(source);
+    if (!cloned)
+    {
+        std::cerr << "Error: could not copy " << sourceFileName << " to " << destinationFileName << std::endl;
+    }
+
+    return cloned;
+}
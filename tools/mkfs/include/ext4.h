@@ -0,0 +1,323 @@
+#ifndef __EXT4_H
+#define __EXT4_H
+
+#include <stdint.h>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "fs.h"
+#include "blockdevice.h"
+
+#define EXT4_SIGNATURE 0xEF53
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_BLOCK_SIZE 4096
+#define EXT4_LOG_BLOCK_SIZE 2 // 1024 << 2
+#define EXT4_SECTORS_PER_BLOCK (EXT4_BLOCK_SIZE / BLOCK_SIZE) // in the 512 byte units of i_blocks, not device sectors
+#define EXT4_BLOCKS_PER_GROUP (EXT4_BLOCK_SIZE * 8)
+#define EXT4_INODE_SIZE 256
+#define EXT4_INODES_PER_BLOCK (EXT4_BLOCK_SIZE / EXT4_INODE_SIZE)
+#define EXT4_EXTRA_INODE_SIZE 32 // the fields after the 128 byte base inode that are in use
+#define EXT4_DESCRIPTOR_SIZE 32
+#define EXT4_BYTES_PER_INODE 16384
+#define EXT4_LOG_GROUPS_PER_FLEX 4 // 16 groups share one run of bitmaps and inode tables
+#define EXT4_MIN_LAST_GROUP_BLOCKS 512
+#define EXT4_RESERVED_PERCENT 5
+#define EXT4_MAX_NAME_LENGTH 255
+#define EXT4_STAGING_BUFFER_SIZE (8 * 1024 * 1024)
+
+// revision and states
+#define EXT4_DYNAMIC_REVISION 1
+#define EXT4_STATE_CLEAN 0x0001
+#define EXT4_ERRORS_CONTINUE 1
+#define EXT4_OS_LINUX 0
+#define EXT4_CHECKSUM_CRC32C 1
+#define EXT4_HASH_HALF_MD4 1
+#define EXT4_FLAGS_UNSIGNED_HASH 0x0002
+
+// feature flags
+#define EXT4_FEATURE_COMPAT_EXT_ATTR 0x0008
+#define EXT4_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT4_FEATURE_INCOMPAT_EXTENTS 0x0040
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG 0x0200
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED 0x2000 // checksums seeded from s_checksum_seed, so the UUID can change
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK 0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE 0x0040
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+
+// block group flags
+#define EXT4_BG_INODE_UNINIT 0x0001  // inode table and bitmap are not initialized
+#define EXT4_BG_BLOCK_UNINIT 0x0002  // block bitmap is not initialized
+#define EXT4_BG_INODE_ZEROED 0x0004  // inode table is zeroed
+
+// reserved inodes
+#define EXT4_ROOT_INODE 2
+#define EXT4_FIRST_INODE 11
+#define EXT4_LOST_AND_FOUND_INODE 11
+#define EXT4_LOST_AND_FOUND_BLOCKS 4 // e2fsck wants room to reconnect without growing the directory
+
+// inode modes and flags
+#define EXT4_MODE_DIRECTORY 0040000
+#define EXT4_MODE_FILE 0100000
+#define EXT4_INODE_EXTENTS_FLAG 0x00080000
+
+// directory entry file types
+#define EXT4_TYPE_FILE 1
+#define EXT4_TYPE_DIRECTORY 2
+#define EXT4_TYPE_CHECKSUM 0xDE
+
+// extents
+#define EXT4_EXTENT_SIGNATURE 0xF30A
+#define EXT4_INLINE_EXTENTS 4
+#define EXT4_MAX_EXTENT_BLOCKS 32768 // longer lengths mark uninitialized extents
+#define EXT4_EXTENTS_PER_BLOCK ((EXT4_BLOCK_SIZE - sizeof(EXT4_EXTENT_HEADER) - sizeof(uint32_t)) / sizeof(EXT4_EXTENT))
+
+typedef struct _EXT4_SUPERBLOCK
+{
+    uint32_t inodeCount;
+    uint32_t blockCount;
+    uint32_t reservedBlockCount;
+    uint32_t freeBlockCount;
+    uint32_t freeInodeCount;
+    uint32_t firstDataBlock;
+    uint32_t logBlockSize;
+    uint32_t logClusterSize;
+    uint32_t blocksPerGroup;
+    uint32_t clustersPerGroup;
+    uint32_t inodesPerGroup;
+    uint32_t mountTime;
+    uint32_t writeTime;
+    uint16_t mountCount;
+    uint16_t maxMountCount;
+    uint16_t signature;
+    uint16_t state;
+    uint16_t errors;
+    uint16_t minorRevision;
+    uint32_t lastCheckTime;
+    uint32_t checkInterval;
+    uint32_t creatorOS;
+    uint32_t revision;
+    uint16_t defaultReservedUid;
+    uint16_t defaultReservedGid;
+    uint32_t firstInode;
+    uint16_t inodeSize;
+    uint16_t blockGroup; // group holding this copy
+    uint32_t featureCompat;
+    uint32_t featureIncompat;
+    uint32_t featureReadOnlyCompat;
+    uint8_t uuid[16];
+    char volumeName[16];
+    char lastMounted[64];
+    uint32_t algorithmUsageBitmap;
+    uint8_t preallocBlocks;
+    uint8_t preallocDirectoryBlocks;
+    uint16_t reservedGdtBlocks;
+    uint8_t journalUuid[16];
+    uint32_t journalInode;
+    uint32_t journalDevice;
+    uint32_t lastOrphan;
+    uint32_t hashSeed[4];
+    uint8_t defaultHashVersion;
+    uint8_t journalBackupType;
+    uint16_t descriptorSize;
+    uint32_t defaultMountOptions;
+    uint32_t firstMetaGroup;
+    uint32_t createTime;
+    uint32_t journalBlocks[17];
+    uint32_t blockCountHigh;
+    uint32_t reservedBlockCountHigh;
+    uint32_t freeBlockCountHigh;
+    uint16_t minExtraInodeSize;
+    uint16_t wantExtraInodeSize;
+    uint32_t flags;
+    uint16_t raidStride;
+    uint16_t mmpInterval;
+    uint64_t mmpBlock;
+    uint32_t raidStripeWidth;
+    uint8_t logGroupsPerFlex;
+    uint8_t checksumType;
+    uint16_t reservedPad;
+    uint64_t kilobytesWritten;
+    uint8_t reserved[240];
+    uint32_t checksumSeed; // CRC32C of the UUID the volume was made with
+    uint8_t reservedHigh[392];
+    uint32_t checksum; // CRC32C of the preceding bytes
+} __attribute__((packed)) EXT4_SUPERBLOCK;
+
+typedef struct _EXT4_GROUP_DESCRIPTOR
+{
+    uint32_t blockBitmapBlock;
+    uint32_t inodeBitmapBlock;
+    uint32_t inodeTableBlock;
+    uint16_t freeBlockCount;
+    uint16_t freeInodeCount;
+    uint16_t usedDirectoryCount;
+    uint16_t flags;
+    uint32_t excludeBitmapBlock;
+    uint16_t blockBitmapChecksum;
+    uint16_t inodeBitmapChecksum;
+    uint16_t unusedInodeCount; // inodes at the end of the table never used, and possibly not zeroed
+    uint16_t checksum;
+} __attribute__((packed)) EXT4_GROUP_DESCRIPTOR;
+
+typedef struct _EXT4_EXTENT_HEADER
+{
+    uint16_t signature;
+    uint16_t count;
+    uint16_t maxCount;
+    uint16_t depth; // 0 for leaves
+    uint32_t generation;
+} __attribute__((packed)) EXT4_EXTENT_HEADER;
+
+typedef struct _EXT4_EXTENT
+{
+    uint32_t logicalBlock;
+    uint16_t blockCount;
+    uint16_t physicalBlockHigh;
+    uint32_t physicalBlockLow;
+} __attribute__((packed)) EXT4_EXTENT;
+
+typedef struct _EXT4_EXTENT_INDEX
+{
+    uint32_t logicalBlock;
+    uint32_t leafBlockLow;
+    uint16_t leafBlockHigh;
+    uint16_t unused;
+} __attribute__((packed)) EXT4_EXTENT_INDEX;
+
+typedef struct _EXT4_INODE
+{
+    uint16_t mode;
+    uint16_t uid;
+    uint32_t size;
+    uint32_t accessTime;
+    uint32_t changeTime;
+    uint32_t modifyTime;
+    uint32_t deleteTime;
+    uint16_t gid;
+    uint16_t linkCount;
+    uint32_t sectorCount; // in 512 byte units
+    uint32_t flags;
+    uint32_t version;
+    uint8_t block[60]; // extent header and up to four extents
+    uint32_t generation;
+    uint32_t fileAcl;
+    uint32_t sizeHigh;
+    uint32_t fragmentAddress;
+    uint16_t sectorCountHigh;
+    uint16_t fileAclHigh;
+    uint16_t uidHigh;
+    uint16_t gidHigh;
+    uint16_t checksumLow;
+    uint16_t reserved;
+    uint16_t extraSize;
+    uint16_t checksumHigh;
+    uint32_t changeTimeExtra; // nanoseconds << 2
+    uint32_t modifyTimeExtra;
+    uint32_t accessTimeExtra;
+    uint32_t createTime;
+    uint32_t createTimeExtra;
+    uint32_t versionHigh;
+    uint32_t projectId;
+    uint8_t padding[96];
+} __attribute__((packed)) EXT4_INODE;
+
+typedef struct _EXT4_DIRECTORY_ENTRY
+{
+    uint32_t inode;
+    uint16_t recordLength;
+    uint8_t nameLength;
+    uint8_t type;
+    char name[];
+} __attribute__((packed)) EXT4_DIRECTORY_ENTRY;
+
+// the fake entry closing every directory block when metadata_csum is on
+typedef struct _EXT4_DIRECTORY_TAIL
+{
+    uint32_t inode; // always 0
+    uint16_t recordLength;
+    uint8_t nameLength;
+    uint8_t type; // EXT4_TYPE_CHECKSUM
+    uint32_t checksum;
+} __attribute__((packed)) EXT4_DIRECTORY_TAIL;
+
+// an extent while the volume is being built
+typedef struct _EXT4_RUN
+{
+    uint32_t logicalBlock;
+    uint32_t physicalBlock;
+    uint32_t blockCount;
+} EXT4_RUN;
+
+// layout of an ext4 volume, worked out before anything is written
+typedef struct _EXT4_VOLUME
+{
+    uint64_t partitionStartingLogicalBlockAddress;
+    uint32_t sectorsPerBlock; // logical sectors of the device per block
+    uint32_t blockCount;
+    uint32_t groupCount;
+    uint32_t inodesPerGroup;
+    uint32_t inodeTableBlocks; // per group
+    uint32_t descriptorBlocks;
+    uint32_t checksumSeed; // CRC32C of the UUID
+    uint8_t uuid[16];
+    std::vector<EXT4_GROUP_DESCRIPTOR> descriptors;
+    std::vector<uint64_t> blockBitmap; // whole volume, bit set when the block is in use
+    std::vector<EXT4_INODE> inodes;    // inodes 1.. in use, handed out in order from group 0
+    std::vector<uint32_t> groupInodes; // used inodes per group
+    uint32_t nextDataBlock;
+} EXT4_VOLUME;
+
+// a file or directory of the host tree copied into the volume
+typedef struct _EXT4_NODE
+{
+    std::string hostPath;
+    std::string name;
+    bool isDirectory;
+    uint64_t size;
+    uint32_t parent;
+    std::vector<uint32_t> children;
+    uint16_t mode;
+    struct timespec accessTime;
+    struct timespec modifyTime;
+    struct timespec changeTime;
+    uint32_t inode;
+    std::vector<EXT4_RUN> runs;
+    uint32_t treeBlock; // extent leaf blocks when the runs do not fit the inode
+    std::vector<uint8_t> tree;
+    std::vector<uint8_t> directory; // directory blocks
+} EXT4_NODE;
+
+class EXT4
+{
+public:
+    static bool makeFileSystem(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, const char *sourceDirectory = nullptr);
+    static bool renewVolumeIdentifier(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress);
+
+private:
+    static bool planVolume(EXT4_VOLUME &volume, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, uint32_t sectorSize);
+    static void newVolumeIdentifier(uint8_t (&uuid)[16]);
+    static bool hasSuperblockBackup(uint32_t group);
+    static uint32_t getGroupBlockCount(const EXT4_VOLUME &volume, uint32_t group);
+    static void markBlocks(EXT4_VOLUME &volume, uint32_t firstBlock, uint32_t blockCount);
+    static bool isBlockUsed(const EXT4_VOLUME &volume, uint32_t block);
+    static bool allocateInode(EXT4_VOLUME &volume, uint32_t &inode);
+    static bool allocateBlocks(EXT4_VOLUME &volume, uint32_t blockCount, std::vector<EXT4_RUN> &runs);
+    static uint32_t checksum(uint32_t seed, const void *data, size_t length);
+    static uint32_t getInodeSeed(const EXT4_VOLUME &volume, uint32_t inode);
+    static void buildDirectory(const EXT4_VOLUME &volume, std::vector<EXT4_NODE> &nodes, uint32_t directory);
+    static void buildExtents(const EXT4_VOLUME &volume, EXT4_NODE &node, EXT4_INODE &inode);
+    static void setInodeChecksum(const EXT4_VOLUME &volume, uint32_t inode, EXT4_INODE &raw);
+    static void fillInode(EXT4_VOLUME &volume, std::vector<EXT4_NODE> &nodes, uint32_t node);
+    static bool allocateNodes(EXT4_VOLUME &volume, std::vector<EXT4_NODE> &nodes);
+    static bool writeBlocks(BlockDevice &device, const EXT4_VOLUME &volume, uint32_t block, const void *buffer, uint32_t blockCount);
+    static bool writeMetadata(BlockDevice &device, EXT4_VOLUME &volume);
+    static bool writeTrees(BlockDevice &device, const EXT4_VOLUME &volume, const std::vector<EXT4_NODE> &nodes);
+
+    // populating the volume from a host directory (ext4populate.cpp)
+    static bool scanDirectory(std::vector<EXT4_NODE> &nodes, uint32_t directory);
+    static bool writeFiles(BlockDevice &device, const EXT4_VOLUME &volume, const std::vector<EXT4_NODE> &nodes);
+};
+#endif // __EXT4_H
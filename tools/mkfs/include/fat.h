@@ -3,6 +3,37 @@
 
 #include <stdint.h>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "blockdevice.h"
+
+#define FAT32_CLUSTER_MASK 0x0FFFFFFF
+#define FAT12_END_OF_CHAIN 0x0FFF
+#define FAT16_END_OF_CHAIN 0xFFFF
+#define FAT32_END_OF_CHAIN 0x0FFFFFFF
+#define FAT_FIRST_CLUSTER 2
+#define FAT12_MAX_CLUSTERS 4084
+#define FAT16_MAX_CLUSTERS 65524
+#define FAT32_MAX_CLUSTERS 0x0FFFFFF5
+#define FAT_NUMBER_OF_FATS 2
+#define FAT_MEDIA_FIXED_DISK 0xF8
+#define FAT32_RESERVED_SECTORS 32
+#define FAT32_FSINFO_SECTOR 1
+#define FAT32_BACKUP_BOOT_SECTOR 6
+#define FAT_FSINFO_UNKNOWN 0xFFFFFFFF
+#define FAT_ROOT_ENTRY_COUNT 512
+#define FAT_MAX_CLUSTER_SIZE 32768
+#define FAT_STAGING_BUFFER_SIZE (8 * 1024 * 1024)
+#define FAT_WORKER_BATCH_SIZE (32 * 1024 * 1024) // file data handed to a population worker at a time
+#define FAT_COPY_IN_KERNEL_MIN_SIZE (1024 * 1024) // files from this size on are copied by the kernel when nothing needs their hash
+#define FAT_MANIFEST_SIGNATURE 0x464E4D5441463247 // "G2FATMNF"
+#define FAT_MANIFEST_VERSION 3
+#define FAT_LONG_NAME_CHARACTERS 13 // UTF-16 code units per long name entry
+#define FAT_LONG_NAME_MAX_LENGTH 255
+#define FAT_LONG_NAME_LAST_ENTRY 0x40 // ORed into the order of the entry holding the end of the name
+#define FAT_CASE_LOWER_BASE 0x08 // DIR_NTRes: the 8 character base is lower case
+#define FAT_CASE_LOWER_EXTENSION 0x10 // DIR_NTRes: the 3 character extension is lower case
 
 typedef struct _VOLUME_BOOT_RECORD
 {
@@ -37,6 +68,34 @@ typedef struct _VOLUME_BOOT_RECORD
     uint16_t signature;
 } __attribute__((packed)) VOLUME_BOOT_RECORD;
 
+// FAT12 and FAT16 share the BPB up to BPB_TotSec32, then go straight to the
+// extended boot signature fields
+typedef struct _VOLUME_BOOT_RECORD_FAT16
+{
+    uint8_t BS_jmpBoot[3];
+    uint8_t BS_OEMName[8];
+    uint16_t BPB_BytsPerSec;
+    uint8_t BPB_SecPerClus;
+    uint16_t BPB_RsvdSecCnt;
+    uint8_t BPB_NumFATs;
+    uint16_t BPB_RootEntCnt;
+    uint16_t BPB_TotSec16;
+    uint8_t BPB_Media;
+    uint16_t BPB_FATSz16;
+    uint16_t BPB_SecPerTrk;
+    uint16_t BPB_NumHeads;
+    uint32_t BPB_HiddSec;
+    uint32_t BPB_TotSec32;
+    uint8_t BS_DrvNum;
+    uint8_t BS_Reserved1;
+    uint8_t BS_BootSig;
+    uint32_t BS_VolID;
+    uint8_t BS_VolLab[11];
+    uint8_t BS_FilSysType[8];
+    uint8_t padding[448];
+    uint16_t signature;
+} __attribute__((packed)) VOLUME_BOOT_RECORD_FAT16;
+
 typedef struct _FS_INFO
 {
     uint32_t FSI_LeadSig;
@@ -64,6 +123,20 @@ typedef struct _FAT32_DIRECTORY_ENTRY
     uint32_t DIR_FileSize;
 } __attribute__((packed)) FAT32_DIRECTORY_ENTRY;
 
+// one part of a VFAT long name; the parts sit in front of their short name
+// entry, the last part first
+typedef struct _FAT_LONG_NAME_ENTRY
+{
+    uint8_t LDIR_Ord;
+    uint16_t LDIR_Name1[5];
+    uint8_t LDIR_Attr;
+    uint8_t LDIR_Type;
+    uint8_t LDIR_Chksum;
+    uint16_t LDIR_Name2[6];
+    uint16_t LDIR_FstClusLO;
+    uint16_t LDIR_Name3[2];
+} __attribute__((packed)) FAT_LONG_NAME_ENTRY;
+
 typedef enum {
     ATTR_READ_ONLY = 0x01,
     ATTR_HIDDEN = 0x02,
@@ -77,16 +150,128 @@ typedef enum {
 } FAT32_DIR_ATTR;
 
 
+// on-disk layout of a FAT volume, worked out before anything is written
+typedef struct _FAT_GEOMETRY
+{
+    uint64_t partitionStartingLogicalBlockAddress;
+    uint32_t totalSectors;
+    uint16_t bytesPerSector; // the logical sector size of the device, 512 or 4096
+    uint8_t fatType; // 12, 16 or 32
+    uint8_t sectorsPerCluster;
+    uint16_t reservedSectors;
+    uint8_t numberOfFATs;
+    uint16_t rootEntryCount;       // 0 on FAT32
+    uint32_t rootDirectorySectors; // 0 on FAT32
+    uint32_t fatSize;              // sectors per FAT
+    uint32_t clusterCount;
+    uint32_t rootCluster; // 0 on FAT12/16, the root directory has a fixed region
+} FAT_GEOMETRY;
+
+class FATAllocator;
+
+// a file or directory of the host tree copied into the volume
+typedef struct _FAT_NODE
+{
+    std::string hostPath;
+    uint8_t shortName[11];
+    uint8_t caseFlags;       // FAT_CASE_* for a short name that is all lower case
+    std::u16string longName; // empty when the short name and case flags carry the whole name
+    bool isDirectory;
+    uint64_t size;
+    uint32_t parent;
+    std::vector<uint32_t> children;
+    uint32_t firstCluster;
+    uint32_t clusterCount;
+    uint16_t time;
+    uint16_t date;
+    int64_t modifyTime; // host modification time in nanoseconds
+    int64_t changeTime; // host status change time in nanoseconds
+    uint64_t hostInode;
+    uint32_t crc32;     // of the file contents
+    uint64_t entryLogicalBlockAddress; // sector holding the directory entry, 0 for the root
+    uint32_t entryOffset;              // byte offset of the directory entry in that sector
+} FAT_NODE;
+
+// the manifest kept next to an image for incremental rebuilds: this header,
+// then one entry per node, each followed by its path relative to the source
+// directory
+typedef struct _FAT_MANIFEST_HEADER
+{
+    uint64_t signature;
+    uint32_t version;
+    uint32_t crc32; // of the entries and paths
+    uint64_t partitionStartingLogicalBlockAddress;
+    uint32_t totalSectors;
+    uint32_t fatSize;
+    uint8_t fatType;
+    uint8_t sectorsPerCluster;
+    uint16_t bytesPerSector;
+    uint32_t fatCrc32; // of FAT #1 as written, to notice images changed behind the manifest's back
+    uint32_t entryCount;
+} __attribute__((packed)) FAT_MANIFEST_HEADER;
+
+typedef struct _FAT_MANIFEST_ENTRY
+{
+    uint64_t size;
+    int64_t modifyTime;
+    int64_t changeTime;
+    uint64_t hostInode;
+    uint64_t entryLogicalBlockAddress;
+    uint32_t entryOffset;
+    uint32_t crc32;
+    uint32_t firstCluster;
+    uint32_t clusterCount;
+    uint8_t isDirectory;
+    uint8_t reserved;
+    uint16_t pathLength;
+} __attribute__((packed)) FAT_MANIFEST_ENTRY;
+
 class FAT
 {
 public:
-    static bool makeFileSystem(std::fstream &diskImage, uint8_t fatSize, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors);
+    static bool makeFileSystem(BlockDevice &device, uint8_t fatSize, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors, const char *sourceDirectory = nullptr, const char *manifestPath = nullptr, uint32_t threadCount = 1);
+    static bool planGeometry(uint8_t fatSize, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors, uint16_t bytesPerSector, FAT_GEOMETRY &geometry);
+    static uint32_t getEndOfChain(const FAT_GEOMETRY &geometry);
+    static uint32_t getFATEntry(const FAT_GEOMETRY &geometry, const uint8_t *fat, uint32_t cluster);
+    static void setFATEntry(const FAT_GEOMETRY &geometry, uint8_t *fat, uint32_t cluster, uint32_t value);
+    static bool renewVolumeIdentifier(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress);
 
 private:
-    static bool writeVolumeBootRecord(std::fstream &diskImage, uint8_t fatSize, uint32_t totalSectors, VOLUME_BOOT_RECORD &vbr);
-    static bool writeFSInfo(std::fstream &diskImage);
-    static bool writeFATs(std::fstream &diskImage, uint64_t partitionStartingLogicalBlockAddress, const VOLUME_BOOT_RECORD &vbr);
-    static bool writeFileDirectoryEntries(std::fstream &diskImage, uint64_t partitionStartingLogicalBlockAddress, const VOLUME_BOOT_RECORD &vbr);
+    static uint8_t getDefaultSectorsPerCluster(uint8_t fatType, uint32_t totalSectors, uint16_t bytesPerSector);
+    static bool layoutGeometry(uint8_t fatType, uint8_t sectorsPerCluster, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors, uint16_t bytesPerSector, FAT_GEOMETRY &geometry);
+    static bool planGeometryForType(uint8_t fatType, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors, uint16_t bytesPerSector, FAT_GEOMETRY &geometry);
+    static bool writeVolumeBootRecord(BlockDevice &device, uint64_t logicalBlockAddress, const FAT_GEOMETRY &geometry);
+    static bool writeFSInfo(BlockDevice &device, uint64_t logicalBlockAddress, uint32_t freeCount, uint32_t nextFree);
+    static bool writeFATs(BlockDevice &device, const FAT_GEOMETRY &geometry, const uint8_t *fat);
+    static uint64_t getFATStartingLogicalBlockAddress(const FAT_GEOMETRY &geometry);
+    static uint64_t getRootDirectoryLogicalBlockAddress(const FAT_GEOMETRY &geometry);
+    static uint64_t clusterToLogicalBlockAddress(const FAT_GEOMETRY &geometry, uint32_t cluster);
     static void getFATDirEntryTimeAndDate(uint16_t &time, uint16_t &date);
+    static void getFATDirEntryTimeAndDate(time_t timestamp, uint16_t &time, uint16_t &date);
+
+    // populating the volume from a host directory (fatpopulate.cpp)
+    static bool populate(BlockDevice &device, const FAT_GEOMETRY &geometry, FATAllocator &allocator, const char *sourceDirectory, uint32_t threadCount, bool hashContents, std::vector<FAT_NODE> &nodes);
+    static bool scanDirectory(std::vector<FAT_NODE> &nodes, uint32_t directory);
+    static uint32_t getDirectoryEntryCount(const std::vector<FAT_NODE> &nodes, uint32_t directory);
+    static bool allocateClusters(std::vector<FAT_NODE> &nodes, const FAT_GEOMETRY &geometry, FATAllocator &allocator);
+    static bool writeDirectories(BlockDevice &device, const FAT_GEOMETRY &geometry, const std::vector<FAT_NODE> &nodes);
+    static bool writeFiles(BlockDevice &device, const FAT_GEOMETRY &geometry, std::vector<FAT_NODE> &nodes, uint32_t threadCount, bool hashContents);
+    static bool writeFileBatch(BlockDevice &device, const FAT_GEOMETRY &geometry, std::vector<FAT_NODE> &nodes, const uint32_t *files, size_t fileCount, uint8_t *staging, bool hashContents, std::mutex *deviceMutex);
+    static FAT32_DIRECTORY_ENTRY makeDirectoryEntry(const FAT_NODE &node, const uint8_t (&name)[11], uint32_t cluster);
+
+    // short names, long names and case flags of directory entries (fatname.cpp)
+    static bool makeNames(std::vector<FAT_NODE> &nodes, uint32_t directory);
+    static uint8_t getShortNameChecksum(const uint8_t (&name)[11]);
+    static uint32_t getLongNameEntryCount(const FAT_NODE &node);
+    static FAT_LONG_NAME_ENTRY *makeLongNameEntries(const FAT_NODE &node, FAT_LONG_NAME_ENTRY *entries);
+
+    // incremental rebuilds driven by a manifest (fatmanifest.cpp)
+    static void locateDirectoryEntries(const FAT_GEOMETRY &geometry, std::vector<FAT_NODE> &nodes);
+    static bool readManifest(const char *manifestPath, FAT_MANIFEST_HEADER &header, std::vector<FAT_NODE> &nodes);
+    static bool writeManifest(const char *manifestPath, const FAT_GEOMETRY &geometry, const uint8_t *fat, const std::vector<FAT_NODE> &nodes);
+    static bool hashFile(const FAT_NODE &node, uint32_t &crc);
+    static bool writeDirectoryEntries(BlockDevice &device, const std::vector<FAT_NODE> &nodes, const std::vector<uint32_t> &changed);
+    static bool writeDirtyFATSectors(BlockDevice &device, const FAT_GEOMETRY &geometry, const uint8_t *fat, const uint8_t *original);
+    static bool updateFileSystem(BlockDevice &device, const FAT_GEOMETRY &geometry, const char *sourceDirectory, const char *manifestPath, uint32_t threadCount, bool &updated);
 };
 #endif // __FAT_H
@@ -0,0 +1,62 @@
+#ifndef __FATALLOC_H
+#define __FATALLOC_H
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <vector>
+#include "fat.h"
+
+// a run of clusters changed since the last commit
+typedef struct _FAT_ALLOCATOR_RUN
+{
+    uint32_t firstCluster;
+    uint32_t clusterCount;
+    bool allocated;
+} FAT_ALLOCATOR_RUN;
+
+/**
+ * Free cluster allocator over an in-memory FAT. Free space is kept as a bitmap
+ * (one bit per cluster, set when free) and as free extents indexed both by
+ * size, for best fit contiguous requests in O(log n), and by start, for
+ * coalescing. The FAT itself is only touched by commit, which writes every
+ * changed run back at once.
+ */
+class FATAllocator
+{
+public:
+    FATAllocator(const FAT_GEOMETRY &geometry, uint8_t *fat);
+
+    void load();
+    bool allocate(uint32_t clusterCount, uint32_t &firstCluster);
+    bool free(uint32_t firstCluster, uint32_t clusterCount);
+    void commit();
+
+    bool isFree(uint32_t cluster) const;
+    uint32_t getFreeCount() const { return freeCount; }
+    uint32_t getLargestExtent() const;
+    uint32_t getFirstFree() const;
+
+private:
+    void scanFAT32();
+    void scanFAT16();
+    void scanFAT12();
+    void buildExtents();
+    void insertExtent(uint32_t firstCluster, uint32_t clusterCount);
+    void eraseExtent(uint32_t firstCluster, uint32_t clusterCount);
+    void markBitmap(uint32_t firstCluster, uint32_t clusterCount, bool free);
+
+    FAT_GEOMETRY geometry;
+    uint8_t *fat;
+    uint32_t freeCount;
+
+    // bit (cluster - FAT_FIRST_CLUSTER) is set when the cluster is free
+    std::vector<uint64_t> bitmap;
+
+    // free extents as (size, first cluster), smallest first, and first cluster -> size
+    std::set<std::pair<uint32_t, uint32_t>> extentsBySize;
+    std::map<uint32_t, uint32_t> extentsByStart;
+
+    std::vector<FAT_ALLOCATOR_RUN> pendingRuns;
+};
+#endif // __FATALLOC_H
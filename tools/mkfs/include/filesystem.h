@@ -0,0 +1,54 @@
+#ifndef __FILESYSTEM_H
+#define __FILESYSTEM_H
+
+#include <stdint.h>
+#include <string>
+#include "blockdevice.h"
+
+/**
+ * @brief Check the options of a file system before anything is written
+ * @param  &partitionType: the file system (i.e. vfat, ext4, g2fs)
+ * @param  fatSize: the FAT size, 0 to pick it from the partition size
+ * @param  groupCount: the number of g2fs allocation groups
+ * @retval true if the options are valid, false otherwise
+ */
+bool checkFileSystemOptions(const std::string &partitionType, uint8_t fatSize, uint32_t groupCount);
+
+/**
+ * @brief Check that a file system can be populated without holding its file data
+ * @note Such a file system hands every run of file data to
+ *       BlockDevice::referenceHostFile first, so a device planning a
+ *       streamed image keeps nothing but metadata in memory
+ * @param  &partitionType: the file system (i.e. vfat, ext4, g2fs)
+ * @param  *manifestPath: the manifest the file system is built with, or nullptr
+ * @retval true if its file data can be referenced, false otherwise
+ */
+bool canReferenceHostFiles(const std::string &partitionType, const char *manifestPath);
+
+/**
+ * @brief Make a file system on a partition and optionally populate it
+ * @param  &device: the block device
+ * @param  partitionStartingLogicalBlockAddress: the first block of the partition
+ * @param  partitionType: the file system (i.e. vfat, ext4, g2fs)
+ * @param  fatSize: the FAT size, 0 to pick it from the partition size
+ * @param  groupCount: the number of g2fs allocation groups
+ * @param  totalSectors: the size of the partition in blocks
+ * @param  *sourceDirectory: the host directory to copy in, or nullptr
+ * @param  *manifestPath: the manifest of an incremental vfat build, or nullptr
+ * @param  threadCount: the number of threads populating a vfat partition
+ * @retval true if successful, false otherwise
+ */
+bool makeFileSystem(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, std::string partitionType, uint8_t fatSize, uint32_t groupCount, uint64_t totalSectors, const char *sourceDirectory, const char *manifestPath, uint32_t threadCount);
+
+/**
+ * @brief Give the file system on a partition a new volume identifier
+ * @note Used on images cloned from a template; for ext4 the UUID and the
+ *       superblock checksums change, the other checksums use the stored seed
+ * @param  &device: the block device
+ * @param  partitionStartingLogicalBlockAddress: the first block of the partition
+ * @param  partitionType: the file system (i.e. vfat, ext4, g2fs)
+ * @retval true if successful, false otherwise
+ */
+bool renewVolumeIdentifier(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, std::string partitionType);
+
+#endif // __FILESYSTEM_H
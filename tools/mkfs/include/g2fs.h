@@ -0,0 +1,97 @@
+#ifndef __G2FS_H
+#define __G2FS_H
+
+#include <stdint.h>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "fs.h"
+#include "blockdevice.h"
+
+#define G2FS_DEFAULT_GROUP_COUNT 4
+#define G2FS_MAX_GROUP_COUNT 1024
+#define G2FS_MIN_GROUP_BLOCKS 1024 // 4 MiB
+#define G2FS_BYTES_PER_INODE 16384
+#define G2FS_STAGING_BUFFER_SIZE (8 * 1024 * 1024)
+#define G2FS_INDEX_ENTRIES_PER_NODE ((G2FS_BLOCK_SIZE - sizeof(G2FS_NODE_HEADER)) / sizeof(G2FS_NODE_INDEX))
+#define G2FS_EXTENTS_PER_NODE ((G2FS_BLOCK_SIZE - sizeof(G2FS_NODE_HEADER)) / sizeof(G2FS_EXTENT))
+
+// an allocation group while the volume is being built
+typedef struct _G2FS_GROUP
+{
+    G2FS_GROUP_DESCRIPTOR descriptor;
+    std::vector<uint64_t> blockBitmap; // bit set when the block is in use
+    std::vector<uint64_t> inodeBitmap; // bit set when the inode is in use
+    uint64_t blockBitmapBlocks;
+    uint64_t inodeBitmapBlocks;
+    uint64_t nextDataBlock; // blocks are handed out in order on a fresh volume
+    uint32_t nextInode;
+    std::vector<G2FS_INODE> inodes; // the used part of the inode table, inodes are handed out in order too
+} G2FS_GROUP;
+
+// layout of a g2fs volume and its groups, worked out before anything is written
+typedef struct _G2FS_VOLUME
+{
+    uint64_t partitionStartingLogicalBlockAddress;
+    uint32_t sectorsPerBlock; // logical sectors of the device per block
+    uint64_t blockCount;
+    uint32_t groupCount;
+    uint32_t blocksPerGroup;
+    uint32_t inodesPerGroup;
+    std::vector<G2FS_GROUP> groups;
+} G2FS_VOLUME;
+
+// a file or directory of the host tree copied into the volume
+typedef struct _G2FS_NODE
+{
+    std::string hostPath;
+    std::string name;
+    bool isDirectory;
+    uint64_t size;
+    uint32_t parent;
+    std::vector<uint32_t> children;
+    uint16_t mode;
+    uint64_t accessTime;
+    uint64_t modifyTime;
+    uint64_t changeTime;
+    uint32_t group;
+    uint64_t inode;
+    std::vector<G2FS_EXTENT> extents;
+    uint64_t treeBlock; // first block of the directory or extent B+tree
+    std::vector<uint8_t> tree;
+    uint64_t root;
+} G2FS_NODE;
+
+class G2FS
+{
+public:
+    static bool makeFileSystem(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, uint32_t groupCount, const char *sourceDirectory = nullptr);
+    static bool renewVolumeIdentifier(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress);
+
+private:
+    static bool planVolume(G2FS_VOLUME &volume, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, uint32_t sectorSize, uint32_t groupCount);
+    static uint64_t getGroupFirstBlock(const G2FS_VOLUME &volume, uint32_t group);
+    static uint64_t getGroupBlockCount(const G2FS_VOLUME &volume, uint32_t group);
+    static void markBlocks(G2FS_VOLUME &volume, uint64_t firstBlock, uint64_t blockCount);
+    static bool allocateInode(G2FS_VOLUME &volume, uint32_t group, uint64_t &inode);
+    static bool allocateBlocks(G2FS_VOLUME &volume, uint32_t group, uint64_t blockCount, std::vector<G2FS_EXTENT> &extents);
+    static G2FS_INODE &getInode(G2FS_VOLUME &volume, uint64_t inode);
+    static void finishTree(std::vector<uint8_t> &tree, const std::vector<uint64_t> &leafKeys, uint64_t firstBlock, uint64_t owner, uint64_t &root);
+    static void buildDirectoryTree(const std::vector<G2FS_NODE> &nodes, uint32_t directory, uint64_t firstBlock, std::vector<uint8_t> &tree, uint64_t &root);
+    static void buildExtentTree(const std::vector<G2FS_EXTENT> &extents, uint64_t owner, uint64_t firstBlock, std::vector<uint8_t> &tree, uint64_t &root);
+    static void fillInode(G2FS_VOLUME &volume, const std::vector<G2FS_NODE> &nodes, uint32_t node);
+    static bool writeGroups(BlockDevice &device, G2FS_VOLUME &volume);
+    static bool writeSuperblocks(BlockDevice &device, const G2FS_VOLUME &volume);
+    static bool writeBlocks(BlockDevice &device, const G2FS_VOLUME &volume, uint64_t block, const void *buffer, uint64_t blockCount);
+    static bool allocateNodes(G2FS_VOLUME &volume, std::vector<G2FS_NODE> &nodes);
+    static bool writeTrees(BlockDevice &device, const G2FS_VOLUME &volume, const std::vector<G2FS_NODE> &nodes);
+    static GUID newVolumeIdentifier();
+    static uint64_t getTimeInNanoseconds();
+    static uint64_t getTimeInNanoseconds(const struct timespec &time);
+
+    // populating the volume from a host directory (g2fspopulate.cpp)
+    static bool scanDirectory(std::vector<G2FS_NODE> &nodes, uint32_t directory);
+    static bool writeFiles(BlockDevice &device, const G2FS_VOLUME &volume, const std::vector<G2FS_NODE> &nodes);
+};
+#endif // __G2FS_H
@@ -0,0 +1,840 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "ext4.h"
+
+/**
+ * @brief Get the extra time field of an inode
+ * @note The extra field holds the nanoseconds shifted left by 2 and, in its low
+ *       2 bits, the epoch bits that carry the 32-bit seconds past 2038
+ * @param  &time: the time
+ * @retval The extra field
+ */
+static uint32_t getInodeTimeExtra(const struct timespec &time)
+{
+    int64_t seconds = time.tv_sec;
+    return ((uint32_t)time.tv_nsec << 2) | ((uint32_t)((seconds - (int32_t)seconds) >> 32) & 3);
+}
+
+uint32_t EXT4::checksum(uint32_t seed, const void *data, size_t length)
+{
+    // ext4 chains the raw CRC32C register, without the final inversion
+    return ~crc32c(data, length, ~seed);
+}
+
+uint32_t EXT4::getInodeSeed(const EXT4_VOLUME &volume, uint32_t inode)
+{
+    uint32_t generation = 0;
+    uint32_t seed = checksum(volume.checksumSeed, &inode, sizeof(inode));
+    return checksum(seed, &generation, sizeof(generation));
+}
+
+bool EXT4::hasSuperblockBackup(uint32_t group)
+{
+    // sparse_super: groups 0, 1 and the powers of 3, 5 and 7
+    if (group <= 1)
+    {
+        return true;
+    }
+
+    for (uint32_t base : {3, 5, 7})
+    {
+        uint64_t power = base;
+        while (power < group)
+        {
+            power *= base;
+        }
+        if (power == group)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t EXT4::getGroupBlockCount(const EXT4_VOLUME &volume, uint32_t group)
+{
+    // the last group takes the blocks left over by the division
+    return group + 1 == volume.groupCount ? volume.blockCount - group * EXT4_BLOCKS_PER_GROUP : EXT4_BLOCKS_PER_GROUP;
+}
+
+void EXT4::markBlocks(EXT4_VOLUME &volume, uint32_t firstBlock, uint32_t blockCount)
+{
+    for (uint32_t block = firstBlock; block < firstBlock + blockCount; block++)
+    {
+        volume.blockBitmap[block / 64] |= 1ULL << (block % 64);
+    }
+}
+
+bool EXT4::isBlockUsed(const EXT4_VOLUME &volume, uint32_t block)
+{
+    return (volume.blockBitmap[block / 64] >> (block % 64)) & 1;
+}
+
+bool EXT4::planVolume(EXT4_VOLUME &volume, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, uint32_t sectorSize)
+{
+    volume.sectorsPerBlock = EXT4_BLOCK_SIZE / sectorSize;
+    uint64_t blockCount = totalSectors / volume.sectorsPerBlock;
+    if (blockCount > UINT32_MAX)
+    {
+        std::cerr << "Error: ext4 volumes are limited to " << UINT32_MAX << " blocks" << std::endl;
+        return false;
+    }
+
+    // a short last group is dropped rather than carrying a tiny tail
+    uint32_t lastGroupBlocks = blockCount % EXT4_BLOCKS_PER_GROUP;
+    if (blockCount > EXT4_BLOCKS_PER_GROUP && lastGroupBlocks != 0 && lastGroupBlocks < EXT4_MIN_LAST_GROUP_BLOCKS)
+    {
+        blockCount -= lastGroupBlocks;
+    }
+
+    volume.partitionStartingLogicalBlockAddress = partitionStartingLogicalBlockAddress;
+    volume.blockCount = blockCount;
+    volume.groupCount = (blockCount + EXT4_BLOCKS_PER_GROUP - 1) / EXT4_BLOCKS_PER_GROUP;
+    volume.descriptorBlocks = ((uint64_t)volume.groupCount * EXT4_DESCRIPTOR_SIZE + EXT4_BLOCK_SIZE - 1) / EXT4_BLOCK_SIZE;
+
+    // spread the inodes evenly, filling whole inode table blocks
+    uint64_t inodeCount = (uint64_t)blockCount * EXT4_BLOCK_SIZE / EXT4_BYTES_PER_INODE;
+    uint64_t inodesPerGroup = (inodeCount + volume.groupCount - 1) / std::max<uint32_t>(volume.groupCount, 1);
+    inodesPerGroup = (inodesPerGroup + EXT4_INODES_PER_BLOCK - 1) / EXT4_INODES_PER_BLOCK * EXT4_INODES_PER_BLOCK;
+    volume.inodesPerGroup = std::max<uint64_t>(inodesPerGroup, EXT4_INODES_PER_BLOCK);
+    volume.inodeTableBlocks = volume.inodesPerGroup / EXT4_INODES_PER_BLOCK;
+
+    if (volume.groupCount == 0 || blockCount < 1 + volume.descriptorBlocks + 2 + volume.inodeTableBlocks + 1 + EXT4_LOST_AND_FOUND_BLOCKS)
+    {
+        std::cerr << "Error: a " << totalSectors << " sector partition is too small for ext4" << std::endl;
+        return false;
+    }
+
+    volume.blockBitmap.assign(((uint64_t)volume.groupCount * EXT4_BLOCKS_PER_GROUP + 63) / 64, 0);
+    volume.descriptors.assign(volume.groupCount, EXT4_GROUP_DESCRIPTOR());
+    volume.groupInodes.assign(volume.groupCount, 0);
+
+    // superblock and descriptor table copies open their groups
+    for (uint32_t group = 0; group < volume.groupCount; group++)
+    {
+        if (hasSuperblockBackup(group))
+        {
+            markBlocks(volume, group * EXT4_BLOCKS_PER_GROUP, 1 + volume.descriptorBlocks);
+        }
+    }
+
+    // flex_bg: the first group of every flex group holds the bitmaps and
+    // inode tables of all its members back to back, which leaves the other
+    // groups free of metadata and lets whole flex groups be written at once
+    auto allocateMetadata = [&volume](uint32_t &cursor, uint32_t blockCount)
+    {
+        uint32_t runLength = 0;
+        for (; cursor < volume.blockCount; cursor++)
+        {
+            runLength = isBlockUsed(volume, cursor) ? 0 : runLength + 1;
+            if (runLength == blockCount)
+            {
+                uint32_t block = ++cursor - blockCount;
+                markBlocks(volume, block, blockCount);
+                return block;
+            }
+        }
+        return 0U;
+    };
+
+    uint32_t groupsPerFlex = 1U << EXT4_LOG_GROUPS_PER_FLEX;
+    for (uint32_t flex = 0; flex < volume.groupCount; flex += groupsPerFlex)
+    {
+        uint32_t members = std::min(groupsPerFlex, volume.groupCount - flex);
+        uint32_t cursor = flex * EXT4_BLOCKS_PER_GROUP;
+        for (uint32_t group = flex; group < flex + members; group++)
+        {
+            volume.descriptors[group].blockBitmapBlock = allocateMetadata(cursor, 1);
+        }
+        for (uint32_t group = flex; group < flex + members; group++)
+        {
+            volume.descriptors[group].inodeBitmapBlock = allocateMetadata(cursor, 1);
+        }
+        for (uint32_t group = flex; group < flex + members; group++)
+        {
+            volume.descriptors[group].inodeTableBlock = allocateMetadata(cursor, volume.inodeTableBlocks);
+        }
+
+        // block 0 always holds the superblock, so 0 means "did not fit"
+        if (volume.descriptors[flex + members - 1].inodeTableBlock == 0)
+        {
+            std::cerr << "Error: no room for the inode tables of ext4 groups " << flex << " to " << flex + members - 1 << std::endl;
+            return false;
+        }
+    }
+
+    // inodes 1 to 10 are reserved; the root directory is one of them
+    volume.inodes.assign(EXT4_FIRST_INODE - 1, EXT4_INODE());
+    volume.groupInodes[0] = EXT4_FIRST_INODE - 1;
+    volume.nextDataBlock = 0;
+
+    // every metadata checksum is seeded from the first UUID, which the
+    // superblock keeps, so later UUIDs need not rewrite the checksums
+    newVolumeIdentifier(volume.uuid);
+    volume.checksumSeed = checksum(~0U, volume.uuid, sizeof(volume.uuid));
+
+    return true;
+}
+
+void EXT4::newVolumeIdentifier(uint8_t (&uuid)[16])
+{
+    // random (version 4) UUID
+    std::random_device random;
+    for (size_t i = 0; i < sizeof(uuid); i++)
+    {
+        uuid[i] = random();
+    }
+    uuid[6] = (uuid[6] & 0x0F) | 0x40;
+    uuid[8] = (uuid[8] & 0x3F) | 0x80;
+}
+
+bool EXT4::allocateInode(EXT4_VOLUME &volume, uint32_t &inode)
+{
+    // inodes are handed out in order, filling group 0 first
+    if (volume.inodes.size() == (uint64_t)volume.groupCount * volume.inodesPerGroup)
+    {
+        std::cerr << "Error: out of ext4 inodes" << std::endl;
+        return false;
+    }
+
+    volume.inodes.push_back(EXT4_INODE());
+    inode = volume.inodes.size();
+    volume.groupInodes[(inode - 1) / volume.inodesPerGroup]++;
+    return true;
+}
+
+bool EXT4::allocateBlocks(EXT4_VOLUME &volume, uint32_t blockCount, std::vector<EXT4_RUN> &runs)
+{
+    uint32_t logicalBlock = 0;
+    for (const EXT4_RUN &run : runs)
+    {
+        logicalBlock += run.blockCount;
+    }
+
+    // bump allocation past the metadata; runs break at used blocks and at the
+    // longest extent ext4 can describe
+    while (blockCount > 0)
+    {
+        while (volume.nextDataBlock < volume.blockCount && isBlockUsed(volume, volume.nextDataBlock))
+        {
+            volume.nextDataBlock++;
+        }
+        if (volume.nextDataBlock == volume.blockCount)
+        {
+            std::cerr << "Error: out of ext4 blocks" << std::endl;
+            return false;
+        }
+
+        uint32_t first = volume.nextDataBlock;
+        uint32_t limit = std::min<uint32_t>(blockCount, EXT4_MAX_EXTENT_BLOCKS);
+        uint32_t length = 0;
+        while (length < limit && first + length < volume.blockCount && !isBlockUsed(volume, first + length))
+        {
+            length++;
+        }
+
+        runs.push_back({logicalBlock, first, length});
+        markBlocks(volume, first, length);
+        volume.nextDataBlock = first + length;
+        logicalBlock += length;
+        blockCount -= length;
+    }
+
+    return true;
+}
+
+void EXT4::buildDirectory(const EXT4_VOLUME &volume, std::vector<EXT4_NODE> &nodes, uint32_t directory)
+{
+    EXT4_NODE &node = nodes[directory];
+    const uint32_t usable = EXT4_BLOCK_SIZE - sizeof(EXT4_DIRECTORY_TAIL);
+
+    std::vector<std::pair<const std::string *, uint32_t>> entries;
+    static const std::string dot = ".", dotDot = "..";
+    entries.push_back({&dot, directory});
+    entries.push_back({&dotDot, node.parent});
+    for (uint32_t child : node.children)
+    {
+        entries.push_back({&nodes[child].name, child});
+    }
+
+    // linear directory: entries are packed into blocks, the last entry of a
+    // block stretches to the checksum tail
+    node.directory.assign(EXT4_BLOCK_SIZE, 0);
+    uint32_t offset = 0;
+    EXT4_DIRECTORY_ENTRY *last = nullptr;
+
+    for (const auto &entry : entries)
+    {
+        uint32_t recordLength = (sizeof(EXT4_DIRECTORY_ENTRY) + entry.first->size() + 3) & ~3U;
+        if (offset + recordLength > usable)
+        {
+            last->recordLength += usable - offset;
+            node.directory.resize(node.directory.size() + EXT4_BLOCK_SIZE, 0);
+            offset = 0;
+        }
+
+        const EXT4_NODE &target = nodes[entry.second];
+        last = reinterpret_cast<EXT4_DIRECTORY_ENTRY *>(node.directory.data() + node.directory.size() - EXT4_BLOCK_SIZE + offset);
+        last->inode = target.inode;
+        last->recordLength = recordLength;
+        last->nameLength = entry.first->size();
+        last->type = target.isDirectory ? EXT4_TYPE_DIRECTORY : EXT4_TYPE_FILE;
+        memcpy(last->name, entry.first->data(), entry.first->size());
+        offset += recordLength;
+    }
+    last->recordLength += usable - offset;
+
+    // lost+found is created with room to spare, as an empty entry per block
+    while (node.inode == EXT4_LOST_AND_FOUND_INODE && node.directory.size() < EXT4_LOST_AND_FOUND_BLOCKS * EXT4_BLOCK_SIZE)
+    {
+        node.directory.resize(node.directory.size() + EXT4_BLOCK_SIZE, 0);
+        reinterpret_cast<EXT4_DIRECTORY_ENTRY *>(node.directory.data() + node.directory.size() - EXT4_BLOCK_SIZE)->recordLength = usable;
+    }
+
+    uint32_t seed = getInodeSeed(volume, node.inode);
+    for (size_t block = 0; block < node.directory.size(); block += EXT4_BLOCK_SIZE)
+    {
+        EXT4_DIRECTORY_TAIL *tail = reinterpret_cast<EXT4_DIRECTORY_TAIL *>(node.directory.data() + block + usable);
+        tail->recordLength = sizeof(EXT4_DIRECTORY_TAIL);
+        tail->type = EXT4_TYPE_CHECKSUM;
+        tail->checksum = checksum(seed, node.directory.data() + block, usable);
+    }
+}
+
+void EXT4::buildExtents(const EXT4_VOLUME &volume, EXT4_NODE &node, EXT4_INODE &inode)
+{
+    EXT4_EXTENT_HEADER *header = reinterpret_cast<EXT4_EXTENT_HEADER *>(inode.block);
+    *header = {EXT4_EXTENT_SIGNATURE, 0, EXT4_INLINE_EXTENTS, 0, 0};
+
+    auto toExtent = [](const EXT4_RUN &run)
+    {
+        return EXT4_EXTENT{run.logicalBlock, static_cast<uint16_t>(run.blockCount), 0, run.physicalBlock};
+    };
+
+    EXT4_EXTENT *extents = reinterpret_cast<EXT4_EXTENT *>(header + 1);
+    if (node.runs.size() <= EXT4_INLINE_EXTENTS)
+    {
+        header->count = node.runs.size();
+        std::transform(node.runs.begin(), node.runs.end(), extents, toExtent);
+        return;
+    }
+
+    // too many extents for the inode: one level of leaf blocks under an
+    // index in the inode
+    uint32_t seed = getInodeSeed(volume, node.inode);
+    EXT4_EXTENT_INDEX *index = reinterpret_cast<EXT4_EXTENT_INDEX *>(header + 1);
+    header->depth = 1;
+
+    for (size_t i = 0, leaf = 0; i < node.runs.size(); i += EXT4_EXTENTS_PER_BLOCK, leaf++)
+    {
+        size_t count = std::min<size_t>(EXT4_EXTENTS_PER_BLOCK, node.runs.size() - i);
+        uint8_t *block = node.tree.data() + leaf * EXT4_BLOCK_SIZE;
+        EXT4_EXTENT_HEADER *leafHeader = reinterpret_cast<EXT4_EXTENT_HEADER *>(block);
+        *leafHeader = {EXT4_EXTENT_SIGNATURE, static_cast<uint16_t>(count), EXT4_EXTENTS_PER_BLOCK, 0, 0};
+        std::transform(node.runs.begin() + i, node.runs.begin() + i + count, reinterpret_cast<EXT4_EXTENT *>(leafHeader + 1), toExtent);
+
+        size_t tailOffset = sizeof(EXT4_EXTENT_HEADER) + EXT4_EXTENTS_PER_BLOCK * sizeof(EXT4_EXTENT);
+        uint32_t leafChecksum = checksum(seed, block, tailOffset);
+        memcpy(block + tailOffset, &leafChecksum, sizeof(leafChecksum));
+
+        index[leaf] = {node.runs[i].logicalBlock, static_cast<uint32_t>(node.treeBlock + leaf), 0, 0};
+        header->count++;
+    }
+}
+
+void EXT4::setInodeChecksum(const EXT4_VOLUME &volume, uint32_t inode, EXT4_INODE &raw)
+{
+    // the high half only exists when the extra fields reach it
+    bool hasHigh = raw.extraSize >= offsetof(EXT4_INODE, changeTimeExtra) - offsetof(EXT4_INODE, extraSize);
+    raw.checksumLow = 0;
+    raw.checksumHigh = 0;
+
+    uint32_t crc = checksum(getInodeSeed(volume, inode), &raw, sizeof(raw));
+    raw.checksumLow = crc & 0xFFFF;
+    if (hasHigh)
+    {
+        raw.checksumHigh = crc >> 16;
+    }
+}
+
+void EXT4::fillInode(EXT4_VOLUME &volume, std::vector<EXT4_NODE> &nodes, uint32_t node)
+{
+    EXT4_NODE &source = nodes[node];
+    EXT4_INODE &inode = volume.inodes[source.inode - 1];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    inode = {};
+    inode.mode = source.mode;
+    inode.linkCount = 1;
+    inode.flags = EXT4_INODE_EXTENTS_FLAG;
+    inode.extraSize = EXT4_EXTRA_INODE_SIZE;
+    inode.accessTime = source.accessTime.tv_sec;
+    inode.accessTimeExtra = getInodeTimeExtra(source.accessTime);
+    inode.modifyTime = source.modifyTime.tv_sec;
+    inode.modifyTimeExtra = getInodeTimeExtra(source.modifyTime);
+    inode.changeTime = source.changeTime.tv_sec;
+    inode.changeTimeExtra = getInodeTimeExtra(source.changeTime);
+    inode.createTime = now.tv_sec;
+    inode.createTimeExtra = getInodeTimeExtra(now);
+
+    uint64_t size = source.isDirectory ? source.directory.size() : source.size;
+    inode.size = (uint32_t)size;
+    inode.sizeHigh = size >> 32;
+
+    uint64_t sectors = source.tree.size() / BLOCK_SIZE;
+    for (const EXT4_RUN &run : source.runs)
+    {
+        sectors += (uint64_t)run.blockCount * EXT4_SECTORS_PER_BLOCK;
+    }
+    inode.sectorCount = (uint32_t)sectors;
+    inode.sectorCountHigh = sectors >> 32;
+
+    if (source.isDirectory)
+    {
+        // '.' and the parent's entry, plus '..' of every subdirectory; past
+        // the 16-bit limit dir_nlink says the count is not kept
+        uint32_t linkCount = 2;
+        for (uint32_t child : source.children)
+        {
+            linkCount += nodes[child].isDirectory ? 1 : 0;
+        }
+        inode.linkCount = linkCount < 65000 ? linkCount : 1;
+    }
+
+    buildExtents(volume, source, inode);
+    setInodeChecksum(volume, source.inode, inode);
+}
+
+bool EXT4::allocateNodes(EXT4_VOLUME &volume, std::vector<EXT4_NODE> &nodes)
+{
+    // breadth first from the root, so lost+found, the first child of the
+    // root, gets the first unreserved inode
+    std::vector<uint32_t> directories(1, 0);
+    nodes[0].inode = EXT4_ROOT_INODE;
+
+    for (size_t i = 0; i < directories.size(); i++)
+    {
+        for (uint32_t child : nodes[directories[i]].children)
+        {
+            if (!allocateInode(volume, nodes[child].inode))
+            {
+                return false;
+            }
+
+            if (nodes[child].isDirectory)
+            {
+                directories.push_back(child);
+            }
+        }
+    }
+
+    // directories first, so they sit together at the front of the volume
+    for (uint32_t directory : directories)
+    {
+        EXT4_NODE &node = nodes[directory];
+        buildDirectory(volume, nodes, directory);
+        if (!allocateBlocks(volume, node.directory.size() / EXT4_BLOCK_SIZE, node.runs))
+        {
+            std::cerr << "Error: no room for directory \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+        volume.descriptors[(node.inode - 1) / volume.inodesPerGroup].usedDirectoryCount++;
+    }
+
+    // then file data, in directory order
+    for (uint32_t directory : directories)
+    {
+        for (uint32_t child : nodes[directory].children)
+        {
+            EXT4_NODE &node = nodes[child];
+            if (node.isDirectory)
+            {
+                continue;
+            }
+
+            uint64_t blockCount = (node.size + EXT4_BLOCK_SIZE - 1) / EXT4_BLOCK_SIZE;
+            if (blockCount > UINT32_MAX || !allocateBlocks(volume, blockCount, node.runs))
+            {
+                std::cerr << "Error: no room for \"" << node.hostPath << "\"" << std::endl;
+                return false;
+            }
+        }
+    }
+
+    // extent leaf blocks for whatever did not fit in its inode
+    for (EXT4_NODE &node : nodes)
+    {
+        if (node.runs.size() <= EXT4_INLINE_EXTENTS)
+        {
+            continue;
+        }
+
+        uint32_t leafCount = (node.runs.size() + EXT4_EXTENTS_PER_BLOCK - 1) / EXT4_EXTENTS_PER_BLOCK;
+        std::vector<EXT4_RUN> leaves;
+        if (leafCount > EXT4_INLINE_EXTENTS || !allocateBlocks(volume, leafCount, leaves) || leaves.size() != 1)
+        {
+            std::cerr << "Error: no contiguous room for the extents of \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+
+        node.treeBlock = leaves[0].physicalBlock;
+        node.tree.assign(leafCount * EXT4_BLOCK_SIZE, 0);
+    }
+
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        fillInode(volume, nodes, i);
+    }
+
+    return true;
+}
+
+bool EXT4::writeBlocks(BlockDevice &device, const EXT4_VOLUME &volume, uint32_t block, const void *buffer, uint32_t blockCount)
+{
+    return device.writeSectors(volume.partitionStartingLogicalBlockAddress + (uint64_t)block * volume.sectorsPerBlock, buffer, (uint64_t)blockCount * volume.sectorsPerBlock);
+}
+
+bool EXT4::writeTrees(BlockDevice &device, const EXT4_VOLUME &volume, const std::vector<EXT4_NODE> &nodes)
+{
+    for (const EXT4_NODE &node : nodes)
+    {
+        if (!node.tree.empty() && !writeBlocks(device, volume, node.treeBlock, node.tree.data(), node.tree.size() / EXT4_BLOCK_SIZE))
+        {
+            std::cerr << "Error: failed to write extents of \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+
+        if (!node.isDirectory)
+        {
+            continue;
+        }
+
+        for (const EXT4_RUN &run : node.runs)
+        {
+            if (!writeBlocks(device, volume, run.physicalBlock, node.directory.data() + (uint64_t)run.logicalBlock * EXT4_BLOCK_SIZE, run.blockCount))
+            {
+                std::cerr << "Error: failed to write directory \"" << node.hostPath << "\"" << std::endl;
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool EXT4::writeMetadata(BlockDevice &device, EXT4_VOLUME &volume)
+{
+    AlignedBuffer bitmap = allocateAlignedBuffer(EXT4_BLOCK_SIZE);
+    if (!bitmap)
+    {
+        std::cerr << "Error: failed to allocate bitmap" << std::endl;
+        return false;
+    }
+
+    uint64_t freeBlocks = 0;
+    uint64_t freeInodes = 0;
+
+    for (uint32_t group = 0; group < volume.groupCount; group++)
+    {
+        EXT4_GROUP_DESCRIPTOR &descriptor = volume.descriptors[group];
+        uint32_t firstBlock = group * EXT4_BLOCKS_PER_GROUP;
+        uint32_t blockCount = getGroupBlockCount(volume, group);
+        uint32_t usedInodes = volume.groupInodes[group];
+
+        // block bitmap, padded with ones past the end of a short last group
+        memset(bitmap.get(), 0, EXT4_BLOCK_SIZE);
+        uint32_t usedBlocks = 0;
+        for (uint32_t bit = 0; bit < EXT4_BLOCKS_PER_GROUP; bit++)
+        {
+            if (bit >= blockCount || isBlockUsed(volume, firstBlock + bit))
+            {
+                bitmap[bit / 8] |= 1 << (bit % 8);
+                usedBlocks += bit < blockCount ? 1 : 0;
+            }
+        }
+
+        descriptor.freeBlockCount = blockCount - usedBlocks;
+        descriptor.freeInodeCount = volume.inodesPerGroup - usedInodes;
+        descriptor.unusedInodeCount = volume.inodesPerGroup - usedInodes;
+        descriptor.blockBitmapChecksum = checksum(volume.checksumSeed, bitmap.get(), EXT4_BLOCKS_PER_GROUP / 8) & 0xFFFF;
+        freeBlocks += descriptor.freeBlockCount;
+        freeInodes += descriptor.freeInodeCount;
+
+        // a group whose only blocks are its superblock backup can have its
+        // bitmap rebuilt on first use; the kernel never does that for the last
+        // group or for groups holding the metadata of others
+        uint32_t backupBlocks = hasSuperblockBackup(group) ? 1 + volume.descriptorBlocks : 0;
+        bool blockUninit = usedBlocks == backupBlocks && group + 1 < volume.groupCount;
+        if (blockUninit)
+        {
+            descriptor.flags |= EXT4_BG_BLOCK_UNINIT;
+        }
+        else if (!writeBlocks(device, volume, descriptor.blockBitmapBlock, bitmap.get(), 1))
+        {
+            std::cerr << "Error: failed to write block bitmap of group " << group << std::endl;
+            return false;
+        }
+
+        // inode bitmap, padded with ones past the inodes of the group
+        memset(bitmap.get(), 0, EXT4_BLOCK_SIZE);
+        for (uint32_t bit = 0; bit < EXT4_BLOCK_SIZE * 8; bit++)
+        {
+            if (bit < usedInodes || bit >= volume.inodesPerGroup)
+            {
+                bitmap[bit / 8] |= 1 << (bit % 8);
+            }
+        }
+        descriptor.inodeBitmapChecksum = checksum(volume.checksumSeed, bitmap.get(), volume.inodesPerGroup / 8) & 0xFFFF;
+
+        // lazy inode tables: only the blocks holding used inodes are written,
+        // ITABLE_ZEROED stays clear and the kernel zeroes the rest in the
+        // background after the first mount
+        if (usedInodes == 0)
+        {
+            descriptor.flags |= EXT4_BG_INODE_UNINIT;
+        }
+        else
+        {
+            if (!writeBlocks(device, volume, descriptor.inodeBitmapBlock, bitmap.get(), 1))
+            {
+                std::cerr << "Error: failed to write inode bitmap of group " << group << std::endl;
+                return false;
+            }
+
+            uint32_t usedTableBlocks = (usedInodes + EXT4_INODES_PER_BLOCK - 1) / EXT4_INODES_PER_BLOCK;
+            AlignedBuffer table = allocateAlignedBuffer((uint64_t)usedTableBlocks * EXT4_BLOCK_SIZE);
+            if (!table)
+            {
+                std::cerr << "Error: failed to allocate inode table of group " << group << std::endl;
+                return false;
+            }
+
+            uint64_t firstInode = (uint64_t)group * volume.inodesPerGroup;
+            for (uint32_t i = 0; i < usedInodes; i++)
+            {
+                EXT4_INODE &inode = volume.inodes[firstInode + i];
+                if (inode.mode == 0)
+                {
+                    // the unused reserved inodes still carry a valid checksum
+                    setInodeChecksum(volume, firstInode + i + 1, inode);
+                }
+                memcpy(table.get() + (uint64_t)i * EXT4_INODE_SIZE, &inode, sizeof(inode));
+            }
+
+            if (!writeBlocks(device, volume, descriptor.inodeTableBlock, table.get(), usedTableBlocks))
+            {
+                std::cerr << "Error: failed to write inode table of group " << group << std::endl;
+                return false;
+            }
+        }
+
+        uint32_t groupNumber = group;
+        descriptor.checksum = 0;
+        uint32_t crc = checksum(volume.checksumSeed, &groupNumber, sizeof(groupNumber));
+        descriptor.checksum = checksum(crc, &descriptor, sizeof(descriptor)) & 0xFFFF;
+    }
+
+    // superblock, then the descriptor table from the next block on
+    AlignedBuffer buffer = allocateAlignedBuffer((1 + (uint64_t)volume.descriptorBlocks) * EXT4_BLOCK_SIZE);
+    if (!buffer)
+    {
+        std::cerr << "Error: failed to allocate superblock" << std::endl;
+        return false;
+    }
+    memcpy(buffer.get() + EXT4_BLOCK_SIZE, volume.descriptors.data(), volume.descriptors.size() * sizeof(EXT4_GROUP_DESCRIPTOR));
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    EXT4_SUPERBLOCK superblock = {};
+    superblock.inodeCount = volume.groupCount * volume.inodesPerGroup;
+    superblock.blockCount = volume.blockCount;
+    superblock.reservedBlockCount = (uint64_t)volume.blockCount * EXT4_RESERVED_PERCENT / 100;
+    superblock.freeBlockCount = freeBlocks;
+    superblock.freeInodeCount = freeInodes;
+    superblock.firstDataBlock = 0;
+    superblock.logBlockSize = EXT4_LOG_BLOCK_SIZE;
+    superblock.logClusterSize = EXT4_LOG_BLOCK_SIZE;
+    superblock.blocksPerGroup = EXT4_BLOCKS_PER_GROUP;
+    superblock.clustersPerGroup = EXT4_BLOCKS_PER_GROUP;
+    superblock.inodesPerGroup = volume.inodesPerGroup;
+    superblock.writeTime = now.tv_sec;
+    superblock.maxMountCount = 0xFFFF;
+    superblock.signature = EXT4_SIGNATURE;
+    superblock.state = EXT4_STATE_CLEAN;
+    superblock.errors = EXT4_ERRORS_CONTINUE;
+    superblock.lastCheckTime = now.tv_sec;
+    superblock.creatorOS = EXT4_OS_LINUX;
+    superblock.revision = EXT4_DYNAMIC_REVISION;
+    superblock.firstInode = EXT4_FIRST_INODE;
+    superblock.inodeSize = EXT4_INODE_SIZE;
+    superblock.featureCompat = EXT4_FEATURE_COMPAT_EXT_ATTR;
+    superblock.featureIncompat = EXT4_FEATURE_INCOMPAT_FILETYPE | EXT4_FEATURE_INCOMPAT_EXTENTS | EXT4_FEATURE_INCOMPAT_FLEX_BG | EXT4_FEATURE_INCOMPAT_CSUM_SEED;
+    superblock.featureReadOnlyCompat = EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT4_FEATURE_RO_COMPAT_LARGE_FILE | EXT4_FEATURE_RO_COMPAT_DIR_NLINK |
+                                       EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM;
+    memcpy(superblock.uuid, volume.uuid, sizeof(superblock.uuid));
+    memcpy(superblock.volumeName, "G2", 2);
+    memcpy(superblock.hashSeed, volume.uuid, sizeof(superblock.hashSeed));
+    superblock.defaultHashVersion = EXT4_HASH_HALF_MD4;
+    superblock.descriptorSize = EXT4_DESCRIPTOR_SIZE;
+    superblock.createTime = now.tv_sec;
+    superblock.minExtraInodeSize = EXT4_EXTRA_INODE_SIZE;
+    superblock.wantExtraInodeSize = EXT4_EXTRA_INODE_SIZE;
+    superblock.flags = EXT4_FLAGS_UNSIGNED_HASH;
+    superblock.logGroupsPerFlex = EXT4_LOG_GROUPS_PER_FLEX;
+    superblock.checksumType = EXT4_CHECKSUM_CRC32C;
+    superblock.checksumSeed = volume.checksumSeed;
+
+    // the primary copy sits 1024 bytes into block 0, the backups at the start
+    // of their groups; each copy records its group and its own checksum
+    for (uint32_t group = 0; group < volume.groupCount; group++)
+    {
+        if (!hasSuperblockBackup(group))
+        {
+            continue;
+        }
+
+        superblock.blockGroup = group;
+        superblock.checksum = checksum(~0U, &superblock, offsetof(EXT4_SUPERBLOCK, checksum));
+
+        uint32_t offset = group == 0 ? EXT4_SUPERBLOCK_OFFSET : 0;
+        memset(buffer.get(), 0, EXT4_BLOCK_SIZE);
+        memcpy(buffer.get() + offset, &superblock, sizeof(superblock));
+
+        if (!writeBlocks(device, volume, group * EXT4_BLOCKS_PER_GROUP, buffer.get(), 1 + volume.descriptorBlocks))
+        {
+            std::cerr << "Error: failed to write superblock of group " << group << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool EXT4::renewVolumeIdentifier(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress)
+{
+    uint32_t sectorsPerBlock = EXT4_BLOCK_SIZE / device.getSectorSize();
+    AlignedBuffer buffer = allocateAlignedBuffer(EXT4_BLOCK_SIZE);
+    if (!buffer)
+    {
+        std::cerr << "Error: failed to allocate superblock" << std::endl;
+        return false;
+    }
+
+    EXT4_SUPERBLOCK superblock;
+    if (!device.readSectors(partitionStartingLogicalBlockAddress, buffer.get(), sectorsPerBlock))
+    {
+        std::cerr << "Error: failed to read superblock" << std::endl;
+        return false;
+    }
+    memcpy(&superblock, buffer.get() + EXT4_SUPERBLOCK_OFFSET, sizeof(superblock));
+
+    // without a stored checksum seed the UUID seeds every checksum of the
+    // volume, which then keeps the UUID it was made with
+    if (superblock.signature != EXT4_SIGNATURE || superblock.blocksPerGroup == 0 ||
+        superblock.checksum != checksum(~0U, &superblock, offsetof(EXT4_SUPERBLOCK, checksum)))
+    {
+        std::cerr << "Error: invalid superblock" << std::endl;
+        return false;
+    }
+    if (!(superblock.featureIncompat & EXT4_FEATURE_INCOMPAT_CSUM_SEED))
+    {
+        return true;
+    }
+
+    newVolumeIdentifier(superblock.uuid);
+
+    // every copy records its group and its own checksum
+    uint32_t groupCount = (superblock.blockCount + superblock.blocksPerGroup - 1) / superblock.blocksPerGroup;
+    for (uint32_t group = 0; group < groupCount; group++)
+    {
+        if (!hasSuperblockBackup(group))
+        {
+            continue;
+        }
+
+        uint64_t logicalBlockAddress = partitionStartingLogicalBlockAddress + (uint64_t)group * superblock.blocksPerGroup * sectorsPerBlock;
+        uint32_t offset = group == 0 ? EXT4_SUPERBLOCK_OFFSET : 0;
+        if (!device.readSectors(logicalBlockAddress, buffer.get(), sectorsPerBlock))
+        {
+            std::cerr << "Error: failed to read superblock of group " << group << std::endl;
+            return false;
+        }
+
+        superblock.blockGroup = group;
+        superblock.checksum = checksum(~0U, &superblock, offsetof(EXT4_SUPERBLOCK, checksum));
+        memcpy(buffer.get() + offset, &superblock, sizeof(superblock));
+        if (!device.writeSectors(logicalBlockAddress, buffer.get(), sectorsPerBlock))
+        {
+            std::cerr << "Error: failed to write superblock of group " << group << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool EXT4::makeFileSystem(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, const char *sourceDirectory)
+{
+    EXT4_VOLUME volume;
+    if (!planVolume(volume, partitionStartingLogicalBlockAddress, totalSectors, device.getSectorSize()))
+    {
+        return false;
+    }
+
+    // the root directory, empty unless populated from a host directory
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    EXT4_NODE root = {};
+    root.isDirectory = true;
+    root.mode = EXT4_MODE_DIRECTORY | 0755;
+    root.accessTime = root.modifyTime = root.changeTime = now;
+
+    std::vector<EXT4_NODE> nodes(1, root);
+    if (sourceDirectory != nullptr)
+    {
+        struct stat st;
+        if (stat(sourceDirectory, &st) != 0 || !S_ISDIR(st.st_mode))
+        {
+            std::cerr << "Error: \"" << sourceDirectory << "\" is not a directory" << std::endl;
+            return false;
+        }
+
+        nodes[0].hostPath = sourceDirectory;
+        nodes[0].mode = EXT4_MODE_DIRECTORY | (st.st_mode & 07777);
+        nodes[0].accessTime = st.st_atim;
+        nodes[0].modifyTime = st.st_mtim;
+        nodes[0].changeTime = st.st_ctim;
+        if (!scanDirectory(nodes, 0))
+        {
+            std::cerr << "Error: failed to populate file system from \"" << sourceDirectory << "\"" << std::endl;
+            return false;
+        }
+    }
+
+    // e2fsck and the kernel expect lost+found as the first entry of the root
+    EXT4_NODE lostAndFound = root;
+    lostAndFound.name = "lost+found";
+    lostAndFound.mode = EXT4_MODE_DIRECTORY | 0700;
+    lostAndFound.accessTime = lostAndFound.modifyTime = lostAndFound.changeTime = now;
+    nodes[0].children.insert(nodes[0].children.begin(), nodes.size());
+    nodes.push_back(lostAndFound);
+
+    // place every inode, directory and extent, then write metadata and data
+    if (!allocateNodes(volume, nodes))
+    {
+        return false;
+    }
+
+    return writeMetadata(device, volume) &&
+           writeTrees(device, volume, nodes) &&
+           writeFiles(device, volume, nodes);
+}
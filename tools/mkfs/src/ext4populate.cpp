@@ -0,0 +1,212 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ext4.h"
+
+// a run of file data in volume order
+typedef struct _EXT4_DATA_RUN
+{
+    uint64_t physicalBlock;
+    uint64_t logicalBlock;
+    uint64_t blockCount;
+    uint32_t node;
+} EXT4_DATA_RUN;
+
+bool EXT4::scanDirectory(std::vector<EXT4_NODE> &nodes, uint32_t directory)
+{
+    DIR *dir = opendir(nodes[directory].hostPath.c_str());
+    if (dir == nullptr)
+    {
+        std::cerr << "Error: failed to open directory \"" << nodes[directory].hostPath << "\"" << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> names;
+    for (struct dirent *entry = readdir(dir); entry != nullptr; entry = readdir(dir))
+    {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+        {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    // sort so that the image does not depend on host directory order
+    std::sort(names.begin(), names.end());
+
+    for (const std::string &name : names)
+    {
+        std::string hostPath = nodes[directory].hostPath + "/" + name;
+        struct stat st;
+        if (stat(hostPath.c_str(), &st) != 0)
+        {
+            std::cerr << "Error: failed to stat \"" << hostPath << "\"" << std::endl;
+            return false;
+        }
+
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+        {
+            std::cerr << "Warning: skipping \"" << hostPath << "\", not a file or directory" << std::endl;
+            continue;
+        }
+
+        if (directory == 0 && name == "lost+found")
+        {
+            std::cerr << "Warning: skipping \"" << hostPath << "\", lost+found is created by mkfs" << std::endl;
+            continue;
+        }
+
+        if (name.size() > EXT4_MAX_NAME_LENGTH)
+        {
+            std::cerr << "Error: \"" << hostPath << "\" has a name longer than " << EXT4_MAX_NAME_LENGTH << " bytes" << std::endl;
+            return false;
+        }
+
+        EXT4_NODE node = {};
+        node.hostPath = hostPath;
+        node.name = name;
+        node.isDirectory = S_ISDIR(st.st_mode);
+        node.size = node.isDirectory ? 0 : st.st_size;
+        node.parent = directory;
+        node.mode = (node.isDirectory ? EXT4_MODE_DIRECTORY : EXT4_MODE_FILE) | (st.st_mode & 07777);
+        node.accessTime = st.st_atim;
+        node.modifyTime = st.st_mtim;
+        node.changeTime = st.st_ctim;
+
+        nodes[directory].children.push_back(nodes.size());
+        nodes.push_back(node);
+    }
+
+    for (size_t i = 0; i < nodes[directory].children.size(); i++)
+    {
+        uint32_t child = nodes[directory].children[i];
+        if (nodes[child].isDirectory && !scanDirectory(nodes, child))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool EXT4::writeFiles(BlockDevice &device, const EXT4_VOLUME &volume, const std::vector<EXT4_NODE> &nodes)
+{
+    std::vector<EXT4_DATA_RUN> runs;
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i].isDirectory)
+        {
+            continue;
+        }
+
+        for (const EXT4_RUN &run : nodes[i].runs)
+        {
+            runs.push_back({run.physicalBlock, run.logicalBlock, run.blockCount, i});
+        }
+    }
+
+    // write in ascending block order
+    std::sort(runs.begin(), runs.end(), [](const EXT4_DATA_RUN &a, const EXT4_DATA_RUN &b)
+              { return a.physicalBlock < b.physicalBlock; });
+
+    // file data is gathered into one staging buffer and written whenever it
+    // fills up or the next run does not continue it
+    AlignedBuffer staging = allocateAlignedBuffer(EXT4_STAGING_BUFFER_SIZE);
+    if (!staging)
+    {
+        std::cerr << "Error: failed to allocate staging buffer" << std::endl;
+        return false;
+    }
+
+    uint64_t stagingBlock = 0;
+    uint64_t stagingUsed = 0;
+    auto flushStaging = [&]()
+    {
+        bool result = stagingUsed == 0 || writeBlocks(device, volume, stagingBlock, staging.get(), stagingUsed / EXT4_BLOCK_SIZE);
+        stagingBlock += stagingUsed / EXT4_BLOCK_SIZE;
+        stagingUsed = 0;
+        return result;
+    };
+
+    for (const EXT4_DATA_RUN &run : runs)
+    {
+        const EXT4_NODE &node = nodes[run.node];
+        if (stagingBlock + stagingUsed / EXT4_BLOCK_SIZE != run.physicalBlock)
+        {
+            if (!flushStaging())
+            {
+                std::cerr << "Error: failed to write file data" << std::endl;
+                return false;
+            }
+            stagingBlock = run.physicalBlock;
+        }
+
+        // a device planning a streamed image only notes where the data goes
+        uint64_t offset = run.logicalBlock * EXT4_BLOCK_SIZE;
+        uint64_t remaining = std::min(run.blockCount * EXT4_BLOCK_SIZE, node.size - offset);
+        uint64_t logicalBlockAddress = volume.partitionStartingLogicalBlockAddress + (uint64_t)run.physicalBlock * volume.sectorsPerBlock;
+        if (device.referenceHostFile(node.hostPath, offset, logicalBlockAddress, remaining))
+        {
+            if (!flushStaging())
+            {
+                std::cerr << "Error: failed to write file data" << std::endl;
+                return false;
+            }
+            stagingBlock += run.blockCount;
+            continue;
+        }
+
+        int fd = open(node.hostPath.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Error: failed to open \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        uint64_t padding = run.blockCount * EXT4_BLOCK_SIZE - remaining;
+        while (remaining > 0)
+        {
+            if (stagingUsed == EXT4_STAGING_BUFFER_SIZE && !flushStaging())
+            {
+                close(fd);
+                std::cerr << "Error: failed to write file data" << std::endl;
+                return false;
+            }
+
+            ssize_t result = pread(fd, staging.get() + stagingUsed, std::min<uint64_t>(remaining, EXT4_STAGING_BUFFER_SIZE - stagingUsed), offset);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result <= 0)
+            {
+                close(fd);
+                std::cerr << "Error: failed to read \"" << node.hostPath << "\"" << std::endl;
+                return false;
+            }
+
+            stagingUsed += result;
+            offset += result;
+            remaining -= result;
+        }
+        close(fd);
+
+        // zero the tail of the last block; it is less than a block, and the
+        // staging buffer is a whole number of blocks, so it always fits
+        memset(staging.get() + stagingUsed, 0, padding);
+        stagingUsed += padding;
+    }
+
+    if (!flushStaging())
+    {
+        std::cerr << "Error: failed to write file data" << std::endl;
+        return false;
+    }
+
+    return true;
+}
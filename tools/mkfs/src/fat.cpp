@@ -1,226 +1,381 @@
 #include <iostream>
-#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <random>
 #include "fs.h"
 #include "fat.h"
+#include "fatalloc.h"
 
-/**
- * @brief Pad to a full logical block size with zeros
- * @param  *fp: the file pointer
- * @retval true if successful, false otherwise
- */
-bool fillToALogicalBlockSizeWithZeros(std::fstream &outfile)
+uint8_t FAT::getDefaultSectorsPerCluster(uint8_t fatType, uint32_t totalSectors, uint16_t bytesPerSector)
 {
-    uint8_t zero[512];
-    for (int i = 0; i < (BLOCK_SIZE - sizeof(zero)) / sizeof(zero); i++)
+    uint32_t clusterSizeInBytes = bytesPerSector;
+
+    // the tables below count 512 byte sectors
+    totalSectors = (uint32_t)std::min<uint64_t>(UINT32_MAX, (uint64_t)totalSectors * bytesPerSector / BLOCK_SIZE);
+
+    if (fatType == 32)
+    {
+        // 4 KiB clusters line up with the host page and block size; large
+        // volumes step up as in the Microsoft FAT specification
+        clusterSizeInBytes = totalSectors <= 16777216 ? 4096 : totalSectors <= 33554432 ? 8192 : totalSectors <= 67108864 ? 16384 : 32768;
+    }
+    else if (fatType == 16)
+    {
+        // FAT16 table of the Microsoft FAT specification
+        clusterSizeInBytes = totalSectors <= 32680 ? 1024 : totalSectors <= 262144 ? 2048 : totalSectors <= 524288 ? 4096 : totalSectors <= 1048576 ? 8192 : totalSectors <= 2097152 ? 16384 : 32768;
+    }
+
+    // FAT12 starts from one sector and grows until the cluster count fits
+    return std::max<uint32_t>(1, clusterSizeInBytes / bytesPerSector);
+}
+
+bool FAT::layoutGeometry(uint8_t fatType, uint8_t sectorsPerCluster, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors, uint16_t bytesPerSector, FAT_GEOMETRY &geometry)
+{
+    geometry = {};
+    geometry.partitionStartingLogicalBlockAddress = partitionStartingLogicalBlockAddress;
+    geometry.totalSectors = totalSectors;
+    geometry.bytesPerSector = bytesPerSector;
+    geometry.fatType = fatType;
+    geometry.sectorsPerCluster = sectorsPerCluster;
+    geometry.numberOfFATs = FAT_NUMBER_OF_FATS;
+    geometry.reservedSectors = fatType == 32 ? FAT32_RESERVED_SECTORS : 1;
+    geometry.rootEntryCount = fatType == 32 ? 0 : FAT_ROOT_ENTRY_COUNT;
+    geometry.rootDirectorySectors = (geometry.rootEntryCount * sizeof(FAT32_DIRECTORY_ENTRY) + bytesPerSector - 1) / bytesPerSector;
+    geometry.rootCluster = fatType == 32 ? FAT_FIRST_CLUSTER : 0;
+
+    uint64_t overheadSectors = geometry.reservedSectors + geometry.rootDirectorySectors;
+    if (totalSectors <= overheadSectors)
     {
-        if (!outfile.write(reinterpret_cast<const char *>(&zero), sizeof(zero)))
+        return false;
+    }
+
+    // size the FAT for every cluster the volume could hold without the FATs;
+    // that overestimates slightly but always covers the real data region
+    uint64_t maximumClusters = (totalSectors - overheadSectors) / sectorsPerCluster;
+    uint64_t fatSizeInBytes = ((maximumClusters + FAT_FIRST_CLUSTER) * fatType + 7) / 8;
+    geometry.fatSize = (fatSizeInBytes + bytesPerSector - 1) / bytesPerSector;
+
+    // grow the reserved region so the data region starts on a partition
+    // alignment boundary, unless that would eat too much of a tiny volume
+    uint64_t metadataSectors = overheadSectors + (uint64_t)geometry.numberOfFATs * geometry.fatSize;
+    uint64_t alignment = ALIGNMENT_LBA(bytesPerSector);
+    uint64_t padding = (alignment - (partitionStartingLogicalBlockAddress + metadataSectors) % alignment) % alignment;
+    if (padding * 8 < totalSectors && geometry.reservedSectors + padding <= UINT16_MAX)
+    {
+        geometry.reservedSectors += padding;
+        metadataSectors += padding;
+    }
+
+    if (totalSectors <= metadataSectors)
+    {
+        return false;
+    }
+
+    geometry.clusterCount = (totalSectors - metadataSectors) / sectorsPerCluster;
+    return geometry.clusterCount > 0;
+}
+
+bool FAT::planGeometryForType(uint8_t fatType, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors, uint16_t bytesPerSector, FAT_GEOMETRY &geometry)
+{
+    // the FAT type is decided by the cluster count alone
+    uint32_t minimumClusters = fatType == 12 ? 1 : fatType == 16 ? FAT12_MAX_CLUSTERS + 1 : FAT16_MAX_CLUSTERS + 1;
+    uint32_t maximumClusters = fatType == 12 ? FAT12_MAX_CLUSTERS : fatType == 16 ? FAT16_MAX_CLUSTERS : FAT32_MAX_CLUSTERS;
+
+    // move the cluster size one way only until the count is in range
+    uint8_t sectorsPerCluster = getDefaultSectorsPerCluster(fatType, totalSectors, bytesPerSector);
+    int direction = 0;
+    while (layoutGeometry(fatType, sectorsPerCluster, partitionStartingLogicalBlockAddress, totalSectors, bytesPerSector, geometry))
+    {
+        if (geometry.clusterCount > maximumClusters)
+        {
+            if (direction < 0 || (uint32_t)sectorsPerCluster * bytesPerSector >= FAT_MAX_CLUSTER_SIZE)
+            {
+                return false;
+            }
+            sectorsPerCluster *= 2;
+            direction = 1;
+        }
+        else if (geometry.clusterCount < minimumClusters)
+        {
+            if (direction > 0 || sectorsPerCluster == 1)
+            {
+                return false;
+            }
+            sectorsPerCluster /= 2;
+            direction = -1;
+        }
+        else
         {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool FAT::planGeometry(uint8_t fatSize, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors, uint16_t bytesPerSector, FAT_GEOMETRY &geometry)
+{
+    if (fatSize != 0)
+    {
+        if (!planGeometryForType(fatSize, partitionStartingLogicalBlockAddress, totalSectors, bytesPerSector, geometry))
+        {
+            std::cerr << "Error: a " << totalSectors << " sector partition cannot hold FAT" << (int)fatSize << std::endl;
             return false;
         }
+
+        return true;
     }
 
-    return true;
+    // prefer FAT32, which UEFI firmware requires on the ESP, and fall back
+    // to the smaller variants only for volumes too small for it
+    static const uint8_t fatTypes[] = {32, 16, 12};
+    for (uint8_t fatType : fatTypes)
+    {
+        if (planGeometryForType(fatType, partitionStartingLogicalBlockAddress, totalSectors, bytesPerSector, geometry))
+        {
+            return true;
+        }
+    }
+
+    std::cerr << "Error: a " << totalSectors << " sector partition is too small for FAT" << std::endl;
+    return false;
 }
 
-bool FAT::writeVolumeBootRecord(std::fstream &diskImage, uint8_t fatSize, uint32_t totalSectors, VOLUME_BOOT_RECORD &vbr)
+bool FAT::writeVolumeBootRecord(BlockDevice &device, uint64_t logicalBlockAddress, const FAT_GEOMETRY &geometry)
 {
-    vbr = {
-        .BS_jmpBoot = {0xEB, 0x3C, 0x90},
+    uint8_t fileSystemType[8] = {'F', 'A', 'T', static_cast<uint8_t>(48 + (geometry.fatType / 10)), static_cast<uint8_t>(48 + (geometry.fatType % 10)), ' ', ' ', ' '};
+
+    if (geometry.fatType != 32)
+    {
+        VOLUME_BOOT_RECORD_FAT16 vbr = {
+            .BS_jmpBoot = {0xEB, 0x3C, 0x90},
+            .BS_OEMName = {'T', 'H', 'I', 'S', 'D', 'I', 'S', 'K'},
+            .BPB_BytsPerSec = geometry.bytesPerSector,
+            .BPB_SecPerClus = geometry.sectorsPerCluster,
+            .BPB_RsvdSecCnt = geometry.reservedSectors,
+            .BPB_NumFATs = geometry.numberOfFATs,
+            .BPB_RootEntCnt = geometry.rootEntryCount,
+            .BPB_TotSec16 = static_cast<uint16_t>(geometry.totalSectors <= UINT16_MAX ? geometry.totalSectors : 0),
+            .BPB_Media = FAT_MEDIA_FIXED_DISK,
+            .BPB_FATSz16 = static_cast<uint16_t>(geometry.fatSize),
+            .BPB_SecPerTrk = 0,
+            .BPB_NumHeads = 0,
+            .BPB_HiddSec = static_cast<uint32_t>(geometry.partitionStartingLogicalBlockAddress),
+            .BPB_TotSec32 = geometry.totalSectors <= UINT16_MAX ? 0 : geometry.totalSectors,
+            .BS_DrvNum = 0x80, // hard coded to 0x80 for fixed disk
+            .BS_Reserved1 = 0,
+            .BS_BootSig = 0x29, // hard coded to 0x29
+            .BS_VolID = 0,
+            .BS_VolLab = {'N', 'O', ' ', 'N', 'A', 'M', 'E', ' ', ' ', ' ', ' '},
+            .BS_FilSysType = {0},
+            .padding = {0},
+            .signature = 0xAA55};
+        memcpy(vbr.BS_FilSysType, fileSystemType, sizeof(vbr.BS_FilSysType));
+
+        // write VBR to disk image, if error return false
+        if (!writeSectorBytes(device, logicalBlockAddress, &vbr, sizeof(vbr)))
+        {
+            std::cerr << "Error: failed to write volume boot record" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    VOLUME_BOOT_RECORD vbr = {
+        .BS_jmpBoot = {0xEB, 0x58, 0x90},
         .BS_OEMName = {'T', 'H', 'I', 'S', 'D', 'I', 'S', 'K'},
-        .BPB_BytsPerSec = BLOCK_SIZE,
-        .BPB_SecPerClus = 1,
-        .BPB_RsvdSecCnt = 32,
-        .BPB_NumFATs = 2,
+        .BPB_BytsPerSec = geometry.bytesPerSector,
+        .BPB_SecPerClus = geometry.sectorsPerCluster,
+        .BPB_RsvdSecCnt = geometry.reservedSectors,
+        .BPB_NumFATs = geometry.numberOfFATs,
         .BPB_RootEntCnt = 0,
         .BPB_TotSec16 = 0,
-        .BPB_Media = 0xF8, // hard coded to 0xF8 for fixed disk
+        .BPB_Media = FAT_MEDIA_FIXED_DISK,
         .BPB_FATSz16 = 0,
         .BPB_SecPerTrk = 0,
         .BPB_NumHeads = 0,
-        .BPB_HiddSec = 2048 - 1,
-        .BPB_TotSec32 = totalSectors,
-        .BPB_FATSz32 = (2048 - 32) / 2,
+        .BPB_HiddSec = static_cast<uint32_t>(geometry.partitionStartingLogicalBlockAddress),
+        .BPB_TotSec32 = geometry.totalSectors,
+        .BPB_FATSz32 = geometry.fatSize,
         .BPB_ExtFlags = 0,
         .BPB_FSVer = 0,
-        .BPB_RootClus = 2,
-        .BPB_FSInfo = 1,
-        .BPB_BkBootSec = 6,
+        .BPB_RootClus = geometry.rootCluster,
+        .BPB_FSInfo = FAT32_FSINFO_SECTOR,
+        .BPB_BkBootSec = FAT32_BACKUP_BOOT_SECTOR,
         .BPB_Reserved = {0},
         .BS_DrvNum = 0x80, // hard coded to 0x80 for fixed disk
         .BS_Reserved1 = 0,
         .BS_BootSig = 0x29, // hard coded to 0x29
         .BS_VolID = 0,
         .BS_VolLab = {'N', 'O', ' ', 'N', 'A', 'M', 'E', ' ', ' ', ' ', ' '},
-        .BS_FilSysType = {'F', 'A', 'T', static_cast<uint8_t>(48 + (fatSize / 10)), static_cast<uint8_t>(48 + (fatSize % 10)), ' ', ' ', ' '},
+        .BS_FilSysType = {0},
         .padding = {0},
         .signature = 0xAA55};
+    memcpy(vbr.BS_FilSysType, fileSystemType, sizeof(vbr.BS_FilSysType));
 
     // write VBR to disk image, if error return false
-    if (!diskImage.write(reinterpret_cast<const char *>(&vbr), sizeof(vbr)))
+    if (!writeSectorBytes(device, logicalBlockAddress, &vbr, sizeof(vbr)))
     {
         std::cerr << "Error: failed to write volume boot record" << std::endl;
         return false;
     }
 
-    // fill to a full logical block size with zeros
-    if (!fillToALogicalBlockSizeWithZeros(diskImage))
-    {
-        std::cerr << "Error: failed to fill to a full logical block size with zeros" << std::endl;
-        return false;
-    }
-
     return true;
 }
 
-bool FAT::writeFSInfo(std::fstream &diskImage)
+bool FAT::writeFSInfo(BlockDevice &device, uint64_t logicalBlockAddress, uint32_t freeCount, uint32_t nextFree)
 {
     FS_INFO fsInfo = {
         .FSI_LeadSig = 0x41615252,
         .FSI_Reserved1 = {0},
         .FSI_StrucSig = 0x61417272,
-        .FSI_FreeCount = 0xFFFFFFFF,
-        .FSI_NxtFree = 0xFFFFFFFF,
+        .FSI_FreeCount = freeCount,
+        .FSI_NxtFree = nextFree,
         .FSI_Reserved2 = {0},
         .FSI_TrailSig = 0xAA550000};
 
     // write FSInfo to disk image
-    if (!diskImage.write(reinterpret_cast<const char *>(&fsInfo), sizeof(fsInfo)))
+    if (!writeSectorBytes(device, logicalBlockAddress, &fsInfo, sizeof(fsInfo)))
     {
         std::cerr << "Error: failed to write FSInfo: " << std::endl;
         return false;
     }
 
-    // fill to a full logical block size with zeros
-    if (!fillToALogicalBlockSizeWithZeros(diskImage))
-    {
-        std::cerr << "Error: failed to fill to a full logical block size with zeros" << std::endl;
-        return false;
-    }
-
     return true;
 }
 
-bool FAT::writeFATs(std::fstream &diskImage, uint64_t partitionStartingLogicalBlockAddress, const VOLUME_BOOT_RECORD &vbr)
+bool FAT::writeFATs(BlockDevice &device, const FAT_GEOMETRY &geometry, const uint8_t *fat)
 {
-    for (uint8_t i = 0; i < vbr.BPB_NumFATs; i++)
+    uint64_t fatSizeInBytes = (uint64_t)geometry.fatSize * geometry.bytesPerSector;
+    uint64_t fatStartingLogicalBlockAddress = getFATStartingLogicalBlockAddress(geometry);
+
+    if (device.isSparse())
     {
-        // seek to location of FAT [i]
-        if (!diskImage.seekp((partitionStartingLogicalBlockAddress + vbr.BPB_RsvdSecCnt + (i * vbr.BPB_FATSz32)) * BLOCK_SIZE, std::ios::beg))
+        // punch every copy to zero, then write only the sectors up to the
+        // last one holding an allocated entry
+        if (!device.zeroSectors(fatStartingLogicalBlockAddress, (uint64_t)geometry.numberOfFATs * geometry.fatSize))
         {
+            std::cerr << "Error: failed to zero FATs" << std::endl;
             return false;
         }
 
-        // write FAT [i] to disk image, if error return false
-        // FAT Identifier
-        uint32_t fatEntry = 0x0FFFFFFF | vbr.BPB_Media;
-        if (!diskImage.write(reinterpret_cast<const char *>(&fatEntry), sizeof(fatEntry)))
+        uint64_t usedSectors = geometry.fatSize;
+        while (usedSectors > 1)
         {
-            std::cerr << "Error: failed to write FAT" << std::endl;
-            return false;
+            const uint8_t *sector = fat + (usedSectors - 1) * geometry.bytesPerSector;
+            if (sector[0] != 0 || memcmp(sector, sector + 1, geometry.bytesPerSector - 1) != 0)
+            {
+                break;
+            }
+            usedSectors--;
         }
 
-        // Cluster 1
-        fatEntry = 0x0FFFFFFF;
-        if (!diskImage.write(reinterpret_cast<const char *>(&fatEntry), sizeof(fatEntry)))
+        for (uint8_t i = 0; i < geometry.numberOfFATs; i++)
         {
-            std::cerr << "Error: failed to write FAT" << std::endl;
-            return false;
+            // write FAT [i] to disk image, if error return false
+            if (!device.writeSectors(fatStartingLogicalBlockAddress + (i * geometry.fatSize), fat, usedSectors))
+            {
+                std::cerr << "Error: failed to write FAT" << std::endl;
+                return false;
+            }
         }
 
-        // Cluster 2; Root Dir '/'
-        fatEntry = 0x0FFFFFFF | vbr.BPB_Media;
-        if (!diskImage.write(reinterpret_cast<const char *>(&fatEntry), sizeof(fatEntry)))
-        {
-            std::cerr << "Error: failed to write FAT" << std::endl;
-            return false;
-        }
+        return true;
+    }
 
-        // Cluster 3; 'EFI' directory
-        fatEntry = 0x0FFFFFFF | vbr.BPB_Media;
-        if (!diskImage.write(reinterpret_cast<const char *>(&fatEntry), sizeof(fatEntry)))
-        {
-            std::cerr << "Error: failed to write FAT" << std::endl;
-            return false;
-        }
+    // the copies are back to back, write them all in one vectored write
+    std::vector<struct iovec> copies(geometry.numberOfFATs, {const_cast<uint8_t *>(fat), fatSizeInBytes});
+    if (!device.writeSectorsVectored(fatStartingLogicalBlockAddress, copies.data(), copies.size()))
+    {
+        std::cerr << "Error: failed to write FAT" << std::endl;
+        return false;
     }
 
     return true;
 }
 
-bool FAT::writeFileDirectoryEntries(std::fstream &diskImage, uint64_t partitionStartingLogicalBlockAddress, const VOLUME_BOOT_RECORD &vbr)
+uint64_t FAT::getFATStartingLogicalBlockAddress(const FAT_GEOMETRY &geometry)
 {
-    // compute starting logical block address of FAT
-    uint32_t fatStartingLogicalBlockAddress = partitionStartingLogicalBlockAddress + vbr.BPB_RsvdSecCnt;
+    return geometry.partitionStartingLogicalBlockAddress + geometry.reservedSectors;
+}
 
+uint64_t FAT::getRootDirectoryLogicalBlockAddress(const FAT_GEOMETRY &geometry)
+{
+    // only meaningful on FAT12/16, where the root directory follows the FATs
+    return getFATStartingLogicalBlockAddress(geometry) + ((uint64_t)geometry.numberOfFATs * geometry.fatSize);
+}
+
+uint64_t FAT::clusterToLogicalBlockAddress(const FAT_GEOMETRY &geometry, uint32_t cluster)
+{
     // compute starting logical blook address of data region
-    uint32_t dataStartingLogicalBlockAddress = fatStartingLogicalBlockAddress + (vbr.BPB_NumFATs * vbr.BPB_FATSz32);
+    uint64_t dataStartingLogicalBlockAddress = getRootDirectoryLogicalBlockAddress(geometry) + geometry.rootDirectorySectors;
+
+    return dataStartingLogicalBlockAddress + (uint64_t)(cluster - FAT_FIRST_CLUSTER) * geometry.sectorsPerCluster;
+}
 
-    // seek to starting logical blook address of data region
-    if (!diskImage.seekp(dataStartingLogicalBlockAddress * BLOCK_SIZE, std::ios::beg))
+uint32_t FAT::getEndOfChain(const FAT_GEOMETRY &geometry)
+{
+    return geometry.fatType == 12 ? FAT12_END_OF_CHAIN : geometry.fatType == 16 ? FAT16_END_OF_CHAIN : FAT32_END_OF_CHAIN;
+}
+
+uint32_t FAT::getFATEntry(const FAT_GEOMETRY &geometry, const uint8_t *fat, uint32_t cluster)
+{
+    if (geometry.fatType == 32)
     {
-        std::cerr << "Error: failed to seek to starting logical blook address of data region" << std::endl;
-        return false;
+        return reinterpret_cast<const uint32_t *>(fat)[cluster] & FAT32_CLUSTER_MASK;
     }
-
-    // "/EFI" directory entry
-    FAT32_DIRECTORY_ENTRY dirEntry = {
-        .DIR_Name = {'E', 'F', 'I', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
-        .DIR_Attr = ATTR_DIRECTORY,
-        .DIR_NTRes = 0,
-        .DIR_CrtTimeTenth = 0,
-        .DIR_CrtTime = 0,
-        .DIR_CrtDate = 0,
-        .DIR_LstAccDate = 0,
-        .DIR_FstClusHI = 0,
-        .DIR_WrtTime = 0,
-        .DIR_WrtDate = 0,
-        .DIR_FstClusLO = 3,
-        .DIR_FileSize = 0};
-
-    uint16_t time, date;
-    getFATDirEntryTimeAndDate(time, date);
-    dirEntry.DIR_CrtTime = time;
-    dirEntry.DIR_CrtDate = date;
-    dirEntry.DIR_WrtTime = time;
-    dirEntry.DIR_WrtDate = date;
-
-    // write dir entry to disk image
-    if (!diskImage.write(reinterpret_cast<const char *>(&dirEntry), sizeof(dirEntry)))
+    else if (geometry.fatType == 16)
     {
-        std::cerr << "Error: failed to write dir entry" << std::endl;
-        return false;
+        return reinterpret_cast<const uint16_t *>(fat)[cluster];
     }
 
-    // 'EFI' directory contents
-    if (!diskImage.seekp((dataStartingLogicalBlockAddress + 1) * BLOCK_SIZE, std::ios::beg))
+    // FAT12 packs two entries into three bytes
+    const uint8_t *entry = fat + cluster + (cluster / 2);
+    uint16_t value = entry[0] | (entry[1] << 8);
+    return cluster & 1 ? value >> 4 : value & 0x0FFF;
+}
+
+void FAT::setFATEntry(const FAT_GEOMETRY &geometry, uint8_t *fat, uint32_t cluster, uint32_t value)
+{
+    if (geometry.fatType == 32)
     {
-        std::cerr << "Error: failed to seek to EFI directory contents" << std::endl;
-        return false;
+        // the top four bits are reserved and left as they are
+        uint32_t *entries = reinterpret_cast<uint32_t *>(fat);
+        entries[cluster] = (entries[cluster] & ~FAT32_CLUSTER_MASK) | (value & FAT32_CLUSTER_MASK);
     }
-
-    memcpy(dirEntry.DIR_Name, ".           ", 11);
-    if (!diskImage.write(reinterpret_cast<const char *>(&dirEntry), sizeof(dirEntry)))
+    else if (geometry.fatType == 16)
     {
-        std::cerr << "Error: failed to write dir entry" << std::endl;
-        return false;
+        reinterpret_cast<uint16_t *>(fat)[cluster] = value;
     }
-
-    // root directory doesn't have a cluster value
-    dirEntry.DIR_FstClusLO = 0;
-    memcpy(dirEntry.DIR_Name, "..          ", 11);
-    if (!diskImage.write(reinterpret_cast<const char *>(&dirEntry), sizeof(dirEntry)))
+    else
     {
-        std::cerr << "Error: failed to write dir entry" << std::endl;
-        return false;
+        // FAT12 packs two entries into three bytes
+        uint8_t *entry = fat + cluster + (cluster / 2);
+        if (cluster & 1)
+        {
+            entry[0] = (entry[0] & 0x0F) | ((value << 4) & 0xF0);
+            entry[1] = (value >> 4) & 0xFF;
+        }
+        else
+        {
+            entry[0] = value & 0xFF;
+            entry[1] = (entry[1] & 0xF0) | ((value >> 8) & 0x0F);
+        }
     }
-
-    return true;
 }
 
 void FAT::getFATDirEntryTimeAndDate(uint16_t &time, uint16_t &date)
 {
-    std::time_t now = std::time(nullptr);
-    std::tm tm = *std::localtime(&now);
+    getFATDirEntryTimeAndDate(std::time(nullptr), time, date);
+}
+
+void FAT::getFATDirEntryTimeAndDate(time_t timestamp, uint16_t &time, uint16_t &date)
+{
+    // partitions may be formatted on several threads at once
+    std::tm tm;
+    localtime_r(&timestamp, &tm);
 
     // seconds is # of 2 second increments (0..29)
     if (tm.tm_sec == 60)
@@ -232,65 +387,155 @@ void FAT::getFATDirEntryTimeAndDate(uint16_t &time, uint16_t &date)
     date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | (tm.tm_mday & 0x1F);
 }
 
-bool FAT::makeFileSystem(std::fstream &diskImage, uint8_t fatSize, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors)
+bool FAT::renewVolumeIdentifier(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress)
 {
-    // seek to partition starting block
-    if (!diskImage.seekp(partitionStartingLogicalBlockAddress * BLOCK_SIZE, std::ios::beg))
+    std::random_device random;
+    uint32_t volumeIdentifier = random();
+
+    VOLUME_BOOT_RECORD vbr;
+    if (!readSectorBytes(device, partitionStartingLogicalBlockAddress, &vbr, sizeof(vbr)) || vbr.signature != 0xAA55)
     {
+        std::cerr << "Error: failed to read volume boot record" << std::endl;
         return false;
     }
 
-    // write MBR to disk image
-    VOLUME_BOOT_RECORD vbr;
-    if (!writeVolumeBootRecord(diskImage, fatSize, totalSectors, vbr))
+    // FAT12 and FAT16 keep BS_VolID where FAT32 has its extended BPB
+    if (vbr.BPB_FATSz16 != 0)
+    {
+        VOLUME_BOOT_RECORD_FAT16 *fat16 = reinterpret_cast<VOLUME_BOOT_RECORD_FAT16 *>(&vbr);
+        fat16->BS_VolID = volumeIdentifier;
+        if (!writeSectorBytes(device, partitionStartingLogicalBlockAddress, fat16, sizeof(*fat16)))
+        {
+            std::cerr << "Error: failed to write volume boot record" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    // FAT32 keeps a backup VBR that must stay identical to the primary one
+    vbr.BS_VolID = volumeIdentifier;
+    if (!writeSectorBytes(device, partitionStartingLogicalBlockAddress, &vbr, sizeof(vbr)) ||
+        (vbr.BPB_BkBootSec != 0 && !writeSectorBytes(device, partitionStartingLogicalBlockAddress + vbr.BPB_BkBootSec, &vbr, sizeof(vbr))))
     {
         std::cerr << "Error: failed to write volume boot record" << std::endl;
         return false;
     }
 
-    // write FSInfo to disk image
-    if (!writeFSInfo(diskImage))
+    return true;
+}
+
+bool FAT::makeFileSystem(BlockDevice &device, uint8_t fatSize, uint64_t partitionStartingLogicalBlockAddress, uint32_t totalSectors, const char *sourceDirectory, const char *manifestPath, uint32_t threadCount)
+{
+    // work out cluster size, FAT type and FAT length for this partition
+    FAT_GEOMETRY geometry;
+    if (!planGeometry(fatSize, partitionStartingLogicalBlockAddress, totalSectors, device.getSectorSize(), geometry))
     {
-        std::cerr << "Error: failed to write FSInfo" << std::endl;
         return false;
     }
 
-    // seek to location of backup VBR
-    if (!diskImage.seekp((partitionStartingLogicalBlockAddress + vbr.BPB_BkBootSec) * BLOCK_SIZE, std::ios::beg))
+    // with a manifest from an earlier build, only what changed is rewritten
+    if (sourceDirectory != nullptr && manifestPath != nullptr)
     {
-        std::cerr << "Error: failed to seek to location of backup VBR" << std::endl;
-        return false;
+        bool updated = false;
+        if (!updateFileSystem(device, geometry, sourceDirectory, manifestPath, threadCount, updated))
+        {
+            return false;
+        }
+        if (updated)
+        {
+            return true;
+        }
     }
 
-    // write backup VBR to disk image
-    if (!writeVolumeBootRecord(diskImage, fatSize, totalSectors, vbr))
+    // write VBR to disk image
+    if (!writeVolumeBootRecord(device, partitionStartingLogicalBlockAddress, geometry))
     {
         std::cerr << "Error: failed to write volume boot record" << std::endl;
         return false;
     }
 
-    // write backup FSInfo to disk image
-    if (!writeFSInfo(diskImage))
+    if (geometry.fatType == 32)
+    {
+        // write backup VBR to disk image
+        if (!writeVolumeBootRecord(device, partitionStartingLogicalBlockAddress + FAT32_BACKUP_BOOT_SECTOR, geometry))
+        {
+            std::cerr << "Error: failed to write volume boot record" << std::endl;
+            return false;
+        }
+    }
+
+    // build FAT #1 once; every other copy is written from the same buffer
+    AlignedBuffer fat = allocateAlignedBuffer((uint64_t)geometry.fatSize * geometry.bytesPerSector);
+    if (!fat)
     {
-        std::cerr << "Error: failed to write FSInfo" << std::endl;
+        std::cerr << "Error: failed to allocate FAT" << std::endl;
         return false;
     }
 
+    // FAT Identifier
+    setFATEntry(geometry, fat.get(), 0, (getEndOfChain(geometry) & ~0xFF) | FAT_MEDIA_FIXED_DISK);
+
+    // Cluster 1
+    setFATEntry(geometry, fat.get(), 1, getEndOfChain(geometry));
+
+    FATAllocator allocator(geometry, fat.get());
+    allocator.load();
+
+    std::vector<FAT_NODE> nodes;
+    if (sourceDirectory != nullptr)
+    {
+        // copy the host tree, which also allocates and writes the root directory
+        if (!populate(device, geometry, allocator, sourceDirectory, threadCount, manifestPath != nullptr, nodes))
+        {
+            std::cerr << "Error: failed to populate file system from \"" << sourceDirectory << "\"" << std::endl;
+            return false;
+        }
+    }
+    else
+    {
+        // Cluster 2; Root Dir '/' on FAT32
+        uint32_t rootCluster = 0;
+        if (geometry.rootCluster != 0 && (!allocator.allocate(1, rootCluster) || rootCluster != geometry.rootCluster))
+        {
+            std::cerr << "Error: failed to allocate root directory" << std::endl;
+            return false;
+        }
+        allocator.commit();
+
+        // clear the root directory so a reused image reads back empty
+        bool cleared = geometry.rootCluster != 0
+                           ? device.zeroSectors(clusterToLogicalBlockAddress(geometry, geometry.rootCluster), geometry.sectorsPerCluster)
+                           : device.zeroSectors(getRootDirectoryLogicalBlockAddress(geometry), geometry.rootDirectorySectors);
+        if (!cleared)
+        {
+            std::cerr << "Error: failed to clear root directory" << std::endl;
+            return false;
+        }
+    }
+
+    if (geometry.fatType == 32)
+    {
+        // the FAT is final now, so FSInfo can carry the real free count and
+        // spare every mount a scan of the whole FAT
+        uint32_t freeCount = allocator.getFreeCount();
+        uint32_t nextFree = freeCount == 0 ? FAT_FSINFO_UNKNOWN : allocator.getFirstFree();
+
+        // write FSInfo and backup FSInfo to disk image, always as a pair
+        if (!writeFSInfo(device, partitionStartingLogicalBlockAddress + FAT32_FSINFO_SECTOR, freeCount, nextFree) ||
+            !writeFSInfo(device, partitionStartingLogicalBlockAddress + FAT32_BACKUP_BOOT_SECTOR + FAT32_FSINFO_SECTOR, freeCount, nextFree))
+        {
+            std::cerr << "Error: failed to write FSInfo" << std::endl;
+            return false;
+        }
+    }
+
     // write FATs to disk image
-    if (!writeFATs(diskImage, partitionStartingLogicalBlockAddress, vbr))
+    if (!writeFATs(device, geometry, fat.get()))
     {
         std::cerr << "Error: failed to write FATs" << std::endl;
         return false;
     }
 
-    // TODO: remove once create directory/file works
-
-    // // Write File/Directory Entries
-    // if (!writeFileDirectoryEntries(diskImage, fatSize, partitionStartingLogicalBlockAddress, totalSectors, vbr))
-    // {
-    //     std::cerr << "Error: failed to write file/directory entries" << std::endl;
-    //     return false;
-    // }
-
-    return true;
+    return manifestPath == nullptr || nodes.empty() || writeManifest(manifestPath, geometry, fat.get(), nodes);
 }
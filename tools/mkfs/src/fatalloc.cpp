@@ -0,0 +1,326 @@
+#include <iostream>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "fatalloc.h"
+
+FATAllocator::FATAllocator(const FAT_GEOMETRY &geometry, uint8_t *fat)
+    : geometry(geometry), fat(fat), freeCount(0)
+{
+}
+
+void FATAllocator::load()
+{
+    bitmap.assign((geometry.clusterCount + 63) / 64, 0);
+    extentsBySize.clear();
+    extentsByStart.clear();
+    pendingRuns.clear();
+    freeCount = 0;
+
+    // one pass over the FAT fills the bitmap, a second over the much smaller
+    // bitmap finds the free extents
+    if (geometry.fatType == 32)
+    {
+        scanFAT32();
+    }
+    else if (geometry.fatType == 16)
+    {
+        scanFAT16();
+    }
+    else
+    {
+        scanFAT12();
+    }
+
+    buildExtents();
+}
+
+void FATAllocator::scanFAT32()
+{
+    const uint32_t *entries = reinterpret_cast<const uint32_t *>(fat);
+    uint32_t cluster = FAT_FIRST_CLUSTER;
+    uint32_t endCluster = geometry.clusterCount + FAT_FIRST_CLUSTER;
+
+    // the groups start at a multiple of their width past FAT_FIRST_CLUSTER, so
+    // each mask lands inside a single bitmap word
+#if defined(__AVX2__)
+    const __m256i mask = _mm256_set1_epi32(FAT32_CLUSTER_MASK);
+    for (; cluster + 8 <= endCluster; cluster += 8)
+    {
+        __m256i values = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries + cluster)), mask);
+        uint64_t zero = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(values, _mm256_setzero_si256())));
+        uint32_t bit = cluster - FAT_FIRST_CLUSTER;
+        bitmap[bit / 64] |= zero << (bit % 64);
+        freeCount += __builtin_popcountll(zero);
+    }
+#elif defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi32(FAT32_CLUSTER_MASK);
+    for (; cluster + 4 <= endCluster; cluster += 4)
+    {
+        __m128i values = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + cluster)), mask);
+        uint64_t zero = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(values, _mm_setzero_si128())));
+        uint32_t bit = cluster - FAT_FIRST_CLUSTER;
+        bitmap[bit / 64] |= zero << (bit % 64);
+        freeCount += __builtin_popcountll(zero);
+    }
+#endif
+
+    for (; cluster < endCluster; cluster++)
+    {
+        if ((entries[cluster] & FAT32_CLUSTER_MASK) == 0)
+        {
+            uint32_t bit = cluster - FAT_FIRST_CLUSTER;
+            bitmap[bit / 64] |= 1ULL << (bit % 64);
+            freeCount++;
+        }
+    }
+}
+
+void FATAllocator::scanFAT16()
+{
+    const uint16_t *entries = reinterpret_cast<const uint16_t *>(fat);
+    uint32_t cluster = FAT_FIRST_CLUSTER;
+    uint32_t endCluster = geometry.clusterCount + FAT_FIRST_CLUSTER;
+
+#if defined(__SSE2__)
+    // compare 16 entries, then pack the 16 bit results down to one byte each
+    for (; cluster + 16 <= endCluster; cluster += 16)
+    {
+        __m128i low = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + cluster)), _mm_setzero_si128());
+        __m128i high = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + cluster + 8)), _mm_setzero_si128());
+        uint64_t zero = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(low, high));
+        uint32_t bit = cluster - FAT_FIRST_CLUSTER;
+        bitmap[bit / 64] |= zero << (bit % 64);
+        freeCount += __builtin_popcountll(zero);
+    }
+#endif
+
+    for (; cluster < endCluster; cluster++)
+    {
+        if (entries[cluster] == 0)
+        {
+            uint32_t bit = cluster - FAT_FIRST_CLUSTER;
+            bitmap[bit / 64] |= 1ULL << (bit % 64);
+            freeCount++;
+        }
+    }
+}
+
+void FATAllocator::scanFAT12()
+{
+    // at most 4084 clusters, not worth vectorizing the packed entries
+    for (uint32_t cluster = FAT_FIRST_CLUSTER; cluster < geometry.clusterCount + FAT_FIRST_CLUSTER; cluster++)
+    {
+        if (FAT::getFATEntry(geometry, fat, cluster) == 0)
+        {
+            uint32_t bit = cluster - FAT_FIRST_CLUSTER;
+            bitmap[bit / 64] |= 1ULL << (bit % 64);
+            freeCount++;
+        }
+    }
+}
+
+void FATAllocator::buildExtents()
+{
+    uint32_t bits = geometry.clusterCount;
+    uint32_t bit = 0;
+
+    while (bit < bits)
+    {
+        // find the next set bit, skipping whole allocated words
+        uint32_t word = bit / 64;
+        uint64_t value = bitmap[word] & (~0ULL << (bit % 64));
+        while (value == 0 && ++word < bitmap.size())
+        {
+            value = bitmap[word];
+        }
+        if (value == 0)
+        {
+            break;
+        }
+        uint32_t first = word * 64 + __builtin_ctzll(value);
+
+        // then the next clear bit, skipping whole free words
+        value = ~bitmap[word] & (~0ULL << (first % 64));
+        while (value == 0 && ++word < bitmap.size())
+        {
+            value = ~bitmap[word];
+        }
+        uint32_t end = value == 0 ? bits : std::min<uint32_t>(bits, word * 64 + __builtin_ctzll(value));
+
+        insertExtent(first + FAT_FIRST_CLUSTER, end - first);
+        bit = end;
+    }
+}
+
+void FATAllocator::insertExtent(uint32_t firstCluster, uint32_t clusterCount)
+{
+    extentsBySize.insert({clusterCount, firstCluster});
+    extentsByStart[firstCluster] = clusterCount;
+}
+
+void FATAllocator::eraseExtent(uint32_t firstCluster, uint32_t clusterCount)
+{
+    extentsBySize.erase({clusterCount, firstCluster});
+    extentsByStart.erase(firstCluster);
+}
+
+void FATAllocator::markBitmap(uint32_t firstCluster, uint32_t clusterCount, bool free)
+{
+    uint32_t bit = firstCluster - FAT_FIRST_CLUSTER;
+    uint32_t end = bit + clusterCount;
+
+    while (bit < end)
+    {
+        uint32_t bits = std::min<uint32_t>(64 - bit % 64, end - bit);
+        uint64_t mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << (bit % 64);
+        if (free)
+        {
+            bitmap[bit / 64] |= mask;
+        }
+        else
+        {
+            bitmap[bit / 64] &= ~mask;
+        }
+        bit += bits;
+    }
+}
+
+bool FATAllocator::allocate(uint32_t clusterCount, uint32_t &firstCluster)
+{
+    if (clusterCount == 0)
+    {
+        return false;
+    }
+
+    // best fit: the smallest extent that is large enough, lowest first
+    auto extent = extentsBySize.lower_bound({clusterCount, 0});
+    if (extent == extentsBySize.end())
+    {
+        return false;
+    }
+
+    uint32_t extentSize = extent->first;
+    firstCluster = extent->second;
+    eraseExtent(firstCluster, extentSize);
+    if (extentSize > clusterCount)
+    {
+        insertExtent(firstCluster + clusterCount, extentSize - clusterCount);
+    }
+
+    markBitmap(firstCluster, clusterCount, false);
+    freeCount -= clusterCount;
+    pendingRuns.push_back({firstCluster, clusterCount, true});
+
+    return true;
+}
+
+bool FATAllocator::free(uint32_t firstCluster, uint32_t clusterCount)
+{
+    if (clusterCount == 0 || firstCluster < FAT_FIRST_CLUSTER ||
+        (uint64_t)firstCluster + clusterCount > (uint64_t)geometry.clusterCount + FAT_FIRST_CLUSTER)
+    {
+        std::cerr << "Error: cannot free clusters " << firstCluster << "+" << clusterCount << ", out of range" << std::endl;
+        return false;
+    }
+
+    for (uint32_t cluster = firstCluster; cluster < firstCluster + clusterCount; cluster++)
+    {
+        if (isFree(cluster))
+        {
+            std::cerr << "Error: cannot free cluster " << cluster << ", it is already free" << std::endl;
+            return false;
+        }
+    }
+
+    markBitmap(firstCluster, clusterCount, true);
+    freeCount += clusterCount;
+    pendingRuns.push_back({firstCluster, clusterCount, false});
+
+    // coalesce with the free extents on either side
+    auto next = extentsByStart.find(firstCluster + clusterCount);
+    if (next != extentsByStart.end())
+    {
+        uint32_t nextSize = next->second;
+        eraseExtent(firstCluster + clusterCount, nextSize);
+        clusterCount += nextSize;
+    }
+
+    auto previous = extentsByStart.lower_bound(firstCluster);
+    if (previous != extentsByStart.begin())
+    {
+        --previous;
+        if (previous->first + previous->second == firstCluster)
+        {
+            uint32_t previousStart = previous->first;
+            uint32_t previousSize = previous->second;
+            eraseExtent(previousStart, previousSize);
+            firstCluster = previousStart;
+            clusterCount += previousSize;
+        }
+    }
+
+    insertExtent(firstCluster, clusterCount);
+    return true;
+}
+
+void FATAllocator::commit()
+{
+    uint32_t endOfChain = FAT::getEndOfChain(geometry);
+
+    // runs are applied in order, so a run freed after it was allocated ends
+    // up free
+    for (const FAT_ALLOCATOR_RUN &run : pendingRuns)
+    {
+        uint32_t lastCluster = run.firstCluster + run.clusterCount - 1;
+
+        if (geometry.fatType == 32)
+        {
+            uint32_t *entries = reinterpret_cast<uint32_t *>(fat);
+            for (uint32_t cluster = run.firstCluster; cluster <= lastCluster; cluster++)
+            {
+                uint32_t value = !run.allocated ? 0 : cluster == lastCluster ? endOfChain : cluster + 1;
+                entries[cluster] = (entries[cluster] & ~FAT32_CLUSTER_MASK) | value;
+            }
+        }
+        else if (geometry.fatType == 16)
+        {
+            uint16_t *entries = reinterpret_cast<uint16_t *>(fat);
+            for (uint32_t cluster = run.firstCluster; cluster <= lastCluster; cluster++)
+            {
+                entries[cluster] = !run.allocated ? 0 : cluster == lastCluster ? endOfChain : cluster + 1;
+            }
+        }
+        else
+        {
+            for (uint32_t cluster = run.firstCluster; cluster <= lastCluster; cluster++)
+            {
+                FAT::setFATEntry(geometry, fat, cluster, !run.allocated ? 0 : cluster == lastCluster ? endOfChain : cluster + 1);
+            }
+        }
+    }
+
+    pendingRuns.clear();
+}
+
+bool FATAllocator::isFree(uint32_t cluster) const
+{
+    if (cluster < FAT_FIRST_CLUSTER || cluster >= geometry.clusterCount + FAT_FIRST_CLUSTER)
+    {
+        return false;
+    }
+
+    uint32_t bit = cluster - FAT_FIRST_CLUSTER;
+    return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+uint32_t FATAllocator::getLargestExtent() const
+{
+    return extentsBySize.empty() ? 0 : extentsBySize.rbegin()->first;
+}
+
+uint32_t FATAllocator::getFirstFree() const
+{
+    return extentsByStart.empty() ? 0 : extentsByStart.begin()->first;
+}
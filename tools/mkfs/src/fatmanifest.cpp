@@ -0,0 +1,459 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "fs.h"
+#include "fat.h"
+#include "fatalloc.h"
+
+#define FAT_HASH_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * @brief Get the path of a node relative to the source directory
+ * @param  &nodes: the nodes, the root first
+ * @param  &node: the node
+ * @retval The relative path, empty for the root
+ */
+static std::string getRelativePath(const std::vector<FAT_NODE> &nodes, const FAT_NODE &node)
+{
+    return &node == &nodes[0] ? std::string() : node.hostPath.substr(nodes[0].hostPath.size() + 1);
+}
+
+void FAT::locateDirectoryEntries(const FAT_GEOMETRY &geometry, std::vector<FAT_NODE> &nodes)
+{
+    // entries are written in child order after '.' and '..', each behind its
+    // long name entries, and directory runs are contiguous, so an entry's
+    // sector follows from the entries before it
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        const FAT_NODE &directory = nodes[i];
+        if (!directory.isDirectory)
+        {
+            continue;
+        }
+
+        uint64_t firstLogicalBlockAddress = directory.clusterCount == 0 ? getRootDirectoryLogicalBlockAddress(geometry)
+                                                                         : clusterToLogicalBlockAddress(geometry, directory.firstCluster);
+        uint64_t offset = (i == 0 ? 0 : 2) * sizeof(FAT32_DIRECTORY_ENTRY);
+        for (uint32_t child : directory.children)
+        {
+            offset += getLongNameEntryCount(nodes[child]) * sizeof(FAT32_DIRECTORY_ENTRY);
+            nodes[child].entryLogicalBlockAddress = firstLogicalBlockAddress + offset / geometry.bytesPerSector;
+            nodes[child].entryOffset = offset % geometry.bytesPerSector;
+            offset += sizeof(FAT32_DIRECTORY_ENTRY);
+        }
+    }
+}
+
+bool FAT::writeManifest(const char *manifestPath, const FAT_GEOMETRY &geometry, const uint8_t *fat, const std::vector<FAT_NODE> &nodes)
+{
+    FAT_MANIFEST_HEADER header = {};
+    header.signature = FAT_MANIFEST_SIGNATURE;
+    header.version = FAT_MANIFEST_VERSION;
+    header.partitionStartingLogicalBlockAddress = geometry.partitionStartingLogicalBlockAddress;
+    header.totalSectors = geometry.totalSectors;
+    header.fatSize = geometry.fatSize;
+    header.fatType = geometry.fatType;
+    header.sectorsPerCluster = geometry.sectorsPerCluster;
+    header.bytesPerSector = geometry.bytesPerSector;
+    header.fatCrc32 = crc32(fat, (uint64_t)geometry.fatSize * geometry.bytesPerSector);
+    header.entryCount = nodes.size();
+
+    std::string body;
+    for (const FAT_NODE &node : nodes)
+    {
+        std::string path = getRelativePath(nodes, node);
+        FAT_MANIFEST_ENTRY entry = {};
+        entry.size = node.size;
+        entry.modifyTime = node.modifyTime;
+        entry.changeTime = node.changeTime;
+        entry.hostInode = node.hostInode;
+        entry.entryLogicalBlockAddress = node.entryLogicalBlockAddress;
+        entry.entryOffset = node.entryOffset;
+        entry.crc32 = node.crc32;
+        entry.firstCluster = node.firstCluster;
+        entry.clusterCount = node.clusterCount;
+        entry.isDirectory = node.isDirectory;
+        entry.pathLength = path.size();
+
+        body.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        body.append(path);
+    }
+    header.crc32 = crc32(body.data(), body.size());
+
+    // written next to the real manifest, then renamed over it, so a failed
+    // build never leaves a manifest describing a different image
+    std::string temporaryPath = std::string(manifestPath) + ".tmp";
+    int fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Error: failed to create manifest \"" << temporaryPath << "\"" << std::endl;
+        return false;
+    }
+
+    bool written = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+                   write(fd, body.data(), body.size()) == (ssize_t)body.size();
+    if (close(fd) != 0 || !written || rename(temporaryPath.c_str(), manifestPath) != 0)
+    {
+        std::cerr << "Error: failed to write manifest \"" << manifestPath << "\"" << std::endl;
+        unlink(temporaryPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool FAT::readManifest(const char *manifestPath, FAT_MANIFEST_HEADER &header, std::vector<FAT_NODE> &nodes)
+{
+    int fd = open(manifestPath, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    std::string body;
+    bool valid = fstat(fd, &st) == 0 && (uint64_t)st.st_size >= sizeof(header) &&
+                 readFully(fd, &header, sizeof(header), 0);
+    if (valid)
+    {
+        body.resize(st.st_size - sizeof(header));
+        valid = readFully(fd, body.data(), body.size(), sizeof(header));
+    }
+    close(fd);
+
+    if (!valid || header.signature != FAT_MANIFEST_SIGNATURE || header.version != FAT_MANIFEST_VERSION ||
+        header.crc32 != crc32(body.data(), body.size()))
+    {
+        return false;
+    }
+
+    // paths are kept relative; the caller compares them with a fresh scan
+    nodes.clear();
+    size_t offset = 0;
+    for (uint32_t i = 0; i < header.entryCount; i++)
+    {
+        FAT_MANIFEST_ENTRY entry;
+        if (offset + sizeof(entry) > body.size())
+        {
+            return false;
+        }
+        memcpy(&entry, body.data() + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (offset + entry.pathLength > body.size())
+        {
+            return false;
+        }
+
+        FAT_NODE node = {};
+        node.hostPath = body.substr(offset, entry.pathLength);
+        node.isDirectory = entry.isDirectory;
+        node.size = entry.size;
+        node.modifyTime = entry.modifyTime;
+        node.changeTime = entry.changeTime;
+        node.hostInode = entry.hostInode;
+        node.entryLogicalBlockAddress = entry.entryLogicalBlockAddress;
+        node.entryOffset = entry.entryOffset;
+        node.crc32 = entry.crc32;
+        node.firstCluster = entry.firstCluster;
+        node.clusterCount = entry.clusterCount;
+        nodes.push_back(node);
+        offset += entry.pathLength;
+    }
+
+    return offset == body.size();
+}
+
+bool FAT::hashFile(const FAT_NODE &node, uint32_t &crc)
+{
+    int fd = open(node.hostPath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Error: failed to open \"" << node.hostPath << "\"" << std::endl;
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    AlignedBuffer buffer = allocateAlignedBuffer(FAT_HASH_BUFFER_SIZE);
+    if (!buffer)
+    {
+        close(fd);
+        std::cerr << "Error: failed to allocate hash buffer" << std::endl;
+        return false;
+    }
+
+    crc = 0;
+    for (uint64_t offset = 0; offset < node.size;)
+    {
+        size_t length = std::min<uint64_t>(FAT_HASH_BUFFER_SIZE, node.size - offset);
+        if (!readFully(fd, buffer.get(), length, offset))
+        {
+            close(fd);
+            std::cerr << "Error: failed to read \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+        crc = crc32(buffer.get(), length, crc);
+        offset += length;
+    }
+    close(fd);
+
+    return true;
+}
+
+bool FAT::writeDirectoryEntries(BlockDevice &device, const std::vector<FAT_NODE> &nodes, const std::vector<uint32_t> &changed)
+{
+    // several changed entries may share a sector; each sector is read and
+    // written once
+    std::map<uint64_t, std::vector<uint32_t>> sectors;
+    for (uint32_t node : changed)
+    {
+        sectors[nodes[node].entryLogicalBlockAddress].push_back(node);
+    }
+
+    uint8_t sector[MAX_SECTOR_SIZE];
+    for (const auto &entries : sectors)
+    {
+        if (!device.readSectors(entries.first, sector, 1))
+        {
+            std::cerr << "Error: failed to read directory sector " << entries.first << std::endl;
+            return false;
+        }
+
+        for (uint32_t node : entries.second)
+        {
+            FAT32_DIRECTORY_ENTRY dirEntry = makeDirectoryEntry(nodes[node], nodes[node].shortName, nodes[node].firstCluster);
+            memcpy(sector + nodes[node].entryOffset, &dirEntry, sizeof(dirEntry));
+        }
+
+        if (!device.writeSectors(entries.first, sector, 1))
+        {
+            std::cerr << "Error: failed to write directory sector " << entries.first << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FAT::writeDirtyFATSectors(BlockDevice &device, const FAT_GEOMETRY &geometry, const uint8_t *fat, const uint8_t *original)
+{
+    uint64_t fatStartingLogicalBlockAddress = getFATStartingLogicalBlockAddress(geometry);
+    uint64_t sectorSize = geometry.bytesPerSector;
+
+    // write each run of changed sectors to every copy
+    uint32_t sector = 0;
+    while (sector < geometry.fatSize)
+    {
+        if (memcmp(fat + sector * sectorSize, original + sector * sectorSize, sectorSize) == 0)
+        {
+            sector++;
+            continue;
+        }
+
+        uint32_t first = sector;
+        while (sector < geometry.fatSize && memcmp(fat + sector * sectorSize, original + sector * sectorSize, sectorSize) != 0)
+        {
+            sector++;
+        }
+
+        for (uint8_t i = 0; i < geometry.numberOfFATs; i++)
+        {
+            if (!device.writeSectors(fatStartingLogicalBlockAddress + (uint64_t)i * geometry.fatSize + first, fat + first * sectorSize, sector - first))
+            {
+                std::cerr << "Error: failed to write FAT sectors " << first << " to " << sector - 1 << std::endl;
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool FAT::updateFileSystem(BlockDevice &device, const FAT_GEOMETRY &geometry, const char *sourceDirectory, const char *manifestPath, uint32_t threadCount, bool &updated)
+{
+    updated = false;
+
+    FAT_MANIFEST_HEADER header;
+    std::vector<FAT_NODE> previous;
+    if (!readManifest(manifestPath, header, previous))
+    {
+        std::cout << "No usable manifest at \"" << manifestPath << "\", building the whole file system" << std::endl;
+        return true;
+    }
+
+    if (header.partitionStartingLogicalBlockAddress != geometry.partitionStartingLogicalBlockAddress || header.totalSectors != geometry.totalSectors ||
+        header.fatSize != geometry.fatSize || header.fatType != geometry.fatType || header.sectorsPerCluster != geometry.sectorsPerCluster ||
+        header.bytesPerSector != geometry.bytesPerSector)
+    {
+        std::cout << "The partition layout changed, building the whole file system" << std::endl;
+        return true;
+    }
+
+    AlignedBuffer fat = allocateAlignedBuffer((uint64_t)geometry.fatSize * geometry.bytesPerSector);
+    AlignedBuffer original = allocateAlignedBuffer((uint64_t)geometry.fatSize * geometry.bytesPerSector);
+    if (!fat || !original)
+    {
+        std::cerr << "Error: failed to allocate FAT" << std::endl;
+        return false;
+    }
+
+    if (!device.readSectors(getFATStartingLogicalBlockAddress(geometry), fat.get(), geometry.fatSize))
+    {
+        std::cerr << "Error: failed to read FAT" << std::endl;
+        return false;
+    }
+
+    // anything else writing to the image since the last build shows up in
+    // the FAT, and then the manifest can no longer be trusted
+    if (crc32(fat.get(), (uint64_t)geometry.fatSize * geometry.bytesPerSector) != header.fatCrc32)
+    {
+        std::cout << "The image changed since the manifest was written, building the whole file system" << std::endl;
+        return true;
+    }
+    memcpy(original.get(), fat.get(), (uint64_t)geometry.fatSize * geometry.bytesPerSector);
+
+    struct stat st;
+    if (stat(sourceDirectory, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        std::cerr << "Error: \"" << sourceDirectory << "\" is not a directory" << std::endl;
+        return false;
+    }
+
+    FAT_NODE root = {};
+    root.hostPath = sourceDirectory;
+    root.isDirectory = true;
+    std::vector<FAT_NODE> nodes(1, root);
+    if (!scanDirectory(nodes, 0))
+    {
+        return false;
+    }
+
+    // the scan is sorted, so an unchanged tree lines up entry for entry;
+    // anything else changes directories and goes through a full build
+    bool sameTree = nodes.size() == previous.size();
+    for (uint32_t i = 0; sameTree && i < nodes.size(); i++)
+    {
+        sameTree = nodes[i].isDirectory == previous[i].isDirectory && getRelativePath(nodes, nodes[i]) == previous[i].hostPath;
+    }
+    if (!sameTree)
+    {
+        std::cout << "Files were added, removed or renamed, building the whole file system" << std::endl;
+        return true;
+    }
+
+    FATAllocator allocator(geometry, fat.get());
+    allocator.load();
+
+    uint64_t clusterSizeInBytes = (uint64_t)geometry.sectorsPerCluster * geometry.bytesPerSector;
+    std::vector<uint32_t> changedEntries;
+    std::vector<uint32_t> changedFiles;
+    std::vector<uint32_t> shrunkFiles;
+
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        FAT_NODE &node = nodes[i];
+        const FAT_NODE &old = previous[i];
+        node.firstCluster = old.firstCluster;
+        node.clusterCount = old.clusterCount;
+        node.crc32 = old.crc32;
+        node.entryLogicalBlockAddress = old.entryLogicalBlockAddress;
+        node.entryOffset = old.entryOffset;
+
+        // a file is only trusted unchanged when size, modification time,
+        // status change time and inode all match: cp -p, touch -r and tar
+        // restore the modification time, but not the other two
+        if (node.isDirectory || (node.size == old.size && node.modifyTime == old.modifyTime && node.changeTime == old.changeTime &&
+                                 node.hostInode == old.hostInode))
+        {
+            continue;
+        }
+
+        // touched: at least the entry's time changes
+        changedEntries.push_back(i);
+        if (!hashFile(node, node.crc32))
+        {
+            return false;
+        }
+        if (node.size == old.size && node.crc32 == old.crc32)
+        {
+            continue;
+        }
+
+        // rewrite in place while the new contents fit the old run, giving
+        // back the clusters no longer needed; otherwise move to a new run
+        uint32_t clusterCount = (node.size + clusterSizeInBytes - 1) / clusterSizeInBytes;
+        if (clusterCount <= old.clusterCount)
+        {
+            if (clusterCount < old.clusterCount && !allocator.free(old.firstCluster + clusterCount, old.clusterCount - clusterCount))
+            {
+                return false;
+            }
+            if (clusterCount == 0)
+            {
+                node.firstCluster = 0;
+            }
+            else if (clusterCount < old.clusterCount)
+            {
+                shrunkFiles.push_back(i);
+            }
+        }
+        else
+        {
+            if (old.clusterCount > 0 && !allocator.free(old.firstCluster, old.clusterCount))
+            {
+                return false;
+            }
+            if (!allocator.allocate(clusterCount, node.firstCluster))
+            {
+                std::cout << "No run of " << clusterCount << " free clusters for \"" << node.hostPath << "\", building the whole file system" << std::endl;
+                return true;
+            }
+        }
+
+        node.clusterCount = clusterCount;
+        if (clusterCount > 0)
+        {
+            changedFiles.push_back(i);
+        }
+    }
+
+    // chain the new runs and free the old ones, then close the runs that
+    // were cut short
+    allocator.commit();
+    for (uint32_t i : shrunkFiles)
+    {
+        setFATEntry(geometry, fat.get(), nodes[i].firstCluster + nodes[i].clusterCount - 1, getEndOfChain(geometry));
+    }
+
+    std::vector<FAT_NODE> files;
+    for (uint32_t i : changedFiles)
+    {
+        files.push_back(nodes[i]);
+    }
+    // the changed files were hashed above, so they need not be again
+    if (!writeFiles(device, geometry, files, threadCount, false) || !writeDirectoryEntries(device, nodes, changedEntries) ||
+        !writeDirtyFATSectors(device, geometry, fat.get(), original.get()))
+    {
+        return false;
+    }
+
+    if (geometry.fatType == 32)
+    {
+        uint32_t freeCount = allocator.getFreeCount();
+        uint32_t nextFree = freeCount == 0 ? FAT_FSINFO_UNKNOWN : allocator.getFirstFree();
+        if (!writeFSInfo(device, geometry.partitionStartingLogicalBlockAddress + FAT32_FSINFO_SECTOR, freeCount, nextFree) ||
+            !writeFSInfo(device, geometry.partitionStartingLogicalBlockAddress + FAT32_BACKUP_BOOT_SECTOR + FAT32_FSINFO_SECTOR, freeCount, nextFree))
+        {
+            std::cerr << "Error: failed to write FSInfo" << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "Updated " << changedFiles.size() << " of " << nodes.size() << " files and directories" << std::endl;
+    updated = true;
+    return writeManifest(manifestPath, geometry, fat.get(), nodes);
+}
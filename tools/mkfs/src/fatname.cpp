@@ -0,0 +1,389 @@
+#include <iostream>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include "crc32.h"
+#include "fat.h"
+
+#define FAT_ALIAS_PLAIN_TAILS 4  // NAME~1 to NAME~4 before the stem is replaced by a hash of the long name
+#define FAT_ALIAS_MAX_TAIL 999999
+
+// how the host name of a node maps onto an 8.3 name
+typedef struct _FAT_NAME_PARTS
+{
+    std::string base;        // short name characters, not cut to 8 yet
+    std::string extension;   // short name characters, not cut to 3 yet
+    std::u16string longName; // as it would be stored
+    bool lossy;              // the 8.3 name cannot hold the host name, an alias is needed
+    bool keepLongName;       // false when another entry already has this long name
+} FAT_NAME_PARTS;
+
+/**
+ * @brief Check if a character may appear in a short (8.3) name
+ * @param  c: the character
+ * @retval true if valid, false otherwise
+ */
+static bool isShortNameCharacter(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != 0 && strchr("$%'-_@~`!(){}^#&", c) != nullptr);
+}
+
+/**
+ * @brief Convert part of a long name into short name characters
+ * @param  &name: the long name
+ * @param  begin: the first character
+ * @param  end: one past the last character
+ * @param  &lossy: set to true if characters had to be dropped or replaced
+ * @retval The converted characters
+ */
+static std::string toShortNameCharacters(const std::string &name, size_t begin, size_t end, bool &lossy)
+{
+    std::string result;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        char c = (char)toupper((unsigned char)name[i]);
+        if (c == ' ' || c == '.')
+        {
+            lossy = true;
+            continue;
+        }
+        if (!isShortNameCharacter(c))
+        {
+            lossy = true;
+            c = '_';
+        }
+        result += c;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Work out which case the letters of part of a name are in
+ * @param  &name: the name
+ * @param  begin: the first character
+ * @param  end: one past the last character
+ * @param  &lower: set to true if there is a lower case letter
+ * @param  &upper: set to true if there is an upper case letter
+ * @retval None
+ */
+static void getLetterCase(const std::string &name, size_t begin, size_t end, bool &lower, bool &upper)
+{
+    for (size_t i = begin; i < end; i++)
+    {
+        lower |= name[i] >= 'a' && name[i] <= 'z';
+        upper |= name[i] >= 'A' && name[i] <= 'Z';
+    }
+}
+
+/**
+ * @brief Convert a UTF-8 host name into the UTF-16 long name stored for it
+ * @note Trailing dots and spaces are dropped, as VFAT ignores them, and
+ *       characters a long name may not hold become '_'
+ * @param  &name: the host name
+ * @param  &longName: the long name
+ * @retval true if successful, false if the name is too long
+ */
+static bool toLongName(const std::string &name, std::u16string &longName)
+{
+    size_t end = name.find_last_not_of(". ");
+    end = end == std::string::npos ? 0 : end + 1;
+    longName.clear();
+
+    for (size_t i = 0; i < end;)
+    {
+        uint8_t c = name[i];
+        uint32_t codePoint = c;
+        size_t length = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 0;
+        if (length > 1 && i + length <= end)
+        {
+            codePoint = c & (0x7F >> length);
+            for (size_t j = 1; j < length; j++)
+            {
+                if ((name[i + j] & 0xC0) != 0x80)
+                {
+                    length = 0;
+                    break;
+                }
+                codePoint = (codePoint << 6) | (name[i + j] & 0x3F);
+            }
+        }
+        else if (length > 1)
+        {
+            length = 0;
+        }
+
+        // bytes that are not UTF-8 are replaced one at a time
+        if (length == 0 || codePoint < 0x20 || (codePoint < 0x80 && strchr("\"*/:<>?\\|", (char)codePoint) != nullptr) ||
+            (codePoint >= 0xD800 && codePoint < 0xE000) || codePoint > 0x10FFFF)
+        {
+            codePoint = '_';
+            length = std::max<size_t>(length, 1);
+        }
+
+        if (codePoint >= 0x10000)
+        {
+            longName += (char16_t)(0xD800 + ((codePoint - 0x10000) >> 10));
+            longName += (char16_t)(0xDC00 + ((codePoint - 0x10000) & 0x3FF));
+        }
+        else
+        {
+            longName += (char16_t)codePoint;
+        }
+        i += length;
+    }
+
+    if (longName.empty())
+    {
+        longName = u"_";
+    }
+
+    return longName.size() <= FAT_LONG_NAME_MAX_LENGTH;
+}
+
+/**
+ * @brief Fold a long name to upper case, as VFAT compares long names
+ * @param  &longName: the long name
+ * @retval The folded name
+ */
+static std::u16string foldLongName(const std::u16string &longName)
+{
+    std::u16string folded = longName;
+    for (char16_t &c : folded)
+    {
+        if (c >= u'a' && c <= u'z')
+        {
+            c -= u'a' - u'A';
+        }
+    }
+
+    return folded;
+}
+
+/**
+ * @brief Pad a short name stem and extension to the 11 stored characters
+ * @param  &stem: up to 8 characters
+ * @param  &extension: up to 3 characters
+ * @retval The short name
+ */
+static std::string padShortName(const std::string &stem, const std::string &extension)
+{
+    return (stem + "        ").substr(0, 8) + (extension + "   ").substr(0, 3);
+}
+
+/**
+ * @brief Pick a NAME~N alias no other entry of the directory uses
+ * @note The first aliases keep up to 6 characters of the name, like
+ *       NAME~1; after FAT_ALIAS_PLAIN_TAILS the stem becomes 2 characters
+ *       and 4 hex digits of a hash of the long name, like NA1F2C~1. The
+ *       next tail to try is kept per stem, so names that share a stem
+ *       do not retry each other's aliases and a directory is named in
+ *       linear time
+ * @param  &parts: the converted name
+ * @param  &used: the short names taken
+ * @param  &nextTails: the next tail to try, by stem and extension
+ * @param  &shortName: the alias
+ * @retval true if successful, false if every tail is taken
+ */
+static bool makeAlias(const FAT_NAME_PARTS &parts, std::unordered_set<std::string> &used, std::unordered_map<std::string, uint32_t> &nextTails,
+                      std::string &shortName)
+{
+    std::string extension = parts.extension.substr(0, 3);
+    std::string stem = parts.base.substr(0, 6);
+
+    uint32_t &plainTail = nextTails[padShortName(stem, extension)];
+    for (plainTail = std::max(plainTail, 1u); plainTail <= FAT_ALIAS_PLAIN_TAILS;)
+    {
+        shortName = padShortName(stem + "~" + std::to_string(plainTail++), extension);
+        if (used.insert(shortName).second)
+        {
+            return true;
+        }
+    }
+
+    static const char hexDigits[] = "0123456789ABCDEF";
+    uint32_t hash = crc32(parts.longName.data(), parts.longName.size() * sizeof(char16_t));
+    stem = parts.base.substr(0, 2);
+    for (int shift = 12; shift >= 0; shift -= 4)
+    {
+        stem += hexDigits[(hash >> shift) & 0xF];
+    }
+
+    uint32_t &hashedTail = nextTails[padShortName(stem, extension)];
+    for (hashedTail = std::max(hashedTail, 1u); hashedTail <= FAT_ALIAS_MAX_TAIL;)
+    {
+        std::string tail = "~" + std::to_string(hashedTail++);
+        shortName = padShortName(stem.substr(0, 8 - tail.size()) + tail, extension);
+        if (used.insert(shortName).second)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool FAT::makeNames(std::vector<FAT_NODE> &nodes, uint32_t directory)
+{
+    const std::vector<uint32_t> &children = nodes[directory].children;
+    std::vector<FAT_NAME_PARTS> names(children.size());
+    std::unordered_set<std::string> usedShortNames;
+    std::unordered_set<std::u16string> usedLongNames;
+    std::unordered_map<std::string, uint32_t> nextTails;
+    usedShortNames.reserve(children.size() * 2);
+    usedLongNames.reserve(children.size());
+
+    // first every name that fits 8.3 as it is takes its own short name, so
+    // that no alias can take it away
+    for (size_t i = 0; i < children.size(); i++)
+    {
+        FAT_NODE &node = nodes[children[i]];
+        FAT_NAME_PARTS &parts = names[i];
+        std::string name = node.hostPath.substr(node.hostPath.find_last_of('/') + 1);
+
+        if (!toLongName(name, parts.longName))
+        {
+            std::cerr << "Error: \"" << node.hostPath << "\" has a name longer than " << FAT_LONG_NAME_MAX_LENGTH << " characters" << std::endl;
+            return false;
+        }
+
+        // long names are unique regardless of case; a name that differs from
+        // an earlier one only in case is left with its alias
+        parts.keepLongName = usedLongNames.insert(foldLongName(parts.longName)).second;
+        if (!parts.keepLongName)
+        {
+            std::cerr << "Warning: \"" << node.hostPath << "\" differs from another name only in case, it keeps only its short name" << std::endl;
+        }
+
+        // split at the last dot, ignoring leading dots
+        size_t first = name.find_first_not_of('.');
+        size_t dot = name.find_last_of('.');
+        if (first == std::string::npos || dot < first)
+        {
+            dot = std::string::npos;
+        }
+        size_t baseEnd = dot == std::string::npos ? name.size() : dot;
+
+        parts.lossy = first != 0 || !parts.keepLongName;
+        parts.base = toShortNameCharacters(name, first == std::string::npos ? name.size() : first, baseEnd, parts.lossy);
+        parts.extension = dot == std::string::npos ? "" : toShortNameCharacters(name, dot + 1, name.size(), parts.lossy);
+        if (parts.base.size() > 8 || parts.extension.size() > 3 || parts.base.empty())
+        {
+            parts.lossy = true;
+        }
+        if (parts.lossy)
+        {
+            continue;
+        }
+
+        // a base or extension in one case is recorded in the case flags,
+        // mixed case needs a long name
+        bool baseLower = false, baseUpper = false, extensionLower = false, extensionUpper = false;
+        getLetterCase(name, 0, baseEnd, baseLower, baseUpper);
+        getLetterCase(name, baseEnd, name.size(), extensionLower, extensionUpper);
+
+        std::string shortName = padShortName(parts.base, parts.extension);
+        if (!usedShortNames.insert(shortName).second)
+        {
+            parts.lossy = true;
+            continue;
+        }
+
+        memcpy(node.shortName, shortName.data(), sizeof(node.shortName));
+        if ((baseLower && baseUpper) || (extensionLower && extensionUpper))
+        {
+            node.caseFlags = 0;
+            node.longName = parts.longName;
+        }
+        else
+        {
+            node.caseFlags = (baseLower ? FAT_CASE_LOWER_BASE : 0) | (extensionLower ? FAT_CASE_LOWER_EXTENSION : 0);
+            node.longName.clear();
+        }
+    }
+
+    // then the rest get a numeric tail and keep their name as a long name
+    for (size_t i = 0; i < children.size(); i++)
+    {
+        FAT_NODE &node = nodes[children[i]];
+        const FAT_NAME_PARTS &parts = names[i];
+        if (!parts.lossy)
+        {
+            continue;
+        }
+
+        std::string shortName;
+        if (!makeAlias(parts, usedShortNames, nextTails, shortName))
+        {
+            std::cerr << "Error: no unique short name for \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+
+        memcpy(node.shortName, shortName.data(), sizeof(node.shortName));
+        node.caseFlags = 0;
+        node.longName = parts.keepLongName ? parts.longName : std::u16string();
+
+        // 0xE5 marks a deleted entry, it is stored as 0x05
+        if (node.shortName[0] == 0xE5)
+        {
+            node.shortName[0] = 0x05;
+        }
+    }
+
+    return true;
+}
+
+uint8_t FAT::getShortNameChecksum(const uint8_t (&name)[11])
+{
+    uint8_t sum = 0;
+    for (uint8_t c : name)
+    {
+        sum = ((sum & 1) << 7) + (sum >> 1) + c;
+    }
+
+    return sum;
+}
+
+uint32_t FAT::getLongNameEntryCount(const FAT_NODE &node)
+{
+    return (node.longName.size() + FAT_LONG_NAME_CHARACTERS - 1) / FAT_LONG_NAME_CHARACTERS;
+}
+
+FAT_LONG_NAME_ENTRY *FAT::makeLongNameEntries(const FAT_NODE &node, FAT_LONG_NAME_ENTRY *entries)
+{
+    uint32_t count = getLongNameEntryCount(node);
+    uint8_t checksum = getShortNameChecksum(node.shortName);
+
+    // the name ends in a 0x0000 if there is room, the rest is 0xFFFF
+    for (uint32_t part = 0; part < count; part++)
+    {
+        uint16_t characters[FAT_LONG_NAME_CHARACTERS];
+        for (uint32_t i = 0; i < FAT_LONG_NAME_CHARACTERS; i++)
+        {
+            size_t index = (size_t)part * FAT_LONG_NAME_CHARACTERS + i;
+            characters[i] = index < node.longName.size() ? node.longName[index] : index == node.longName.size() ? 0x0000 : 0xFFFF;
+        }
+
+        // the entry nearest the short name holds the first part
+        FAT_LONG_NAME_ENTRY &entry = entries[count - 1 - part];
+        memset(&entry, 0, sizeof(entry));
+        entry.LDIR_Ord = (part + 1) | (part + 1 == count ? FAT_LONG_NAME_LAST_ENTRY : 0);
+        entry.LDIR_Attr = ATTR_LONG_NAME;
+        entry.LDIR_Chksum = checksum;
+        for (uint32_t i = 0; i < 5; i++)
+        {
+            entry.LDIR_Name1[i] = characters[i];
+        }
+        for (uint32_t i = 0; i < 6; i++)
+        {
+            entry.LDIR_Name2[i] = characters[5 + i];
+        }
+        for (uint32_t i = 0; i < 2; i++)
+        {
+            entry.LDIR_Name3[i] = characters[11 + i];
+        }
+    }
+
+    return entries + count;
+}
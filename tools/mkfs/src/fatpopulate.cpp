@@ -0,0 +1,547 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <ctime>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "fs.h"
+#include "fat.h"
+#include "fatalloc.h"
+
+#define FAT_MAX_DIRECTORY_ENTRIES 65536
+#define FAT_MAX_FILE_SIZE 0xFFFFFFFFULL
+
+bool FAT::scanDirectory(std::vector<FAT_NODE> &nodes, uint32_t directory)
+{
+    DIR *dir = opendir(nodes[directory].hostPath.c_str());
+    if (dir == nullptr)
+    {
+        std::cerr << "Error: failed to open directory \"" << nodes[directory].hostPath << "\"" << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> names;
+    for (struct dirent *entry = readdir(dir); entry != nullptr; entry = readdir(dir))
+    {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+        {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    // sort so that the image does not depend on host directory order
+    std::sort(names.begin(), names.end());
+
+    for (const std::string &name : names)
+    {
+        std::string hostPath = nodes[directory].hostPath + "/" + name;
+        struct stat st;
+        if (stat(hostPath.c_str(), &st) != 0)
+        {
+            std::cerr << "Error: failed to stat \"" << hostPath << "\"" << std::endl;
+            return false;
+        }
+
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+        {
+            std::cerr << "Warning: skipping \"" << hostPath << "\", not a file or directory" << std::endl;
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > FAT_MAX_FILE_SIZE)
+        {
+            std::cerr << "Error: \"" << hostPath << "\" is larger than 4 GiB" << std::endl;
+            return false;
+        }
+
+        FAT_NODE node = {};
+        node.hostPath = hostPath;
+        node.isDirectory = S_ISDIR(st.st_mode);
+        node.size = node.isDirectory ? 0 : st.st_size;
+        node.parent = directory;
+        node.modifyTime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        node.changeTime = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+        node.hostInode = st.st_ino;
+        getFATDirEntryTimeAndDate(st.st_mtime, node.time, node.date);
+
+        nodes[directory].children.push_back(nodes.size());
+        nodes.push_back(node);
+    }
+
+    // long names take entries of their own, so names come before the count
+    if (!makeNames(nodes, directory))
+    {
+        return false;
+    }
+
+    // dropping the long names would leave only ~N aliases, which is not
+    // the tree the caller asked for
+    if (getDirectoryEntryCount(nodes, directory) > FAT_MAX_DIRECTORY_ENTRIES)
+    {
+        std::cerr << "Error: \"" << nodes[directory].hostPath << "\" needs " << getDirectoryEntryCount(nodes, directory)
+                  << " directory entries with its long names, more than the " << FAT_MAX_DIRECTORY_ENTRIES << " a FAT directory holds" << std::endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < nodes[directory].children.size(); i++)
+    {
+        uint32_t child = nodes[directory].children[i];
+        if (nodes[child].isDirectory && !scanDirectory(nodes, child))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint32_t FAT::getDirectoryEntryCount(const std::vector<FAT_NODE> &nodes, uint32_t directory)
+{
+    // every directory but the root starts with '.' and '..', and every
+    // child takes its long name entries on top of its short name entry
+    uint32_t count = nodes[directory].children.size() + (directory == 0 ? 0 : 2);
+    for (uint32_t child : nodes[directory].children)
+    {
+        count += getLongNameEntryCount(nodes[child]);
+    }
+
+    return count;
+}
+
+bool FAT::allocateClusters(std::vector<FAT_NODE> &nodes, const FAT_GEOMETRY &geometry, FATAllocator &allocator)
+{
+    uint64_t clusterSizeInBytes = (uint64_t)geometry.sectorsPerCluster * geometry.bytesPerSector;
+
+    // the FAT12/16 root directory lives in its fixed region and has no clusters
+    if (geometry.rootCluster == 0 && getDirectoryEntryCount(nodes, 0) > geometry.rootEntryCount)
+    {
+        std::cerr << "Error: \"" << nodes[0].hostPath << "\" has more than " << geometry.rootEntryCount
+                  << " entries, the FAT" << (int)geometry.fatType << " root directory limit" << std::endl;
+        return false;
+    }
+
+    // directories first, breadth first from the root, so that all directory
+    // clusters sit together at the start of the data region; then every file
+    // in directory order
+    std::vector<uint32_t> directories(1, 0);
+    for (size_t i = 0; i < directories.size(); i++)
+    {
+        for (uint32_t child : nodes[directories[i]].children)
+        {
+            if (nodes[child].isDirectory)
+            {
+                directories.push_back(child);
+            }
+        }
+    }
+
+    std::vector<uint32_t> order;
+    uint64_t neededClusters = 0;
+    for (uint32_t directory : directories)
+    {
+        if (directory == 0 && geometry.rootCluster == 0)
+        {
+            continue;
+        }
+
+        uint64_t sizeInBytes = (uint64_t)getDirectoryEntryCount(nodes, directory) * sizeof(FAT32_DIRECTORY_ENTRY);
+        nodes[directory].clusterCount = std::max<uint64_t>(1, (sizeInBytes + clusterSizeInBytes - 1) / clusterSizeInBytes);
+        neededClusters += nodes[directory].clusterCount;
+        order.push_back(directory);
+    }
+
+    for (uint32_t directory : directories)
+    {
+        for (uint32_t child : nodes[directory].children)
+        {
+            if (nodes[child].isDirectory || nodes[child].size == 0)
+            {
+                continue;
+            }
+
+            nodes[child].clusterCount = (nodes[child].size + clusterSizeInBytes - 1) / clusterSizeInBytes;
+            neededClusters += nodes[child].clusterCount;
+            order.push_back(child);
+        }
+    }
+
+    if (neededClusters > allocator.getFreeCount())
+    {
+        std::cerr << "Error: \"" << nodes[0].hostPath << "\" needs " << neededClusters
+                  << " clusters, the volume has " << allocator.getFreeCount() << std::endl;
+        return false;
+    }
+
+    // every node gets one contiguous run; on a fresh volume best fit hands
+    // them out back to back, so the FAT32 root lands on its root cluster
+    for (uint32_t node : order)
+    {
+        if (!allocator.allocate(nodes[node].clusterCount, nodes[node].firstCluster))
+        {
+            std::cerr << "Error: no run of " << nodes[node].clusterCount << " free clusters for \""
+                      << nodes[node].hostPath << "\"" << std::endl;
+            return false;
+        }
+    }
+
+    if (geometry.rootCluster != 0 && nodes[0].firstCluster != geometry.rootCluster)
+    {
+        std::cerr << "Error: root directory cluster " << geometry.rootCluster << " is in use" << std::endl;
+        return false;
+    }
+
+    // chain every run
+    allocator.commit();
+
+    return true;
+}
+
+FAT32_DIRECTORY_ENTRY FAT::makeDirectoryEntry(const FAT_NODE &node, const uint8_t (&name)[11], uint32_t cluster)
+{
+    FAT32_DIRECTORY_ENTRY dirEntry = {
+        .DIR_Name = {0},
+        .DIR_Attr = static_cast<uint8_t>(node.isDirectory ? ATTR_DIRECTORY : ATTR_ARCHIVE),
+        .DIR_NTRes = 0,
+        .DIR_CrtTimeTenth = 0,
+        .DIR_CrtTime = node.time,
+        .DIR_CrtDate = node.date,
+        .DIR_LstAccDate = node.date,
+        .DIR_FstClusHI = static_cast<uint16_t>(cluster >> 16),
+        .DIR_WrtTime = node.time,
+        .DIR_WrtDate = node.date,
+        .DIR_FstClusLO = static_cast<uint16_t>(cluster & 0xFFFF),
+        .DIR_FileSize = static_cast<uint32_t>(node.size)};
+
+    memcpy(dirEntry.DIR_Name, name, sizeof(dirEntry.DIR_Name));
+
+    // the case flags belong to the node's own name, not to '.' and '..'
+    if (memcmp(name, node.shortName, sizeof(node.shortName)) == 0)
+    {
+        dirEntry.DIR_NTRes = node.caseFlags;
+    }
+
+    return dirEntry;
+}
+
+bool FAT::writeDirectories(BlockDevice &device, const FAT_GEOMETRY &geometry, const std::vector<FAT_NODE> &nodes)
+{
+    static const uint8_t dotName[11] = {'.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+    static const uint8_t dotDotName[11] = {'.', '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+    uint64_t clusterSizeInBytes = (uint64_t)geometry.sectorsPerCluster * geometry.bytesPerSector;
+
+    // directory clusters are allocated back to back from the first cluster
+    uint32_t lastCluster = FAT_FIRST_CLUSTER - 1;
+    for (const FAT_NODE &node : nodes)
+    {
+        if (node.isDirectory && node.clusterCount > 0)
+        {
+            lastCluster = std::max(lastCluster, node.firstCluster + node.clusterCount - 1);
+        }
+    }
+
+    uint64_t sizeInBytes = (uint64_t)(lastCluster - FAT_FIRST_CLUSTER + 1) * clusterSizeInBytes;
+    uint64_t rootSizeInBytes = (uint64_t)geometry.rootDirectorySectors * geometry.bytesPerSector;
+    AlignedBuffer directories = allocateAlignedBuffer(std::max<uint64_t>(sizeInBytes, geometry.bytesPerSector));
+    AlignedBuffer root = allocateAlignedBuffer(std::max<uint64_t>(rootSizeInBytes, geometry.bytesPerSector));
+    if (!directories || !root)
+    {
+        std::cerr << "Error: failed to allocate directories" << std::endl;
+        return false;
+    }
+
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        const FAT_NODE &directory = nodes[i];
+        if (!directory.isDirectory)
+        {
+            continue;
+        }
+
+        // only the FAT12/16 root directory has no clusters
+        FAT32_DIRECTORY_ENTRY *dirEntries = reinterpret_cast<FAT32_DIRECTORY_ENTRY *>(
+            directory.clusterCount == 0 ? root.get() : directories.get() + (uint64_t)(directory.firstCluster - FAT_FIRST_CLUSTER) * clusterSizeInBytes);
+
+        if (i != 0)
+        {
+            // the root directory doesn't have a cluster value
+            const FAT_NODE &parent = nodes[directory.parent];
+            *dirEntries++ = makeDirectoryEntry(directory, dotName, directory.firstCluster);
+            *dirEntries++ = makeDirectoryEntry(parent, dotDotName, directory.parent == 0 ? 0 : parent.firstCluster);
+        }
+
+        for (uint32_t child : directory.children)
+        {
+            dirEntries = reinterpret_cast<FAT32_DIRECTORY_ENTRY *>(makeLongNameEntries(nodes[child], reinterpret_cast<FAT_LONG_NAME_ENTRY *>(dirEntries)));
+            *dirEntries++ = makeDirectoryEntry(nodes[child], nodes[child].shortName, nodes[child].firstCluster);
+        }
+    }
+
+    // the fixed root region sits in front of the data region
+    if (rootSizeInBytes > 0 && !device.writeSectors(getRootDirectoryLogicalBlockAddress(geometry), root.get(), geometry.rootDirectorySectors))
+    {
+        std::cerr << "Error: failed to write root directory" << std::endl;
+        return false;
+    }
+
+    if (sizeInBytes > 0 && !device.writeSectors(clusterToLogicalBlockAddress(geometry, FAT_FIRST_CLUSTER), directories.get(), sizeInBytes / geometry.bytesPerSector))
+    {
+        std::cerr << "Error: failed to write directories" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool FAT::writeFiles(BlockDevice &device, const FAT_GEOMETRY &geometry, std::vector<FAT_NODE> &nodes, uint32_t threadCount, bool hashContents)
+{
+    uint64_t clusterSizeInBytes = (uint64_t)geometry.sectorsPerCluster * geometry.bytesPerSector;
+
+    std::vector<uint32_t> files;
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        if (!nodes[i].isDirectory && nodes[i].clusterCount > 0)
+        {
+            files.push_back(i);
+        }
+    }
+
+    // write in ascending LBA order
+    std::sort(files.begin(), files.end(), [&nodes](uint32_t a, uint32_t b)
+              { return nodes[a].firstCluster < nodes[b].firstCluster; });
+
+    // every file already owns its clusters, so the files are cut into
+    // batches of neighbouring files, each one a contiguous reservation that
+    // a worker fills on its own; the image is the same for any thread count
+    std::vector<size_t> batches;
+    uint64_t batchSizeInBytes = FAT_WORKER_BATCH_SIZE;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (batchSizeInBytes >= FAT_WORKER_BATCH_SIZE)
+        {
+            batches.push_back(i);
+            batchSizeInBytes = 0;
+        }
+        batchSizeInBytes += nodes[files[i]].clusterCount * clusterSizeInBytes;
+    }
+    batches.push_back(files.size());
+
+    // backends that cannot take concurrent writes get them one at a time,
+    // host reads still overlap
+    std::mutex deviceMutex;
+    std::mutex *writeMutex = device.isConcurrent() ? nullptr : &deviceMutex;
+    std::atomic<size_t> nextBatch(0);
+    std::atomic<bool> failed(false);
+
+    auto writeBatches = [&]()
+    {
+        AlignedBuffer staging = allocateAlignedBuffer(FAT_STAGING_BUFFER_SIZE);
+        if (!staging)
+        {
+            std::cerr << "Error: failed to allocate staging buffer" << std::endl;
+            failed = true;
+            return;
+        }
+
+        for (size_t batch = nextBatch++; batch + 1 < batches.size() && !failed; batch = nextBatch++)
+        {
+            if (!writeFileBatch(device, geometry, nodes, files.data() + batches[batch], batches[batch + 1] - batches[batch], staging.get(), hashContents, writeMutex))
+            {
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < std::min((size_t)threadCount, batches.size() - 1); i++)
+    {
+        workers.emplace_back(writeBatches);
+    }
+    writeBatches();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    return !failed;
+}
+
+bool FAT::writeFileBatch(BlockDevice &device, const FAT_GEOMETRY &geometry, std::vector<FAT_NODE> &nodes, const uint32_t *files, size_t fileCount, uint8_t *staging, bool hashContents, std::mutex *deviceMutex)
+{
+    uint64_t clusterSizeInBytes = (uint64_t)geometry.sectorsPerCluster * geometry.bytesPerSector;
+
+    // file data is gathered into the staging buffer and written whenever it
+    // fills up or the next file does not continue it
+    uint64_t stagingLogicalBlockAddress = 0;
+    uint64_t stagingUsed = 0;
+    auto flushStaging = [&]()
+    {
+        bool result = true;
+        if (stagingUsed > 0)
+        {
+            std::unique_lock<std::mutex> lock;
+            if (deviceMutex != nullptr)
+            {
+                lock = std::unique_lock<std::mutex>(*deviceMutex);
+            }
+            result = device.writeSectors(stagingLogicalBlockAddress, staging, stagingUsed / geometry.bytesPerSector);
+        }
+        stagingLogicalBlockAddress += stagingUsed / geometry.bytesPerSector;
+        stagingUsed = 0;
+        return result;
+    };
+
+    for (size_t i = 0; i < fileCount; i++)
+    {
+        FAT_NODE &node = nodes[files[i]];
+        uint64_t logicalBlockAddress = clusterToLogicalBlockAddress(geometry, node.firstCluster);
+        if (stagingLogicalBlockAddress + stagingUsed / geometry.bytesPerSector != logicalBlockAddress)
+        {
+            if (!flushStaging())
+            {
+                std::cerr << "Error: failed to write file data" << std::endl;
+                return false;
+            }
+            stagingLogicalBlockAddress = logicalBlockAddress;
+        }
+
+        // a device planning a streamed image only notes where the data goes
+        if (!hashContents && device.referenceHostFile(node.hostPath, 0, logicalBlockAddress, node.size))
+        {
+            if (!flushStaging())
+            {
+                std::cerr << "Error: failed to write file data" << std::endl;
+                return false;
+            }
+            stagingLogicalBlockAddress += (uint64_t)node.clusterCount * geometry.sectorsPerCluster;
+            continue;
+        }
+
+        int fd = open(node.hostPath.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Error: failed to open \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        // a large file nobody needs the hash of is copied by the kernel in
+        // whole sectors, a reflink where the host file system can share the
+        // blocks; its last partial sector and the cluster tail are staged
+        uint64_t copied = 0;
+        if (!hashContents && node.size >= FAT_COPY_IN_KERNEL_MIN_SIZE)
+        {
+            if (!flushStaging())
+            {
+                close(fd);
+                std::cerr << "Error: failed to write file data" << std::endl;
+                return false;
+            }
+
+            std::unique_lock<std::mutex> lock;
+            if (deviceMutex != nullptr)
+            {
+                lock = std::unique_lock<std::mutex>(*deviceMutex);
+            }
+            uint64_t length = node.size - node.size % geometry.bytesPerSector;
+            if (device.copyFromFile(fd, 0, logicalBlockAddress, length))
+            {
+                copied = length;
+                stagingLogicalBlockAddress += length / geometry.bytesPerSector;
+            }
+        }
+
+        // otherwise the contents are hashed on the way through for the manifest
+        uint64_t remaining = node.size - copied;
+        if (copied > 0 && lseek(fd, copied, SEEK_SET) < 0)
+        {
+            close(fd);
+            std::cerr << "Error: failed to read \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+        if (hashContents)
+        {
+            node.crc32 = 0;
+        }
+        while (remaining > 0)
+        {
+            if (stagingUsed == FAT_STAGING_BUFFER_SIZE && !flushStaging())
+            {
+                close(fd);
+                std::cerr << "Error: failed to write file data" << std::endl;
+                return false;
+            }
+
+            ssize_t result = read(fd, staging + stagingUsed, std::min<uint64_t>(remaining, FAT_STAGING_BUFFER_SIZE - stagingUsed));
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result <= 0)
+            {
+                close(fd);
+                std::cerr << "Error: failed to read \"" << node.hostPath << "\"" << std::endl;
+                return false;
+            }
+
+            if (hashContents)
+            {
+                node.crc32 = crc32(staging + stagingUsed, result, node.crc32);
+            }
+            stagingUsed += result;
+            remaining -= result;
+        }
+        close(fd);
+
+        // zero the tail of the last cluster
+        uint64_t padding = node.clusterCount * clusterSizeInBytes - node.size;
+        memset(staging + stagingUsed, 0, padding);
+        stagingUsed += padding;
+    }
+
+    if (!flushStaging())
+    {
+        std::cerr << "Error: failed to write file data" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool FAT::populate(BlockDevice &device, const FAT_GEOMETRY &geometry, FATAllocator &allocator, const char *sourceDirectory, uint32_t threadCount, bool hashContents, std::vector<FAT_NODE> &nodes)
+{
+    struct stat st;
+    if (stat(sourceDirectory, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        std::cerr << "Error: \"" << sourceDirectory << "\" is not a directory" << std::endl;
+        return false;
+    }
+
+    // walk the host tree
+    FAT_NODE root = {};
+    root.hostPath = sourceDirectory;
+    root.isDirectory = true;
+    getFATDirEntryTimeAndDate(st.st_mtime, root.time, root.date);
+
+    nodes.assign(1, root);
+    if (!scanDirectory(nodes, 0))
+    {
+        return false;
+    }
+
+    // plan every cluster run up front
+    if (!allocateClusters(nodes, geometry, allocator))
+    {
+        return false;
+    }
+    locateDirectoryEntries(geometry, nodes);
+
+    // directories then file data, both in ascending LBA order
+    return writeDirectories(device, geometry, nodes) &&
+           writeFiles(device, geometry, nodes, threadCount, hashContents);
+}
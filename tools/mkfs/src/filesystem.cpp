@@ -0,0 +1,103 @@
+#include <iostream>
+#include <cstring>
+#include "fat.h"
+#include "ext4.h"
+#include "g2fs.h"
+#include "filesystem.h"
+
+bool checkFileSystemOptions(const std::string &partitionType, uint8_t fatSize, uint32_t groupCount)
+{
+    // if partitionType is not "vfat", "ext4", or "g2fs", error
+    if (strcmp(partitionType.c_str(), "vfat") != 0 && strcmp(partitionType.c_str(), "ext4") != 0 && strcmp(partitionType.c_str(), "g2fs") != 0)
+    {
+        std::cout << "Error: partition type must be \"vfat\", \"ext4\", or \"g2fs\"" << std::endl;
+        return false;
+    }
+
+    if (groupCount < 1 || groupCount > G2FS_MAX_GROUP_COUNT)
+    {
+        std::cout << "Error: allocation groups must be between 1 and " << G2FS_MAX_GROUP_COUNT << std::endl;
+        return false;
+    }
+
+    if (strcmp(partitionType.c_str(), "vfat") == 0 && (fatSize != 0 && fatSize != 12 && fatSize != 16 && fatSize != 32))
+    {
+        std::cout << "Error: FAT size must be 12, 16, or 32" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool canReferenceHostFiles(const std::string &partitionType, const char *manifestPath)
+{
+    // vfat reads the contents itself when a manifest needs them hashed
+    if (partitionType == "vfat")
+    {
+        return manifestPath == nullptr;
+    }
+
+    return partitionType == "ext4" || partitionType == "g2fs";
+}
+
+bool makeFileSystem(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, std::string partitionType, uint8_t fatSize, uint32_t groupCount, uint64_t totalSectors, const char *sourceDirectory, const char *manifestPath, uint32_t threadCount)
+{
+    // switch on partition type
+    if (strcmp(partitionType.c_str(), "vfat") == 0)
+    {
+        // FAT counts sectors in 32 bits
+        if (totalSectors > UINT32_MAX)
+        {
+            std::cout << "Error: FAT partitions are limited to " << UINT32_MAX << " blocks" << std::endl;
+            return false;
+        }
+
+        // make FAT file system
+        if (!FAT::makeFileSystem(device, fatSize, partitionStartingLogicalBlockAddress, totalSectors, sourceDirectory, manifestPath, threadCount))
+        {
+            return false;
+        }
+    }
+    else if (strcmp(partitionType.c_str(), "ext4") == 0)
+    {
+        // make ext4 file system
+        if (!EXT4::makeFileSystem(device, partitionStartingLogicalBlockAddress, totalSectors, sourceDirectory))
+        {
+            return false;
+        }
+    }
+    else if (strcmp(partitionType.c_str(), "g2fs") == 0)
+    {
+        // make g2fs file system
+        if (!G2FS::makeFileSystem(device, partitionStartingLogicalBlockAddress, totalSectors, groupCount, sourceDirectory))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // error
+        std::cout << "Error: partition type must be \"vfat\", \"ext4\", or \"g2fs\"" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool renewVolumeIdentifier(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, std::string partitionType)
+{
+    if (strcmp(partitionType.c_str(), "vfat") == 0)
+    {
+        return FAT::renewVolumeIdentifier(device, partitionStartingLogicalBlockAddress);
+    }
+    else if (strcmp(partitionType.c_str(), "ext4") == 0)
+    {
+        return EXT4::renewVolumeIdentifier(device, partitionStartingLogicalBlockAddress);
+    }
+    else if (strcmp(partitionType.c_str(), "g2fs") == 0)
+    {
+        return G2FS::renewVolumeIdentifier(device, partitionStartingLogicalBlockAddress);
+    }
+
+    return true;
+}
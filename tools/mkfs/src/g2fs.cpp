@@ -0,0 +1,665 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "g2fs.h"
+
+GUID G2FS::newVolumeIdentifier()
+{
+    // random (version 4) volume GUID
+    GUID volumeIdentifier;
+    std::random_device random;
+    uint8_t *identifier = reinterpret_cast<uint8_t *>(&volumeIdentifier);
+    for (size_t i = 0; i < sizeof(volumeIdentifier); i++)
+    {
+        identifier[i] = random();
+    }
+    volumeIdentifier.timeHiAndVersion = (volumeIdentifier.timeHiAndVersion & 0x0FFF) | 0x4000;
+    volumeIdentifier.clockSeqHiAndReserved = (volumeIdentifier.clockSeqHiAndReserved & 0x3F) | 0x80;
+    return volumeIdentifier;
+}
+
+uint64_t G2FS::getTimeInNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return getTimeInNanoseconds(now);
+}
+
+uint64_t G2FS::getTimeInNanoseconds(const struct timespec &time)
+{
+    return (uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+uint64_t G2FS::getGroupFirstBlock(const G2FS_VOLUME &volume, uint32_t group)
+{
+    return (uint64_t)group * volume.blocksPerGroup;
+}
+
+uint64_t G2FS::getGroupBlockCount(const G2FS_VOLUME &volume, uint32_t group)
+{
+    // the last group takes the blocks left over by the division
+    return group + 1 == volume.groupCount ? volume.blockCount - getGroupFirstBlock(volume, group) : volume.blocksPerGroup;
+}
+
+bool G2FS::planVolume(G2FS_VOLUME &volume, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, uint32_t sectorSize, uint32_t groupCount)
+{
+    volume.partitionStartingLogicalBlockAddress = partitionStartingLogicalBlockAddress;
+    volume.sectorsPerBlock = G2FS_BLOCK_SIZE / sectorSize;
+    volume.blockCount = totalSectors / volume.sectorsPerBlock;
+
+    // one group per CPU, as long as every group keeps a useful size
+    volume.groupCount = std::min<uint64_t>(groupCount, volume.blockCount / G2FS_MIN_GROUP_BLOCKS);
+    if (volume.groupCount == 0)
+    {
+        std::cerr << "Error: a " << totalSectors << " sector partition is too small for g2fs" << std::endl;
+        return false;
+    }
+
+    if (volume.blockCount / volume.groupCount > UINT32_MAX)
+    {
+        std::cerr << "Error: g2fs groups are limited to " << UINT32_MAX << " blocks, use more groups" << std::endl;
+        return false;
+    }
+
+    volume.blocksPerGroup = volume.blockCount / volume.groupCount;
+    uint64_t inodesPerGroup = (uint64_t)volume.blocksPerGroup * G2FS_BLOCK_SIZE / G2FS_BYTES_PER_INODE;
+    volume.inodesPerGroup = std::min<uint64_t>(UINT32_MAX - G2FS_INODES_PER_BLOCK, (inodesPerGroup + G2FS_INODES_PER_BLOCK - 1) / G2FS_INODES_PER_BLOCK * G2FS_INODES_PER_BLOCK);
+    volume.groups.assign(volume.groupCount, G2FS_GROUP());
+
+    for (uint32_t i = 0; i < volume.groupCount; i++)
+    {
+        G2FS_GROUP &group = volume.groups[i];
+        uint64_t firstBlock = getGroupFirstBlock(volume, i);
+        uint64_t blockCount = getGroupBlockCount(volume, i);
+
+        // the group descriptor opens the group, after the superblock in group 0;
+        // the bitmaps and the inode table follow it
+        uint64_t descriptorBlock = firstBlock + (i == 0 ? 1 : 0);
+        group.blockBitmapBlocks = (blockCount + G2FS_BITS_PER_BLOCK - 1) / G2FS_BITS_PER_BLOCK;
+        group.inodeBitmapBlocks = ((uint64_t)volume.inodesPerGroup + G2FS_BITS_PER_BLOCK - 1) / G2FS_BITS_PER_BLOCK;
+        uint64_t inodeTableBlocks = volume.inodesPerGroup / G2FS_INODES_PER_BLOCK;
+
+        group.descriptor = {};
+        group.descriptor.signature = G2FS_GROUP_SIGNATURE;
+        group.descriptor.group = i;
+        group.descriptor.firstBlock = firstBlock;
+        group.descriptor.blockCount = blockCount;
+        group.descriptor.blockBitmapBlock = descriptorBlock + 1;
+        group.descriptor.inodeBitmapBlock = group.descriptor.blockBitmapBlock + group.blockBitmapBlocks;
+        group.descriptor.inodeTableBlock = group.descriptor.inodeBitmapBlock + group.inodeBitmapBlocks;
+        group.descriptor.firstDataBlock = group.descriptor.inodeTableBlock + inodeTableBlocks;
+        group.descriptor.freeBlocks = blockCount;
+        group.descriptor.freeInodes = volume.inodesPerGroup;
+
+        if (group.descriptor.firstDataBlock >= firstBlock + blockCount)
+        {
+            std::cerr << "Error: g2fs group " << i << " has no room for data" << std::endl;
+            return false;
+        }
+
+        group.blockBitmap.assign((blockCount + 63) / 64, 0);
+        group.inodeBitmap.assign(((uint64_t)volume.inodesPerGroup + 63) / 64, 0);
+        group.nextDataBlock = group.descriptor.firstDataBlock;
+        group.nextInode = 0;
+
+        markBlocks(volume, firstBlock, group.descriptor.firstDataBlock - firstBlock);
+    }
+
+    // the backup superblock is the last block of the volume
+    markBlocks(volume, volume.blockCount - 1, 1);
+
+    // inode 0 means "no inode" and is never handed out
+    uint64_t reserved;
+    return allocateInode(volume, 0, reserved);
+}
+
+void G2FS::markBlocks(G2FS_VOLUME &volume, uint64_t firstBlock, uint64_t blockCount)
+{
+    while (blockCount > 0)
+    {
+        uint32_t groupNumber = std::min<uint64_t>(firstBlock / volume.blocksPerGroup, volume.groupCount - 1);
+        G2FS_GROUP &group = volume.groups[groupNumber];
+        uint64_t bit = firstBlock - group.descriptor.firstBlock;
+        uint64_t bits = std::min<uint64_t>(64 - bit % 64, blockCount);
+
+        group.blockBitmap[bit / 64] |= (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << (bit % 64);
+        group.descriptor.freeBlocks -= bits;
+        firstBlock += bits;
+        blockCount -= bits;
+    }
+}
+
+bool G2FS::allocateInode(G2FS_VOLUME &volume, uint32_t group, uint64_t &inode)
+{
+    // prefer the given group, then spill into the following ones
+    for (uint32_t i = 0; i < volume.groupCount; i++)
+    {
+        uint32_t groupNumber = (group + i) % volume.groupCount;
+        G2FS_GROUP &candidate = volume.groups[groupNumber];
+        if (candidate.nextInode == volume.inodesPerGroup)
+        {
+            continue;
+        }
+
+        uint32_t index = candidate.nextInode++;
+        candidate.inodeBitmap[index / 64] |= 1ULL << (index % 64);
+        candidate.inodes.push_back(G2FS_INODE());
+        candidate.descriptor.freeInodes--;
+        inode = (uint64_t)groupNumber * volume.inodesPerGroup + index;
+        return true;
+    }
+
+    std::cerr << "Error: out of g2fs inodes" << std::endl;
+    return false;
+}
+
+bool G2FS::allocateBlocks(G2FS_VOLUME &volume, uint32_t group, uint64_t blockCount, std::vector<G2FS_EXTENT> &extents)
+{
+    uint64_t logicalBlock = 0;
+    for (const G2FS_EXTENT &extent : extents)
+    {
+        logicalBlock += extent.blockCount;
+    }
+
+    // prefer the given group, then spill into the following ones, one extent per group
+    for (uint32_t i = 0; i < volume.groupCount && blockCount > 0; i++)
+    {
+        uint32_t groupNumber = (group + i) % volume.groupCount;
+        G2FS_GROUP &candidate = volume.groups[groupNumber];
+        uint64_t endBlock = candidate.descriptor.firstBlock + candidate.descriptor.blockCount - (groupNumber + 1 == volume.groupCount ? 1 : 0);
+
+        while (blockCount > 0 && candidate.nextDataBlock < endBlock)
+        {
+            uint64_t blocks = std::min<uint64_t>({blockCount, endBlock - candidate.nextDataBlock, UINT32_MAX});
+            extents.push_back({logicalBlock, candidate.nextDataBlock, static_cast<uint32_t>(blocks), 0});
+            markBlocks(volume, candidate.nextDataBlock, blocks);
+
+            candidate.nextDataBlock += blocks;
+            logicalBlock += blocks;
+            blockCount -= blocks;
+        }
+    }
+
+    if (blockCount > 0)
+    {
+        std::cerr << "Error: out of g2fs blocks" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+G2FS_INODE &G2FS::getInode(G2FS_VOLUME &volume, uint64_t inode)
+{
+    return volume.groups[inode / volume.inodesPerGroup].inodes[inode % volume.inodesPerGroup];
+}
+
+void G2FS::finishTree(std::vector<uint8_t> &tree, const std::vector<uint64_t> &leafKeys, uint64_t firstBlock, uint64_t owner, uint64_t &root)
+{
+    // the leaves are already in the buffer; add interior levels on top until
+    // one node is left, which is the root
+    std::vector<uint64_t> keys = leafKeys;
+    uint64_t levelFirst = 0;
+    uint16_t level = 0;
+
+    while (true)
+    {
+        uint64_t levelCount = keys.size();
+        for (uint64_t i = 0; i < levelCount; i++)
+        {
+            G2FS_NODE_HEADER *header = reinterpret_cast<G2FS_NODE_HEADER *>(tree.data() + (levelFirst + i) * G2FS_BLOCK_SIZE);
+            header->next = i + 1 == levelCount ? 0 : firstBlock + levelFirst + i + 1;
+        }
+
+        if (levelCount == 1)
+        {
+            root = firstBlock + levelFirst;
+            break;
+        }
+
+        std::vector<uint64_t> parentKeys;
+        uint64_t parentFirst = levelFirst + levelCount;
+        level++;
+        for (uint64_t i = 0; i < levelCount; i += G2FS_INDEX_ENTRIES_PER_NODE)
+        {
+            uint64_t count = std::min<uint64_t>(G2FS_INDEX_ENTRIES_PER_NODE, levelCount - i);
+            tree.resize(tree.size() + G2FS_BLOCK_SIZE, 0);
+
+            uint8_t *block = tree.data() + tree.size() - G2FS_BLOCK_SIZE;
+            G2FS_NODE_HEADER *header = reinterpret_cast<G2FS_NODE_HEADER *>(block);
+            G2FS_NODE_INDEX *index = reinterpret_cast<G2FS_NODE_INDEX *>(block + sizeof(G2FS_NODE_HEADER));
+            *header = {G2FS_NODE_SIGNATURE, 0, level, static_cast<uint16_t>(count), 0, owner, 0};
+            for (uint64_t j = 0; j < count; j++)
+            {
+                index[j] = {keys[i + j], firstBlock + levelFirst + i + j};
+            }
+            parentKeys.push_back(keys[i]);
+        }
+
+        keys.swap(parentKeys);
+        levelFirst = parentFirst;
+    }
+
+    for (uint64_t i = 0; i < tree.size() / G2FS_BLOCK_SIZE; i++)
+    {
+        uint8_t *block = tree.data() + i * G2FS_BLOCK_SIZE;
+        reinterpret_cast<G2FS_NODE_HEADER *>(block)->crc32 = crc32(block, G2FS_BLOCK_SIZE);
+    }
+}
+
+void G2FS::buildDirectoryTree(const std::vector<G2FS_NODE> &nodes, uint32_t directory, uint64_t firstBlock, std::vector<uint8_t> &tree, uint64_t &root)
+{
+    // entries in key order: name hash, then name
+    std::vector<std::pair<uint32_t, uint32_t>> entries;
+    for (uint32_t child : nodes[directory].children)
+    {
+        entries.push_back({crc32(nodes[child].name.data(), nodes[child].name.size()), child});
+    }
+    std::sort(entries.begin(), entries.end(), [&nodes](const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b)
+              { return a.first != b.first ? a.first < b.first : nodes[a.second].name < nodes[b.second].name; });
+
+    // pack the leaves; offsets grow up from the header, records down from the end
+    std::vector<uint64_t> leafKeys;
+    G2FS_NODE_HEADER *header = nullptr;
+    uint8_t *block = nullptr;
+    uint32_t recordStart = 0;
+
+    tree.clear();
+    for (size_t i = 0; i <= entries.size(); i++)
+    {
+        uint32_t recordSize = 0;
+        if (i < entries.size())
+        {
+            recordSize = (sizeof(G2FS_DIRECTORY_ENTRY) + nodes[entries[i].second].name.size() + 7) & ~7U;
+        }
+
+        bool fits = header != nullptr && sizeof(G2FS_NODE_HEADER) + (header->count + 1) * sizeof(uint16_t) + recordSize <= recordStart;
+        if (header == nullptr || (i < entries.size() && !fits))
+        {
+            tree.resize(tree.size() + G2FS_BLOCK_SIZE, 0);
+            block = tree.data() + tree.size() - G2FS_BLOCK_SIZE;
+            header = reinterpret_cast<G2FS_NODE_HEADER *>(block);
+            *header = {G2FS_NODE_SIGNATURE, 0, 0, 0, 0, nodes[directory].inode, 0};
+            recordStart = G2FS_BLOCK_SIZE;
+            leafKeys.push_back(i < entries.size() ? entries[i].first : 0);
+        }
+
+        if (i == entries.size())
+        {
+            break;
+        }
+
+        const G2FS_NODE &child = nodes[entries[i].second];
+        recordStart -= recordSize;
+        G2FS_DIRECTORY_ENTRY *entry = reinterpret_cast<G2FS_DIRECTORY_ENTRY *>(block + recordStart);
+        entry->inode = child.inode;
+        entry->hash = entries[i].first;
+        entry->type = child.isDirectory ? G2FS_TYPE_DIRECTORY : G2FS_TYPE_FILE;
+        entry->nameLength = child.name.size();
+        memcpy(entry->name, child.name.data(), child.name.size());
+
+        uint16_t *offsets = reinterpret_cast<uint16_t *>(block + sizeof(G2FS_NODE_HEADER));
+        offsets[header->count++] = recordStart;
+    }
+
+    finishTree(tree, leafKeys, firstBlock, nodes[directory].inode, root);
+}
+
+void G2FS::buildExtentTree(const std::vector<G2FS_EXTENT> &extents, uint64_t owner, uint64_t firstBlock, std::vector<uint8_t> &tree, uint64_t &root)
+{
+    std::vector<uint64_t> leafKeys;
+
+    tree.clear();
+    for (size_t i = 0; i < extents.size(); i += G2FS_EXTENTS_PER_NODE)
+    {
+        uint64_t count = std::min<uint64_t>(G2FS_EXTENTS_PER_NODE, extents.size() - i);
+        tree.resize(tree.size() + G2FS_BLOCK_SIZE, 0);
+
+        uint8_t *block = tree.data() + tree.size() - G2FS_BLOCK_SIZE;
+        *reinterpret_cast<G2FS_NODE_HEADER *>(block) = {G2FS_NODE_SIGNATURE, 0, 0, static_cast<uint16_t>(count), 0, owner, 0};
+        memcpy(block + sizeof(G2FS_NODE_HEADER), &extents[i], count * sizeof(G2FS_EXTENT));
+        leafKeys.push_back(extents[i].logicalBlock);
+    }
+
+    finishTree(tree, leafKeys, firstBlock, owner, root);
+}
+
+void G2FS::fillInode(G2FS_VOLUME &volume, const std::vector<G2FS_NODE> &nodes, uint32_t node)
+{
+    const G2FS_NODE &source = nodes[node];
+    G2FS_INODE &inode = getInode(volume, source.inode);
+    uint64_t now = getTimeInNanoseconds();
+
+    inode = {};
+    inode.mode = source.mode;
+    inode.linkCount = 1;
+    inode.size = source.size;
+    inode.accessTime = source.accessTime;
+    inode.modifyTime = source.modifyTime;
+    inode.changeTime = source.changeTime;
+    inode.createTime = now;
+    inode.extentCount = source.extents.size();
+    inode.blockCount = source.tree.size() / G2FS_BLOCK_SIZE;
+
+    if (source.isDirectory)
+    {
+        // '.' and the parent's entry, plus '..' of every subdirectory
+        inode.linkCount = 2;
+        for (uint32_t child : source.children)
+        {
+            inode.linkCount += nodes[child].isDirectory ? 1 : 0;
+        }
+        inode.parent = nodes[source.parent].inode;
+        inode.root = source.root;
+    }
+    else
+    {
+        for (const G2FS_EXTENT &extent : source.extents)
+        {
+            inode.blockCount += extent.blockCount;
+        }
+    }
+
+    if (source.extents.size() <= G2FS_INLINE_EXTENTS)
+    {
+        std::copy(source.extents.begin(), source.extents.end(), inode.extents);
+    }
+    else
+    {
+        inode.flags |= G2FS_INODE_EXTENT_TREE;
+        inode.root = source.root;
+    }
+
+    inode.crc32 = crc32(&inode, sizeof(inode));
+}
+
+bool G2FS::allocateNodes(G2FS_VOLUME &volume, std::vector<G2FS_NODE> &nodes)
+{
+    // breadth first from the root; every directory but the root moves on to
+    // the next group so independent subtrees land in different groups, and
+    // files stay in the group of their directory
+    std::vector<uint32_t> directories(1, 0);
+    uint32_t nextGroup = 1;
+
+    nodes[0].group = 0;
+    if (!allocateInode(volume, 0, nodes[0].inode))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < directories.size(); i++)
+    {
+        for (uint32_t child : nodes[directories[i]].children)
+        {
+            G2FS_NODE &node = nodes[child];
+            node.group = node.isDirectory ? nextGroup++ % volume.groupCount : nodes[directories[i]].group;
+            if (!allocateInode(volume, node.group, node.inode))
+            {
+                return false;
+            }
+
+            if (node.isDirectory)
+            {
+                directories.push_back(child);
+            }
+        }
+    }
+
+    // directory trees first, so directories sit at the front of their groups
+    for (uint32_t directory : directories)
+    {
+        G2FS_NODE &node = nodes[directory];
+        buildDirectoryTree(nodes, directory, 0, node.tree, node.root);
+
+        std::vector<G2FS_EXTENT> extents;
+        if (!allocateBlocks(volume, node.group, node.tree.size() / G2FS_BLOCK_SIZE, extents) || extents.size() != 1)
+        {
+            std::cerr << "Error: no contiguous room for directory \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+
+        node.treeBlock = extents[0].physicalBlock;
+        node.extents = extents;
+        node.size = node.tree.size();
+        buildDirectoryTree(nodes, directory, node.treeBlock, node.tree, node.root);
+    }
+
+    // then file data, in directory order
+    for (uint32_t directory : directories)
+    {
+        for (uint32_t child : nodes[directory].children)
+        {
+            G2FS_NODE &node = nodes[child];
+            if (node.isDirectory)
+            {
+                continue;
+            }
+
+            if (!allocateBlocks(volume, node.group, (node.size + G2FS_BLOCK_SIZE - 1) / G2FS_BLOCK_SIZE, node.extents))
+            {
+                std::cerr << "Error: no room for \"" << node.hostPath << "\"" << std::endl;
+                return false;
+            }
+
+            if (node.extents.size() <= G2FS_INLINE_EXTENTS)
+            {
+                continue;
+            }
+
+            // too many extents to keep inline, move them into a B+tree
+            buildExtentTree(node.extents, node.inode, 0, node.tree, node.root);
+
+            std::vector<G2FS_EXTENT> extents;
+            if (!allocateBlocks(volume, node.group, node.tree.size() / G2FS_BLOCK_SIZE, extents) || extents.size() != 1)
+            {
+                std::cerr << "Error: no contiguous room for the extents of \"" << node.hostPath << "\"" << std::endl;
+                return false;
+            }
+
+            node.treeBlock = extents[0].physicalBlock;
+            buildExtentTree(node.extents, node.inode, node.treeBlock, node.tree, node.root);
+        }
+    }
+
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        fillInode(volume, nodes, i);
+    }
+
+    return true;
+}
+
+bool G2FS::writeBlocks(BlockDevice &device, const G2FS_VOLUME &volume, uint64_t block, const void *buffer, uint64_t blockCount)
+{
+    return device.writeSectors(volume.partitionStartingLogicalBlockAddress + block * volume.sectorsPerBlock, buffer, blockCount * volume.sectorsPerBlock);
+}
+
+bool G2FS::writeTrees(BlockDevice &device, const G2FS_VOLUME &volume, const std::vector<G2FS_NODE> &nodes)
+{
+    for (const G2FS_NODE &node : nodes)
+    {
+        if (!node.tree.empty() && !writeBlocks(device, volume, node.treeBlock, node.tree.data(), node.tree.size() / G2FS_BLOCK_SIZE))
+        {
+            std::cerr << "Error: failed to write B+tree of \"" << node.hostPath << "\"" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool G2FS::writeGroups(BlockDevice &device, G2FS_VOLUME &volume)
+{
+    for (G2FS_GROUP &group : volume.groups)
+    {
+        // descriptor, bitmaps and the used part of the inode table are
+        // contiguous, write them at once and zero the rest of the table
+        uint64_t usedInodeBlocks = (group.inodes.size() + G2FS_INODES_PER_BLOCK - 1) / G2FS_INODES_PER_BLOCK;
+        uint64_t blocks = 1 + group.blockBitmapBlocks + group.inodeBitmapBlocks + usedInodeBlocks;
+        uint64_t descriptorBlock = group.descriptor.blockBitmapBlock - 1;
+
+        AlignedBuffer buffer = allocateAlignedBuffer(blocks * G2FS_BLOCK_SIZE);
+        if (!buffer)
+        {
+            std::cerr << "Error: failed to allocate group " << group.descriptor.group << std::endl;
+            return false;
+        }
+
+        group.descriptor.crc32 = 0;
+        group.descriptor.crc32 = crc32(&group.descriptor, sizeof(group.descriptor));
+
+        uint8_t *position = buffer.get();
+        memcpy(position, &group.descriptor, sizeof(group.descriptor));
+        position += G2FS_BLOCK_SIZE;
+        memcpy(position, group.blockBitmap.data(), group.blockBitmap.size() * sizeof(uint64_t));
+        position += group.blockBitmapBlocks * G2FS_BLOCK_SIZE;
+        memcpy(position, group.inodeBitmap.data(), group.inodeBitmap.size() * sizeof(uint64_t));
+        position += group.inodeBitmapBlocks * G2FS_BLOCK_SIZE;
+        memcpy(position, group.inodes.data(), group.inodes.size() * sizeof(G2FS_INODE));
+
+        if (!writeBlocks(device, volume, descriptorBlock, buffer.get(), blocks))
+        {
+            std::cerr << "Error: failed to write group " << group.descriptor.group << std::endl;
+            return false;
+        }
+
+        uint64_t inodeTableBlocks = volume.inodesPerGroup / G2FS_INODES_PER_BLOCK;
+        uint64_t unusedFirstBlock = group.descriptor.inodeTableBlock + usedInodeBlocks;
+        if (usedInodeBlocks < inodeTableBlocks &&
+            !device.zeroSectors(volume.partitionStartingLogicalBlockAddress + unusedFirstBlock * volume.sectorsPerBlock, (inodeTableBlocks - usedInodeBlocks) * volume.sectorsPerBlock))
+        {
+            std::cerr << "Error: failed to clear inode table of group " << group.descriptor.group << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool G2FS::writeSuperblocks(BlockDevice &device, const G2FS_VOLUME &volume)
+{
+    AlignedBuffer buffer = allocateAlignedBuffer(G2FS_BLOCK_SIZE);
+    if (!buffer)
+    {
+        std::cerr << "Error: failed to allocate superblock" << std::endl;
+        return false;
+    }
+
+    G2FS_SUPERBLOCK *superblock = reinterpret_cast<G2FS_SUPERBLOCK *>(buffer.get());
+    superblock->signature = G2FS_SIGNATURE;
+    superblock->revision = G2FS_REVISION;
+    superblock->superblockSize = G2FS_SUPERBLOCK_SIZE;
+    superblock->blockSize = G2FS_BLOCK_SIZE;
+    superblock->blockCount = volume.blockCount;
+    superblock->inodeCount = (uint64_t)volume.groupCount * volume.inodesPerGroup;
+    superblock->groupCount = volume.groupCount;
+    superblock->blocksPerGroup = volume.blocksPerGroup;
+    superblock->inodesPerGroup = volume.inodesPerGroup;
+    superblock->inodeSize = G2FS_INODE_SIZE;
+    superblock->rootInode = G2FS_ROOT_INODE;
+    superblock->createTime = getTimeInNanoseconds();
+    memcpy(superblock->volumeLabel, "G2", 2);
+
+    for (const G2FS_GROUP &group : volume.groups)
+    {
+        superblock->freeBlocks += group.descriptor.freeBlocks;
+        superblock->freeInodes += group.descriptor.freeInodes;
+    }
+
+    superblock->volumeIdentifier = newVolumeIdentifier();
+    superblock->crc32 = crc32(superblock, superblock->superblockSize);
+
+    // write superblock and backup superblock to disk image
+    if (!writeBlocks(device, volume, 0, buffer.get(), 1) || !writeBlocks(device, volume, volume.blockCount - 1, buffer.get(), 1))
+    {
+        std::cerr << "Error: failed to write superblock" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool G2FS::renewVolumeIdentifier(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress)
+{
+    G2FS_SUPERBLOCK superblock;
+    if (!readSectorBytes(device, partitionStartingLogicalBlockAddress, &superblock, sizeof(superblock)))
+    {
+        std::cerr << "Error: failed to read superblock" << std::endl;
+        return false;
+    }
+
+    uint32_t superblockCrc32 = superblock.crc32;
+    superblock.crc32 = 0;
+    if (superblock.signature != G2FS_SIGNATURE || superblock.superblockSize != G2FS_SUPERBLOCK_SIZE ||
+        crc32(&superblock, superblock.superblockSize) != superblockCrc32)
+    {
+        std::cerr << "Error: invalid superblock" << std::endl;
+        return false;
+    }
+
+    superblock.volumeIdentifier = newVolumeIdentifier();
+    superblock.crc32 = crc32(&superblock, superblock.superblockSize);
+
+    // the backup superblock in the last block of the volume is an exact copy
+    uint64_t sectorsPerBlock = G2FS_BLOCK_SIZE / device.getSectorSize();
+    if (!writeSectorBytes(device, partitionStartingLogicalBlockAddress, &superblock, sizeof(superblock)) ||
+        !writeSectorBytes(device, partitionStartingLogicalBlockAddress + (superblock.blockCount - 1) * sectorsPerBlock, &superblock, sizeof(superblock)))
+    {
+        std::cerr << "Error: failed to write superblock" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool G2FS::makeFileSystem(BlockDevice &device, uint64_t partitionStartingLogicalBlockAddress, uint64_t totalSectors, uint32_t groupCount, const char *sourceDirectory)
+{
+    G2FS_VOLUME volume;
+    if (!planVolume(volume, partitionStartingLogicalBlockAddress, totalSectors, device.getSectorSize(), groupCount))
+    {
+        return false;
+    }
+
+    // the root directory, empty unless populated from a host directory
+    G2FS_NODE root = {};
+    root.isDirectory = true;
+    root.mode = G2FS_MODE_DIRECTORY | 0755;
+    root.accessTime = root.modifyTime = root.changeTime = getTimeInNanoseconds();
+
+    std::vector<G2FS_NODE> nodes(1, root);
+    if (sourceDirectory != nullptr)
+    {
+        struct stat st;
+        if (stat(sourceDirectory, &st) != 0 || !S_ISDIR(st.st_mode))
+        {
+            std::cerr << "Error: \"" << sourceDirectory << "\" is not a directory" << std::endl;
+            return false;
+        }
+
+        nodes[0].hostPath = sourceDirectory;
+        nodes[0].mode = G2FS_MODE_DIRECTORY | (st.st_mode & 07777);
+        nodes[0].accessTime = getTimeInNanoseconds(st.st_atim);
+        nodes[0].modifyTime = getTimeInNanoseconds(st.st_mtim);
+        nodes[0].changeTime = getTimeInNanoseconds(st.st_ctim);
+        if (!scanDirectory(nodes, 0))
+        {
+            std::cerr << "Error: failed to populate file system from \"" << sourceDirectory << "\"" << std::endl;
+            return false;
+        }
+    }
+
+    // place every inode, tree and extent, then write metadata and data
+    if (!allocateNodes(volume, nodes))
+    {
+        return false;
+    }
+
+    return writeGroups(device, volume) &&
+           writeTrees(device, volume, nodes) &&
+           writeFiles(device, volume, nodes) &&
+           writeSuperblocks(device, volume);
+}
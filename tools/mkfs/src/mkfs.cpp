@@ -1,7 +1,11 @@
 #include <iostream>
-#include <fstream>
+#include <cstring>
+#include <thread>
 #include "fs.h"
-#include "fat.h"
+#include "gpt.h"
+#include "cli.h"
+#include "g2fs.h"
+#include "filesystem.h"
 
 void printUsage()
 {
@@ -9,43 +13,20 @@ void printUsage()
     std::cout << "Options:" << std::endl;
     std::cout << "  -p\t\t\tPartition number address (i.e. 1, 2, etc.)" << std::endl;
     std::cout << "  -t\t\t\tPartition type (i.e. vfat, ext4, g2fs)" << std::endl;
-    std::cout << "  -F\t\t\tFAT size (i.e. 12, 16, 32)" << std::endl;
-}
-
-bool makeFileSystem(std::fstream &diskImage, uint64_t partitionStartingLogicalBlockAddress, std::string partitionType, uint8_t fatSize, uint32_t totalSectors)
-{
-    // switch on partition type
-    if (strcmp(partitionType.c_str(), "vfat") == 0)
-    {
-        // make FAT file system
-        if (!FAT::makeFileSystem(diskImage, fatSize, partitionStartingLogicalBlockAddress, totalSectors))
-        {
-            return false;
-        }
-    }
-    else if (strcmp(partitionType.c_str(), "ext4") == 0)
-    {
-        // TODO: make ext4 file system
-        return true;
-    }
-    else if (strcmp(partitionType.c_str(), "g2fs") == 0)
-    {
-        // TODO: make g2fs file system
-        return true;
-    }
-    else
-    {
-        // error
-        std::cout << "Error: partition type must be \"vfat\", \"ext4\", or \"g2fs\"" << std::endl;
-        return false;
-    }
-
-    return true;
+    std::cout << "  -F\t\t\tFAT size (i.e. 12, 16, 32; picked from the partition size if omitted)" << std::endl;
+    std::cout << "  -b\t\t\tI/O backend (i.e. file, mmap, uring, direct)" << std::endl;
+    std::cout << "  -q\t\t\tRequests in flight with the uring backend (default " << BLOCK_DEVICE_URING_QUEUE_DEPTH << ")" << std::endl;
+    std::cout << "  -d\t\t\tHost directory to copy into the file system" << std::endl;
+    std::cout << "  -g\t\t\tAllocation groups, one per CPU (g2fs only, default " << G2FS_DEFAULT_GROUP_COUNT << ")" << std::endl;
+    std::cout << "  -j\t\t\tThreads copying files into a vfat partition (default: one per CPU)" << std::endl;
+    std::cout << "  -i\t\t\tIncremental: rewrite only files changed since the last -i build (vfat with -d only)" << std::endl;
+    std::cout << "  \t\t\tfiles whose size, mtime, ctime and inode all match are not read again;" << std::endl;
+    std::cout << "  \t\t\tadding, removing or renaming anything rebuilds the whole partition" << std::endl;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc < 2 || argc > 8)
+    if (argc < 2)
     {
         printUsage();
         return EXIT_FAILURE;
@@ -53,23 +34,77 @@ int main(int argc, char **argv)
 
     // iterate thru args
     std::string diskImageName;
-    uint16_t partitionNumber = 1;
+    uint32_t partitionNumber = 1;
     std::string partitionType = "vfat";
-    uint8_t fatSize = 32;
+    uint32_t fatSize = 0;
+    uint32_t groupCount = G2FS_DEFAULT_GROUP_COUNT;
+    BLOCK_DEVICE_TYPE backend = BLOCK_DEVICE_FILE;
+    uint32_t queueDepth = BLOCK_DEVICE_URING_QUEUE_DEPTH;
+    const char *sourceDirectory = nullptr;
+    bool incremental = false;
+    uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency());
 
     for (int i = 1; i < argc; i++)
     {
-        if (strcmp(argv[i], "-p") == 0)
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT16_MAX, partitionNumber))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
         {
-            partitionNumber = std::stoi(argv[i + 1]);
+            partitionType = argv[++i];
         }
-        else if (strcmp(argv[i], "-t") == 0)
+        else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc)
         {
-            partitionType = argv[i + 1];
+            if (!parseNumber(argv[++i], 0, UINT8_MAX, fatSize))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
         }
-        else if (strcmp(argv[i], "-F") == 0)
+        else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
         {
-            fatSize = std::stoi(argv[i + 1]);
+            if (!parseNumber(argv[++i], 0, UINT32_MAX, groupCount))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            sourceDirectory = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, threadCount))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-i") == 0)
+        {
+            incremental = true;
+        }
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+        {
+            if (!parseNumber(argv[++i], 1, UINT32_MAX, queueDepth))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            if (!parseBlockDeviceType(argv[++i], backend))
+            {
+                printUsage();
+                return EXIT_FAILURE;
+            }
         }
         else
         {
@@ -77,123 +112,47 @@ int main(int argc, char **argv)
         }
     }
 
-    std::fstream diskImage(diskImageName, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskImage.is_open())
+    std::unique_ptr<BlockDevice> device = openBlockDevice(backend, diskImageName.c_str(), queueDepth);
+    if (!device)
     {
         std::cout << "Error: \"" << diskImageName << "\" does not exist" << std::endl;
         return EXIT_FAILURE;
     }
 
-    // if partitionStartingLogicalBlockAddress is < 0 or > diskImage size, error
-    diskImage.seekg(0, std::ios::end);
-    uint64_t diskImageSize = diskImage.tellg() / BLOCK_SIZE;
-
-    // if partitionType is not "vfat", "ext4", or "g2fs", error
-    if (strcmp(partitionType.c_str(), "vfat") != 0 && strcmp(partitionType.c_str(), "ext4") != 0 && strcmp(partitionType.c_str(), "g2fs") != 0)
-    {
-        std::cout << "Error: partition type must be \"vfat\", \"ext4\", or \"g2fs\"" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    if (strcmp(partitionType.c_str(), "vfat") == 0 && (fatSize != 12 && fatSize != 16 && fatSize != 32))
-    {
-        std::cout << "Error: FAT size must be 12, 16, or 32" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    // read PMBR
-    diskImage.seekg(0, std::ios::beg);
-    MBR pmbr;
-    if (!diskImage.read(reinterpret_cast<char *>(&pmbr), sizeof(pmbr)))
-    {
-        std::cout << "Error: failed to read PMBR" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    // make sure signature matches
-    if (pmbr.signature != 0xAA55)
-    {
-        std::cout << "Error: invalid PMBR signature" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    // make sure partition 0 type is OSTYPE_PMBR
-    if (pmbr.partitions[0].type != OSTYPE_PMBR)
-    {
-        std::cout << "Error: invalid partition 0 type" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    // make sure firstLogicalBlockAddress in partition 0 is 1
-    if (pmbr.partitions[0].firstLogicalBlockAddress != 1)
-    {
-        std::cout << "Error: invalid first logical block address in partition 0 of protected master boot record" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    // read GPT header
-    diskImage.seekg(1 * BLOCK_SIZE, std::ios::beg);
-    GPT_HEADER gpt_header;
-    if (!diskImage.read(reinterpret_cast<char *>(&gpt_header), sizeof(gpt_header)))
-    {
-        std::cout << "Error: failed to read GPT header" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    // make sure GTP header signature is GPT_SIGNATURE
-    if (gpt_header.signature != GPT_SIGNATURE)
-    {
-        std::cout << "Error: invalid GPT header signature" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    // make sure partitionNumber is >= 0 and <= number of partition entries
-    if (partitionNumber < 1 || partitionNumber > gpt_header.numberOfPartitionEntries)
-    {
-        std::cout << "Error: partition number must be between 1 and " << gpt_header.numberOfPartitionEntries << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    // seek to start of partition table entry
-    if (!diskImage.seekg((gpt_header.partitionTableLogicalBlockAddress * BLOCK_SIZE) + ((partitionNumber - 1) * sizeof(GPT_PARTITION_ENTRY)), std::ios::beg))
+    if (!checkFileSystemOptions(partitionType, fatSize, groupCount))
     {
-        std::cout << "Error: failed to seek to start of partition table" << std::endl;
         return EXIT_FAILURE;
     }
 
-    // read partition table entry
-    GPT_PARTITION_ENTRY partitionEntry;
-    if (!diskImage.read(reinterpret_cast<char *>(&partitionEntry), sizeof(partitionEntry)))
+    if (incremental && (strcmp(partitionType.c_str(), "vfat") != 0 || sourceDirectory == nullptr))
     {
-        std::cout << "Error: failed to read partition table entry" << std::endl;
+        std::cout << "Error: incremental builds need a vfat partition and a host directory" << std::endl;
         return EXIT_FAILURE;
     }
 
-    uint64_t partitionStartingLogicalBlockAddress = partitionEntry.firstLogicalBlockAddress;
-    if (partitionStartingLogicalBlockAddress < 2048 || partitionStartingLogicalBlockAddress > diskImageSize)
+    // address the image in the sector size it was partitioned with
+    if (!detectSectorSize(*device))
     {
-        std::cout << "Error: partition starting block must be between 2048 and " << diskImageSize << std::endl;
         return EXIT_FAILURE;
     }
 
-    uint64_t partitionEndingLogicalBlockAddress = partitionEntry.lastLogicalBlockAddress;
-    // make sure partitionEndingLogicalBlockAddress is > partitionStartingLogicalBlockAddress and <= diskImageSize
-    if (partitionEndingLogicalBlockAddress <= partitionStartingLogicalBlockAddress || partitionEndingLogicalBlockAddress > diskImageSize)
+    // find the partition in the GPT
+    uint64_t partitionStartingLogicalBlockAddress = 0, totalSectors = 0;
+    if (!readPartition(*device, partitionNumber, partitionStartingLogicalBlockAddress, totalSectors))
     {
-        std::cout << "Error: partition ending block must be between " << partitionStartingLogicalBlockAddress << " and " << diskImageSize << std::endl;
         return EXIT_FAILURE;
     }
 
-    uint32_t totalSectors = partitionEndingLogicalBlockAddress - partitionStartingLogicalBlockAddress;
-    if (!makeFileSystem(diskImage, partitionStartingLogicalBlockAddress, partitionType, fatSize, totalSectors))
+    // the manifest of an incremental build lives next to the image, one per partition
+    std::string manifestPath = diskImageName + ".p" + std::to_string(partitionNumber) + ".manifest";
+    if (!makeFileSystem(*device, partitionStartingLogicalBlockAddress, partitionType, fatSize, groupCount, totalSectors, sourceDirectory, incremental ? manifestPath.c_str() : nullptr, threadCount))
     {
         std::cout << "Error: failed to make file system" << std::endl;
         return EXIT_FAILURE;
     }
 
-    // close file
-    diskImage.close();
-    if (!diskImage.good())
+    // flush and close file
+    if (!device->flush())
     {
         std::cerr << "Error: failed to close file" << std::endl;
         return EXIT_FAILURE;